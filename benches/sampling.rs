@@ -0,0 +1,236 @@
+// Timings for the sampling and render hot paths. On Linux the collectors read
+// a generated proc/ tree with 1k, 10k and 50k processes, so numbers compare
+// across hosts; elsewhere they read the live system.
+//
+//     cargo bench                  # everything
+//     cargo bench -- render        # benchmarks whose name contains "render"
+//
+// Each line gives the min, median and max time per iteration over SAMPLES
+// batches, and heap allocations per iteration from utop's counting allocator.
+
+// utop has no library target, so the whole binary is compiled in here and the
+// benchmarks live inside it, where they can reach its private items. Its
+// tests module comes along too, minus the #[test] functions.
+#[allow(dead_code, unused_imports)]
+mod utop {
+    include!("../src/main.rs");
+
+    use std::hint::black_box;
+
+    const SAMPLES: usize = 20;
+    // Each sample batches enough iterations to run for about this long.
+    const SAMPLE_TARGET: Duration = Duration::from_millis(25);
+    const FIXTURE_SIZES: [usize; 3] = [1_000, 10_000, 50_000];
+
+    struct Runner {
+        filter: Option<String>,
+    }
+
+    impl Runner {
+        fn bench<F: FnMut()>(&self, name: &str, mut f: F) {
+            if self.filter.as_ref().is_some_and(|want| !name.contains(want.as_str())) {
+                return;
+            }
+            f();
+            let start = Instant::now();
+            let mut calib = 0_u32;
+            while start.elapsed() < SAMPLE_TARGET / 4 {
+                f();
+                calib += 1;
+            }
+            let per_iter = start.elapsed() / calib;
+            let batch = (SAMPLE_TARGET.as_nanos() / per_iter.as_nanos().max(1)).clamp(1, 1 << 20) as u32;
+
+            let mut times = [Duration::ZERO; SAMPLES];
+            let allocs = alloc_counter::total();
+            for t in times.iter_mut() {
+                let start = Instant::now();
+                for _ in 0..batch {
+                    f();
+                }
+                *t = start.elapsed() / batch;
+            }
+            let allocs = (alloc_counter::total() - allocs) as f64 / (SAMPLES as f64 * batch as f64);
+            times.sort();
+            println!("{:<28} {:>10} {:>10} {:>10} {:>10.1} allocs/iter",
+                name, Nanos(times[0].as_nanos() as u64), Nanos(times[SAMPLES / 2].as_nanos() as u64),
+                Nanos(times[SAMPLES - 1].as_nanos() as u64), allocs);
+        }
+    }
+
+    // A proc/ tree shaped like the kernel's, with fixed counters. Pids are
+    // added to whatever is already there, so the sizes can grow in place.
+    #[cfg(target_os = "linux")]
+    fn write_fixture(root: &std::path::Path, pids: std::ops::Range<usize>) -> io::Result<()> {
+        let proc = root.join("proc");
+        fs::create_dir_all(proc.join("net"))?;
+        fs::create_dir_all(root.join("sys"))?;
+        if pids.start == 0 {
+            let mut stat = String::from("cpu  40000 100 20000 900000 500 0 300 0 0 0\n");
+            let mut cpuinfo = String::new();
+            for i in 0..8 {
+                stat += &format!("cpu{} 5000 12 2500 112500 60 0 40 0 0 0\n", i);
+                cpuinfo += &format!("processor\t: {}\nmodel name\t: Fixture CPU\nphysical id\t: 0\n\n", i);
+            }
+            stat += "intr 0\nctxt 123456\nbtime 1700000000\nprocesses 60000\nprocs_running 2\nprocs_blocked 0\n";
+            fs::write(proc.join("stat"), stat)?;
+            fs::write(proc.join("cpuinfo"), cpuinfo)?;
+            fs::write(proc.join("meminfo"), "MemTotal:       32768000 kB\nMemFree:         8192000 kB\n\
+                MemAvailable:   16384000 kB\nSwapTotal:       8192000 kB\nSwapFree:        8000000 kB\n")?;
+            let mut dev = String::from("Inter-|   Receive                                                |  Transmit\n \
+                face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n");
+            dev += "    lo: 123456789 98765 0 0 0 0 0 0 123456789 98765 0 0 0 0 0 0\n";
+            for i in 0..32 {
+                dev += &format!("  veth{:x}: 9876543210 7654321 0 3 0 0 0 0 1234567890 2345678 0 0 0 0 0 0\n", i);
+            }
+            fs::write(proc.join("net/dev"), dev)?;
+        }
+        for pid in pids.start.max(1)..pids.end + 1 {
+            let dir = proc.join(pid.to_string());
+            fs::create_dir_all(&dir)?;
+            fs::write(dir.join("stat"), fixture_stat(pid))?;
+        }
+        Ok(())
+    }
+
+    fn fixture_stat(pid: usize) -> String {
+        format!("{pid} (worker-{pid}) S 1 {pid} {pid} 0 -1 4194560 1200 0 3 0 {} {} 0 0 20 0 {} 0 {} 123456789 {} 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 {} 0 0 0 0 0\n",
+            pid * 7 % 5000, pid * 3 % 1000, 1 + pid % 16, 1000 + pid, 100 + pid * 13 % 90000, pid % 8)
+    }
+
+    // Processes with spread-out CPU and memory, for the sort and the render.
+    fn spread(procs: &mut [ProcessInfo]) {
+        let mut x = 0x9E37_79B9_7F4A_7C15_u64;
+        for p in procs.iter_mut() {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            p.cpu_percent = (x % 10_000) as f64 / 100.0;
+            p.mem_bytes = x >> 40;
+            p.sort_key = sort_key(p, SortMode::Cpu);
+        }
+    }
+
+    fn bench_size(r: &Runner, n: &str) {
+        // Only the collectors the fixture stands in for: mounts, GPUs,
+        // sensors and the rest would read (or fork for) this host's own.
+        let mut sampler = Sampler::new();
+        let now = Instant::now();
+        for c in COLLECTORS.into_iter().filter(|&c| c != Collector::Procs && c != Collector::Cpu) {
+            sampler.schedule.enable(c, false, now);
+        }
+        let mut snap = Snapshot::default();
+        let rows = 50 + SORT_MARGIN;
+        r.bench(&format!("sample/{}", n), || {
+            sample_due(&mut sampler, true, SortMode::Cpu, rows, ViewNeeds::default(), &mut snap);
+        });
+
+        spread(&mut snap.procs);
+        let keys: Vec<SortKey> = snap.procs.iter().map(|p| p.sort_key).collect();
+        let mut procs = snap.procs.clone();
+        for (label, rows) in [("top", rows), ("full", usize::MAX)] {
+            r.bench(&format!("sort/{}/{}", label, n), || {
+                for (p, &k) in procs.iter_mut().zip(&keys) {
+                    p.sort_key = k;
+                }
+                let mut sorted = 0;
+                sort_prefix(&mut procs, &mut sorted, rows);
+                black_box(&procs);
+            });
+        }
+
+        snap.sorted = 0;
+        sort_prefix(&mut snap.procs, &mut snap.sorted, rows);
+        let mut history = History::new(DEFAULT_HISTORY);
+        history.push(&snap);
+        let profile = Profile::new();
+        let mut ui = Ui {
+            cpus: sampler.cpu_count.clone(),
+            cpu_name: sampler.cpu_name.clone(),
+            gpu_cores: sampler.gpu_cores.clone(),
+            sort: SortMode::Cpu,
+            filter: String::new(),
+            filter_lower: String::new(),
+            view: FilterView::default(),
+            is_search: false,
+            pane: Pane::Procs,
+            io: false,
+            io_pids: Vec::new(),
+            tree: false,
+            tree_view: TreeView::default(),
+            cgroup_view: CgroupView::default(),
+            selection: 0,
+            selected_pid: None,
+            selected_cgroup: None,
+            threads_pid: None,
+            colours: true,
+        };
+        let mut screen = Screen::new();
+        let mut out = Vec::with_capacity(64 * 1024);
+        // A new snapshot on a screen that has to be repainted from scratch,
+        // then the steady state where nothing changed since the last frame.
+        r.bench(&format!("render/full/{}", n), || {
+            ui.view.current = false;
+            screen.invalid = true;
+            draw_frame(&mut screen, &mut ui, &mut snap, &history, &profile, 160, 50);
+            out.clear();
+            let _ = screen.flush(&mut out);
+        });
+        r.bench(&format!("render/steady/{}", n), || {
+            draw_frame(&mut screen, &mut ui, &mut snap, &history, &profile, 160, 50);
+            out.clear();
+            let _ = screen.flush(&mut out);
+        });
+        // The same with a filter up, which must not allocate either.
+        ui.filter.push_str("Worker-1");
+        ui.filter_edited();
+        r.bench(&format!("render/filtered/{}", n), || {
+            draw_frame(&mut screen, &mut ui, &mut snap, &history, &profile, 160, 50);
+            out.clear();
+            let _ = screen.flush(&mut out);
+        });
+    }
+
+    pub fn run() {
+        let filter = std::env::args().skip(1).find(|a| !a.starts_with("--"));
+        let r = Runner { filter };
+        println!("{:<28} {:>10} {:>10} {:>10}", "benchmark", "min", "median", "max");
+
+        #[cfg(target_os = "linux")]
+        {
+            let stat = fixture_stat(4242);
+            r.bench("parse_proc_stat", || { black_box(parse_proc_stat(black_box(stat.as_bytes()))); });
+
+            let root = std::env::temp_dir().join(format!("utop-bench-{}", std::process::id()));
+            let _ = SYS_ROOT.set(root.to_string_lossy().into_owned());
+            let mut written = 0;
+            for n in FIXTURE_SIZES {
+                if let Err(e) = write_fixture(&root, written..n) {
+                    eprintln!("utop-bench: {}: {}", root.display(), e);
+                    break;
+                }
+                written = n;
+                if n == FIXTURE_SIZES[0] {
+                    r.bench("read_memory", || { black_box(read_memory()); });
+                    let mut net = NetReader::default();
+                    let mut snap = NetworkSnapshot::default();
+                    r.bench("read_network", || read_network(&mut net, 1.0, &mut snap));
+                }
+                bench_size(&r, &n.to_string());
+            }
+            let _ = fs::remove_dir_all(&root);
+        }
+        #[cfg(not(target_os = "linux"))]
+        {
+            r.bench("read_memory", || { black_box(read_memory()); });
+            let mut net = NetReader::default();
+            let mut snap = NetworkSnapshot::default();
+            r.bench("read_network", || read_network(&mut net, 1.0, &mut snap));
+            bench_size(&r, "host");
+        }
+    }
+}
+
+fn main() {
+    utop::run();
+}
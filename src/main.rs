@@ -1,20 +1,29 @@
-use std::cmp::Ordering;
 use std::collections::HashMap;
-#[cfg(target_os = "linux")]
 use std::collections::HashSet;
+#[cfg(target_os = "linux")]
+use std::collections::VecDeque;
 use std::fmt;
+use std::ffi::CStr;
 #[cfg(target_os = "macos")]
-use std::ffi::{CStr, CString};
-#[cfg(target_os = "linux")]
+use std::ffi::CString;
 use std::fs::{self, File};
-use std::io::{self, BufWriter, Write};
+use std::io::{self, Read, Write};
+use std::net::{TcpListener, TcpStream, ToSocketAddrs};
+#[cfg(target_os = "linux")]
+use std::os::unix::fs::FileExt;
 #[cfg(target_os = "linux")]
-use std::io::Read;
-use std::sync::atomic::{AtomicBool, Ordering as AtomicOrdering};
+use std::os::unix::io::{AsRawFd, FromRawFd};
+use std::cell::UnsafeCell;
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc;
+use std::sync::atomic::{AtomicBool, AtomicI32, AtomicI64, AtomicU8, AtomicU32, AtomicUsize, Ordering as AtomicOrdering};
+#[cfg(target_os = "windows")]
+use std::sync::atomic::AtomicPtr;
 use std::time::{Duration, Instant};
 
 #[cfg(target_os = "windows")]
 use windows_sys::core::BOOL;
+#[cfg(target_os = "windows")]
 use windows_sys::Win32::Foundation::{HANDLE, INVALID_HANDLE_VALUE, TRUE, FILETIME, CloseHandle};
 #[cfg(target_os = "windows")]
 use windows_sys::Win32::System::Console::{
@@ -29,8 +38,8 @@ use windows_sys::Win32::System::Console::{
 };
 #[cfg(target_os = "windows")]
 use windows_sys::Win32::System::Threading::{
-    GetSystemTimes, OpenProcess, GetProcessTimes, GetActiveProcessorCount,
-    PROCESS_QUERY_INFORMATION, PROCESS_VM_READ,
+    GetSystemTimes, OpenProcess, GetProcessTimes, GetActiveProcessorCount, GetCurrentProcess,
+    GetProcessIoCounters, IO_COUNTERS, PROCESS_QUERY_INFORMATION, PROCESS_QUERY_LIMITED_INFORMATION, PROCESS_VM_READ,
 };
 #[cfg(target_os = "windows")]
 use windows_sys::Win32::System::ProcessStatus::{
@@ -60,7 +69,11 @@ use windows_sys::Win32::System::Registry::{
     KEY_READ, REG_SZ,
 };
 #[cfg(target_os = "windows")]
-use windows_sys::Win32::System::Threading::WaitForSingleObject;
+use windows_sys::Win32::System::Threading::{CreateEventW, SetEvent, WaitForMultipleObjects, INFINITE};
+#[cfg(target_os = "windows")]
+use windows_sys::Win32::Foundation::WAIT_OBJECT_0;
+#[cfg(target_os = "windows")]
+use windows_sys::Win32::System::LibraryLoader::{LoadLibraryW, GetProcAddress};
 #[cfg(target_os = "windows")]
 use windows_sys::Win32::System::Power::{
     CallNtPowerInformation, ProcessorInformation, PROCESSOR_POWER_INFORMATION,
@@ -72,6 +85,12 @@ struct CpuTimes {
     iowait: u64, irq: u64, softirq: u64, steal: u64,
 }
 
+impl CpuTimes {
+    fn total(&self) -> u64 {
+        self.user + self.nice + self.sys + self.idle + self.iowait + self.irq + self.softirq + self.steal
+    }
+}
+
 #[derive(Default, Clone)]
 struct MemorySnapshot {
     used_bytes: u64, total_bytes: u64,
@@ -101,23 +120,149 @@ impl Default for GpuSnapshot {
 #[derive(Clone)]
 struct ProcessInfo {
     pid: i32,
-    name: String,
+    // -1 when the source did not say.
+    ppid: i32,
+    name: Arc<str>,
+    // Lowercased once per name, for the filter; shares `name` when unchanged.
+    name_lower: Arc<str>,
     cpu_percent: f64,
     mem_bytes: u64,
     threads: i32,
+    // Bytes per second read from and written to storage; NaN unless the
+    // I/O columns asked for this process.
+    read_rate: f64,
+    write_rate: f64,
+    // cgroup v2 path, once the cgroup view has looked the PID up.
+    cgroup: Option<Arc<str>>,
+    // Ascending key for the current SortMode, filled in by sample().
+    sort_key: SortKey,
+}
+
+// One cgroup as shown, sorted and filtered the same way as processes.
+#[derive(Clone)]
+struct CgroupInfo {
+    // Path below the hierarchy's root, "/" for the root itself.
+    path: Arc<str>,
+    path_lower: Arc<str>,
+    cpu_percent: f64,
+    mem_bytes: u64,
+    // Bytes per second, summed over the devices in io.stat.
+    read_rate: f64,
+    write_rate: f64,
+    // Processes mapped to this cgroup.
+    procs: u32,
+    sort_key: SortKey,
+}
+
+// (primary, secondary) inverted so ascending order is "largest first", with
+// the PID last so the order of ties is stable from frame to frame.
+type SortKey = (u64, u64, i32);
+
+fn sort_key(p: &ProcessInfo, sort: SortMode) -> SortKey {
+    sort_key_of(p.cpu_percent, p.mem_bytes, io_total(p.read_rate, p.write_rate), p.pid, sort)
+}
+
+// Read plus write rate; unknown rates count as zero.
+fn io_total(read_rate: f64, write_rate: f64) -> f64 {
+    let known = |r: f64| if r > 0.0 { r } else { 0.0 };
+    known(read_rate) + known(write_rate)
+}
+
+fn sort_key_of(cpu_percent: f64, mem_bytes: u64, io_rate: f64, pid: i32, sort: SortMode) -> SortKey {
+    // Non-negative f64s order the same as their bit patterns.
+    let cpu = if cpu_percent > 0.0 { cpu_percent.to_bits() } else { 0 };
+    match sort {
+        SortMode::Cpu => (!cpu, !mem_bytes, pid),
+        SortMode::Mem => (!mem_bytes, !cpu, pid),
+        SortMode::Io => (!if io_rate > 0.0 { io_rate.to_bits() } else { 0 }, !cpu, pid),
+    }
+}
+
+// Rows past the visible window that the sampler puts in order too, so a short
+// scroll never needs the render thread to sort.
+const SORT_MARGIN: usize = 256;
+
+// Puts the first `n` processes in final order, extending an already ordered
+// prefix of `*sorted` rows. Only that many rows are fully sorted; the rest are
+// just partitioned behind them with select_nth_unstable.
+fn sort_prefix(procs: &mut [ProcessInfo], sorted: &mut usize, n: usize) {
+    sort_prefix_by(procs, sorted, n, |p| p.sort_key);
+}
+
+fn sort_prefix_by<T>(items: &mut [T], sorted: &mut usize, n: usize, key: impl Fn(&T) -> SortKey) {
+    let n = n.min(items.len());
+    if n <= *sorted {
+        return;
+    }
+    let tail = &mut items[*sorted..];
+    let k = n - *sorted;
+    if k < tail.len() {
+        tail.select_nth_unstable_by_key(k - 1, &key);
+    }
+    tail[..k].sort_unstable_by_key(&key);
+    *sorted = n;
 }
 
 #[derive(Clone, Copy, PartialEq)]
 enum SortMode {
     Cpu,
     Mem,
+    // Read plus write rate; only offered while the I/O columns are shown.
+    Io,
 }
 
-#[derive(Default, Clone)]
+// The busiest interface sums up the network on the header line, in exports
+// and in recordings; `ifaces` lists every interface, busiest first.
+#[derive(Default)]
 struct NetworkSnapshot {
     iface: String,
     rx_rate: f64,
     tx_rate: f64,
+    ifaces: Vec<IfaceRates>,
+}
+
+// Clone by hand so clone_from reuses the interface names' buffers.
+impl Clone for NetworkSnapshot {
+    fn clone(&self) -> Self {
+        Self { iface: self.iface.clone(), rx_rate: self.rx_rate, tx_rate: self.tx_rate, ifaces: self.ifaces.clone() }
+    }
+
+    fn clone_from(&mut self, from: &Self) {
+        self.iface.clone_from(&from.iface);
+        self.rx_rate = from.rx_rate;
+        self.tx_rate = from.tx_rate;
+        self.ifaces.clone_from(&from.ifaces);
+    }
+}
+
+// Per-second rates for one interface; drops and errors sum both directions.
+#[derive(Default)]
+struct IfaceRates {
+    name: String,
+    rx_rate: f64,
+    tx_rate: f64,
+    rx_packets: f64,
+    tx_packets: f64,
+    drops: f64,
+    errors: f64,
+}
+
+impl Clone for IfaceRates {
+    fn clone(&self) -> Self {
+        let mut c = Self::default();
+        c.clone_from(self);
+        c
+    }
+
+    fn clone_from(&mut self, from: &Self) {
+        self.name.clone_from(&from.name);
+        self.rx_rate = from.rx_rate;
+        self.tx_rate = from.tx_rate;
+        self.rx_packets = from.rx_packets;
+        self.tx_packets = from.tx_packets;
+        self.drops = from.drops;
+        self.errors = from.errors;
+    }
 }
 
 #[derive(Default, Clone)]
@@ -126,6 +271,11 @@ struct StorageSnapshot {
     device: String,
     used_bytes: u64,
     total_bytes: u64,
+    // Last known values; this pass's stat has not come back yet.
+    stale: bool,
+    // Device throughput in bytes per second; NaN where unknown.
+    read_rate: f64,
+    write_rate: f64,
 }
 
 #[cfg(any(target_os = "linux", target_os = "macos"))]
@@ -230,15 +380,95 @@ impl Drop for Terminal {
 
 // Global flag for signals
 static QUIT: AtomicBool = AtomicBool::new(false);
+// Set by SIGWINCH, or by a console resize event on Windows.
+static RESIZED: AtomicBool = AtomicBool::new(false);
+
+// The render loop blocks on stdin and on this: the write end of a self-pipe
+// on Unix, an auto-reset event on Windows. Unset until main creates it.
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+static WAKE_FD: AtomicI32 = AtomicI32::new(-1);
+#[cfg(target_os = "windows")]
+static WAKE_EVENT: AtomicPtr<std::ffi::c_void> = AtomicPtr::new(std::ptr::null_mut());
+
+// Directory the Linux collectors find proc/ and sys/ under: empty for this
+// host, or e.g. /host in a container with the host's trees mounted there.
+// Set once, before the first Sampler, by --root or a benchmark fixture.
+#[cfg(target_os = "linux")]
+static SYS_ROOT: std::sync::OnceLock<String> = std::sync::OnceLock::new();
+
+#[cfg(target_os = "linux")]
+fn sys_root() -> &'static str {
+    SYS_ROOT.get().map_or("", |r| r.as_str())
+}
+
+// `path`, an absolute /proc or /sys path, under SYS_ROOT. Borrowed when no
+// root is set, which is the common case.
+#[cfg(target_os = "linux")]
+fn sys_path(path: &str) -> std::borrow::Cow<'_, str> {
+    match sys_root() {
+        "" => path.into(),
+        root => format!("{}{}", root, path).into(),
+    }
+}
+
+// Frames are drawn at most this often; anything sooner waits for the next.
+const RENDER_INTERVAL: Duration = Duration::from_millis(16);
+// Poll period when no wake pipe or event could be created.
+const WAKE_FALLBACK: Duration = Duration::from_millis(10);
+
+// Wake the render loop out of its wait. Safe to call from a signal handler.
+fn wake_main() {
+    #[cfg(any(target_os = "linux", target_os = "macos"))]
+    {
+        let fd = WAKE_FD.load(AtomicOrdering::Relaxed);
+        if fd >= 0 {
+            // A full pipe already holds a wakeup, so EAGAIN is fine.
+            let b = 1u8;
+            unsafe { libc::write(fd, &b as *const u8 as *const libc::c_void, 1); }
+        }
+    }
+    #[cfg(target_os = "windows")]
+    {
+        let event = WAKE_EVENT.load(AtomicOrdering::Relaxed);
+        if !event.is_null() {
+            unsafe { SetEvent(event); }
+        }
+    }
+}
+
+// Create the wake pipe and return its read end.
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+fn open_wake_pipe() -> io::Result<i32> {
+    let mut fds = [0; 2];
+    if unsafe { libc::pipe(fds.as_mut_ptr()) } != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    for fd in fds {
+        unsafe {
+            libc::fcntl(fd, libc::F_SETFL, libc::fcntl(fd, libc::F_GETFL) | libc::O_NONBLOCK);
+            libc::fcntl(fd, libc::F_SETFD, libc::FD_CLOEXEC);
+        }
+    }
+    WAKE_FD.store(fds[1], AtomicOrdering::Relaxed);
+    Ok(fds[0])
+}
 
 #[cfg(any(target_os = "linux", target_os = "macos"))]
 extern "C" fn signal_handler(_sig: libc::c_int) {
     QUIT.store(true, AtomicOrdering::SeqCst);
+    wake_main();
+}
+
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+extern "C" fn resize_handler(_sig: libc::c_int) {
+    RESIZED.store(true, AtomicOrdering::SeqCst);
+    wake_main();
 }
 
 #[cfg(target_os = "windows")]
 unsafe extern "system" fn ctrl_handler(_ctrl_type: u32) -> BOOL {
     QUIT.store(true, AtomicOrdering::SeqCst);
+    wake_main();
     TRUE
 }
 
@@ -262,677 +492,4420 @@ struct V3dStats {
     last_rt: u64,
 }
 
-struct Sampler {
-    prev_cpu: CpuTimes,
-    prev_ticks: HashMap<i32, u64>,
-    prev_net: HashMap<String, (u64, u64)>,
-    last_sample: Instant,
-    #[cfg(target_os = "linux")]
-    page_size: i64,
-    #[cfg(target_os = "linux")]
-    v3d_stats: Vec<V3dStats>,
-    cpu_count: String,
-    cpu_name: String,
-    gpu_cores: String,
-    procs: Vec<ProcessInfo>,
-    cpu_temp_path: Option<String>,
-    cpu_freq_paths: Vec<String>,
-    #[cfg(any(target_os = "macos", target_os = "windows"))]
-    logical_cpus: u64,
-    #[cfg(target_os = "macos")]
-    proc_names: HashMap<i32, String>,
+// Keeps /proc and every live /proc/<pid>/stat open between samples. A
+// steady-state tick is one getdents64 pass over the kept-open /proc fd plus one
+// pread per process; only PIDs that appeared since the last pass are opened.
+//
+// entries mirrors the latest listing in ascending PID order (the order procfs
+// lists tasks in), so each scan is a linear merge against the previous one and
+// the slice can be split into contiguous chunks for parallel sampling.
+#[cfg(target_os = "linux")]
+struct ProcDir {
+    dir: File,
+    dents: Vec<u8>,
+    pids: Vec<i32>,
+    entries: Vec<StatFd>,
+    spare: Vec<StatFd>,
+    fd_budget: usize,
 }
 
-impl Sampler {
-    fn new() -> Self {
-        Self {
-            prev_cpu: CpuTimes::default(),
-            prev_ticks: HashMap::new(),
-            prev_net: HashMap::new(),
-            last_sample: Instant::now(),
-            #[cfg(target_os = "linux")]
-            page_size: unsafe { libc::sysconf(libc::_SC_PAGESIZE) },
-            #[cfg(target_os = "linux")]
-            v3d_stats: Vec::new(),
-            cpu_count: read_cpu_count(),
-            cpu_name: read_cpu_name(),
-            gpu_cores: read_gpu_cores(),
-            procs: Vec::new(),
-            cpu_temp_path: None,
-            cpu_freq_paths: Vec::new(),
-            #[cfg(any(target_os = "macos", target_os = "windows"))]
-            logical_cpus: {
-                #[cfg(target_os = "macos")]
-                { read_logical_cpu_count() }
-                #[cfg(target_os = "windows")]
-                { active_cpu_count() as u64 }
-            },
-            #[cfg(target_os = "macos")]
-            proc_names: HashMap::new(),
-        }
-    }
+#[cfg(target_os = "linux")]
+struct StatFd {
+    pid: i32,
+    file: Option<File>,
+    cache_fd: bool,
+    // Cleared by the sampler when it takes the reading; set when the cached fd
+    // went stale, meaning the PID was recycled between scans.
+    recycled: bool,
+    // ProcTable slot, refreshed every tick before the workers run.
+    slot: u32,
 }
 
-fn human_bytes(bytes: u64) -> String {
-    let v = bytes as f64;
-    if v >= 1024.0 * 1024.0 * 1024.0 {
-        format!("{:.2} GiB", v / (1024.0 * 1024.0 * 1024.0))
-    } else if v >= 1024.0 * 1024.0 {
-        format!("{:.1} MiB", v / (1024.0 * 1024.0))
-    } else if v >= 1024.0 {
-        format!("{:.1} KiB", v / 1024.0)
-    } else {
-        format!("{} B", bytes)
-    }
-}
+// Descriptors left free for everything else (sysfs reads, stdio, sockets)
+// once the stat fd cache has filled the soft RLIMIT_NOFILE.
+#[cfg(target_os = "linux")]
+const FD_HEADROOM: usize = 128;
 
-fn clip_to_width(line: &str, width: usize) -> String {
-    line.chars().take(width).collect()
+// How many stat fds ProcDir and the thread view may each keep open. Together
+// they fill the soft RLIMIT_NOFILE up to FD_HEADROOM; the thread view's share
+// is THREAD_FDS, or an eighth on a low limit.
+#[cfg(target_os = "linux")]
+fn stat_fd_budgets() -> (usize, usize) {
+    let total = raise_nofile_limit().saturating_sub(FD_HEADROOM);
+    let threads = THREAD_FDS.min(total / 8);
+    (total - threads, threads)
 }
 
-const STYLE_NONE: &str = "";
-const STYLE_TITLE: &str = "\x1B[1m\x1B[38;5;51m";
-const STYLE_SECTION: &str = "\x1B[1m\x1B[38;5;45m";
-const STYLE_OK: &str = "\x1B[38;5;82m";
-const STYLE_WARN: &str = "\x1B[38;5;220m";
-const STYLE_BAD: &str = "\x1B[38;5;203m";
-const STYLE_INFO: &str = "\x1B[38;5;75m";
-const STYLE_ACCENT: &str = "\x1B[38;5;213m";
-const STYLE_MUTED: &str = "\x1B[38;5;244m";
+#[cfg(target_os = "linux")]
+impl ProcDir {
+    fn open() -> Option<Self> {
+        let dir = File::open(&*sys_path("/proc")).ok()?;
+        Some(Self {
+            dir,
+            dents: vec![0; 32 * 1024],
+            pids: Vec::new(),
+            entries: Vec::new(),
+            spare: Vec::new(),
+            fd_budget: stat_fd_budgets().0,
+        })
+    }
 
-fn colour_enabled() -> bool {
-    if std::env::var_os("NO_COLOR").is_some() {
+    // Refill self.pids from the numeric entries of /proc and merge them into
+    // self.entries. Rewinding the open directory fd makes the kernel rebuild
+    // the listing, so new PIDs show up without reopening /proc or allocating a
+    // DirEntry per process. Entries of PIDs that are gone are dropped, which
+    // closes their fds.
+    fn scan(&mut self) -> bool {
+        if !list_numeric(&self.dir, &mut self.dents, &mut self.pids) {
+            return false;
+        }
+
+        self.spare.clear();
+        let mut old = self.entries.drain(..).peekable();
+        for (idx, &pid) in self.pids.iter().enumerate() {
+            while old.next_if(|e| e.pid < pid).is_some() {}
+            let mut entry = old.next_if(|e| e.pid == pid).unwrap_or(StatFd {
+                pid, file: None, cache_fd: false, recycled: false, slot: 0,
+            });
+            entry.cache_fd = idx < self.fd_budget;
+            if !entry.cache_fd {
+                entry.file = None;
+            }
+            self.spare.push(entry);
+        }
+        drop(old);
+        std::mem::swap(&mut self.entries, &mut self.spare);
+        true
+    }
+}
+
+// Refill `out` with the numeric entries of an open directory (PIDs under /proc,
+// TIDs under /proc/<pid>/task), in ascending order.
+#[cfg(target_os = "linux")]
+fn list_numeric(dir: &File, dents: &mut [u8], out: &mut Vec<i32>) -> bool {
+    out.clear();
+    let fd = dir.as_raw_fd();
+    if unsafe { libc::lseek(fd, 0, libc::SEEK_SET) } < 0 {
         return false;
     }
-    if std::env::var("CLICOLOR_FORCE").is_ok_and(|v| v != "0") {
-        return true;
+    loop {
+        let n = unsafe {
+            libc::syscall(libc::SYS_getdents64, fd, dents.as_mut_ptr(), dents.len())
+        };
+        if n < 0 { return false; }
+        if n == 0 { break; }
+        let mut off = 0_usize;
+        while off < n as usize {
+            // struct linux_dirent64 { u64 d_ino; i64 d_off; u16 d_reclen; u8 d_type; char d_name[]; }
+            let rec = &dents[off..n as usize];
+            let reclen = u16::from_ne_bytes([rec[16], rec[17]]) as usize;
+            if reclen < 20 || reclen > rec.len() { return false; }
+            if let Some(pid) = parse_pid(&rec[19..reclen]) {
+                out.push(pid);
+            }
+            off += reclen;
+        }
     }
-    if std::env::var("CLICOLOR").is_ok_and(|v| v == "0") {
-        return false;
+    if !out.is_sorted() {
+        out.sort_unstable();
     }
-    if std::env::var("TERM").is_ok_and(|term| term == "dumb") {
-        return false;
+    true
+}
+
+// Read /proc/<pid>/stat into buf, reusing the entry's cached fd when it has
+// one. A cached fd whose process has exited fails with ESRCH; the PID may have
+// been recycled since, so fall through and open it afresh.
+#[cfg(target_os = "linux")]
+fn read_stat(dir_fd: libc::c_int, entry: &mut StatFd, buf: &mut [u8]) -> Option<usize> {
+    if let Some(file) = &entry.file {
+        if let Ok(n) = file.read_at(buf, 0) {
+            return Some(n);
+        }
+        entry.file = None;
+        entry.recycled = true;
     }
 
-    stdout_is_tty()
+    let file = open_stat(dir_fd, entry.pid)?;
+    let n = file.read_at(buf, 0).ok()?;
+    if entry.cache_fd {
+        entry.file = Some(file);
+    }
+    Some(n)
 }
 
-#[cfg(any(target_os = "linux", target_os = "macos"))]
-fn stdout_is_tty() -> bool {
-    unsafe { libc::isatty(libc::STDOUT_FILENO) == 1 }
+#[cfg(target_os = "linux")]
+fn open_stat(dir_fd: libc::c_int, pid: i32) -> Option<File> {
+    // "<pid>/stat\0" relative to the /proc fd, formatted without allocating.
+    let mut path = [0_u8; 24];
+    let mut digits = [0_u8; 10];
+    let mut len = 0;
+    let mut v = pid as u32;
+    loop {
+        digits[len] = b'0' + (v % 10) as u8;
+        len += 1;
+        v /= 10;
+        if v == 0 { break; }
+    }
+    for i in 0..len {
+        path[i] = digits[len - 1 - i];
+    }
+    path[len..len + 5].copy_from_slice(b"/stat");
+    let fd = unsafe {
+        libc::openat(dir_fd, path.as_ptr() as *const libc::c_char, libc::O_RDONLY | libc::O_CLOEXEC)
+    };
+    if fd < 0 { None } else { Some(unsafe { File::from_raw_fd(fd) }) }
 }
 
-#[cfg(target_os = "windows")]
-fn stdout_is_tty() -> bool {
-    unsafe {
-        let h = GetStdHandle(STD_OUTPUT_HANDLE);
-        if h.is_null() || h == INVALID_HANDLE_VALUE {
-            return false;
+// Parse a NUL-terminated getdents64 name that is entirely decimal digits.
+#[cfg(target_os = "linux")]
+fn parse_pid(name: &[u8]) -> Option<i32> {
+    let mut pid = 0_i32;
+    let mut any = false;
+    for &b in name {
+        match b {
+            0 => break,
+            b'0'..=b'9' => {
+                pid = pid.checked_mul(10)?.checked_add((b - b'0') as i32)?;
+                any = true;
+            }
+            _ => return None,
         }
-        let mut mode: u32 = 0;
-        GetConsoleMode(h, &mut mode) != 0
     }
+    any.then_some(pid)
 }
 
-fn colour(enabled: bool, style: &'static str) -> &'static str {
-    if enabled { style } else { STYLE_NONE }
+// Fields of /proc/<pid>/stat used by the process table, borrowed from the
+// read buffer.
+#[cfg(target_os = "linux")]
+#[derive(Default, Debug, PartialEq)]
+struct StatFields<'a> {
+    comm: &'a [u8],
+    ppid: i32,
+    utime: u64,
+    stime: u64,
+    threads: i32,
+    rss: u64,
 }
 
-fn usage_style(percent: f64, enabled: bool) -> &'static str {
-    if !enabled {
-        STYLE_NONE
-    } else if percent >= 85.0 {
-        STYLE_BAD
-    } else if percent >= 65.0 {
-        STYLE_WARN
-    } else {
-        STYLE_OK
+// Field indices counted from the state field that follows "(comm) "; see proc(5).
+#[cfg(target_os = "linux")]
+const STAT_PPID: usize = 1;
+#[cfg(target_os = "linux")]
+const STAT_UTIME: usize = 11;
+#[cfg(target_os = "linux")]
+const STAT_STIME: usize = 12;
+#[cfg(target_os = "linux")]
+const STAT_THREADS: usize = 17;
+#[cfg(target_os = "linux")]
+const STAT_RSS: usize = 21;
+
+// Parse /proc/<pid>/stat straight from the read buffer. comm may itself
+// contain spaces and ')', so it runs to the last ')' in the line; numeric
+// fields are decoded from bytes without UTF-8 validation or allocation.
+#[cfg(target_os = "linux")]
+fn parse_proc_stat(buf: &[u8]) -> Option<StatFields<'_>> {
+    let open = buf.iter().position(|&b| b == b'(')?;
+    let close = buf.iter().rposition(|&b| b == b')')?;
+    if close < open { return None; }
+
+    let mut f = StatFields { comm: &buf[open + 1..close], ..Default::default() };
+    let fields = buf[close + 1..].split(|b| b.is_ascii_whitespace()).filter(|t| !t.is_empty());
+    let mut seen = 0;
+    for (idx, tok) in fields.enumerate() {
+        match idx {
+            STAT_PPID => f.ppid = i32::try_from(parse_signed(tok)?).ok()?,
+            STAT_UTIME => f.utime = parse_dec(tok)?,
+            STAT_STIME => f.stime = parse_dec(tok)?,
+            STAT_THREADS => f.threads = i32::try_from(parse_signed(tok)?).ok()?,
+            STAT_RSS => f.rss = parse_signed(tok)?.max(0) as u64,
+            _ => continue,
+        }
+        seen += 1;
+        if idx == STAT_RSS { break; }
     }
+    (seen == 5).then_some(f)
 }
 
-fn process_row_style(cpu_percent: f64, mem_bytes: u64, total_mem_bytes: u64, enabled: bool) -> &'static str {
-    if !enabled {
-        return STYLE_NONE;
-    }
+// The CPU a task last ran on, in the same numbering.
+#[cfg(target_os = "linux")]
+const STAT_PROCESSOR: usize = 36;
 
-    let mem_percent = if total_mem_bytes > 0 {
-        mem_bytes as f64 * 100.0 / total_mem_bytes as f64
-    } else {
-        0.0
-    };
+// comm, utime + stime and last CPU from /proc/<pid>/task/<tid>/stat, which
+// has the same layout as the process's own.
+#[cfg(target_os = "linux")]
+fn parse_thread_stat(buf: &[u8]) -> Option<(&[u8], u64, i32)> {
+    let open = buf.iter().position(|&b| b == b'(')?;
+    let close = buf.iter().rposition(|&b| b == b')')?;
+    if close < open { return None; }
+
+    let mut ticks = 0;
+    let fields = buf[close + 1..].split(|b| b.is_ascii_whitespace()).filter(|t| !t.is_empty());
+    for (idx, tok) in fields.enumerate() {
+        match idx {
+            STAT_UTIME | STAT_STIME => ticks += parse_dec(tok)?,
+            STAT_PROCESSOR => return Some((&buf[open + 1..close], ticks, i32::try_from(parse_signed(tok)?).ok()?)),
+            _ => {}
+        }
+    }
+    None
+}
 
-    if cpu_percent >= 50.0 || mem_percent >= 25.0 {
-        STYLE_BAD
-    } else if cpu_percent >= 15.0 || mem_percent >= 10.0 {
-        STYLE_WARN
-    } else {
-        STYLE_NONE
+#[cfg(target_os = "linux")]
+fn parse_dec(tok: &[u8]) -> Option<u64> {
+    if tok.is_empty() { return None; }
+    let mut v = 0_u64;
+    for &b in tok {
+        if !b.is_ascii_digit() { return None; }
+        v = v.checked_mul(10)?.checked_add((b - b'0') as u64)?;
     }
+    Some(v)
 }
 
-fn draw_line_with_style<W: Write>(
-    out: &mut W,
-    row: u16,
-    width: usize,
-    reverse: bool,
-    style: &str,
-    args: fmt::Arguments<'_>,
-) -> io::Result<()> {
-    let line = clip_to_width(&args.to_string(), width);
-    if reverse {
-        write!(out, "\x1B[{};1H\x1B[0m\x1B[7m{}\x1B[0m\x1B[K", row, line)
-    } else {
-        write!(out, "\x1B[{};1H\x1B[0m{}{}\x1B[0m\x1B[K", row, style, line)
+// The kernel prints %d and %ld columns (ppid, num_threads, rss, processor)
+// signed, and some of them can legitimately read -1.
+#[cfg(target_os = "linux")]
+fn parse_signed(tok: &[u8]) -> Option<i64> {
+    match tok.strip_prefix(b"-") {
+        Some(digits) => i64::try_from(parse_dec(digits)?).ok().map(|v| -v),
+        None => i64::try_from(parse_dec(tok)?).ok(),
     }
 }
 
-fn draw_line<W: Write>(
-    out: &mut W,
-    row: u16,
-    width: usize,
-    reverse: bool,
-    args: fmt::Arguments<'_>,
-) -> io::Result<()> {
-    draw_line_with_style(out, row, width, reverse, STYLE_NONE, args)
+// One thread of the process the thread view is open on.
+#[derive(Clone, Debug, PartialEq)]
+struct ThreadInfo {
+    tid: u64,
+    name: Arc<str>,
+    cpu_percent: f64,
+    // CPU the thread last ran on, where the OS says.
+    cpu: Option<u32>,
 }
 
-fn draw_next_line<W: Write>(
-    out: &mut W,
-    row: &mut u16,
-    height: u16,
-    width: usize,
-    reverse: bool,
-    args: fmt::Arguments<'_>,
-) {
-    if *row <= height {
-        let _ = draw_line(out, *row, width, reverse, args);
-    }
-    *row = (*row).saturating_add(1);
+// Windows has no per-thread reader yet, so its table stays empty and only
+// the shape is shared.
+struct ThreadEntry {
+    info: ThreadInfo,
+    #[cfg(any(target_os = "linux", target_os = "macos"))]
+    ticks: u64,
+    #[cfg(target_os = "linux")]
+    stat: StatFd,
 }
 
-fn draw_next_line_with_style<W: Write>(
-    out: &mut W,
-    row: &mut u16,
-    height: u16,
-    width: usize,
-    reverse: bool,
-    style: &str,
-    args: fmt::Arguments<'_>,
-) {
-    if *row <= height {
-        let _ = draw_line_with_style(out, *row, width, reverse, style, args);
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+impl ThreadEntry {
+    fn new(tid: u64) -> Self {
+        Self {
+            info: ThreadInfo { tid, name: Arc::from(""), cpu_percent: 0.0, cpu: None },
+            ticks: NO_TICKS,
+            #[cfg(target_os = "linux")]
+            stat: StatFd { pid: tid as i32, file: None, cache_fd: false, recycled: false, slot: 0 },
+        }
     }
-    *row = (*row).saturating_add(1);
-}
 
-#[cfg(target_os = "macos")]
-fn sysctl_into<T>(name: &str, value: &mut T) -> bool {
-    let Ok(name) = CString::new(name) else { return false; };
-    let mut len = std::mem::size_of::<T>() as libc::size_t;
-    unsafe {
-        libc::sysctlbyname(name.as_ptr(), value as *mut T as *mut libc::c_void, &mut len, std::ptr::null_mut(), 0) == 0
+    // Fold in one reading; CPU% is the tick delta over `denominator`, as for
+    // processes, and 0 on a thread's first reading.
+    fn update(&mut self, name: &[u8], ticks: u64, cpu: Option<u32>, denominator: f64) {
+        let prev = if self.ticks == NO_TICKS { ticks } else { self.ticks };
+        self.info.cpu_percent = if denominator > 0.0 {
+            ticks.saturating_sub(prev) as f64 * 100.0 / denominator
+        } else { 0.0 };
+        self.ticks = ticks;
+        self.info.cpu = cpu;
+        if self.info.name.as_bytes() != name {
+            self.info.name = Arc::from(String::from_utf8_lossy(name).as_ref());
+        }
     }
 }
 
-#[cfg(target_os = "macos")]
-fn mach_host_self() -> libc::host_t {
-    #[allow(deprecated)]
-    unsafe { libc::mach_host_self() }
-}
+// Thread stat fds the thread view may keep cached. They come out of the
+// same RLIMIT_NOFILE budget as ProcDir's, which is that much smaller; threads
+// past it are read through a freshly opened fd each tick.
+#[cfg(target_os = "linux")]
+const THREAD_FDS: usize = 1024;
 
 #[cfg(target_os = "macos")]
-fn sysctl_i32(name: &str) -> Option<i32> {
-    let mut value = 0_i32;
-    sysctl_into(name, &mut value).then_some(value)
-}
-
+const PROC_PIDTHREADID64INFO: libc::c_int = 15;
 #[cfg(target_os = "macos")]
-fn sysctl_u64(name: &str) -> Option<u64> {
-    let mut value = 0_u64;
-    sysctl_into(name, &mut value).then_some(value)
+const PROC_PIDLISTTHREADIDS: libc::c_int = 28;
+
+// The threads of the single process the thread view is open on, so the cost
+// is bounded by that process alone. On Linux /proc/<pid>/task and each
+// thread's stat stay open between ticks, as in ProcDir: a steady-state tick
+// is one getdents64 pass plus one pread per thread. entries is in ascending
+// TID order.
+struct ThreadTable {
+    // -1 while the view is closed.
+    pid: i32,
+    entries: Vec<ThreadEntry>,
+    spare: Vec<ThreadEntry>,
+    #[cfg(target_os = "linux")]
+    dir: Option<File>,
+    #[cfg(target_os = "linux")]
+    dents: Vec<u8>,
+    #[cfg(target_os = "linux")]
+    tids: Vec<i32>,
+    #[cfg(target_os = "linux")]
+    clk_tck: f64,
+    #[cfg(target_os = "linux")]
+    fd_budget: usize,
+    #[cfg(target_os = "macos")]
+    tids: Vec<u64>,
 }
 
-#[cfg(target_os = "macos")]
-fn sysctl_string(name: &str) -> Option<String> {
-    let name = CString::new(name).ok()?;
-    unsafe {
-        let mut len = 0_usize;
-        if libc::sysctlbyname(name.as_ptr(), std::ptr::null_mut(), &mut len, std::ptr::null_mut(), 0) != 0 || len == 0 {
-            return None;
+impl ThreadTable {
+    fn new() -> Self {
+        Self {
+            pid: -1,
+            entries: Vec::new(),
+            spare: Vec::new(),
+            #[cfg(target_os = "linux")]
+            dir: None,
+            #[cfg(target_os = "linux")]
+            dents: vec![0; 8 * 1024],
+            #[cfg(target_os = "linux")]
+            tids: Vec::new(),
+            #[cfg(target_os = "linux")]
+            clk_tck: unsafe { libc::sysconf(libc::_SC_CLK_TCK) }.max(1) as f64,
+            #[cfg(target_os = "linux")]
+            fd_budget: stat_fd_budgets().1,
+            #[cfg(target_os = "macos")]
+            tids: vec![0; 64],
         }
-        let mut buf = vec![0_u8; len];
-        if libc::sysctlbyname(name.as_ptr(), buf.as_mut_ptr() as *mut libc::c_void, &mut len, std::ptr::null_mut(), 0) != 0 {
-            return None;
+    }
+
+    // Drops the readings and, with them, every cached fd.
+    fn close(&mut self) {
+        self.pid = -1;
+        self.entries.clear();
+        self.spare.clear();
+        #[cfg(target_os = "linux")]
+        { self.dir = None; }
+    }
+
+    // Read every thread of `pid`, `elapsed` seconds after the last call, on a
+    // machine with `cpus` logical CPUs. Switching to another PID starts over.
+    fn read(&mut self, pid: i32, elapsed: f64, cpus: usize) {
+        if pid != self.pid {
+            self.close();
+            self.pid = pid;
         }
-        while buf.last().copied() == Some(0) {
-            buf.pop();
+        #[cfg(target_os = "linux")]
+        self.read_tasks(elapsed * cpus.max(1) as f64 * self.clk_tck);
+        #[cfg(target_os = "macos")]
+        self.read_mach_threads(elapsed * cpus.max(1) as f64 * 1_000_000_000.0);
+        #[cfg(target_os = "windows")]
+        let _ = (elapsed, cpus);
+    }
+
+    #[cfg(target_os = "linux")]
+    fn read_tasks(&mut self, denominator: f64) {
+        if self.dir.is_none() {
+            self.dir = File::open(&*sys_path(&format!("/proc/{}/task", self.pid))).ok();
         }
-        String::from_utf8(buf).ok().filter(|s| !s.is_empty())
+        let Some(dir) = &self.dir else {
+            self.entries.clear();
+            return;
+        };
+        // An exited process lists no tasks; reopen in case the PID comes back.
+        if !list_numeric(dir, &mut self.dents, &mut self.tids) || self.tids.is_empty() {
+            self.dir = None;
+            self.entries.clear();
+            return;
+        }
+        let fd = dir.as_raw_fd();
+        let mut buf = [0_u8; 1024];
+        self.spare.clear();
+        let mut old = self.entries.drain(..).peekable();
+        for (idx, &tid) in self.tids.iter().enumerate() {
+            let tid = tid as u64;
+            while old.next_if(|e| e.info.tid < tid).is_some() {}
+            let mut e = old.next_if(|e| e.info.tid == tid).unwrap_or_else(|| ThreadEntry::new(tid));
+            e.stat.cache_fd = idx < self.fd_budget;
+            let Some(n) = read_stat(fd, &mut e.stat, &mut buf) else { continue; };
+            if std::mem::take(&mut e.stat.recycled) {
+                e.ticks = NO_TICKS;
+            }
+            let Some((comm, ticks, cpu)) = parse_thread_stat(&buf[..n]) else { continue; };
+            e.update(comm, ticks, u32::try_from(cpu).ok(), denominator);
+            self.spare.push(e);
+        }
+        drop(old);
+        std::mem::swap(&mut self.entries, &mut self.spare);
+    }
+
+    // proc_pidinfo lists the thread IDs, then reads each one's
+    // proc_threadinfo; there is nothing to keep open between ticks.
+    #[cfg(target_os = "macos")]
+    fn read_mach_threads(&mut self, denominator: f64) {
+        let bytes = (self.tids.len() * std::mem::size_of::<u64>()) as libc::c_int;
+        let n = unsafe {
+            libc::proc_pidinfo(self.pid, PROC_PIDLISTTHREADIDS, 0, self.tids.as_mut_ptr() as *mut libc::c_void, bytes)
+        };
+        if n <= 0 {
+            self.entries.clear();
+            return;
+        }
+        let count = n as usize / std::mem::size_of::<u64>();
+        // A full buffer may have cut the list short; the next tick has room.
+        if count == self.tids.len() {
+            self.tids.resize(count * 2, 0);
+        }
+        let tids = &mut self.tids[..count];
+        tids.sort_unstable();
+        self.spare.clear();
+        let mut old = self.entries.drain(..).peekable();
+        for &tid in tids.iter() {
+            while old.next_if(|e| e.info.tid < tid).is_some() {}
+            let mut e = old.next_if(|e| e.info.tid == tid).unwrap_or_else(|| ThreadEntry::new(tid));
+            let mut info = unsafe { std::mem::zeroed::<libc::proc_threadinfo>() };
+            let size = std::mem::size_of::<libc::proc_threadinfo>() as libc::c_int;
+            let read = unsafe {
+                libc::proc_pidinfo(self.pid, PROC_PIDTHREADID64INFO, tid, &mut info as *mut _ as *mut libc::c_void, size)
+            };
+            if read < size { continue; }
+            let name = &info.pth_name;
+            let len = name.iter().position(|&c| c == 0).unwrap_or(name.len());
+            let name = unsafe { std::slice::from_raw_parts(name.as_ptr() as *const u8, len) };
+            e.update(name, info.pth_user_time.saturating_add(info.pth_system_time), None, denominator);
+            self.spare.push(e);
+        }
+        drop(old);
+        std::mem::swap(&mut self.entries, &mut self.spare);
+    }
+
+    // The latest readings, busiest first.
+    fn emit(&self, out: &mut Vec<ThreadInfo>) {
+        out.extend(self.entries.iter().map(|e| e.info.clone()));
+        out.sort_by(|a, b| b.cpu_percent.total_cmp(&a.cpu_percent).then(a.tid.cmp(&b.tid)));
     }
 }
 
-#[cfg(target_os = "macos")]
-fn c_char_array_to_string(buf: &[libc::c_char]) -> String {
-    let end = buf.iter().position(|&c| c == 0).unwrap_or(buf.len());
-    let bytes: Vec<u8> = buf[..end].iter().map(|&c| c as u8).collect();
-    String::from_utf8_lossy(&bytes).trim().to_string()
+// Minimal reader for the kernel's own BTF (/sys/kernel/btf/vmlinux), enough to
+// look up struct member offsets and function ids for the task iterator.
+#[cfg(target_os = "linux")]
+struct Btf {
+    data: Vec<u8>,
+    // Byte offset of each type record, indexed by type id (id 0 is void).
+    types: Vec<usize>,
+    strings: usize,
 }
 
 #[cfg(target_os = "linux")]
-fn read_cpu_temp(cached_path: &mut Option<String>) -> f64 {
-    if let Some(ref path) = *cached_path {
-        if let Ok(temp_str) = fs::read_to_string(path)
-            && let Ok(t) = temp_str.trim().parse::<f64>() {
-                return t / 1000.0;
+const BTF_KIND_INT: u32 = 1;
+#[cfg(target_os = "linux")]
+const BTF_KIND_PTR: u32 = 2;
+#[cfg(target_os = "linux")]
+const BTF_KIND_ARRAY: u32 = 3;
+#[cfg(target_os = "linux")]
+const BTF_KIND_STRUCT: u32 = 4;
+#[cfg(target_os = "linux")]
+const BTF_KIND_UNION: u32 = 5;
+#[cfg(target_os = "linux")]
+const BTF_KIND_ENUM: u32 = 6;
+#[cfg(target_os = "linux")]
+const BTF_KIND_TYPEDEF: u32 = 8;
+#[cfg(target_os = "linux")]
+const BTF_KIND_FUNC: u32 = 12;
+#[cfg(target_os = "linux")]
+const BTF_KIND_ENUM64: u32 = 19;
+
+#[cfg(target_os = "linux")]
+impl Btf {
+    fn parse(data: Vec<u8>) -> Option<Self> {
+        let u32_at = |at: usize| -> Option<u32> { Some(u32::from_le_bytes(data.get(at..at + 4)?.try_into().ok()?)) };
+        if data.get(..2)? != [0x9F, 0xEB] {
+            return None;
+        }
+        let hdr_len = u32_at(4)? as usize;
+        let (type_off, type_len) = (u32_at(8)? as usize, u32_at(12)? as usize);
+        let strings = hdr_len + u32_at(16)? as usize;
+        let mut types = vec![0];
+        let mut at = hdr_len + type_off;
+        let end = at + type_len;
+        while at < end {
+            types.push(at);
+            let info = u32_at(at + 4)?;
+            let vlen = (info & 0xFFFF) as usize;
+            at += 12 + match (info >> 24) & 0x1F {
+                BTF_KIND_INT => 4,
+                BTF_KIND_ARRAY => 12,
+                BTF_KIND_STRUCT | BTF_KIND_UNION => 12 * vlen,
+                BTF_KIND_ENUM => 8 * vlen,
+                13 => 8 * vlen,               // FUNC_PROTO
+                14 => 4,                      // VAR
+                15 => 12 * vlen,              // DATASEC
+                17 => 4,                      // DECL_TAG
+                BTF_KIND_ENUM64 => 12 * vlen,
+                _ => 0,
+            };
+        }
+        Some(Self { data, types, strings })
+    }
+
+    fn u32_at(&self, at: usize) -> u32 {
+        self.data.get(at..at + 4).map_or(0, |b| u32::from_le_bytes(b.try_into().unwrap()))
+    }
+
+    fn name(&self, name_off: u32) -> &[u8] {
+        let start = self.strings + name_off as usize;
+        let tail = self.data.get(start..).unwrap_or(&[]);
+        &tail[..tail.iter().position(|&b| b == 0).unwrap_or(tail.len())]
+    }
+
+    // (kind, vlen, size-or-type, record offset) of a type id.
+    fn ty(&self, id: u32) -> (u32, usize, u32, usize) {
+        let at = self.types.get(id as usize).copied().unwrap_or(0);
+        if at == 0 {
+            return (0, 0, 0, 0);
+        }
+        let info = self.u32_at(at + 4);
+        ((info >> 24) & 0x1F, (info & 0xFFFF) as usize, self.u32_at(at + 8), at)
+    }
+
+    // Skips typedefs and qualifiers.
+    fn resolve(&self, mut id: u32) -> u32 {
+        loop {
+            let (kind, _, next, _) = self.ty(id);
+            match kind {
+                BTF_KIND_TYPEDEF | 9 | 10 | 11 | 18 => id = next,
+                _ => return id,
             }
+        }
     }
-    // Discovery: scan once and cache the winning path
-    if let Ok(entries) = fs::read_dir("/sys/class/thermal") {
-        for entry in entries.flatten() {
-            let name_str = entry.file_name().to_string_lossy().to_string();
-            if name_str.starts_with("thermal_zone")
-                && let Ok(type_str) = fs::read_to_string(entry.path().join("type")) {
-                    let type_lower = type_str.to_lowercase();
-                    if type_lower.contains("pkg") || type_lower.contains("cpu") ||
-                       type_lower.contains("core") || type_lower.contains("soc") {
-                        let temp_path = entry.path().join("temp");
-                        if let Ok(temp_str) = fs::read_to_string(&temp_path)
-                            && let Ok(t) = temp_str.trim().parse::<f64>() {
-                                *cached_path = Some(temp_path.to_string_lossy().into_owned());
-                                return t / 1000.0;
-                            }
-                    }
-                }
+
+    fn size(&self, id: u32) -> Option<usize> {
+        let id = self.resolve(id);
+        let (kind, _, size, at) = self.ty(id);
+        match kind {
+            BTF_KIND_INT | BTF_KIND_STRUCT | BTF_KIND_UNION | BTF_KIND_ENUM | BTF_KIND_ENUM64 => Some(size as usize),
+            BTF_KIND_PTR => Some(8),
+            BTF_KIND_ARRAY => Some(self.size(self.u32_at(at + 12))? * self.u32_at(at + 20) as usize),
+            _ => None,
         }
     }
-    if let Ok(entries) = fs::read_dir("/sys/class/hwmon") {
-        for entry in entries.flatten() {
-            if let Ok(name_str) = fs::read_to_string(entry.path().join("name")) {
-                let name_lower = name_str.to_lowercase();
-                if name_lower.contains("coretemp") || name_lower.contains("cpu") || name_lower.contains("k10temp") {
-                    let mut best = -1000.0;
-                    let mut best_path = String::new();
-                    if let Ok(subentries) = fs::read_dir(entry.path()) {
-                        for subentry in subentries.flatten() {
-                            let sname_str = subentry.file_name().to_string_lossy().to_string();
-                            if sname_str.starts_with("temp") && sname_str.contains("_input")
-                                && let Ok(t_str) = fs::read_to_string(subentry.path())
-                                    && let Ok(t) = t_str.trim().parse::<f64>() {
-                                        let t_c = t / 1000.0;
-                                        if t_c > best {
-                                            best = t_c;
-                                            best_path = subentry.path().to_string_lossy().into_owned();
-                                        }
-                                    }
-                        }
-                    }
-                    if best > -1000.0 {
-                        *cached_path = Some(best_path);
-                        return best;
-                    }
+
+    fn find(&self, want_kind: u32, name: &[u8]) -> Option<u32> {
+        (1..self.types.len() as u32).find(|&id| {
+            let (kind, vlen, _, at) = self.ty(id);
+            kind == want_kind && self.name(self.u32_at(at)) == name && (kind != BTF_KIND_STRUCT || vlen > 0)
+        })
+    }
+
+    // Byte offset and type of a named member, looking through anonymous
+    // structs and unions the way C does.
+    fn member(&self, struct_id: u32, name: &[u8]) -> Option<(usize, u32)> {
+        let (kind, vlen, _, at) = self.ty(self.resolve(struct_id));
+        if kind != BTF_KIND_STRUCT && kind != BTF_KIND_UNION {
+            return None;
+        }
+        let bitfields = self.u32_at(at + 4) >> 31 == 1;
+        for m in 0..vlen {
+            let rec = at + 12 + 12 * m;
+            let (name_off, ty, mut bits) = (self.u32_at(rec), self.u32_at(rec + 4), self.u32_at(rec + 8));
+            if bitfields {
+                bits &= 0xFF_FFFF;
+            }
+            if bits % 8 != 0 {
+                continue;
+            }
+            let off = bits as usize / 8;
+            if name_off == 0 {
+                if let Some((inner, ty)) = self.member(ty, name) {
+                    return Some((off + inner, ty));
                 }
+            } else if self.name(name_off) == name {
+                return Some((off, ty));
             }
         }
+        None
+    }
+
+    fn offset(&self, struct_id: u32, name: &[u8]) -> Option<usize> {
+        self.member(struct_id, name).map(|(off, _)| off)
+    }
+
+    // Offsets of the file, anon and shmem page counters inside mm_struct.
+    // rss_stat is an array of percpu_counters since 6.2 and a struct holding
+    // an array of atomic_long_t before that.
+    fn rss_counters(&self, mm: u32) -> Option<[usize; 3]> {
+        let (base, ty) = self.member(mm, b"rss_stat")?;
+        let ty = self.resolve(ty);
+        let (kind, _, _, at) = self.ty(ty);
+        let (base, elem, inner) = match kind {
+            BTF_KIND_ARRAY => {
+                let elem = self.u32_at(at + 12);
+                (base, self.size(elem)?, self.offset(elem, b"count")?)
+            }
+            BTF_KIND_STRUCT => {
+                let (count, arr) = self.member(ty, b"count")?;
+                let (_, _, _, arr_at) = self.ty(self.resolve(arr));
+                (base + count, self.size(self.u32_at(arr_at + 12))?, 0)
+            }
+            _ => return None,
+        };
+        // MM_FILEPAGES, MM_ANONPAGES, MM_SHMEMPAGES; slot 2 is swap entries.
+        Some([0, 1, 3].map(|k| base + k * elem + inner))
     }
-    -1000.0
 }
 
-#[cfg(target_os = "macos")]
-fn read_cpu_temp(_cached_path: &mut Option<String>) -> f64 {
-    -1000.0
+// What the task iterator program writes per task: tgid, pid, CPU time in ns
+// (for a group leader, including threads that already exited), resident
+// pages, then comm.
+#[cfg(target_os = "linux")]
+const TASK_RECORD: usize = 48;
+
+#[cfg(target_os = "linux")]
+const BPF_PROG_LOAD: libc::c_long = 5;
+#[cfg(target_os = "linux")]
+const BPF_LINK_CREATE: libc::c_long = 28;
+#[cfg(target_os = "linux")]
+const BPF_ITER_CREATE: libc::c_long = 33;
+#[cfg(target_os = "linux")]
+const BPF_PROG_TYPE_TRACING: u32 = 26;
+#[cfg(target_os = "linux")]
+const BPF_TRACE_ITER: u32 = 28;
+#[cfg(target_os = "linux")]
+const BPF_FUNC_SEQ_WRITE: i32 = 127;
+
+#[cfg(target_os = "linux")]
+fn bpf(cmd: libc::c_long, attr: &mut [u8]) -> io::Result<i32> {
+    let r = unsafe { libc::syscall(libc::SYS_bpf, cmd, attr.as_mut_ptr(), attr.len()) };
+    if r < 0 { Err(io::Error::last_os_error()) } else { Ok(r as i32) }
 }
 
-#[cfg(target_os = "windows")]
-fn win_reg_read_string(subkey: &[u16], value_name: &[u16]) -> Option<String> {
-    unsafe {
-        let mut hkey: windows_sys::Win32::System::Registry::HKEY = std::ptr::null_mut();
-        if RegOpenKeyExW(HKEY_LOCAL_MACHINE, subkey.as_ptr(), 0, KEY_READ, &mut hkey) != 0 {
-            return None;
-        }
-        let mut buf = [0u16; 512];
-        let mut buf_len = (buf.len() * 2) as u32;
-        let mut reg_type: u32 = 0;
-        let result = RegQueryValueExW(
-            hkey, value_name.as_ptr(), std::ptr::null(),
-            &mut reg_type, buf.as_mut_ptr() as *mut u8, &mut buf_len,
-        );
-        RegCloseKey(hkey);
-        if result != 0 || reg_type != REG_SZ { return None; }
-        let chars = buf_len as usize / 2;
-        let s = String::from_utf16_lossy(&buf[..chars]);
-        Some(s.trim_end_matches('\0').to_string())
-    }
+// One BPF instruction: opcode, dst and src registers, offset, immediate.
+#[cfg(target_os = "linux")]
+fn bpf_insn(code: u8, dst: u8, src: u8, off: i16, imm: i32) -> u64 {
+    code as u64 | ((dst | src << 4) as u64) << 8 | (off as u16 as u64) << 16 | (imm as u32 as u64) << 32
 }
 
-#[cfg(target_os = "windows")]
-fn win_wstr(s: &str) -> Vec<u16> {
-    s.encode_utf16().chain(std::iter::once(0)).collect()
+// The iterator program, with every field offset taken from the running
+// kernel's BTF so no compiler or CO-RE loader is needed. Equivalent to:
+//
+//   task = ctx->task; if (!task) return 0;
+//   rec = { task->tgid, task->pid, task->utime + task->stime };
+//   if (task->pid == task->tgid && task->signal)
+//       rec.ns += task->signal->utime + task->signal->stime;
+//   if (task->mm) rec.pages = file + anon + shmem counters of task->mm;
+//   if (task->real_parent) rec.ppid = task->real_parent->tgid;
+//   memcpy(rec.comm, task->comm, 16);
+//   bpf_seq_write(ctx->meta->seq, &rec, sizeof rec);
+#[cfg(target_os = "linux")]
+fn task_iter_program(btf: &Btf) -> Option<Vec<u64>> {
+    let task = btf.find(BTF_KIND_STRUCT, b"task_struct")?;
+    let signal = btf.find(BTF_KIND_STRUCT, b"signal_struct")?;
+    let mm = btf.find(BTF_KIND_STRUCT, b"mm_struct")?;
+    let off = |id, name| btf.offset(id, name).and_then(|o| i16::try_from(o).ok());
+    let (tgid, pid) = (off(task, b"tgid")?, off(task, b"pid")?);
+    let (utime, stime, comm) = (off(task, b"utime")?, off(task, b"stime")?, off(task, b"comm")?);
+    let (task_signal, task_mm, real_parent) = (off(task, b"signal")?, off(task, b"mm")?, off(task, b"real_parent")?);
+    let (sig_utime, sig_stime) = (off(signal, b"utime")?, off(signal, b"stime")?);
+    let [file, anon, shmem] = btf.rss_counters(mm)?.map(|o| i16::try_from(o).ok());
+    let (file, anon, shmem) = (file?, anon?, shmem?);
+
+    const LDX_DW: u8 = 0x79;
+    const LDX_W: u8 = 0x61;
+    const STX_DW: u8 = 0x7b;
+    const STX_W: u8 = 0x63;
+    const ST_DW: u8 = 0x7a;
+    const ADD: u8 = 0x0f;
+    const ADD_K: u8 = 0x07;
+    const MOV: u8 = 0xbf;
+    const MOV_K: u8 = 0xb7;
+    const JEQ_K: u8 = 0x15;
+    const JNE: u8 = 0x5d;
+    const CALL: u8 = 0x85;
+    const EXIT: u8 = 0x95;
+    let i = bpf_insn;
+    Some(vec![
+        i(LDX_DW, 6, 1, 8, 0),            // r6 = ctx->task
+        i(JEQ_K, 6, 0, 40, 0),            // if !r6 goto out
+        i(LDX_DW, 7, 1, 0, 0),            // r7 = ctx->meta
+        i(LDX_DW, 7, 7, 0, 0),            // r7 = meta->seq
+        i(LDX_W, 2, 6, tgid, 0),
+        i(STX_W, 10, 2, -48, 0),
+        i(LDX_W, 3, 6, pid, 0),
+        i(STX_W, 10, 3, -44, 0),
+        i(LDX_DW, 4, 6, utime, 0),
+        i(LDX_DW, 5, 6, stime, 0),
+        i(ADD, 4, 5, 0, 0),
+        i(JNE, 2, 3, 6, 0),               // not the leader: skip signal
+        i(LDX_DW, 8, 6, task_signal, 0),
+        i(JEQ_K, 8, 0, 4, 0),
+        i(LDX_DW, 5, 8, sig_utime, 0),
+        i(ADD, 4, 5, 0, 0),
+        i(LDX_DW, 5, 8, sig_stime, 0),
+        i(ADD, 4, 5, 0, 0),
+        i(STX_DW, 10, 4, -40, 0),
+        i(ST_DW, 10, 0, -32, 0),
+        i(LDX_DW, 8, 6, task_mm, 0),
+        i(JEQ_K, 8, 0, 6, 0),             // kernel thread: no mm
+        i(LDX_DW, 4, 8, file, 0),
+        i(LDX_DW, 5, 8, anon, 0),
+        i(ADD, 4, 5, 0, 0),
+        i(LDX_DW, 5, 8, shmem, 0),
+        i(ADD, 4, 5, 0, 0),
+        i(STX_DW, 10, 4, -32, 0),
+        i(ST_DW, 10, 0, -24, 0),          // ppid and padding
+        i(LDX_DW, 8, 6, real_parent, 0),
+        i(JEQ_K, 8, 0, 2, 0),
+        i(LDX_W, 5, 8, tgid, 0),
+        i(STX_W, 10, 5, -24, 0),
+        i(LDX_DW, 4, 6, comm, 0),
+        i(STX_DW, 10, 4, -16, 0),
+        i(LDX_DW, 4, 6, comm + 8, 0),
+        i(STX_DW, 10, 4, -8, 0),
+        i(MOV, 1, 7, 0, 0),
+        i(MOV, 2, 10, 0, 0),
+        i(ADD_K, 2, 0, 0, -(TASK_RECORD as i32)),
+        i(MOV_K, 3, 0, 0, TASK_RECORD as i32),
+        i(CALL, 0, 0, 0, BPF_FUNC_SEQ_WRITE),
+        i(MOV_K, 0, 0, 0, 0),             // out:
+        i(EXIT, 0, 0, 0, 0),
+    ])
 }
 
-#[cfg(target_os = "windows")]
-fn read_cpu_temp(_cached_path: &mut Option<String>) -> f64 {
-    // Try wmic for CPU temperature
-    if let Ok(output) = std::process::Command::new("wmic")
-        .args(["path", "MSAcpi_ThermalZoneTemperature", "get", "CurrentTemperature", "/value"])
-        .output()
-        && output.status.success() {
-            let out_str = String::from_utf8_lossy(&output.stdout);
-            for line in out_str.lines() {
-                if let Some(val) = line.strip_prefix("CurrentTemperature=") {
-                    if let Ok(t) = val.trim().parse::<f64>() {
-                        return (t - 2732.0) / 10.0;
-                    }
+// Per-process sums while folding one iterator pass of per-thread records.
+#[cfg(target_os = "linux")]
+#[derive(Clone, Copy, Default)]
+struct TaskSum {
+    tick: u32,
+    ns: u64,
+    pages: u64,
+    threads: i32,
+    ppid: i32,
+}
+
+// Linux process source that reads every task from a BPF task iterator: one
+// iterator fd and a few large reads per tick however many processes there
+// are, instead of a pread per PID. Needs CAP_BPF (or root) and kernel BTF;
+// Sampler falls back to /proc when open() fails.
+#[cfg(target_os = "linux")]
+struct TaskIter {
+    link: File,
+    _prog: File,
+    buf: Vec<u8>,
+    sums: Vec<TaskSum>,
+    touched: Vec<u32>,
+    clk_tck: u64,
+}
+
+#[cfg(target_os = "linux")]
+impl TaskIter {
+    fn open() -> io::Result<Self> {
+        let unsupported = |what: &str| io::Error::new(io::ErrorKind::Unsupported, what.to_string());
+        // Task structs hold global PIDs; inside a PID namespace they would not
+        // match what /proc and everything else here shows.
+        const PROC_PID_INIT_INO: u64 = 0xEFFF_FFFC;
+        if fs::metadata("/proc/self/ns/pid").map(|m| std::os::unix::fs::MetadataExt::ino(&m))? != PROC_PID_INIT_INO {
+            return Err(unsupported("not in the initial PID namespace"));
+        }
+        let btf = Btf::parse(fs::read("/sys/kernel/btf/vmlinux")?).ok_or_else(|| unsupported("unreadable kernel BTF"))?;
+        let attach_id = btf.find(BTF_KIND_FUNC, b"bpf_iter_task").ok_or_else(|| unsupported("no task iterator in this kernel"))?;
+        let insns = task_iter_program(&btf).ok_or_else(|| unsupported("unexpected task_struct layout"))?;
+        drop(btf);
+
+        let license = b"GPL\0";
+        let mut attr = [0_u8; 128];
+        attr[0..4].copy_from_slice(&BPF_PROG_TYPE_TRACING.to_ne_bytes());
+        attr[4..8].copy_from_slice(&(insns.len() as u32).to_ne_bytes());
+        attr[8..16].copy_from_slice(&(insns.as_ptr() as u64).to_ne_bytes());
+        attr[16..24].copy_from_slice(&(license.as_ptr() as u64).to_ne_bytes());
+        attr[48..52].copy_from_slice(b"utop");
+        attr[68..72].copy_from_slice(&BPF_TRACE_ITER.to_ne_bytes());
+        attr[108..112].copy_from_slice(&attach_id.to_ne_bytes());
+        let prog = unsafe { File::from_raw_fd(bpf(BPF_PROG_LOAD, &mut attr)?) };
+
+        let mut attr = [0_u8; 64];
+        attr[0..4].copy_from_slice(&(prog.as_raw_fd() as u32).to_ne_bytes());
+        attr[8..12].copy_from_slice(&BPF_TRACE_ITER.to_ne_bytes());
+        let link = unsafe { File::from_raw_fd(bpf(BPF_LINK_CREATE, &mut attr)?) };
+
+        Ok(Self {
+            link,
+            _prog: prog,
+            buf: Vec::new(),
+            sums: Vec::new(),
+            touched: Vec::new(),
+            clk_tck: unsafe { libc::sysconf(libc::_SC_CLK_TCK) }.max(1) as u64,
+        })
+    }
+
+    // One pass over every task into `slab`, claiming table slots by TGID.
+    fn sample(&mut self, table: &mut ProcTable, page_size: u64, slab: &mut SampleSlab) -> io::Result<()> {
+        use io::Read as _;
+        let mut attr = [0_u8; 8];
+        attr[0..4].copy_from_slice(&(self.link.as_raw_fd() as u32).to_ne_bytes());
+        let mut iter = unsafe { File::from_raw_fd(bpf(BPF_ITER_CREATE, &mut attr)?) };
+        let mut len = 0;
+        loop {
+            if len == self.buf.len() {
+                self.buf.resize((self.buf.len() * 2).max(256 * 1024), 0);
+            }
+            match iter.read(&mut self.buf[len..]) {
+                Ok(0) => break,
+                Ok(n) => len += n,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(e) => return Err(e),
+            }
+        }
+
+        self.touched.clear();
+        let mut last = (-1, 0_u32);
+        for rec in self.buf[..len].chunks_exact(TASK_RECORD) {
+            let tgid = i32::from_ne_bytes(rec[0..4].try_into().unwrap());
+            let pid = i32::from_ne_bytes(rec[4..8].try_into().unwrap());
+            let ns = u64::from_ne_bytes(rec[8..16].try_into().unwrap());
+            let pages = i64::from_ne_bytes(rec[16..24].try_into().unwrap()).max(0) as u64;
+            let ppid = i32::from_ne_bytes(rec[24..28].try_into().unwrap());
+            // Threads mostly follow their leader, so the last lookup is a hit.
+            let slot = if last.0 == tgid { last.1 } else { table.claim(tgid) };
+            last = (tgid, slot);
+            let i = slot as usize;
+            if i >= self.sums.len() {
+                self.sums.resize(i + 1, TaskSum::default());
+            }
+            let sum = &mut self.sums[i];
+            if sum.tick != table.tick {
+                *sum = TaskSum { tick: table.tick, ..TaskSum::default() };
+                self.touched.push(slot);
+            }
+            sum.ns += ns;
+            sum.threads += 1;
+            if pid == tgid {
+                sum.pages = pages;
+                sum.ppid = ppid;
+                let comm = &rec[32..48];
+                let comm = &comm[..comm.iter().position(|&b| b == 0).unwrap_or(comm.len())];
+                if table.name(slot).is_none_or(|name| name.as_bytes() != comm) {
+                    slab.names.push((slot, Arc::from(String::from_utf8_lossy(comm).as_ref())));
                 }
             }
         }
-    -1000.0
+        for &slot in &self.touched {
+            let sum = self.sums[slot as usize];
+            slab.readings.push(ProcReading {
+                slot,
+                ticks: (sum.ns as u128 * self.clk_tck as u128 / 1_000_000_000) as u64,
+                rss: sum.pages * page_size,
+                threads: sum.threads,
+                ppid: sum.ppid,
+                reset: false,
+            });
+        }
+        Ok(())
+    }
 }
 
+// Raise the soft open-file limit to the hard limit so the stat fd cache can
+// cover hosts with tens of thousands of processes. Returns the soft limit.
 #[cfg(target_os = "linux")]
-fn read_cpu_freq(cached_paths: &mut Vec<String>) -> f64 {
-    // Discover sysfs freq paths once and cache them
-    if cached_paths.is_empty() {
-        if let Ok(entries) = fs::read_dir("/sys/devices/system/cpu") {
-            for entry in entries.flatten() {
-                let name_str = entry.file_name().to_string_lossy().to_string();
-                if name_str.starts_with("cpu") && name_str.len() > 3
-                    && name_str.chars().nth(3).unwrap().is_ascii_digit() {
-                    let freq_path = entry.path().join("cpufreq/scaling_cur_freq");
-                    if fs::metadata(&freq_path).is_ok() {
-                        cached_paths.push(freq_path.to_string_lossy().into_owned());
-                    }
-                }
+fn raise_nofile_limit() -> usize {
+    unsafe {
+        let mut lim: libc::rlimit = std::mem::zeroed();
+        if libc::getrlimit(libc::RLIMIT_NOFILE, &mut lim) != 0 {
+            return 0;
+        }
+        if lim.rlim_cur < lim.rlim_max {
+            let mut raised = lim;
+            raised.rlim_cur = lim.rlim_max;
+            if libc::setrlimit(libc::RLIMIT_NOFILE, &raised) == 0 {
+                lim = raised;
             }
         }
+        usize::try_from(lim.rlim_cur).unwrap_or(usize::MAX)
     }
-    if !cached_paths.is_empty() {
-        let mut total = 0.0;
-        let mut count = 0;
-        for path in cached_paths.iter() {
-            if let Ok(khz_str) = fs::read_to_string(path)
-                && let Ok(khz) = khz_str.trim().parse::<f64>() {
-                    total += khz / 1000.0;
-                    count += 1;
-                }
-        }
-        if count > 0 { return total / count as f64; }
-    }
-    // Fall back to /proc/cpuinfo
-    if let Ok(content) = fs::read_to_string("/proc/cpuinfo") {
-        let mut total = 0.0;
-        let mut count = 0;
-        for line in content.lines() {
-            if line.starts_with("cpu MHz")
-                && let Some(p) = line.split(':').nth(1)
-                    && let Ok(freq) = p.trim().parse::<f64>() {
-                        total += freq;
-                        count += 1;
-                    }
-        }
-        if count > 0 {
-            return total / count as f64;
-        }
-    }
-    0.0
 }
 
-#[cfg(target_os = "macos")]
-fn read_cpu_freq(_cached_paths: &mut Vec<String>) -> f64 {
-    sysctl_u64("hw.cpufrequency")
-        .or_else(|| sysctl_u64("hw.cpufrequency_max"))
-        .map(|hz| hz as f64 / 1_000_000.0)
-        .unwrap_or(0.0)
+// Each collector runs on its own period. Procs always runs together with
+// Cpu, since a process's CPU% is its share of the ticks Cpu reads.
+#[derive(Clone, Copy, PartialEq, Debug)]
+enum Collector {
+    Procs, Cpu, Mem, Net, Storage, Gpu, Temp, Freq, Cgroup, DiskIo, Threads,
 }
 
-#[cfg(target_os = "windows")]
-fn read_cpu_freq(_cached_paths: &mut Vec<String>) -> f64 {
-    unsafe {
-        let count = active_cpu_count() as usize;
-        if count == 0 { return 0.0; }
+const COLLECTORS: [Collector; 11] = [
+    Collector::Procs, Collector::Cpu, Collector::Mem, Collector::Net,
+    Collector::Storage, Collector::Gpu, Collector::Temp, Collector::Freq,
+    Collector::Cgroup, Collector::DiskIo, Collector::Threads,
+];
+
+impl Collector {
+    fn name(self) -> &'static str {
+        match self {
+            Collector::Procs => "procs",
+            Collector::Cpu => "cpu",
+            Collector::Mem => "mem",
+            Collector::Net => "net",
+            Collector::Storage => "storage",
+            Collector::Gpu => "gpu",
+            Collector::Temp => "temp",
+            Collector::Freq => "freq",
+            Collector::Cgroup => "cgroup",
+            Collector::DiskIo => "diskio",
+            Collector::Threads => "threads",
+        }
+    }
 
-        let mut pinfo: Vec<PROCESSOR_POWER_INFORMATION> = vec![std::mem::zeroed(); count];
-        let ret = CallNtPowerInformation(
-            ProcessorInformation, std::ptr::null(), 0,
-            pinfo.as_mut_ptr() as *mut core::ffi::c_void,
-            (count * std::mem::size_of::<PROCESSOR_POWER_INFORMATION>()) as u32,
-        );
-        if ret != 0 { return 0.0; }
+    fn parse(name: &str) -> Option<Self> {
+        COLLECTORS.into_iter().find(|c| c.name() == name)
+    }
 
-        // MhzLimit includes turbo headroom; CurrentMhz is the actual frequency.
-        // Pick the highest across all processors.
-        let mut best = pinfo[0].MaxMhz;
-        for p in &pinfo {
-            if p.CurrentMhz > best { best = p.CurrentMhz; }
-            if p.MhzLimit > best { best = p.MhzLimit; }
-        }
-        best as f64
+    // Runs only while a view shows its readings.
+    fn on_demand(self) -> bool {
+        matches!(self, Collector::Cgroup | Collector::Threads)
+    }
+
+    // Disk usage and clocks barely move; process CPU changes constantly, and
+    // the thread view reads a single process.
+    fn default_period(self) -> Duration {
+        Duration::from_millis(match self {
+            Collector::Threads => 250,
+            Collector::Procs | Collector::Cpu => 500,
+            Collector::Mem | Collector::Net | Collector::Gpu | Collector::Freq | Collector::Cgroup | Collector::DiskIo => 1000,
+            Collector::Temp => 2000,
+            Collector::Storage => 10_000,
+        })
     }
 }
 
-#[cfg(target_os = "linux")]
-fn read_gpu_cores() -> String {
-    let mut gpu_count = 0;
-    let mut unique_devices: HashSet<String> = HashSet::new();
-    let mut has_videocore = false;
-    
-    // Count physical GPUs via DRM, deduplicating by device path
-    if let Ok(entries) = fs::read_dir("/sys/class/drm") {
-        for entry in entries.flatten() {
-            let name = entry.file_name().to_string_lossy().to_string();
-            if name.starts_with("card") && !name.contains('-') {
-                let dev_path = format!("/sys/class/drm/{}/device", name);
-                let dev_id = fs::canonicalize(&dev_path)
-                    .map(|p| p.to_string_lossy().to_string())
-                    .unwrap_or_else(|_| name.clone());
-                
-                // VideoCore/Broadcom GPUs (Pi4, etc.) expose multiple DRM
-                // drivers (vc4 display + v3d render) for one physical GPU
-                let is_videocore =
-                    fs::read_to_string(format!("{}/uevent", dev_path))
-                        .is_ok_and(|u| u.contains("DRIVER=v3d") || u.contains("DRIVER=vc4"))
-                    || fs::read_to_string(format!("{}/vendor", dev_path))
-                        .is_ok_and(|v| v.contains("0x14e4"));
-                
-                if is_videocore {
-                    has_videocore = true;
-                } else if unique_devices.insert(dev_id) {
-                    gpu_count += 1;
-                }
-            }
+// A run that takes more than 1/SLOW_RUN_FRACTION of the collector's period
+// doubles its interval, up to 2^MAX_BACKOFF times the period; each quick run
+// halves it again.
+const SLOW_RUN_FRACTION: u32 = 4;
+const MAX_BACKOFF: u32 = 6;
+// Collectors due this close together run in the same pass, so periods that
+// are multiples of each other stay in step instead of waking twice.
+const SCHEDULE_SLACK: Duration = Duration::from_millis(20);
+
+struct Schedule {
+    period: [Duration; COLLECTORS.len()],
+    backoff: [u32; COLLECTORS.len()],
+    next: [Instant; COLLECTORS.len()],
+    last: [Instant; COLLECTORS.len()],
+    // Switched-off collectors neither run nor wake the sampler.
+    off: [bool; COLLECTORS.len()],
+}
+
+impl Schedule {
+    fn new() -> Self {
+        let now = Instant::now();
+        Self {
+            period: COLLECTORS.map(Collector::default_period),
+            backoff: [0; COLLECTORS.len()],
+            next: [now; COLLECTORS.len()],
+            last: [now; COLLECTORS.len()],
+            off: COLLECTORS.map(Collector::on_demand),
         }
     }
-    if has_videocore {
-        gpu_count += 1;
-    }
-    
-    // Fallback to nvidia-smi if DRM didn't find any
-    if gpu_count == 0 {
-        if let Ok(output) = std::process::Command::new("/usr/bin/nvidia-smi").arg("-L").output() {
-            if output.status.success() {
-                let out_str = String::from_utf8_lossy(&output.stdout);
-                gpu_count = out_str.lines().filter(|l| l.starts_with("GPU")).count();
-            }
-        }
+
+    fn interval(&self, c: Collector) -> Duration {
+        self.period[c as usize] * (1 << self.backoff[c as usize])
     }
 
-    let gpu_str = if gpu_count == 1 { "GPU:" } else { "GPUs:" };
-    let count_prefix = if gpu_count > 0 { format!("{} {}, ", gpu_str, gpu_count) } else { String::new() };
+    fn due(&self, c: Collector, now: Instant) -> bool {
+        self.next[c as usize] <= now + SCHEDULE_SLACK
+    }
 
-    // Try NVIDIA
-    if let Ok(output) = std::process::Command::new("/usr/bin/nvidia-settings")
-        .args(["-q", "CUDACores", "-t"])
-        .output()
-    {
-        if output.status.success() {
-            let out_str = String::from_utf8_lossy(&output.stdout);
-            if let Ok(cores) = out_str.trim().parse::<u32>() {
-                return format!("{}{} CUDA Cores", count_prefix, cores);
-            }
+    // A collector switched back on is due straight away.
+    fn enable(&mut self, c: Collector, on: bool, now: Instant) {
+        let i = c as usize;
+        if on && self.off[i] {
+            self.next[i] = now;
         }
+        self.off[i] = !on;
     }
 
-    // Try AMD
-    if let Ok(entries) = fs::read_dir("/sys/class/kfd/kfd/topology/nodes/") {
-        let mut max_simd = 0;
-        for entry in entries.flatten() {
-            if let Ok(content) = fs::read_to_string(entry.path().join("properties")) {
-                for line in content.lines() {
-                    if line.starts_with("simd_count") {
-                        let parts: Vec<&str> = line.split_whitespace().collect();
-                        if parts.len() >= 2 {
-                            if let Ok(simd) = parts[1].parse::<u32>() {
-                                if simd > max_simd {
-                                    max_simd = simd;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-        }
-        if max_simd > 0 {
-            let sps = max_simd * 64;
-            return format!("{}{} Stream Processors", count_prefix, sps);
+    // Seconds since the collector last ran, for its rates; marks this run.
+    fn start(&mut self, c: Collector, now: Instant) -> f64 {
+        let elapsed = now.duration_since(self.last[c as usize]).as_secs_f64();
+        self.last[c as usize] = now;
+        elapsed.max(0.001)
+    }
+
+    fn finish(&mut self, c: Collector, now: Instant, took: Duration) {
+        let i = c as usize;
+        if took > self.interval(c) / SLOW_RUN_FRACTION {
+            self.backoff[i] = (self.backoff[i] + 1).min(MAX_BACKOFF);
+        } else {
+            self.backoff[i] = self.backoff[i].saturating_sub(1);
         }
+        self.next[i] = now + self.interval(c);
     }
 
-    if gpu_count > 0 {
-        format!("{} {}", gpu_str, gpu_count)
-    } else {
-        String::new()
+    fn next_deadline(&self) -> Instant {
+        self.next.iter().zip(&self.off).filter(|&(_, &off)| !off).map(|(&next, _)| next).min().unwrap_or_else(Instant::now)
     }
 }
 
-#[cfg(target_os = "macos")]
-fn read_gpu_cores() -> String {
-    String::new()
+// Stages the profiler breaks a tick into: one per collector (indexed by
+// `Collector as usize`), then the sort and the frame or batch record.
+const STAGE_SORT: usize = COLLECTORS.len();
+const STAGE_RENDER: usize = STAGE_SORT + 1;
+const STAGES: usize = STAGE_RENDER + 1;
+
+fn stage_name(stage: usize) -> &'static str {
+    match stage {
+        STAGE_SORT => "sort",
+        STAGE_RENDER => "render",
+        _ => COLLECTORS[stage].name(),
+    }
 }
 
-#[cfg(target_os = "windows")]
-fn read_gpu_cores() -> String {
-    if let Ok(output) = std::process::Command::new("nvidia-smi")
-        .arg("-L")
-        .output()
-        && output.status.success() {
-            let out_str = String::from_utf8_lossy(&output.stdout);
-            let gpu_count = out_str.lines().filter(|l| l.starts_with("GPU")).count();
-            if gpu_count > 0 {
-                let gpu_str = if gpu_count == 1 { "GPU:" } else { "GPUs:" };
-                return format!("{} {}", gpu_str, gpu_count);
-            }
-        }
-    String::new()
+// Log-linear buckets, 8 per power of two, so a percentile read back is
+// within 12.5% of the recorded value over the whole u64 range.
+const HIST_SUB_BITS: u32 = 3;
+const HIST_BUCKETS: usize = (64 - HIST_SUB_BITS as usize + 1) << HIST_SUB_BITS;
+
+// Fixed-size histogram that one thread records into while another reads
+// percentiles, without a lock or any allocation after construction.
+struct Histogram {
+    counts: [AtomicU32; HIST_BUCKETS],
 }
 
-#[cfg(target_os = "linux")]
-fn read_cpu_name() -> String {
-    if let Ok(content) = fs::read_to_string("/proc/cpuinfo") {
-        for line in content.lines() {
-            if line.starts_with("model name") {
-                if let Some(name) = line.split(':').nth(1) {
-                    let mut n = name.trim().replace("(R)", "").replace("(TM)", "").replace("(tm)", "").replace("(r)", "");
-                    n = n.replace(" CPU", "").replace(" Processor", "");
-                    let parts: Vec<&str> = n.split_whitespace().collect();
-                    n = parts.join(" ");
-                    n = n.replace("Intel Core ", "");
-                    n = n.replace("AMD Ryzen ", "Ryzen ");
-                    return n;
-                }
-            }
+impl Histogram {
+    fn new() -> Self {
+        Self { counts: std::array::from_fn(|_| AtomicU32::new(0)) }
+    }
+
+    fn bucket(v: u64) -> usize {
+        if v < 1 << HIST_SUB_BITS { return v as usize; }
+        let exp = 63 - v.leading_zeros();
+        let sub = (v >> (exp - HIST_SUB_BITS)) as usize & ((1 << HIST_SUB_BITS) - 1);
+        (((exp - HIST_SUB_BITS + 1) as usize) << HIST_SUB_BITS) + sub
+    }
+
+    // Largest value that lands in bucket `i`.
+    fn bucket_max(i: usize) -> u64 {
+        if i < 1 << HIST_SUB_BITS { return i as u64; }
+        let shift = (i >> HIST_SUB_BITS) as u32 - 1;
+        let sub = (i & ((1 << HIST_SUB_BITS) - 1)) as u128;
+        ((((1 << HIST_SUB_BITS) + sub + 1) << shift) - 1).min(u64::MAX as u128) as u64
+    }
+
+    fn record(&self, v: u64) {
+        self.counts[Self::bucket(v)].fetch_add(1, AtomicOrdering::Relaxed);
+    }
+
+    fn count(&self) -> u64 {
+        self.counts.iter().map(|c| c.load(AtomicOrdering::Relaxed) as u64).sum()
+    }
+
+    // Upper bound of the bucket holding the q-th quantile, None when empty.
+    fn percentile(&self, q: f64) -> Option<u64> {
+        let total = self.count();
+        if total == 0 { return None; }
+        let rank = ((q * total as f64).ceil() as u64).clamp(1, total);
+        let mut seen = 0;
+        for (i, c) in self.counts.iter().enumerate() {
+            seen += c.load(AtomicOrdering::Relaxed) as u64;
+            if seen >= rank { return Some(Self::bucket_max(i)); }
         }
+        None
     }
-    "CPU".to_string()
 }
 
-#[cfg(target_os = "macos")]
-fn read_cpu_name() -> String {
-    sysctl_string("machdep.cpu.brand_string")
-        .or_else(|| sysctl_string("hw.model"))
-        .unwrap_or_else(|| "CPU".to_string())
+struct StageStats {
+    // Wall time on the stage's own thread, in nanoseconds.
+    time_ns: Histogram,
+    // read/write-family syscalls, from the thread's /proc io counters.
+    syscalls: Histogram,
+    bytes_written: Histogram,
 }
 
-#[cfg(target_os = "windows")]
-fn read_cpu_name() -> String {
-    let subkey = win_wstr("HARDWARE\\DESCRIPTION\\System\\CentralProcessor\\0");
-    let value_name = win_wstr("ProcessorNameString");
-    if let Some(name) = win_reg_read_string(&subkey, &value_name) {
-        let mut n = name.replace("(R)", "").replace("(TM)", "").replace("(tm)", "").replace("(r)", "");
-        n = n.replace(" CPU", "").replace(" Processor", "");
-        let parts: Vec<&str> = n.split_whitespace().collect();
-        n = parts.join(" ");
-        n = n.replace("Intel Core ", "");
-        n = n.replace("AMD Ryzen ", "Ryzen ");
-        return n;
+// Cost of every stage since startup. Shared between the sampler thread, which
+// records the collectors and the sort, and the render loop; see Probe.
+struct Profile {
+    stages: [StageStats; STAGES],
+    // Counting syscalls costs two extra reads per stage, so it only runs
+    // with --profile or while the overlay is up.
+    count_syscalls: AtomicBool,
+}
+
+// Start of one stage run, from Profile::start.
+struct Probe {
+    start: Instant,
+    syscalls: Option<u64>,
+}
+
+impl Profile {
+    fn new() -> Self {
+        Self {
+            stages: std::array::from_fn(|_| StageStats {
+                time_ns: Histogram::new(),
+                syscalls: Histogram::new(),
+                bytes_written: Histogram::new(),
+            }),
+            count_syscalls: AtomicBool::new(false),
+        }
+    }
+
+    fn start(&self) -> Probe {
+        let syscalls = if self.count_syscalls.load(AtomicOrdering::Relaxed) { thread_syscalls() } else { None };
+        Probe { start: Instant::now(), syscalls }
+    }
+
+    // Record a run of `stage` and return how long it took.
+    fn finish(&self, stage: usize, probe: Probe, bytes_written: u64) -> Duration {
+        let took = probe.start.elapsed();
+        let st = &self.stages[stage];
+        st.time_ns.record(took.as_nanos() as u64);
+        st.bytes_written.record(bytes_written);
+        // The read in start() is counted by the one here, so take it off.
+        if let (Some(before), Some(after)) = (probe.syscalls, thread_syscalls()) {
+            st.syscalls.record(after.saturating_sub(before).saturating_sub(1));
+        }
+        took
     }
-    "CPU".to_string()
 }
 
+// read/write-family syscalls made by the calling thread so far. Each thread
+// keeps its own /proc/thread-self/io open; one pread per call.
 #[cfg(target_os = "linux")]
-fn read_cpu_times() -> CpuTimes {
-    let mut t = CpuTimes::default();
-    if let Ok(content) = fs::read_to_string("/proc/stat")
-        && let Some(line) = content.lines().next() {
-            let parts: Vec<&str> = line.split_whitespace().collect();
-            if parts.len() >= 9 && parts[0] == "cpu" {
-                t.user = parts[1].parse().unwrap_or(0);
-                t.nice = parts[2].parse().unwrap_or(0);
-                t.sys = parts[3].parse().unwrap_or(0);
-                t.idle = parts[4].parse().unwrap_or(0);
-                t.iowait = parts[5].parse().unwrap_or(0);
-                t.irq = parts[6].parse().unwrap_or(0);
-                t.softirq = parts[7].parse().unwrap_or(0);
-                t.steal = parts[8].parse().unwrap_or(0);
+fn thread_syscalls() -> Option<u64> {
+    thread_local! {
+        static IO: Option<File> = File::open("/proc/thread-self/io").ok();
+    }
+    IO.with(|f| {
+        let mut buf = [0u8; 512];
+        let n = f.as_ref()?.read_at(&mut buf, 0).ok()?;
+        let mut total = 0;
+        for line in buf[..n].split(|&b| b == b'\n') {
+            if let Some(v) = line.strip_prefix(b"syscr: ").or_else(|| line.strip_prefix(b"syscw: ")) {
+                total += parse_dec(v)?;
             }
         }
-    t
+        Some(total)
+    })
+}
+
+#[cfg(not(target_os = "linux"))]
+fn thread_syscalls() -> Option<u64> {
+    None
+}
+
+// utop's own resident set size, for the overlay.
+#[cfg(target_os = "linux")]
+fn self_rss() -> u64 {
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) }.max(1) as u64;
+    let mut buf = [0u8; 128];
+    let n = File::open("/proc/self/statm").and_then(|f| f.read_at(&mut buf, 0)).unwrap_or(0);
+    buf[..n].split(|&b| b == b' ').nth(1).and_then(parse_dec).unwrap_or(0) * page_size
 }
 
 #[cfg(target_os = "macos")]
-fn read_cpu_times() -> CpuTimes {
-    let mut t = CpuTimes::default();
-    unsafe {
-        let mut info = std::mem::zeroed::<libc::host_cpu_load_info>();
-        let mut count = libc::HOST_CPU_LOAD_INFO_COUNT;
-        let kr = libc::host_statistics64(
-            mach_host_self(),
-            libc::HOST_CPU_LOAD_INFO,
-            &mut info as *mut _ as libc::host_info64_t,
-            &mut count,
-        );
-        if kr == libc::KERN_SUCCESS {
-            t.user = info.cpu_ticks[libc::CPU_STATE_USER as usize] as u64;
-            t.sys = info.cpu_ticks[libc::CPU_STATE_SYSTEM as usize] as u64;
-            t.idle = info.cpu_ticks[libc::CPU_STATE_IDLE as usize] as u64;
-            t.nice = info.cpu_ticks[libc::CPU_STATE_NICE as usize] as u64;
-        }
-    }
-    t
+fn self_rss() -> u64 {
+    let mut info = unsafe { std::mem::zeroed::<libc::proc_taskinfo>() };
+    let size = std::mem::size_of::<libc::proc_taskinfo>() as libc::c_int;
+    let read = unsafe { libc::proc_pidinfo(libc::getpid(), libc::PROC_PIDTASKINFO, 0, &mut info as *mut _ as *mut libc::c_void, size) };
+    if read < size { 0 } else { info.pti_resident_size }
 }
 
 #[cfg(target_os = "windows")]
-fn read_cpu_times() -> CpuTimes {
-    let mut t = CpuTimes::default();
+fn self_rss() -> u64 {
     unsafe {
-        let mut idle_time: FILETIME = std::mem::zeroed();
-        let mut kernel_time: FILETIME = std::mem::zeroed();
-        let mut user_time: FILETIME = std::mem::zeroed();
-        if GetSystemTimes(&mut idle_time, &mut kernel_time, &mut user_time) != 0 {
-            let idle = ((idle_time.dwHighDateTime as u64) << 32) | idle_time.dwLowDateTime as u64;
-            let kernel = ((kernel_time.dwHighDateTime as u64) << 32) | kernel_time.dwLowDateTime as u64;
-            let user = ((user_time.dwHighDateTime as u64) << 32) | user_time.dwLowDateTime as u64;
-            // kernel includes idle time on Windows
-            t.sys = kernel.saturating_sub(idle);
-            t.user = user;
-            t.idle = idle;
-        }
+        let mut pmc: windows_sys::Win32::System::ProcessStatus::PROCESS_MEMORY_COUNTERS = std::mem::zeroed();
+        pmc.cb = std::mem::size_of::<windows_sys::Win32::System::ProcessStatus::PROCESS_MEMORY_COUNTERS>() as u32;
+        if K32GetProcessMemoryInfo(GetCurrentProcess(), &mut pmc, pmc.cb) != 0 { pmc.WorkingSetSize as u64 } else { 0 }
     }
-    t
 }
 
-#[cfg(target_os = "linux")]
-fn read_memory() -> MemorySnapshot {
-    let mut m = MemorySnapshot::default();
-    if let Ok(content) = fs::read_to_string("/proc/meminfo") {
+struct Sampler {
+    schedule: Schedule,
+    profile: Arc<Profile>,
+    // Latest readings of every collector but Procs, whichever pass made them.
+    latest: Snapshot,
+    prev_cpu: CpuTimes,
+    // Total CPU ticks when the process table was last read.
+    #[cfg(target_os = "linux")]
+    procs_prev_total: u64,
+    cpu_stat: CpuStatFile,
+    // Flat per-core counters from this tick and the one before.
+    core_ticks: Vec<u64>,
+    prev_core_ticks: Vec<u64>,
+    net: NetReader,
+    #[cfg(target_os = "linux")]
+    page_size: i64,
+    #[cfg(target_os = "linux")]
+    v3d_stats: Vec<V3dStats>,
+    #[cfg(target_os = "linux")]
+    sysfs_gpu: Option<SysfsGpu>,
+    #[cfg(target_os = "linux")]
+    sysfs_gpu_found: Instant,
+    #[cfg(target_os = "linux")]
+    proc_dir: Option<ProcDir>,
+    // Replaces the proc_dir walk when --proc-source bpf could be set up.
+    #[cfg(target_os = "linux")]
+    task_iter: Option<TaskIter>,
+    #[cfg(target_os = "linux")]
+    storage: StorageWorker,
+    #[cfg(target_os = "linux")]
+    cgroups: CgroupTable,
+    #[cfg(target_os = "linux")]
+    disks: DiskStats,
+    cpu_count: String,
+    cpu_name: String,
+    gpu_cores: String,
+    #[cfg(any(target_os = "linux", target_os = "windows"))]
+    nvml: Option<Nvml>,
+    #[cfg(any(target_os = "linux", target_os = "windows"))]
+    nvml_tried: bool,
+    #[cfg(any(target_os = "linux", target_os = "windows"))]
+    nvidia_smi_missing: bool,
+    cpu_temp_path: Option<String>,
+    cpu_freq_paths: Vec<String>,
+    #[cfg(any(target_os = "macos", target_os = "windows"))]
+    logical_cpus: u64,
+    procs: ProcTable,
+    // Seconds between the last two process reads, for I/O rates.
+    procs_elapsed: f64,
+    threads: ThreadTable,
+    // This tick's (pid, slot) list, or (pid, slot, threads, ppid) from Toolhelp.
+    #[cfg(target_os = "macos")]
+    listed: Vec<(i32, u32)>,
+    #[cfg(target_os = "windows")]
+    win_procs: Vec<(i32, u32, i32, i32)>,
+    // Grow-only buffer for the SystemProcessInformation snapshot.
+    #[cfg(target_os = "windows")]
+    nt_procs: Vec<u64>,
+    slabs: Vec<SampleSlab>,
+}
+
+// What a sampling worker read for one process. Workers only read the table;
+// readings are applied on the sampler thread once every worker is done.
+struct ProcReading {
+    slot: u32,
+    ticks: u64,
+    rss: u64,
+    threads: i32,
+    // Parent PID, or -1 to keep the last one (sources that only read it for
+    // new processes).
+    ppid: i32,
+    // The PID was recycled since the slot's previous reading.
+    reset: bool,
+}
+
+// Output of one process-sampling worker. Slabs live in the Sampler so their
+// capacity carries over between ticks.
+#[derive(Default)]
+struct SampleSlab {
+    readings: Vec<ProcReading>,
+    // Names for slots that had none, or whose process renamed itself.
+    names: Vec<(u32, Arc<str>)>,
+}
+
+// Tick count of a slot with no earlier reading to diff against.
+const NO_TICKS: u64 = u64::MAX;
+
+// Whether a process's first reading counts every tick since it started. On
+// Linux the first frame's denominator is also "since boot", which makes that a
+// lifetime average; elsewhere the first window is too short to mean anything.
+const FIRST_READING_FROM_ZERO: bool = cfg!(target_os = "linux");
+
+// Marks "no slot" and "no row" in the tree links.
+const NO_SLOT: u32 = u32::MAX;
+
+// Parent/child links between ProcTable slots, as intrusive sibling lists so
+// that a birth, a death or a reparent is a few index writes. The links only
+// change when a reading reports a new ppid or a slot is freed; build() then
+// lays the whole tree out in three linear passes.
+#[derive(Default)]
+struct ProcTree {
+    // Parent PID from the last reading that had one; -1 when unknown.
+    ppid: Vec<i32>,
+    parent: Vec<u32>,
+    first_child: Vec<u32>,
+    next_sibling: Vec<u32>,
+    prev_sibling: Vec<u32>,
+    // Scratch for build(), kept for its capacity.
+    row_of: Vec<u32>,
+    sub_cpu: Vec<f64>,
+    sub_mem: Vec<u64>,
+    sub_io: Vec<f64>,
+    descendants: Vec<u32>,
+    preorder: Vec<u32>,
+    stack: Vec<(u32, u16, u32)>,
+    kids: Vec<u32>,
+}
+
+// One process in tree order, pointing into the snapshot's procs.
+#[derive(Clone, Copy, Debug, PartialEq)]
+struct TreeRow {
+    row: u32,
+    depth: u16,
+    // Index of the parent's TreeRow, NO_SLOT at the top level.
+    parent: u32,
+    // Rows below this one that belong to its subtree.
+    descendants: u32,
+    // CPU% and RSS of the process and everything under it.
+    cpu: f64,
+    mem: u64,
+}
+
+impl ProcTree {
+    fn push(&mut self) {
+        self.ppid.push(-1);
+        self.parent.push(NO_SLOT);
+        self.first_child.push(NO_SLOT);
+        self.next_sibling.push(NO_SLOT);
+        self.prev_sibling.push(NO_SLOT);
+    }
+
+    fn unlink(&mut self, i: usize) {
+        let (p, prev, next) = (self.parent[i], self.prev_sibling[i], self.next_sibling[i]);
+        if prev != NO_SLOT {
+            self.next_sibling[prev as usize] = next;
+        } else if p != NO_SLOT {
+            self.first_child[p as usize] = next;
+        }
+        if next != NO_SLOT {
+            self.prev_sibling[next as usize] = prev;
+        }
+        self.parent[i] = NO_SLOT;
+        self.prev_sibling[i] = NO_SLOT;
+        self.next_sibling[i] = NO_SLOT;
+    }
+
+    fn reparent(&mut self, i: usize, parent: Option<u32>) {
+        self.unlink(i);
+        let Some(p) = parent.filter(|&p| p as usize != i) else { return; };
+        let head = self.first_child[p as usize];
+        self.parent[i] = p;
+        self.next_sibling[i] = head;
+        if head != NO_SLOT {
+            self.prev_sibling[head as usize] = i as u32;
+        }
+        self.first_child[p as usize] = i as u32;
+    }
+
+    // Drop a freed slot. Its children become roots until their next reading
+    // names the process that adopted them.
+    fn remove(&mut self, i: usize) {
+        self.unlink(i);
+        let mut c = std::mem::replace(&mut self.first_child[i], NO_SLOT);
+        while c != NO_SLOT {
+            let ci = c as usize;
+            c = self.next_sibling[ci];
+            self.parent[ci] = NO_SLOT;
+            self.prev_sibling[ci] = NO_SLOT;
+            self.next_sibling[ci] = NO_SLOT;
+            self.ppid[ci] = -1;
+        }
+        self.ppid[i] = -1;
+    }
+
+    // Lay out every emitted process depth-first, siblings in `sort` order of
+    // their subtree totals. `row_of` maps slots to rows of `procs` (NO_SLOT
+    // for slots that were not emitted; their children move up a level).
+    fn build(&mut self, pid: &[i32], procs: &[ProcessInfo], sort: SortMode, out: &mut Vec<TreeRow>) {
+        out.clear();
+        let n = pid.len();
+        self.sub_cpu.clear();
+        self.sub_cpu.resize(n, 0.0);
+        self.sub_mem.clear();
+        self.sub_mem.resize(n, 0);
+        self.sub_io.clear();
+        self.sub_io.resize(n, 0.0);
+        self.descendants.clear();
+        self.descendants.resize(n, 0);
+
+        // Preorder from the roots. Slots still unvisited after that sit on a
+        // cycle, which stale parent PIDs can form after PID reuse; each is cut
+        // loose as a root of its own.
+        self.preorder.clear();
+        self.stack.clear();
+        self.stack.extend((0..n as u32).filter(|&s| pid[s as usize] >= 0 && self.parent[s as usize] == NO_SLOT).map(|s| (s, 0, 0)));
+        let mut next_root = 0;
+        loop {
+            while let Some((s, _, _)) = self.stack.pop() {
+                self.descendants[s as usize] = 1;
+                self.preorder.push(s);
+                let mut c = self.first_child[s as usize];
+                while c != NO_SLOT {
+                    self.stack.push((c, 0, 0));
+                    c = self.next_sibling[c as usize];
+                }
+            }
+            while next_root < n && (pid[next_root] < 0 || self.descendants[next_root] != 0) {
+                next_root += 1;
+            }
+            if next_root == n { break; }
+            self.unlink(next_root);
+            self.stack.push((next_root as u32, 0, 0));
+        }
+        self.descendants.fill(0);
+
+        // Rollups: children come after their parent in preorder, so one
+        // reverse pass folds every subtree into its root.
+        for &s in &self.preorder {
+            let r = self.row_of[s as usize];
+            if r != NO_SLOT {
+                self.sub_cpu[s as usize] = procs[r as usize].cpu_percent;
+                self.sub_mem[s as usize] = procs[r as usize].mem_bytes;
+                self.sub_io[s as usize] = io_total(procs[r as usize].read_rate, procs[r as usize].write_rate);
+            }
+        }
+        for &s in self.preorder.iter().rev() {
+            let (i, p) = (s as usize, self.parent[s as usize]);
+            if p == NO_SLOT { continue; }
+            let p = p as usize;
+            self.sub_cpu[p] += self.sub_cpu[i];
+            self.sub_mem[p] += self.sub_mem[i];
+            self.sub_io[p] += self.sub_io[i];
+            self.descendants[p] += self.descendants[i] + (self.row_of[i] != NO_SLOT) as u32;
+        }
+
+        // Emit with each set of siblings ordered by subtree totals.
+        let (sub_cpu, sub_mem, sub_io) = (&self.sub_cpu, &self.sub_mem, &self.sub_io);
+        let key = |&s: &u32| sort_key_of(sub_cpu[s as usize], sub_mem[s as usize], sub_io[s as usize], pid[s as usize], sort);
+        self.kids.clear();
+        self.kids.extend(self.preorder.iter().copied().filter(|&s| self.parent[s as usize] == NO_SLOT));
+        self.kids.sort_unstable_by_key(key);
+        self.stack.clear();
+        self.stack.extend(self.kids.iter().rev().map(|&s| (s, 0, NO_SLOT)));
+        while let Some((s, depth, parent)) = self.stack.pop() {
+            let i = s as usize;
+            let r = self.row_of[i];
+            let (child_depth, child_parent) = if r != NO_SLOT {
+                out.push(TreeRow { row: r, depth, parent, descendants: self.descendants[i], cpu: self.sub_cpu[i], mem: self.sub_mem[i] });
+                (depth.saturating_add(1), (out.len() - 1) as u32)
+            } else {
+                (depth, parent)
+            };
+            self.kids.clear();
+            let mut c = self.first_child[i];
+            while c != NO_SLOT {
+                self.kids.push(c);
+                c = self.next_sibling[c as usize];
+            }
+            self.kids.sort_unstable_by_key(key);
+            self.stack.extend(self.kids.iter().rev().map(|&c| (c, child_depth, child_parent)));
+        }
+    }
+}
+
+// Per-process state kept across ticks as parallel arrays indexed by slot. A
+// PID holds its slot, and the name interned for it, for as long as it keeps
+// being listed; slots of exited PIDs go on a free list for the next newcomer,
+// so a steady-state tick neither rebuilds a map nor allocates.
+#[derive(Default)]
+struct ProcTable {
+    slots: HashMap<i32, u32>,
+    // -1 marks a free slot.
+    pid: Vec<i32>,
+    name: Vec<Option<Arc<str>>>,
+    name_lower: Vec<Option<Arc<str>>>,
+    ticks: Vec<u64>,
+    cpu: Vec<f64>,
+    rss: Vec<u64>,
+    threads: Vec<i32>,
+    tree: ProcTree,
+    // cgroup path, looked up once per PID by the cgroup collector.
+    cgroup: Vec<Option<Arc<str>>>,
+    // Storage read and write totals, the tick they were read on, and the
+    // rates against the tick before; see read_io.
+    io_bytes: Vec<[u64; 2]>,
+    io_tick: Vec<u32>,
+    io_rate: Vec<[f64; 2]>,
+    // Tick on which each slot was last listed, and last read.
+    listed: Vec<u32>,
+    read: Vec<u32>,
+    free: Vec<u32>,
+    tick: u32,
+    // Denominator of the last tick's CPU%, kept for the recorder.
+    denominator: f64,
+}
+
+// Names are nearly always lowercase ASCII already; those share the Arc.
+fn lowercase(name: &Arc<str>) -> Arc<str> {
+    if name.is_ascii() && !name.bytes().any(|b| b.is_ascii_uppercase()) {
+        name.clone()
+    } else {
+        Arc::from(name.to_lowercase())
+    }
+}
+
+// Process filter: a case-insensitive name match or a PID substring.
+fn matches_filter(p: &ProcessInfo, filter_lower: &str) -> bool {
+    if filter_lower.is_empty() || p.name_lower.contains(filter_lower) {
+        return true;
+    }
+    use fmt::Write as _;
+    let mut pid = StackStr::<12>::new();
+    let _ = write!(pid, "{}", p.pid);
+    pid.as_str().contains(filter_lower)
+}
+
+// The process list as shown: indices into the snapshot's procs that match
+// the filter. Typing a longer query narrows the previous matches rather
+// than rescanning, and nothing here goes back to the sampler.
+#[derive(Default)]
+struct FilterView {
+    rows: Vec<u32>,
+    // Leading rows already in sort order; see sort_prefix.
+    sorted: usize,
+    query: String,
+    // Cleared when a new snapshot arrives, since the rows index the old one.
+    current: bool,
+}
+
+impl FilterView {
+    fn update(&mut self, procs: &[ProcessInfo], procs_sorted: usize, filter_lower: &str) {
+        if self.current && filter_lower.starts_with(self.query.as_str()) {
+            if filter_lower.len() == self.query.len() { return; }
+            // Retaining keeps the order, so the sorted rows stay a prefix.
+            let (mut i, sorted) = (0, self.sorted);
+            self.rows.retain(|&r| {
+                let keep = matches_filter(&procs[r as usize], filter_lower);
+                if !keep && i < sorted { self.sorted -= 1; }
+                i += 1;
+                keep
+            });
+        } else {
+            // The snapshot's sorted prefix holds the smallest keys, so its
+            // matches come first and in order.
+            self.rows.clear();
+            self.sorted = 0;
+            for (i, p) in procs.iter().enumerate() {
+                if matches_filter(p, filter_lower) {
+                    self.rows.push(i as u32);
+                    if i < procs_sorted { self.sorted += 1; }
+                }
+            }
+        }
+        self.query.clear();
+        self.query.push_str(filter_lower);
+        self.current = true;
+    }
+
+    fn sort_prefix(&mut self, procs: &[ProcessInfo], n: usize) {
+        sort_prefix_by(&mut self.rows, &mut self.sorted, n, |&r| procs[r as usize].sort_key);
+    }
+}
+
+// The process tree as shown: indices into the snapshot's tree rows, minus
+// the subtrees of collapsed processes. A filter keeps the matches and every
+// ancestor of one, so a match is always shown where it sits in the tree.
+#[derive(Default)]
+struct TreeView {
+    rows: Vec<u32>,
+    // PIDs whose children are hidden.
+    collapsed: HashSet<i32>,
+    keep: Vec<bool>,
+}
+
+impl TreeView {
+    fn update(&mut self, tree: &[TreeRow], procs: &[ProcessInfo], filter_lower: &str) {
+        self.keep.clear();
+        self.keep.extend(tree.iter().map(|t| matches_filter(&procs[t.row as usize], filter_lower)));
+        if !filter_lower.is_empty() {
+            // Parents come before their children, so one reverse pass
+            // carries every match up to the root.
+            for i in (0..tree.len()).rev() {
+                if self.keep[i] && tree[i].parent != NO_SLOT {
+                    self.keep[tree[i].parent as usize] = true;
+                }
+            }
+        }
+        self.rows.clear();
+        let mut i = 0;
+        while i < tree.len() {
+            let t = &tree[i];
+            if !self.keep[i] {
+                i += 1;
+                continue;
+            }
+            self.rows.push(i as u32);
+            i += 1;
+            if t.descendants > 0 && self.collapsed.contains(&procs[t.row as usize].pid) {
+                i += t.descendants as usize;
+            }
+        }
+    }
+}
+
+// The cgroup table as shown: the cgroups whose path matches the filter, each
+// expanded one followed by its processes in sort order.
+#[derive(Default)]
+struct CgroupView {
+    // (index into the snapshot's cgroups, row of procs or NO_SLOT for the
+    // cgroup's own line)
+    rows: Vec<(u32, u32)>,
+    expanded: HashSet<Arc<str>>,
+    members: Vec<u32>,
+}
+
+impl CgroupView {
+    fn update(&mut self, cgroups: &[CgroupInfo], procs: &[ProcessInfo], filter_lower: &str) {
+        self.rows.clear();
+        for (i, c) in cgroups.iter().enumerate() {
+            if !c.path_lower.contains(filter_lower) { continue; }
+            self.rows.push((i as u32, NO_SLOT));
+            if c.procs == 0 || !self.expanded.contains(&c.path) { continue; }
+            self.members.clear();
+            self.members.extend((0..procs.len() as u32).filter(|&r| procs[r as usize].cgroup.as_ref() == Some(&c.path)));
+            self.members.sort_unstable_by_key(|&r| procs[r as usize].sort_key);
+            self.rows.extend(self.members.iter().map(|&r| (i as u32, r)));
+        }
+    }
+}
+
+impl ProcTable {
+    fn begin(&mut self) {
+        self.tick = self.tick.wrapping_add(1);
+    }
+
+    // The slot for a listed PID, claiming a free one if the PID is new.
+    fn claim(&mut self, pid: i32) -> u32 {
+        let slot = match self.slots.get(&pid) {
+            Some(&slot) => slot,
+            None => {
+                let slot = match self.free.pop() {
+                    Some(slot) => {
+                        let i = slot as usize;
+                        self.pid[i] = pid;
+                        self.ticks[i] = NO_TICKS;
+                        self.io_bytes[i] = [NO_TICKS; 2];
+                        self.tree.ppid[i] = -1;
+                        slot
+                    }
+                    None => {
+                        self.pid.push(pid);
+                        self.name.push(None);
+                        self.name_lower.push(None);
+                        self.ticks.push(NO_TICKS);
+                        self.cpu.push(0.0);
+                        self.rss.push(0);
+                        self.threads.push(0);
+                        self.tree.push();
+                        self.cgroup.push(None);
+                        self.io_bytes.push([NO_TICKS; 2]);
+                        self.io_tick.push(0);
+                        self.io_rate.push([f64::NAN; 2]);
+                        self.listed.push(0);
+                        self.read.push(0);
+                        (self.pid.len() - 1) as u32
+                    }
+                };
+                self.slots.insert(pid, slot);
+                slot
+            }
+        };
+        self.listed[slot as usize] = self.tick;
+        slot
+    }
+
+    fn name(&self, slot: u32) -> Option<&Arc<str>> {
+        self.name[slot as usize].as_ref()
+    }
+
+    fn set_name(&mut self, slot: u32, name: Arc<str>) {
+        self.name_lower[slot as usize] = Some(lowercase(&name));
+        self.name[slot as usize] = Some(name);
+    }
+
+    // Fold in one reading; CPU% is the tick delta over `denominator`.
+    fn apply(&mut self, r: &ProcReading, denominator: f64) {
+        let i = r.slot as usize;
+        let mut prev = if r.reset { NO_TICKS } else { self.ticks[i] };
+        if prev == NO_TICKS {
+            prev = if FIRST_READING_FROM_ZERO { 0 } else { r.ticks };
+        }
+        self.cpu[i] = if denominator > 0.0 {
+            r.ticks.saturating_sub(prev) as f64 * 100.0 / denominator
+        } else { 0.0 };
+        self.ticks[i] = r.ticks;
+        self.rss[i] = r.rss;
+        self.threads[i] = r.threads;
+        self.read[i] = self.tick;
+        if r.reset {
+            self.cgroup[i] = None;
+            self.io_bytes[i] = [NO_TICKS; 2];
+        }
+        // Roots retry the lookup: a parent listed after its child this tick
+        // has a slot by the next one.
+        if r.ppid >= 0 && (r.ppid != self.tree.ppid[i] || r.reset || self.tree.parent[i] == NO_SLOT) {
+            self.tree.ppid[i] = r.ppid;
+            self.tree.reparent(i, self.slots.get(&r.ppid).copied());
+        }
+    }
+
+    // Free the slots of PIDs that were not listed this tick.
+    fn sweep(&mut self) {
+        for i in 0..self.pid.len() {
+            if self.pid[i] >= 0 && self.listed[i] != self.tick {
+                self.slots.remove(&self.pid[i]);
+                self.pid[i] = -1;
+                self.name[i] = None;
+                self.name_lower[i] = None;
+                self.cgroup[i] = None;
+                self.tree.remove(i);
+                self.free.push(i as u32);
+            }
+        }
+    }
+
+    // Append every process read this tick; filtering is up to the view.
+    fn emit(&self, out: &mut Vec<ProcessInfo>) {
+        for i in 0..self.pid.len() {
+            if self.read[i] != self.tick { continue; }
+            let (Some(name), Some(name_lower)) = (&self.name[i], &self.name_lower[i]) else { continue; };
+            out.push(ProcessInfo {
+                pid: self.pid[i],
+                ppid: self.tree.ppid[i],
+                name: name.clone(),
+                name_lower: name_lower.clone(),
+                cpu_percent: self.cpu[i],
+                mem_bytes: self.rss[i],
+                threads: self.threads[i],
+                read_rate: if self.io_tick[i] == self.tick { self.io_rate[i][0] } else { f64::NAN },
+                write_rate: if self.io_tick[i] == self.tick { self.io_rate[i][1] } else { f64::NAN },
+                cgroup: self.cgroup[i].clone(),
+                sort_key: (0, 0, 0),
+            });
+        }
+    }
+
+    // Read a slot's storage I/O, at most once per tick. Rates need readings on
+    // two consecutive ticks, `elapsed` seconds apart; a process that just came
+    // into view gets its rates on the tick after.
+    fn read_io(&mut self, slot: usize, elapsed: f64) {
+        if self.io_tick[slot] == self.tick { return; }
+        let prev_tick = std::mem::replace(&mut self.io_tick[slot], self.tick);
+        let Some(bytes) = read_proc_io(self.pid[slot]) else {
+            self.io_bytes[slot] = [NO_TICKS; 2];
+            self.io_rate[slot] = [f64::NAN; 2];
+            return;
+        };
+        let prev = std::mem::replace(&mut self.io_bytes[slot], bytes);
+        let fresh = prev_tick == self.tick.wrapping_sub(1) && prev[0] != NO_TICKS;
+        for k in 0..2 {
+            self.io_rate[slot][k] = if fresh { bytes[k].saturating_sub(prev[k]) as f64 / elapsed } else { f64::NAN };
+        }
+    }
+
+    // The tree of the processes the last emit() produced, in whatever order
+    // they have been sorted into since.
+    fn build_tree(&mut self, procs: &[ProcessInfo], sort: SortMode, out: &mut Vec<TreeRow>) {
+        self.tree.row_of.clear();
+        self.tree.row_of.resize(self.pid.len(), NO_SLOT);
+        for (r, p) in procs.iter().enumerate() {
+            if let Some(&slot) = self.slots.get(&p.pid) {
+                self.tree.row_of[slot as usize] = r as u32;
+            }
+        }
+        self.tree.build(&self.pid, procs, sort, out);
+    }
+}
+
+// Files of one cgroup kept open between reads.
+#[cfg(target_os = "linux")]
+#[derive(Default)]
+struct CgroupFiles {
+    cpu_stat: Option<File>,
+    memory_current: Option<File>,
+    io_stat: Option<File>,
+}
+
+// Cgroup files held open at once; past this, files are opened per read.
+#[cfg(target_os = "linux")]
+const CGROUP_CACHED_FILES: usize = 3 * 1024;
+
+// Every cgroup in the v2 hierarchy, in slots like ProcTable's: a cgroup keeps
+// its slot and its open cpu.stat, memory.current and io.stat for as long as
+// its directory exists, so a read costs a few preads and one readdir per
+// cgroup however many processes they hold.
+#[cfg(target_os = "linux")]
+struct CgroupTable {
+    // Where the hierarchy is mounted; None without cgroup v2.
+    root: Option<String>,
+    slots: HashMap<Arc<str>, u32>,
+    // None marks a free slot.
+    path: Vec<Option<Arc<str>>>,
+    path_lower: Vec<Option<Arc<str>>>,
+    files: Vec<CgroupFiles>,
+    usage_usec: Vec<u64>,
+    // rbytes and wbytes totals, and their rates.
+    io_bytes: Vec<[u64; 2]>,
+    io_rate: Vec<[f64; 2]>,
+    cpu: Vec<f64>,
+    mem: Vec<u64>,
+    procs: Vec<u32>,
+    listed: Vec<u32>,
+    free: Vec<u32>,
+    tick: u32,
+    open_files: usize,
+    // Given to PIDs whose /proc/<pid>/cgroup could not be read, so they are
+    // not retried.
+    unknown: Arc<str>,
+    buf: Vec<u8>,
+}
+
+// The hierarchy under /sys/fs/cgroup, or its unified/ mount on hosts that
+// still run v1 controllers alongside.
+#[cfg(target_os = "linux")]
+fn cgroup_root() -> Option<String> {
+    ["/sys/fs/cgroup", "/sys/fs/cgroup/unified"].into_iter()
+        .map(|p| sys_path(p).into_owned())
+        .find(|p| fs::metadata(format!("{}/cgroup.controllers", p)).is_ok())
+}
+
+// The v2 entry ("0::<path>") of a /proc/<pid>/cgroup file.
+#[cfg(target_os = "linux")]
+fn parse_proc_cgroup(text: &[u8]) -> Option<&str> {
+    let line = text.split(|&b| b == b'\n').find(|l| l.starts_with(b"0::"))?;
+    std::str::from_utf8(&line[3..]).ok().filter(|p| p.starts_with('/'))
+}
+
+// Sectors in /proc/diskstats are 512 bytes whatever the device's own size.
+#[cfg(target_os = "linux")]
+const DISKSTATS_SECTOR: f64 = 512.0;
+
+// Read and write throughput of every block device from /proc/diskstats, for
+// the DSK lines, which name the device their filesystem is mounted from.
+#[cfg(target_os = "linux")]
+#[derive(Default)]
+struct DiskStats {
+    file: Option<File>,
+    buf: Vec<u8>,
+    // Per disk as of the last read; only a new disk allocates.
+    disks: HashMap<String, DiskCounters>,
+    tick: u32,
+    // Mounted device path to its diskstats name, resolved once per device.
+    names: HashMap<String, Option<String>>,
+}
+
+#[cfg(target_os = "linux")]
+struct DiskCounters {
+    // Sectors read and written, and the rates since the read before, NaN
+    // until there have been two.
+    sectors: [u64; 2],
+    rate: [f64; 2],
+    // The read that last listed it.
+    tick: u32,
+}
+
+#[cfg(target_os = "linux")]
+impl DiskStats {
+    fn read(&mut self, elapsed: f64) {
+        if self.file.is_none() {
+            self.file = File::open(&*sys_path("/proc/diskstats")).ok();
+        }
+        let Some(file) = &self.file else { return; };
+        if self.buf.is_empty() {
+            self.buf.resize(16 * 1024, 0);
+        }
+        let n = loop {
+            let Ok(n) = file.read_at(&mut self.buf, 0) else { return; };
+            if n < self.buf.len() || self.buf.len() >= 16 << 20 { break n; }
+            let len = self.buf.len() * 2;
+            self.buf.resize(len, 0);
+        };
+        let buf = std::mem::take(&mut self.buf);
+        self.update(&buf[..n], elapsed);
+        self.buf = buf;
+    }
+
+    // Fold in one read of /proc/diskstats and forget the disks it did not
+    // list, so a re-plugged one starts over from its first reading.
+    fn update(&mut self, text: &[u8], elapsed: f64) {
+        self.tick = self.tick.wrapping_add(1);
+        let tick = self.tick;
+        // major minor name reads merged sectors ms writes merged sectors ...
+        for line in text.split(|&b| b == b'\n') {
+            let mut t = line.split(|&b| b == b' ').filter(|t| !t.is_empty());
+            let (Some(name), Some(rd), Some(wr)) = (t.nth(2), t.nth(2), t.nth(3)) else { continue; };
+            let (Ok(name), Some(rd), Some(wr)) = (std::str::from_utf8(name), parse_dec(rd), parse_dec(wr)) else { continue; };
+            let cur = [rd, wr];
+            match self.disks.get_mut(name) {
+                Some(d) => {
+                    d.rate = [0, 1].map(|k| cur[k].saturating_sub(d.sectors[k]) as f64 * DISKSTATS_SECTOR / elapsed);
+                    d.sectors = cur;
+                    d.tick = tick;
+                }
+                None => { self.disks.insert(name.to_string(), DiskCounters { sectors: cur, rate: [f64::NAN; 2], tick }); }
+            }
+        }
+        self.disks.retain(|_, d| d.tick == tick);
+    }
+
+    fn apply(&mut self, storage: &mut [StorageSnapshot]) {
+        for s in storage.iter_mut() {
+            if !self.names.contains_key(&s.device) {
+                self.names.insert(s.device.clone(), diskstats_name(&s.device));
+            }
+            let disk = self.names[&s.device].as_ref().and_then(|n| self.disks.get(n));
+            [s.read_rate, s.write_rate] = disk.map_or([f64::NAN; 2], |d| d.rate);
+        }
+        // An unmounted device is resolved again if it comes back, maybe as
+        // another disk.
+        self.names.retain(|device, _| storage.iter().any(|s| s.device == *device));
+    }
+}
+
+// The kernel's name for a /dev path; /dev/mapper and /dev/disk entries are
+// symlinks to it.
+#[cfg(target_os = "linux")]
+fn diskstats_name(device: &str) -> Option<String> {
+    let name = device.strip_prefix("/dev/")?;
+    let real = fs::canonicalize(device).ok();
+    let real = real.as_ref().and_then(|p| p.file_name()).and_then(|n| n.to_str());
+    Some(real.unwrap_or(name).to_string())
+}
+
+// Reads `name` of a cgroup through its cached file, opening it if needed.
+#[cfg(target_os = "linux")]
+fn read_cgroup_file(file: &mut Option<File>, dir: &str, name: &str, keep: &mut bool, buf: &mut [u8]) -> Option<usize> {
+    if let Some(f) = file {
+        if let Ok(n) = f.read_at(buf, 0) {
+            return Some(n);
+        }
+        *file = None;
+    }
+    let f = File::open(format!("{}/{}", dir, name)).ok()?;
+    let n = f.read_at(buf, 0).ok()?;
+    if *keep {
+        *file = Some(f);
+        *keep = false;
+    }
+    Some(n)
+}
+
+#[cfg(target_os = "linux")]
+impl CgroupTable {
+    fn new(root: Option<String>) -> Self {
+        Self {
+            root,
+            slots: HashMap::new(),
+            path: Vec::new(),
+            path_lower: Vec::new(),
+            files: Vec::new(),
+            usage_usec: Vec::new(),
+            io_bytes: Vec::new(),
+            io_rate: Vec::new(),
+            cpu: Vec::new(),
+            mem: Vec::new(),
+            procs: Vec::new(),
+            listed: Vec::new(),
+            free: Vec::new(),
+            tick: 0,
+            open_files: 0,
+            unknown: Arc::from(""),
+            buf: vec![0; 4096],
+        }
+    }
+
+    // Walk the hierarchy and read every cgroup. CPU% is usage over `elapsed`
+    // seconds of `cpus` CPUs, so it adds up the same way process CPU% does.
+    fn read(&mut self, elapsed: f64, cpus: usize) {
+        let Some(root) = self.root.take() else { return; };
+        self.tick = self.tick.wrapping_add(1);
+        let mut dir = root.clone();
+        self.walk(&mut dir, root.len(), elapsed * 1_000_000.0 * cpus.max(1) as f64, elapsed);
+        self.root = Some(root);
+
+        for i in 0..self.path.len() {
+            if self.path[i].is_some() && self.listed[i] != self.tick {
+                if let Some(p) = self.path[i].take() {
+                    self.slots.remove(&p);
+                }
+                self.path_lower[i] = None;
+                let f = std::mem::take(&mut self.files[i]);
+                self.open_files -= [f.cpu_stat.is_some(), f.memory_current.is_some(), f.io_stat.is_some()].iter().filter(|&&o| o).count();
+                self.free.push(i as u32);
+            }
+        }
+    }
+
+    // `dir` is the cgroup's directory; its path proper starts at `at`.
+    fn walk(&mut self, dir: &mut String, at: usize, usec_total: f64, elapsed: f64) {
+        let slot = self.claim(if dir.len() == at { "/" } else { &dir[at..] }) as usize;
+        self.listed[slot] = self.tick;
+
+        let mut keep = [self.open_files < CGROUP_CACHED_FILES; 3];
+        let was = [self.files[slot].cpu_stat.is_some(), self.files[slot].memory_current.is_some(), self.files[slot].io_stat.is_some()];
+        let files = &mut self.files[slot];
+        let buf = &mut self.buf;
+        let usage = read_cgroup_file(&mut files.cpu_stat, dir, "cpu.stat", &mut keep[0], buf)
+            .and_then(|n| buf[..n].split(|&b| b == b'\n').find_map(|l| l.strip_prefix(b"usage_usec ").and_then(parse_dec)));
+        if let Some(usage) = usage {
+            let prev = std::mem::replace(&mut self.usage_usec[slot], usage);
+            self.cpu[slot] = if prev == NO_TICKS || usec_total <= 0.0 { 0.0 } else { usage.saturating_sub(prev) as f64 * 100.0 / usec_total };
+        }
+        self.mem[slot] = read_cgroup_file(&mut files.memory_current, dir, "memory.current", &mut keep[1], buf)
+            .and_then(|n| parse_dec(buf[..n].trim_ascii_end()))
+            .unwrap_or(0);
+        if let Some(n) = read_cgroup_file(&mut files.io_stat, dir, "io.stat", &mut keep[2], buf) {
+            let mut total = [0_u64; 2];
+            for tok in buf[..n].split(|&b| b == b' ' || b == b'\n') {
+                if let Some(v) = tok.strip_prefix(b"rbytes=").and_then(parse_dec) { total[0] += v; }
+                if let Some(v) = tok.strip_prefix(b"wbytes=").and_then(parse_dec) { total[1] += v; }
+            }
+            let prev = std::mem::replace(&mut self.io_bytes[slot], total);
+            for k in 0..2 {
+                self.io_rate[slot][k] = if prev[k] == NO_TICKS { 0.0 } else { total[k].saturating_sub(prev[k]) as f64 / elapsed };
+            }
+        }
+        let now = [files.cpu_stat.is_some(), files.memory_current.is_some(), files.io_stat.is_some()];
+        for k in 0..3 {
+            if now[k] && !was[k] { self.open_files += 1; }
+            if was[k] && !now[k] { self.open_files -= 1; }
+        }
+
+        let Ok(entries) = fs::read_dir(&*dir) else { return; };
+        for e in entries.flatten() {
+            if !e.file_type().is_ok_and(|t| t.is_dir()) { continue; }
+            let name = e.file_name();
+            let Some(name) = name.to_str() else { continue; };
+            let len = dir.len();
+            dir.push('/');
+            dir.push_str(name);
+            self.walk(dir, at, usec_total, elapsed);
+            dir.truncate(len);
+        }
+    }
+
+    fn claim(&mut self, path: &str) -> u32 {
+        if let Some(&slot) = self.slots.get(path) {
+            return slot;
+        }
+        let path: Arc<str> = Arc::from(path);
+        let slot = match self.free.pop() {
+            Some(slot) => slot,
+            None => {
+                self.path.push(None);
+                self.path_lower.push(None);
+                self.files.push(CgroupFiles::default());
+                self.usage_usec.push(NO_TICKS);
+                self.io_bytes.push([NO_TICKS; 2]);
+                self.io_rate.push([0.0; 2]);
+                self.cpu.push(0.0);
+                self.mem.push(0);
+                self.procs.push(0);
+                self.listed.push(0);
+                (self.path.len() - 1) as u32
+            }
+        };
+        let i = slot as usize;
+        self.usage_usec[i] = NO_TICKS;
+        self.io_bytes[i] = [NO_TICKS; 2];
+        self.io_rate[i] = [0.0; 2];
+        self.cpu[i] = 0.0;
+        self.path_lower[i] = Some(lowercase(&path));
+        self.path[i] = Some(path.clone());
+        self.slots.insert(path, slot);
+        slot
+    }
+
+    // Give each process read this tick its cgroup, looking up only PIDs that
+    // have none yet, and count the processes in every cgroup.
+    fn map_pids(&mut self, table: &mut ProcTable) {
+        if self.root.is_none() { return; }
+        self.procs.fill(0);
+        for i in 0..table.pid.len() {
+            if table.read[i] != table.tick { continue; }
+            if table.cgroup[i].is_none() {
+                let text = fs::read(&*sys_path(&format!("/proc/{}/cgroup", table.pid[i]))).unwrap_or_default();
+                table.cgroup[i] = Some(match parse_proc_cgroup(&text) {
+                    Some(path) => self.slots.get_key_value(path).map_or_else(|| Arc::from(path), |(k, _)| k.clone()),
+                    None => self.unknown.clone(),
+                });
+            }
+            if let Some(c) = &table.cgroup[i]
+                && let Some(&slot) = self.slots.get(&**c) {
+                    self.procs[slot as usize] += 1;
+                }
+        }
+    }
+
+    // Append every cgroup, sorted in full; there are few enough.
+    fn emit(&self, sort: SortMode, out: &mut Vec<CgroupInfo>) {
+        for i in 0..self.path.len() {
+            let (Some(path), Some(path_lower)) = (&self.path[i], &self.path_lower[i]) else { continue; };
+            out.push(CgroupInfo {
+                path: path.clone(),
+                path_lower: path_lower.clone(),
+                cpu_percent: self.cpu[i],
+                mem_bytes: self.mem[i],
+                read_rate: self.io_rate[i][0],
+                write_rate: self.io_rate[i][1],
+                procs: self.procs[i],
+                sort_key: sort_key_of(self.cpu[i], self.mem[i], self.io_rate[i][0] + self.io_rate[i][1], i as i32, sort),
+            });
+        }
+        out.sort_unstable_by_key(|c| c.sort_key);
+    }
+}
+
+// Auto-sized sampling runs one worker per this many logical CPUs...
+const CORES_PER_SAMPLER_THREAD: usize = 16;
+const MAX_SAMPLER_THREADS: usize = 16;
+// ...but never gives a worker fewer PIDs than this; below it thread handoff
+// costs more than the reads it saves.
+const MIN_PIDS_PER_SAMPLER_THREAD: usize = 1024;
+
+fn auto_sampler_threads() -> usize {
+    let cpus = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1);
+    (cpus / CORES_PER_SAMPLER_THREAD).clamp(1, MAX_SAMPLER_THREADS)
+}
+
+// Split items into one contiguous chunk per worker and run f on each chunk
+// with its own slab, on scoped threads. The first chunk runs on the calling
+// thread; with a single worker nothing is spawned.
+fn run_chunked<T: Send, F>(items: &mut [T], slabs: &mut [SampleSlab], f: F)
+where
+    F: Fn(&mut [T], &mut SampleSlab) + Sync,
+{
+    for slab in slabs.iter_mut() {
+        slab.readings.clear();
+        slab.names.clear();
+    }
+    let workers = slabs.len().min(items.len().div_ceil(MIN_PIDS_PER_SAMPLER_THREAD)).max(1);
+    if workers == 1 {
+        f(items, &mut slabs[0]);
+        return;
+    }
+    let chunk = items.len().div_ceil(workers);
+    std::thread::scope(|scope| {
+        let mut chunks = items.chunks_mut(chunk).zip(slabs.iter_mut());
+        let first = chunks.next();
+        for (items, slab) in chunks {
+            let f = &f;
+            scope.spawn(move || f(items, slab));
+        }
+        if let Some((items, slab)) = first {
+            f(items, slab);
+        }
+    });
+}
+
+impl Sampler {
+    fn new() -> Self {
+        Self::discovered(Discovery::header())
+    }
+
+    // A sampler that starts from what an earlier discovery found, such as a
+    // cached one, instead of probing for it.
+    fn discovered(found: Discovery) -> Self {
+        Self {
+            schedule: Schedule::new(),
+            profile: Arc::new(Profile::new()),
+            latest: Snapshot::default(),
+            prev_cpu: CpuTimes::default(),
+            #[cfg(target_os = "linux")]
+            procs_prev_total: 0,
+            cpu_stat: CpuStatFile::default(),
+            core_ticks: Vec::new(),
+            prev_core_ticks: Vec::new(),
+            net: NetReader::default(),
+            #[cfg(target_os = "linux")]
+            page_size: unsafe { libc::sysconf(libc::_SC_PAGESIZE) },
+            #[cfg(target_os = "linux")]
+            v3d_stats: Vec::new(),
+            #[cfg(target_os = "linux")]
+            sysfs_gpu: None,
+            #[cfg(target_os = "linux")]
+            sysfs_gpu_found: Instant::now(),
+            #[cfg(target_os = "linux")]
+            proc_dir: ProcDir::open(),
+            #[cfg(target_os = "linux")]
+            task_iter: None,
+            #[cfg(target_os = "linux")]
+            storage: StorageWorker::new(statvfs_usage),
+            #[cfg(target_os = "linux")]
+            cgroups: CgroupTable::new(cgroup_root()),
+            #[cfg(target_os = "linux")]
+            disks: DiskStats::default(),
+            cpu_count: found.cpu_count,
+            cpu_name: found.cpu_name,
+            gpu_cores: found.gpu_cores,
+            #[cfg(any(target_os = "linux", target_os = "windows"))]
+            nvml: None,
+            #[cfg(any(target_os = "linux", target_os = "windows"))]
+            nvml_tried: false,
+            #[cfg(any(target_os = "linux", target_os = "windows"))]
+            nvidia_smi_missing: found.nvidia_smi_missing,
+            cpu_temp_path: found.cpu_temp_path,
+            cpu_freq_paths: found.cpu_freq_paths,
+            #[cfg(any(target_os = "macos", target_os = "windows"))]
+            logical_cpus: {
+                #[cfg(target_os = "macos")]
+                { read_logical_cpu_count() }
+                #[cfg(target_os = "windows")]
+                { active_cpu_count() as u64 }
+            },
+            procs: ProcTable::default(),
+            procs_elapsed: 1.0,
+            threads: ThreadTable::new(),
+            #[cfg(target_os = "macos")]
+            listed: Vec::new(),
+            #[cfg(target_os = "windows")]
+            win_procs: Vec::new(),
+            #[cfg(target_os = "windows")]
+            nt_procs: Vec::new(),
+            slabs: Vec::new(),
+        }
+        .with_sampler_threads(auto_sampler_threads())
+    }
+
+    fn with_sampler_threads(mut self, threads: usize) -> Self {
+        self.slabs.resize_with(threads.max(1), SampleSlab::default);
+        self
+    }
+
+    fn with_period(mut self, c: Collector, period: Duration) -> Self {
+        self.schedule.period[c as usize] = period;
+        self
+    }
+
+    // Switch to rtnetlink for interface counters, or explain why not.
+    fn with_net_source(mut self, source: NetSource) -> Self {
+        if source == NetSource::Netlink {
+            #[cfg(target_os = "linux")]
+            match NetlinkStats::open() {
+                Ok(nl) => self.net.netlink = Some(nl),
+                Err(e) => eprintln!("utop: rtnetlink stats unavailable ({}), reading /proc/net/dev instead", e),
+            }
+            #[cfg(not(target_os = "linux"))]
+            eprintln!("utop: --net-source netlink is Linux-only, ignoring it");
+        }
+        self
+    }
+
+    // Switch to the BPF task iterator, or explain why /proc stays in use.
+    fn with_proc_source(mut self, source: ProcSource) -> Self {
+        if source == ProcSource::Bpf {
+            #[cfg(target_os = "linux")]
+            match TaskIter::open() {
+                Ok(it) => self.task_iter = Some(it),
+                Err(e) => eprintln!("utop: BPF task iterator unavailable ({}), reading /proc instead", e),
+            }
+            #[cfg(not(target_os = "linux"))]
+            eprintln!("utop: --proc-source bpf is Linux-only, ignoring it");
+        }
+        self
+    }
+}
+
+// One complete frame of collected data. The sampler thread fills these and
+// the render loop only ever reads a whole one.
+struct Snapshot {
+    cpu: f64,
+    // Busy % per core, indexed by CPU number.
+    cores: Vec<f32>,
+    mem: MemorySnapshot,
+    net: NetworkSnapshot,
+    gpus: Vec<GpuSnapshot>,
+    storage: Vec<StorageSnapshot>,
+    cpu_temp: f64,
+    cpu_freq: f64,
+    procs: Vec<ProcessInfo>,
+    // Leading procs already in sort order; see sort_prefix.
+    sorted: usize,
+    // Every process in tree order, when the view asked for it.
+    tree: Vec<TreeRow>,
+    // Every cgroup, in sort order, likewise.
+    cgroups: Vec<CgroupInfo>,
+    // Threads of the process the thread view is open on, busiest first.
+    threads: Vec<ThreadInfo>,
+    // Set when the frame comes from a recording rather than this machine.
+    replay: Option<ReplayPos>,
+    // Every agent under --connect, and which of them the rest describes.
+    hosts: Vec<HostSummary>,
+    host: usize,
+    // Counts the samples behind the system readings: it moves when the Cpu
+    // collector ran or a recorded frame was decoded, not when a frame is only
+    // republished for a sort or another collector. The sparklines take one
+    // point per sample, and start over when `epoch` moves on a replay seek.
+    seq: u64,
+    epoch: u64,
+}
+
+impl Snapshot {
+    // Everything but the process list, reusing this frame's allocations.
+    fn copy_system_from(&mut self, from: &Snapshot) {
+        self.cpu = from.cpu;
+        self.cores.clone_from(&from.cores);
+        self.mem = from.mem.clone();
+        self.net.clone_from(&from.net);
+        self.gpus.clone_from(&from.gpus);
+        self.storage.clone_from(&from.storage);
+        self.cpu_temp = from.cpu_temp;
+        self.cpu_freq = from.cpu_freq;
+        self.seq = from.seq;
+    }
+}
+
+impl Default for Snapshot {
+    fn default() -> Self {
+        Self {
+            cpu: 0.0,
+            cores: Vec::new(),
+            mem: MemorySnapshot::default(),
+            net: NetworkSnapshot::default(),
+            gpus: Vec::new(),
+            storage: Vec::new(),
+            cpu_temp: -1000.0,
+            cpu_freq: 0.0,
+            procs: Vec::new(),
+            sorted: 0,
+            tree: Vec::new(),
+            cgroups: Vec::new(),
+            threads: Vec::new(),
+            replay: None,
+            hosts: Vec::new(),
+            host: 0,
+            seq: 0,
+            epoch: 0,
+        }
+    }
+}
+
+// Lock-free single-producer/single-consumer triple buffer. The writer fills
+// its back buffer and swaps it into the middle slot; the reader swaps the
+// middle slot with its front buffer when a fresh one is there. Neither side
+// ever waits for the other, and the three Snapshots (with their Vec
+// capacity) are recycled instead of reallocated.
+struct TripleBuffer<T> {
+    bufs: [UnsafeCell<T>; 3],
+    // Index of the middle buffer, plus TRIPLE_FRESH once the writer has
+    // published into it and the reader has not yet taken it.
+    middle: AtomicU8,
+}
+
+const TRIPLE_INDEX: u8 = 0b11;
+const TRIPLE_FRESH: u8 = 0b100;
+
+// Safety: each buffer is owned by exactly one of writer, middle slot or
+// reader at any time, and ownership only moves through the atomic swap.
+unsafe impl<T: Send> Sync for TripleBuffer<T> {}
+
+struct SnapshotWriter<T> {
+    shared: Arc<TripleBuffer<T>>,
+    back: u8,
+}
+
+struct SnapshotReader<T> {
+    shared: Arc<TripleBuffer<T>>,
+    front: u8,
+}
+
+fn triple_buffer<T: Default>() -> (SnapshotWriter<T>, SnapshotReader<T>) {
+    let shared = Arc::new(TripleBuffer {
+        bufs: [UnsafeCell::new(T::default()), UnsafeCell::new(T::default()), UnsafeCell::new(T::default())],
+        middle: AtomicU8::new(1),
+    });
+    (SnapshotWriter { shared: shared.clone(), back: 0 }, SnapshotReader { shared, front: 2 })
+}
+
+impl<T> SnapshotWriter<T> {
+    fn back_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.shared.bufs[self.back as usize].get() }
+    }
+
+    fn publish(&mut self) {
+        let prev = self.shared.middle.swap(self.back | TRIPLE_FRESH, AtomicOrdering::AcqRel);
+        self.back = prev & TRIPLE_INDEX;
+    }
+}
+
+impl<T> SnapshotReader<T> {
+    // Take the latest published frame, if any arrived since the last call.
+    fn update(&mut self) -> bool {
+        if self.shared.middle.load(AtomicOrdering::Relaxed) & TRIPLE_FRESH == 0 {
+            return false;
+        }
+        let prev = self.shared.middle.swap(self.front, AtomicOrdering::AcqRel);
+        self.front = prev & TRIPLE_INDEX;
+        true
+    }
+
+    // The front buffer belongs to the reader alone until the next update(),
+    // so the render loop may finish sorting it in place.
+    fn get_mut(&mut self) -> &mut T {
+        unsafe { &mut *self.shared.bufs[self.front as usize].get() }
+    }
+}
+
+// View parameters the sampler thread applies to the process list. The render
+// loop edits these and wakes the thread; the lock is only held to copy them.
+// sort_rows is how far down the list the view reaches, published every frame.
+// seek_ms and paused only mean anything to the replay thread, host only to
+// the --connect one.
+struct SamplerControl {
+    sort: Mutex<SortMode>,
+    requested: AtomicBool,
+    sort_rows: AtomicUsize,
+    seek_ms: AtomicI64,
+    paused: AtomicBool,
+    // What the view shows beyond the process list; see ViewNeeds.
+    tree: AtomicBool,
+    cgroups: AtomicBool,
+    io_rows: AtomicUsize,
+    io_pids: Mutex<Vec<i32>>,
+    // PID the thread view is open on, or -1.
+    threads: AtomicI32,
+    host: AtomicUsize,
+}
+
+// Run collection on its own thread so slow sysfs reads or a stalled
+// nvidia-smi never hold up input handling or drawing. The thread sleeps until
+// the next collector is due, feeds the recorder, if any, whenever the process
+// table was read, and returns the error that stopped it.
+fn spawn_sampler(mut sampler: Sampler, mut recorder: Option<Recorder>, mut writer: SnapshotWriter<Snapshot>, control: Arc<SamplerControl>) -> std::thread::JoinHandle<Option<io::Error>> {
+    std::thread::Builder::new()
+        .name("utop-sampler".to_string())
+        .spawn(move || {
+            let mut sort = SortMode::Cpu;
+            let mut error = None;
+            let mut io_pids = Vec::new();
+            while !QUIT.load(AtomicOrdering::SeqCst) {
+                let resort = control.requested.swap(false, AtomicOrdering::AcqRel);
+                if resort {
+                    sort = *control.sort.lock().unwrap();
+                }
+                let sort_rows = control.sort_rows.load(AtomicOrdering::Relaxed) + SORT_MARGIN;
+                io_pids.clone_from(&*control.io_pids.lock().unwrap());
+                let needs = ViewNeeds {
+                    tree: control.tree.load(AtomicOrdering::Relaxed),
+                    cgroups: control.cgroups.load(AtomicOrdering::Relaxed),
+                    io_rows: control.io_rows.load(AtomicOrdering::Relaxed),
+                    io_pids: &io_pids,
+                    threads: Some(control.threads.load(AtomicOrdering::Relaxed)).filter(|&pid| pid >= 0),
+                };
+                let ran = sample_due(&mut sampler, false, sort, sort_rows, needs, writer.back_mut());
+                if ran[Collector::Procs as usize]
+                    && let Some(rec) = &mut recorder
+                    && let Err(e) = rec.write_frame(unix_ms(), &sampler.procs, writer.back_mut()) {
+                        error = Some(e);
+                        recorder = None;
+                    }
+                if resort || ran.contains(&true) {
+                    writer.publish();
+                    wake_main();
+                }
+
+                let deadline = sampler.schedule.next_deadline();
+                loop {
+                    if control.requested.load(AtomicOrdering::Acquire) || QUIT.load(AtomicOrdering::SeqCst) { break; }
+                    let now = Instant::now();
+                    if now >= deadline { break; }
+                    std::thread::park_timeout(deadline - now);
+                }
+            }
+            if let Some(rec) = recorder
+                && let Err(e) = rec.finish() {
+                    error = Some(e);
+                }
+            error
+        })
+        .expect("failed to spawn sampler thread")
+}
+
+// Fixed-capacity ring of the most recent samples. The storage is allocated
+// once up front; pushing overwrites the oldest slot.
+struct Ring<T> {
+    buf: Box<[T]>,
+    // Slot the next push writes.
+    next: usize,
+    len: usize,
+}
+
+impl<T: Copy> Ring<T> {
+    fn new(capacity: usize, fill: T) -> Self {
+        Self { buf: vec![fill; capacity.max(1)].into_boxed_slice(), next: 0, len: 0 }
+    }
+
+    fn capacity(&self) -> usize {
+        self.buf.len()
+    }
+
+    fn push(&mut self, v: T) {
+        self.buf[self.next] = v;
+        self.next = (self.next + 1) % self.buf.len();
+        self.len = (self.len + 1).min(self.buf.len());
+    }
+
+    fn clear(&mut self) {
+        self.len = 0;
+    }
+
+    // The newest `n` samples (or fewer, if not that many yet), oldest first.
+    fn last(&self, n: usize) -> impl ExactSizeIterator<Item = T> + '_ {
+        let cap = self.buf.len();
+        let n = n.min(self.len);
+        let start = (self.next + cap - n) % cap;
+        (0..n).map(move |i| self.buf[(start + i) % cap])
+    }
+}
+
+const DEFAULT_HISTORY: usize = 120;
+const MAX_HISTORY: usize = 100_000;
+// Processes, from the top of the list, whose CPU% is kept in history.
+const HISTORY_PROCS: usize = 8;
+
+// Per-PID CPU history for one of the HISTORY_PROCS tracked processes.
+struct ProcHistory {
+    pid: i32,
+    last_seen: u64,
+    cpu: Ring<f32>,
+}
+
+// Per-frame system totals and top-process CPU, for the sparklines. Owned by
+// the render loop; every ring is sized at startup and pushing a frame never
+// allocates. Gauges in percent, network in bytes/s, NaN where there was no
+// value (no GPU, process not in the top that frame).
+struct History {
+    cpu: Ring<f32>,
+    mem: Ring<f32>,
+    net: Ring<f32>,
+    gpu: Ring<f32>,
+    procs: Vec<ProcHistory>,
+    frames: u64,
+}
+
+impl History {
+    fn new(capacity: usize) -> Self {
+        Self {
+            cpu: Ring::new(capacity, 0.0),
+            mem: Ring::new(capacity, 0.0),
+            net: Ring::new(capacity, 0.0),
+            gpu: Ring::new(capacity, 0.0),
+            procs: (0..HISTORY_PROCS).map(|_| ProcHistory { pid: -1, last_seen: 0, cpu: Ring::new(capacity, 0.0) }).collect(),
+            frames: 0,
+        }
+    }
+
+    fn push(&mut self, snap: &Snapshot) {
+        self.frames += 1;
+        let mem = &snap.mem;
+        self.cpu.push(snap.cpu as f32);
+        self.mem.push(if mem.total_bytes > 0 { (mem.used_bytes as f64 * 100.0 / mem.total_bytes as f64) as f32 } else { 0.0 });
+        self.net.push((snap.net.rx_rate + snap.net.tx_rate) as f32);
+        self.gpu.push(match snap.gpus.first() {
+            Some(g) if g.has_usage => g.usage as f32,
+            Some(g) if g.has_mem && g.mem_total > 0 => (g.mem_used as f64 * 100.0 / g.mem_total as f64) as f32,
+            _ => f32::NAN,
+        });
+
+        // Follow the leading rows of the list; a process that drops out keeps
+        // its slot, with gaps, until a newcomer needs the least recently seen.
+        let top = &snap.procs[..snap.sorted.min(snap.procs.len()).min(HISTORY_PROCS)];
+        for h in self.procs.iter_mut() {
+            match top.iter().find(|p| p.pid == h.pid) {
+                Some(p) => {
+                    h.cpu.push(p.cpu_percent as f32);
+                    h.last_seen = self.frames;
+                }
+                None => h.cpu.push(f32::NAN),
+            }
+        }
+        for p in top {
+            if self.procs.iter().any(|h| h.pid == p.pid) {
+                continue;
+            }
+            if let Some(h) = self.procs.iter_mut().filter(|h| h.last_seen != self.frames).min_by_key(|h| h.last_seen) {
+                h.pid = p.pid;
+                h.last_seen = self.frames;
+                h.cpu.clear();
+                h.cpu.push(p.cpu_percent as f32);
+            }
+        }
+    }
+
+    fn proc_cpu(&self, pid: i32) -> Option<&Ring<f32>> {
+        self.procs.iter().find(|h| h.pid == pid).map(|h| &h.cpu)
+    }
+}
+
+// Fixed-capacity fmt::Write target for short fragments that need measuring or
+// padding before they are written out. Formatting past the end is an error.
+struct StackStr<const N: usize> {
+    buf: [u8; N],
+    len: usize,
+}
+
+impl<const N: usize> StackStr<N> {
+    fn new() -> Self {
+        Self { buf: [0; N], len: 0 }
+    }
+
+    fn as_str(&self) -> &str {
+        // Only whole &strs are ever copied in, so this is always valid UTF-8.
+        std::str::from_utf8(&self.buf[..self.len]).unwrap_or("")
+    }
+}
+
+impl<const N: usize> fmt::Write for StackStr<N> {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        let end = self.len + s.len();
+        if end > N {
+            return Err(fmt::Error);
+        }
+        self.buf[self.len..end].copy_from_slice(s.as_bytes());
+        self.len = end;
+        Ok(())
+    }
+}
+
+// Byte count in binary units. Formats through a stack buffer, and honours
+// width and alignment flags so it can sit in a padded column.
+struct HumanBytes(u64);
+
+impl fmt::Display for HumanBytes {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        use fmt::Write as _;
+        let mut s = StackStr::<32>::new();
+        let v = self.0 as f64;
+        if v >= 1024.0 * 1024.0 * 1024.0 {
+            write!(s, "{:.2} GiB", v / (1024.0 * 1024.0 * 1024.0))?;
+        } else if v >= 1024.0 * 1024.0 {
+            write!(s, "{:.1} MiB", v / (1024.0 * 1024.0))?;
+        } else if v >= 1024.0 {
+            write!(s, "{:.1} KiB", v / 1024.0)?;
+        } else {
+            write!(s, "{} B", self.0)?;
+        }
+        f.pad(s.as_str())
+    }
+}
+
+// A CPU number, or "-" where the OS does not report one.
+struct CpuNo(Option<u32>);
+
+impl fmt::Display for CpuNo {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self.0 {
+            Some(cpu) => fmt::Display::fmt(&cpu, f),
+            None => f.pad("-"),
+        }
+    }
+}
+
+// Bytes per second as HumanBytes, or "-" for an unknown (NaN) rate.
+struct Rate(f64);
+
+impl fmt::Display for Rate {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        if self.0 >= 0.0 {
+            fmt::Display::fmt(&HumanBytes(self.0 as u64), f)
+        } else {
+            f.pad("-")
+        }
+    }
+}
+
+// "  r <rate>/s  w <rate>/s" after a DSK line, when the device's are known.
+struct DiskRates(f64, f64);
+
+impl fmt::Display for DiskRates {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        if !(self.0 >= 0.0 && self.1 >= 0.0) { return Ok(()); }
+        write!(f, "  r {}/s  w {}/s", HumanBytes(self.0 as u64), HumanBytes(self.1 as u64))
+    }
+}
+
+const IO_W: usize = 10;
+
+// The process list's read and write columns, or nothing while they are off.
+struct IoColumns<A, B>(bool, A, B);
+
+impl<A: fmt::Display, B: fmt::Display> fmt::Display for IoColumns<A, B> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        if !self.0 { return Ok(()); }
+        write!(f, " {:>w$} {:>w$}", self.1, self.2, w = IO_W)
+    }
+}
+
+// Terminal columns taken by `ch`: 2 for East Asian wide and emoji ranges, 0 for
+// control characters (which are dropped rather than sent to the terminal) and
+// combining marks, 1 for everything else.
+fn char_width(ch: char) -> usize {
+    let c = ch as u32;
+    match c {
+        0..=0x1F | 0x7F..=0x9F => 0,
+        0x0300..=0x036F | 0x200B..=0x200F | 0xFE00..=0xFE0F => 0,
+        0x1100..=0x115F
+        | 0x2E80..=0x303E
+        | 0x3041..=0x33FF
+        | 0x3400..=0x4DBF
+        | 0x4E00..=0x9FFF
+        | 0xA000..=0xA4CF
+        | 0xAC00..=0xD7A3
+        | 0xF900..=0xFAFF
+        | 0xFE30..=0xFE4F
+        | 0xFF00..=0xFF60
+        | 0xFFE0..=0xFFE6
+        | 0x1F300..=0x1F64F
+        | 0x1F900..=0x1F9FF
+        | 0x20000..=0x3FFFD => 2,
+        _ => 1,
+    }
+}
+
+// Left-aligned column of exactly `width` display columns: longer text is cut
+// at a character boundary, shorter text is padded with spaces.
+struct Fit<'a>(&'a str, usize);
+
+impl fmt::Display for Fit<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        use fmt::Write as _;
+        let mut used = 0;
+        let mut end = 0;
+        for (i, ch) in self.0.char_indices() {
+            let w = char_width(ch);
+            if used + w > self.1 {
+                break;
+            }
+            used += w;
+            end = i + ch.len_utf8();
+        }
+        f.write_str(&self.0[..end])?;
+        for _ in used..self.1 {
+            f.write_char(' ')?;
+        }
+        Ok(())
+    }
+}
+
+// Eighth-block sparkline of a ring's newest `width` samples, newest on the
+// right, scaled so `max` is a full block. Left-padded while history is short;
+// missing (NaN) samples are blank.
+struct Spark<'a> {
+    ring: &'a Ring<f32>,
+    width: usize,
+    max: f32,
+}
+
+const SPARK_LEVELS: [char; 8] = ['▁', '▂', '▃', '▄', '▅', '▆', '▇', '█'];
+
+impl fmt::Display for Spark<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        use fmt::Write as _;
+        let samples = self.ring.last(self.width);
+        for _ in samples.len()..self.width {
+            f.write_char(' ')?;
+        }
+        for v in samples {
+            let ch = if v.is_nan() {
+                ' '
+            } else {
+                let level = if self.max > 0.0 { (v / self.max * 8.0).round() as usize } else { 0 };
+                SPARK_LEVELS[level.clamp(1, 8) - 1]
+            };
+            f.write_char(ch)?;
+        }
+        Ok(())
+    }
+}
+
+// `n` copies of a character, for rules and separators.
+struct Repeat(char, usize);
+
+impl fmt::Display for Repeat {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        use fmt::Write as _;
+        for _ in 0..self.1 {
+            f.write_char(self.0)?;
+        }
+        Ok(())
+    }
+}
+
+const STYLE_NONE: &str = "";
+const STYLE_TITLE: &str = "\x1B[1m\x1B[38;5;51m";
+const STYLE_SECTION: &str = "\x1B[1m\x1B[38;5;45m";
+const STYLE_OK: &str = "\x1B[38;5;82m";
+const STYLE_WARN: &str = "\x1B[38;5;220m";
+const STYLE_BAD: &str = "\x1B[38;5;203m";
+const STYLE_INFO: &str = "\x1B[38;5;75m";
+const STYLE_ACCENT: &str = "\x1B[38;5;213m";
+const STYLE_MUTED: &str = "\x1B[38;5;244m";
+
+fn colour_enabled() -> bool {
+    if std::env::var_os("NO_COLOR").is_some() {
+        return false;
+    }
+    if std::env::var("CLICOLOR_FORCE").is_ok_and(|v| v != "0") {
+        return true;
+    }
+    if std::env::var("CLICOLOR").is_ok_and(|v| v == "0") {
+        return false;
+    }
+    if std::env::var("TERM").is_ok_and(|term| term == "dumb") {
+        return false;
+    }
+
+    stdout_is_tty()
+}
+
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+fn stdout_is_tty() -> bool {
+    unsafe { libc::isatty(libc::STDOUT_FILENO) == 1 }
+}
+
+#[cfg(target_os = "windows")]
+fn stdout_is_tty() -> bool {
+    unsafe {
+        let h = GetStdHandle(STD_OUTPUT_HANDLE);
+        if h.is_null() || h == INVALID_HANDLE_VALUE {
+            return false;
+        }
+        let mut mode: u32 = 0;
+        GetConsoleMode(h, &mut mode) != 0
+    }
+}
+
+fn colour(enabled: bool, style: &'static str) -> &'static str {
+    if enabled { style } else { STYLE_NONE }
+}
+
+fn usage_style(percent: f64, enabled: bool) -> &'static str {
+    if !enabled {
+        STYLE_NONE
+    } else if percent >= 85.0 {
+        STYLE_BAD
+    } else if percent >= 65.0 {
+        STYLE_WARN
+    } else {
+        STYLE_OK
+    }
+}
+
+fn process_row_style(cpu_percent: f64, mem_bytes: u64, total_mem_bytes: u64, enabled: bool) -> &'static str {
+    if !enabled {
+        return STYLE_NONE;
+    }
+
+    let mem_percent = if total_mem_bytes > 0 {
+        mem_bytes as f64 * 100.0 / total_mem_bytes as f64
+    } else {
+        0.0
+    };
+
+    if cpu_percent >= 50.0 || mem_percent >= 25.0 {
+        STYLE_BAD
+    } else if cpu_percent >= 15.0 || mem_percent >= 10.0 {
+        STYLE_WARN
+    } else {
+        STYLE_NONE
+    }
+}
+
+const STYLE_REVERSE: &str = "\x1B[7m";
+
+// One terminal cell. Styles are the STYLE_* escape strings, so comparing two
+// cells is a char compare plus a short string compare.
+#[derive(Clone, Copy, PartialEq)]
+struct Cell {
+    ch: char,
+    style: &'static str,
+}
+
+const BLANK: Cell = Cell { ch: ' ', style: STYLE_NONE };
+// Placeholder for the right half of a double-width character; never written.
+const WIDE_TAIL: char = '\0';
+
+// Unchanged cells shorter than this between two changed runs are rewritten
+// rather than skipped, since a cursor move costs about as much.
+const SCREEN_MERGE_GAP: usize = 8;
+
+// Double-buffered cell grid. A frame is drawn into `back`; `flush` compares it
+// against `front`, the cells the terminal is known to show, and writes only the
+// runs that changed.
+struct Screen {
+    width: usize,
+    height: usize,
+    back: Vec<Cell>,
+    front: Vec<Cell>,
+    // Set when the terminal no longer matches `front` (first frame, resize).
+    invalid: bool,
+    buf: Vec<u8>,
+    last_frame_bytes: usize,
+    total_bytes: u64,
+}
+
+impl Screen {
+    fn new() -> Self {
+        Self {
+            width: 0,
+            height: 0,
+            back: Vec::new(),
+            front: Vec::new(),
+            invalid: true,
+            buf: Vec::with_capacity(16384),
+            last_frame_bytes: 0,
+            total_bytes: 0,
+        }
+    }
+
+    // Starts a frame at the given terminal size with a blank back buffer.
+    fn begin(&mut self, width: usize, height: usize) {
+        if width != self.width || height != self.height {
+            self.width = width;
+            self.height = height;
+            self.front.clear();
+            self.front.resize(width * height, BLANK);
+            self.invalid = true;
+        }
+        self.back.clear();
+        self.back.resize(width * height, BLANK);
+    }
+
+    // Formats straight into the cells of 1-based `row`, clipped to the width.
+    fn put_line(&mut self, row: u16, style: &'static str, args: fmt::Arguments<'_>) {
+        if row == 0 || row as usize > self.height {
+            return;
+        }
+        let start = (row as usize - 1) * self.width;
+        let mut writer = RowWriter { cells: &mut self.back[start..start + self.width], col: 0, style };
+        let _ = fmt::Write::write_fmt(&mut writer, args);
+    }
+
+    // Like put_line, but starting at 0-based column `col` and leaving the
+    // cells before it alone.
+    fn put_at(&mut self, row: u16, col: usize, style: &'static str, args: fmt::Arguments<'_>) {
+        if row == 0 || row as usize > self.height || col >= self.width {
+            return;
+        }
+        let start = (row as usize - 1) * self.width;
+        let mut writer = RowWriter { cells: &mut self.back[start + col..start + self.width], col: 0, style };
+        let _ = fmt::Write::write_fmt(&mut writer, args);
+    }
+
+    // Blank columns at the right end of a row drawn this frame.
+    fn free_cols(&self, row: u16) -> usize {
+        if row == 0 || row as usize > self.height {
+            return 0;
+        }
+        let start = (row as usize - 1) * self.width;
+        let cells = &self.back[start..start + self.width];
+        self.width - cells.iter().rposition(|c| *c != BLANK).map_or(0, |i| i + 1)
+    }
+
+    // Writes the difference between the back and front buffers to `out` and
+    // returns the number of bytes it took.
+    fn flush<W: Write>(&mut self, out: &mut W) -> io::Result<usize> {
+        let Screen { width, height, back, front, buf, .. } = self;
+        let width = *width;
+        buf.clear();
+        if self.invalid {
+            buf.extend_from_slice(b"\x1B[0m\x1B[2J");
+            front.fill(BLANK);
+            self.invalid = false;
+        }
+
+        let mut sgr: Option<&'static str> = None;
+        let mut cursor: Option<(usize, usize)> = None;
+        let move_to = |buf: &mut Vec<u8>, cursor: &mut Option<(usize, usize)>, r: usize, c: usize| {
+            if *cursor != Some((r, c)) {
+                let _ = write!(buf, "\x1B[{};{}H", r + 1, c + 1);
+            }
+        };
+        for r in 0..*height {
+            let cells = r * width..(r + 1) * width;
+            let (back, front) = (&back[cells.clone()], &mut front[cells]);
+            // Everything from content_end on is blank and can go out as one EL.
+            let content_end = back.iter().rposition(|c| *c != BLANK).map_or(0, |i| i + 1);
+            let tail_dirty = front[content_end..].iter().any(|c| *c != BLANK);
+
+            let mut c = 0;
+            while c < content_end {
+                if back[c] == front[c] {
+                    c += 1;
+                    continue;
+                }
+                // A run must start on the left half of a wide character and
+                // end after its right half.
+                if back[c].ch == WIDE_TAIL && c > 0 {
+                    c -= 1;
+                }
+                let mut end = c + 1;
+                let mut e = end;
+                while e < content_end && e - end < SCREEN_MERGE_GAP {
+                    if back[e] != front[e] {
+                        end = e + 1;
+                    }
+                    e += 1;
+                }
+                if end < width && back[end].ch == WIDE_TAIL {
+                    end += 1;
+                }
+                move_to(buf, &mut cursor, r, c);
+                for cell in &back[c..end] {
+                    if cell.ch == WIDE_TAIL {
+                        continue;
+                    }
+                    if sgr != Some(cell.style) {
+                        buf.extend_from_slice(b"\x1B[0m");
+                        buf.extend_from_slice(cell.style.as_bytes());
+                        sgr = Some(cell.style);
+                    }
+                    let mut utf8 = [0u8; 4];
+                    buf.extend_from_slice(cell.ch.encode_utf8(&mut utf8).as_bytes());
+                }
+                // Autowrap is off, so the cursor sticks at the last column.
+                cursor = (end < width).then_some((r, end));
+                c = end;
+            }
+            if tail_dirty {
+                move_to(buf, &mut cursor, r, content_end);
+                if sgr != Some(STYLE_NONE) {
+                    buf.extend_from_slice(b"\x1B[0m");
+                    sgr = Some(STYLE_NONE);
+                }
+                buf.extend_from_slice(b"\x1B[K");
+            }
+            front.copy_from_slice(back);
+        }
+
+        out.write_all(buf)?;
+        out.flush()?;
+        self.last_frame_bytes = buf.len();
+        self.total_bytes += buf.len() as u64;
+        Ok(buf.len())
+    }
+}
+
+// fmt::Write sink that fills one row of cells by display width and drops
+// whatever overflows. A wide character takes its cell plus a WIDE_TAIL cell.
+struct RowWriter<'a> {
+    cells: &'a mut [Cell],
+    col: usize,
+    style: &'static str,
+}
+
+impl fmt::Write for RowWriter<'_> {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        for ch in s.chars() {
+            let w = char_width(ch);
+            if w == 0 {
+                continue;
+            }
+            if self.col + w > self.cells.len() {
+                self.col = self.cells.len();
+                break;
+            }
+            self.cells[self.col] = Cell { ch, style: self.style };
+            if w == 2 {
+                self.cells[self.col + 1] = Cell { ch: WIDE_TAIL, style: self.style };
+            }
+            self.col += w;
+        }
+        Ok(())
+    }
+}
+
+fn draw_line_with_style(
+    screen: &mut Screen,
+    row: u16,
+    reverse: bool,
+    style: &'static str,
+    args: fmt::Arguments<'_>,
+) {
+    screen.put_line(row, if reverse { STYLE_REVERSE } else { style }, args);
+}
+
+fn draw_line(screen: &mut Screen, row: u16, reverse: bool, args: fmt::Arguments<'_>) {
+    draw_line_with_style(screen, row, reverse, STYLE_NONE, args)
+}
+
+// Sparklines sit in whatever a line leaves free at the right edge, keeping a
+// gap after the text, and are dropped when that is too narrow to read.
+const SPARK_GAP: usize = 2;
+const SPARK_MIN_WIDTH: usize = 8;
+const SPARK_MAX_WIDTH: usize = 60;
+
+// `max` of None scales to the largest sample shown, for rates.
+fn draw_spark(screen: &mut Screen, row: u16, style: &'static str, ring: &Ring<f32>, max: Option<f32>) {
+    let width = screen.free_cols(row).saturating_sub(SPARK_GAP).min(SPARK_MAX_WIDTH).min(ring.capacity());
+    if width < SPARK_MIN_WIDTH {
+        return;
+    }
+    let max = max.unwrap_or_else(|| ring.last(width).filter(|v| !v.is_nan()).fold(0.0, f32::max));
+    let col = screen.width - width;
+    screen.put_at(row, col, style, format_args!("{}", Spark { ring, width, max }));
+}
+
+// The core heatmap takes at most this many rows; past that, each cell
+// stands for a run of neighbouring cores and shows the busiest.
+const HEATMAP_MAX_ROWS: usize = 4;
+const HEATMAP_GROUP: usize = 8;
+const HEATMAP_LABEL: usize = 5;
+
+// One cell per core, bar height and colour by busy %, in groups of eight
+// behind the number of the row's first CPU.
+fn draw_core_heatmap(screen: &mut Screen, row: &mut u16, cores: &[f32], colours: bool) {
+    if cores.len() < 2 {
+        return;
+    }
+    let groups = (screen.width.saturating_sub(HEATMAP_LABEL) / (HEATMAP_GROUP + 1)).max(1);
+    let per_row = groups * HEATMAP_GROUP;
+    let per_cell = cores.len().div_ceil(per_row * HEATMAP_MAX_ROWS);
+    let cells = cores.len().div_ceil(per_cell);
+    for first in (0..cells).step_by(per_row) {
+        draw_line_with_style(screen, *row, false, colour(colours, STYLE_MUTED), format_args!("{:>4}", first * per_cell));
+        for cell in first..cells.min(first + per_row) {
+            let run = &cores[cell * per_cell..cores.len().min((cell + 1) * per_cell)];
+            let busy = run.iter().copied().fold(0.0, f32::max);
+            let level = (busy / 100.0 * 8.0).round() as usize;
+            let i = cell - first;
+            let col = HEATMAP_LABEL + i + i / HEATMAP_GROUP;
+            screen.put_at(*row, col, usage_style(busy as f64, colours), format_args!("{}", SPARK_LEVELS[level.clamp(1, 8) - 1]));
+        }
+        *row = (*row).saturating_add(1);
+    }
+}
+
+// A duration given in nanoseconds, scaled to ns, us, ms or s. Honours width and
+// alignment like HumanBytes.
+struct Nanos(u64);
+
+impl fmt::Display for Nanos {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        use fmt::Write as _;
+        let mut s = StackStr::<32>::new();
+        let v = self.0 as f64;
+        if v >= 1e9 {
+            write!(s, "{:.2}s", v / 1e9)?;
+        } else if v >= 1e6 {
+            write!(s, "{:.1}ms", v / 1e6)?;
+        } else if v >= 1e3 {
+            write!(s, "{:.0}us", v / 1e3)?;
+        } else {
+            write!(s, "{}ns", self.0)?;
+        }
+        f.pad(s.as_str())
+    }
+}
+
+// What fills the screen below the header lines.
+#[derive(Clone, Copy, PartialEq)]
+enum Pane {
+    Procs,
+    Net,
+    Profile,
+    Cgroups,
+    Hosts,
+    Threads,
+}
+
+// Per-stage p50/p99 since startup, in place of the process list.
+fn draw_profile_table(screen: &mut Screen, row: &mut u16, width: usize, height: u16, profile: &Profile, colours: bool) {
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_SECTION), format_args!("{:<8} {:>7} {:>9} {:>9} {:>7} {:>7} {:>10} {:>10}",
+        "STAGE", "RUNS", "TIME p50", "p99", "SYS p50", "p99", "WRITE p50", "p99"));
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}", Repeat('-', width.min(75))));
+    for (i, st) in profile.stages.iter().enumerate() {
+        if *row >= height { break; }
+        let runs = st.time_ns.count();
+        if runs == 0 {
+            draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{:<8} {:>7}", stage_name(i), 0));
+            continue;
+        }
+        let t = |q| Nanos(st.time_ns.percentile(q).unwrap_or(0));
+        let b = |q| HumanBytes(st.bytes_written.percentile(q).unwrap_or(0));
+        let mut sys = StackStr::<24>::new();
+        {
+            use fmt::Write as _;
+            let _ = match (st.syscalls.percentile(0.5), st.syscalls.percentile(0.99)) {
+                (Some(p50), Some(p99)) => write!(sys, "{:>7} {:>7}", p50, p99),
+                _ => write!(sys, "{:>7} {:>7}", "-", "-"),
+            };
+        }
+        draw_next_line(screen, row, false, format_args!("{:<8} {:>7} {:>9} {:>9} {} {:>10} {:>10}",
+            stage_name(i), runs, t(0.5), t(0.99), sys.as_str(), b(0.5), b(0.99)));
+    }
+    draw_line_with_style(screen, height, false, colour(colours, STYLE_MUTED), format_args!("utop: RSS {}, {} allocations",
+        HumanBytes(self_rss()), alloc_counter::total()));
+}
+
+// Everything the render loop keeps between frames besides the snapshot.
+struct Ui {
+    cpus: String,
+    cpu_name: String,
+    gpu_cores: String,
+    sort: SortMode,
+    filter: String,
+    // filter, lowercased once per edit rather than once per frame.
+    filter_lower: String,
+    view: FilterView,
+    is_search: bool,
+    pane: Pane,
+    // Show read and write rates in the process list.
+    io: bool,
+    // The filtered rows on screen, by PID, whose I/O the sampler reads.
+    io_pids: Vec<i32>,
+    // Show the process list as a tree, through tree_view rather than view.
+    tree: bool,
+    tree_view: TreeView,
+    cgroup_view: CgroupView,
+    selection: usize,
+    // PID under the selection as of the last frame, and the cgroup it is in
+    // or on in the cgroup table.
+    selected_pid: Option<i32>,
+    selected_cgroup: Option<Arc<str>>,
+    // The process the thread view was opened on.
+    threads_pid: Option<i32>,
+    colours: bool,
+}
+
+impl Ui {
+    // Call after every change to filter.
+    fn filter_edited(&mut self) {
+        self.filter_lower.clear();
+        self.filter_lower.extend(self.filter.chars().flat_map(char::to_lowercase));
+    }
+
+    // h/l step through the sort columns left to right: CPU%, MEM, then the
+    // I/O rates when those are shown.
+    fn sort_left(&self) -> SortMode {
+        match self.sort {
+            SortMode::Io => SortMode::Mem,
+            _ => SortMode::Cpu,
+        }
+    }
+
+    fn sort_right(&self) -> SortMode {
+        match self.sort {
+            SortMode::Cpu => SortMode::Mem,
+            _ if self.io => SortMode::Io,
+            _ => SortMode::Mem,
+        }
+    }
+}
+
+// Lay out one frame on `screen`; flushing it is up to the caller. Returns how
+// many leading rows the process list showed, for the sampler's partial sort.
+fn draw_frame(screen: &mut Screen, ui: &mut Ui, snap: &mut Snapshot, history: &History, profile: &Profile, term_width: usize, term_height: u16) -> Option<usize> {
+    let (sort, is_search, pane, colours) = (ui.sort, ui.is_search, ui.pane, ui.colours);
+    let (cpu, cpu_temp, cpu_freq) = (snap.cpu, snap.cpu_temp, snap.cpu_freq);
+    let (mem, net, gpus, storage) = (&snap.mem, &snap.net, &snap.gpus, &snap.storage);
+    let mut row = 1_u16;
+    let mut sort_rows = None;
+
+    screen.begin(term_width, term_height as usize);
+    // Under --connect the header describes the focused agent, not this machine.
+    let host = snap.hosts.get(snap.host);
+    let (cpus, cpu_name, gpu_cores) = match host {
+        Some(h) => (&*h.cpus, &*h.cpu_name, &*h.gpu_cores),
+        None => (ui.cpus.as_str(), ui.cpu_name.as_str(), ui.gpu_cores.as_str()),
+    };
+    let gpu_cores_str = if !gpu_cores.is_empty() { format!("    {}", gpu_cores) } else { String::new() };
+    let replay_str = match snap.replay {
+        Some(r) => format!("    [replay {} / {}{}{}]", Hms(r.pos_ms), Hms(r.total_ms),
+            if r.speed != 1.0 { format!(" x{}", r.speed) } else { String::new() },
+            if r.paused { " paused" } else { "" }),
+        None => match host {
+            Some(h) => format!("    [{}{}]", h.name, match h.state {
+                HostState::Up => "",
+                HostState::Connecting => " connecting",
+                HostState::Down => " down",
+            }),
+            None => String::new(),
+        },
+    };
+    draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_TITLE), format_args!("utop (Rust version)    {}{}{}", cpus, gpu_cores_str, replay_str));
+
+    let temp_str = if cpu_temp > -1000.0 { format!(" {:.1}°C", cpu_temp) } else { String::new() };
+    let freq_str = if cpu_freq > 0.0 { format!(" @ {:.2} GHz", cpu_freq / 1000.0) } else { String::new() };
+
+    draw_next_line_with_style(screen, &mut row, false, usage_style(cpu, colours), format_args!("{}: {:5.1}%{}{}", cpu_name, cpu, freq_str, temp_str));
+    draw_spark(screen, row - 1, usage_style(cpu, colours), &history.cpu, Some(100.0));
+    draw_core_heatmap(screen, &mut row, &snap.cores, colours);
+    let mem_pct = if mem.total_bytes > 0 { mem.used_bytes as f64 * 100.0 / mem.total_bytes as f64 } else { 0.0 };
+    draw_next_line_with_style(screen, &mut row, false, usage_style(mem_pct, colours), format_args!("MEM: {:5.1}% {} / {}", mem_pct, HumanBytes(mem.used_bytes), HumanBytes(mem.total_bytes)));
+    draw_spark(screen, row - 1, usage_style(mem_pct, colours), &history.mem, Some(100.0));
+
+    if mem.swap_total_bytes > 0 {
+        let swp_pct = mem.swap_used_bytes as f64 * 100.0 / mem.swap_total_bytes as f64;
+        draw_next_line_with_style(screen, &mut row, false, usage_style(swp_pct, colours), format_args!("SWP: {:5.1}% {} / {}", swp_pct, HumanBytes(mem.swap_used_bytes), HumanBytes(mem.swap_total_bytes)));
+    } else {
+        draw_next_line(screen, &mut row, false, format_args!(""));
+    }
+
+    let multi_gpu = gpus.len() > 1;
+    for (i, gpu) in gpus.iter().enumerate() {
+        let g_temp = if gpu.has_temp { format!(" {:.1}°C", gpu.temp) } else { String::new() };
+        let g_vram = if gpu.has_mem {
+            let pct = if gpu.mem_total > 0 { gpu.mem_used as f64 * 100.0 / gpu.mem_total as f64 } else { 0.0 };
+            format!("  VRAM: {:5.1}% {} / {}", pct, HumanBytes(gpu.mem_used), HumanBytes(gpu.mem_total))
+        } else { String::new() };
+        let g_usage = if gpu.has_usage { format!("{:5.1}%", gpu.usage) } else { String::new() };
+        let gpu_pct = if gpu.has_usage {
+            gpu.usage
+        } else if gpu.has_mem && gpu.mem_total > 0 {
+            gpu.mem_used as f64 * 100.0 / gpu.mem_total as f64
+        } else {
+            0.0
+        };
+        let g_index = if multi_gpu { format!("GPU{} ", i) } else { String::new() };
+        draw_next_line_with_style(screen, &mut row, false, usage_style(gpu_pct, colours), format_args!("{}{}: {}{}{}", g_index, gpu.name, g_usage, g_temp, g_vram));
+        if i == 0 {
+            draw_spark(screen, row - 1, usage_style(gpu_pct, colours), &history.gpu, Some(100.0));
+        }
+    }
+    if gpus.is_empty() {
+        draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_MUTED), format_args!("GPU:"));
+    }
+
+    let gpu_mem_total = gpus.first().filter(|g| g.has_mem).map(|g| g.mem_total);
+    if mem.cma_total_bytes > 0 && gpu_mem_total != Some(mem.cma_total_bytes) {
+        let cma_pct = mem.cma_used_bytes as f64 * 100.0 / mem.cma_total_bytes as f64;
+        draw_next_line_with_style(screen, &mut row, false, usage_style(cma_pct, colours), format_args!("CMA: {:5.1}% {} / {}", cma_pct, HumanBytes(mem.cma_used_bytes), HumanBytes(mem.cma_total_bytes)));
+    }
+
+    draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_INFO), format_args!("NET: {}  rx {}/s  tx {}/s", net.iface, HumanBytes(net.rx_rate as u64), HumanBytes(net.tx_rate as u64)));
+    draw_spark(screen, row - 1, colour(colours, STYLE_INFO), &history.net, None);
+            
+    for s in storage.iter().take(3) {
+        let pct = if s.total_bytes > 0 { s.used_bytes as f64 * 100.0 / s.total_bytes as f64 } else { 0.0 };
+        draw_next_line_with_style(screen, &mut row, false, usage_style(pct, colours), format_args!("DSK: {:<10} {:5.1}% {} / {} [{}]{}{}", s.mount_point, pct, HumanBytes(s.used_bytes), HumanBytes(s.total_bytes), s.device,
+            if s.stale { " (stale)" } else { "" }, DiskRates(s.read_rate, s.write_rate)));
+    }
+
+    draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_MUTED), format_args!("Controls: q:quit, j/k/arrows:move, h/l/arrows:sort, /:filter, n:net, p:profile, i:io, t:tree, c:cgroups, T:threads{} [{}]",
+        if snap.replay.is_some() { ", space:pause, [/]:seek" } else if host.is_some() { ", d:hosts, enter:open" } else { "" }, if is_search { "SEARCHING" } else { "NORMAL" }));
+
+    if is_search {
+        draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_ACCENT), format_args!("Filter: /{}_", ui.filter));
+    } else if !ui.filter.is_empty() {
+        draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_ACCENT), format_args!("Filter: {} (press / to edit)", ui.filter));
+    } else {
+        draw_next_line(screen, &mut row, false, format_args!(""));
+    }
+    draw_next_line(screen, &mut row, false, format_args!(""));
+
+    if pane == Pane::Net {
+        draw_iface_table(screen, &mut row, term_width, term_height, net, colours);
+    } else if pane == Pane::Profile {
+        draw_profile_table(screen, &mut row, term_width, term_height, profile, colours);
+    } else if pane == Pane::Cgroups {
+        draw_cgroup_table(screen, &mut row, ui, snap, term_width, term_height);
+    } else if pane == Pane::Hosts {
+        draw_host_table(screen, &mut row, ui, snap, term_width, term_height);
+    } else if pane == Pane::Threads {
+        draw_thread_table(screen, &mut row, ui, snap, term_width, term_height);
+    } else if ui.tree && !snap.tree.is_empty() {
+        draw_tree_table(screen, &mut row, ui, snap, history, term_width, term_height);
+    } else {
+        let pid_w = 7;
+        let cpu_w = 8;
+        let mem_w = 12;
+        let thr_w = 4;
+
+        let cpu_hdr = if sort == SortMode::Cpu { "CPU%▼" } else { "CPU%" };
+        let mem_hdr = if sort == SortMode::Mem { "MEM▼" } else { "MEM" };
+
+        let io = ui.io;
+        let io_cols = if io { 2 * (IO_W + 1) } else { 0 };
+        let (read_hdr, write_hdr) = if sort == SortMode::Io { ("READ/s▼", "WRITE/s▼") } else { ("READ/s", "WRITE/s") };
+
+        let sort_extra = (if sort == SortMode::Cpu { 2isize } else { 0 }) + (if sort == SortMode::Mem { 2 } else { 0 });
+        let name_w = (term_width as isize - (pid_w as isize + cpu_w as isize + mem_w as isize + thr_w as isize + io_cols as isize + 9 + sort_extra)).max(12) as usize;
+
+        let w1 = cpu_w + if sort == SortMode::Cpu { 2 } else { 0 };
+        let w2 = mem_w + if sort == SortMode::Mem { 2 } else { 0 };
+
+        draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_SECTION), format_args!("{:<pid_w$} {:<name_w$} {:>w1$} {:>w2$} {:>thr_w$}{}", "PID", "NAME", cpu_hdr, mem_hdr, "THR",
+            IoColumns(io, read_hdr, write_hdr), pid_w=pid_w, name_w=name_w, w1=w1, w2=w2, thr_w=thr_w));
+
+        let max_dashes = term_width;
+        let req_dashes = pid_w + name_w + cpu_w + mem_w + thr_w + io_cols + 4;
+        let num_dashes = max_dashes.min(req_dashes);
+        draw_next_line_with_style(screen, &mut row, false, colour(colours, STYLE_MUTED), format_args!("{}", Repeat('-', num_dashes)));
+
+        let visible = term_height.saturating_sub(row) as usize;
+        ui.view.update(&snap.procs, snap.sorted, &ui.filter_lower);
+        let count = ui.view.rows.len();
+        if ui.selection >= count && count > 0 { ui.selection = count - 1; }
+        if count == 0 { ui.selection = 0; }
+
+        let mut scroll_top = ui.selection.saturating_sub(visible / 2);
+        if scroll_top > count.saturating_sub(visible) { scroll_top = count.saturating_sub(visible); }
+
+        // The sampler only orders the rows the view reached last time;
+        // scrolling past them sorts a further slice here.
+        let window_end = count.min(scroll_top + visible);
+        if window_end > ui.view.sorted {
+            ui.view.sort_prefix(&snap.procs, window_end + SORT_MARGIN);
+        }
+        sort_rows = Some(window_end);
+        // Filtered rows are no prefix of the sampler's order, so name them.
+        ui.io_pids.clear();
+        if io && !ui.filter.is_empty() {
+            ui.io_pids.extend(ui.view.rows[scroll_top..window_end].iter().map(|&r| snap.procs[r as usize].pid));
+        }
+
+        for i in scroll_top..count.min(scroll_top + visible) {
+            let p = &snap.procs[ui.view.rows[i] as usize];
+            let row_style = process_row_style(p.cpu_percent, p.mem_bytes, mem.total_bytes, colours);
+            draw_next_line_with_style(screen, &mut row, i == ui.selection, row_style, format_args!("{:<pid_w$} {} {:>w1$.1} {:>mem_w$} {:>thr_w$}{}",
+                p.pid, Fit(&p.name, name_w), p.cpu_percent, HumanBytes(p.mem_bytes), p.threads,
+                IoColumns(io, Rate(p.read_rate), Rate(p.write_rate)), pid_w=pid_w, w1=w1, mem_w=w2, thr_w=thr_w));
+        }
+        ui.selected_pid = None;
+        if count > 0 {
+            let end_idx = count.min(scroll_top + visible);
+            draw_line_with_style(screen, term_height, false, colour(colours, STYLE_MUTED), format_args!("Showing {}-{} of {}", scroll_top + 1, end_idx, count));
+            let pid = snap.procs[ui.view.rows[ui.selection] as usize].pid;
+            ui.selected_pid = Some(pid);
+            if let Some(ring) = history.proc_cpu(pid) {
+                draw_spark(screen, term_height, colour(colours, STYLE_ACCENT), ring, Some(100.0));
+            }
+        }
+    }
+    sort_rows
+}
+
+// The process list as a tree, with each process's own CPU% and memory next
+// to the totals of its subtree.
+fn draw_tree_table(screen: &mut Screen, row: &mut u16, ui: &mut Ui, snap: &Snapshot, history: &History, width: usize, height: u16) {
+    let (pid_w, cpu_w, mem_w) = (7, 7, 10);
+    let (sort, colours) = (ui.sort, ui.colours);
+    let name_w = width.saturating_sub(pid_w + 2 * cpu_w + 2 * mem_w + 5).max(12);
+    let cpu_hdr = if sort == SortMode::Cpu { "ΣCPU%▼" } else { "ΣCPU%" };
+    let mem_hdr = if sort == SortMode::Mem { "ΣMEM▼" } else { "ΣMEM" };
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_SECTION), format_args!("{:<pid_w$} {:<name_w$} {:>cpu_w$} {:>cpu_w$} {:>mem_w$} {:>mem_w$}",
+        "PID", "NAME", "CPU%", cpu_hdr, "MEM", mem_hdr));
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}", Repeat('-', width.min(pid_w + name_w + 2 * cpu_w + 2 * mem_w + 5))));
+
+    let visible = height.saturating_sub(*row) as usize;
+    ui.tree_view.update(&snap.tree, &snap.procs, &ui.filter_lower);
+    let count = ui.tree_view.rows.len();
+    if ui.selection >= count && count > 0 { ui.selection = count - 1; }
+    if count == 0 { ui.selection = 0; }
+    let mut scroll_top = ui.selection.saturating_sub(visible / 2);
+    if scroll_top > count.saturating_sub(visible) { scroll_top = count.saturating_sub(visible); }
+
+    for i in scroll_top..count.min(scroll_top + visible) {
+        let t = &snap.tree[ui.tree_view.rows[i] as usize];
+        let p = &snap.procs[t.row as usize];
+        let indent = (2 * t.depth as usize).min(name_w / 2);
+        let marker = if t.descendants == 0 { "  " } else if ui.tree_view.collapsed.contains(&p.pid) { "+ " } else { "- " };
+        let row_style = process_row_style(p.cpu_percent, p.mem_bytes, snap.mem.total_bytes, colours);
+        draw_next_line_with_style(screen, row, i == ui.selection, row_style, format_args!("{:<pid_w$} {}{}{} {:>cpu_w$.1} {:>cpu_w$.1} {:>mem_w$} {:>mem_w$}",
+            p.pid, Repeat(' ', indent), marker, Fit(&p.name, name_w - indent - 2), p.cpu_percent, t.cpu, HumanBytes(p.mem_bytes), HumanBytes(t.mem)));
+    }
+    ui.selected_pid = None;
+    if count > 0 {
+        let end_idx = count.min(scroll_top + visible);
+        draw_line_with_style(screen, height, false, colour(colours, STYLE_MUTED), format_args!("Showing {}-{} of {}", scroll_top + 1, end_idx, count));
+        let pid = snap.procs[snap.tree[ui.tree_view.rows[ui.selection] as usize].row as usize].pid;
+        ui.selected_pid = Some(pid);
+        if let Some(ring) = history.proc_cpu(pid) {
+            draw_spark(screen, height, colour(colours, STYLE_ACCENT), ring, Some(100.0));
+        }
+    }
+}
+
+// Every cgroup with its CPU%, memory and I/O, in place of the process list.
+fn draw_cgroup_table(screen: &mut Screen, row: &mut u16, ui: &mut Ui, snap: &Snapshot, width: usize, height: u16) {
+    let (sort, colours) = (ui.sort, ui.colours);
+    let name_w = width.saturating_sub(56).max(12);
+    let cpu_hdr = if sort == SortMode::Cpu { "CPU%▼" } else { "CPU%" };
+    let mem_hdr = if sort == SortMode::Mem { "MEM▼" } else { "MEM" };
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_SECTION), format_args!("{:<name_w$} {:>8} {:>10} {:>10} {:>10} {:>12}",
+        "CGROUP", cpu_hdr, mem_hdr, "READ/s", "WRITE/s", "PROCS", name_w = name_w));
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}", Repeat('-', width.min(name_w + 56))));
+    if snap.cgroups.is_empty() {
+        draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}",
+            if cfg!(target_os = "linux") { "No cgroup v2 hierarchy under /sys/fs/cgroup" } else { "cgroups are Linux-only" }));
+    }
+
+    let visible = height.saturating_sub(*row) as usize;
+    ui.cgroup_view.update(&snap.cgroups, &snap.procs, &ui.filter_lower);
+    let count = ui.cgroup_view.rows.len();
+    if ui.selection >= count && count > 0 { ui.selection = count - 1; }
+    if count == 0 { ui.selection = 0; }
+    let mut scroll_top = ui.selection.saturating_sub(visible / 2);
+    if scroll_top > count.saturating_sub(visible) { scroll_top = count.saturating_sub(visible); }
+
+    for i in scroll_top..count.min(scroll_top + visible) {
+        let (c, r) = ui.cgroup_view.rows[i];
+        let c = &snap.cgroups[c as usize];
+        if r == NO_SLOT {
+            let marker = if c.procs == 0 { "  " } else if ui.cgroup_view.expanded.contains(&c.path) { "- " } else { "+ " };
+            let style = process_row_style(c.cpu_percent, c.mem_bytes, snap.mem.total_bytes, colours);
+            draw_next_line_with_style(screen, row, i == ui.selection, style, format_args!("{}{} {:>8.1} {:>10} {:>10} {:>10} {:>12}",
+                marker, Fit(&c.path, name_w - 2), c.cpu_percent, HumanBytes(c.mem_bytes), HumanBytes(c.read_rate as u64), HumanBytes(c.write_rate as u64), c.procs));
+        } else {
+            let p = &snap.procs[r as usize];
+            let style = process_row_style(p.cpu_percent, p.mem_bytes, snap.mem.total_bytes, colours);
+            draw_next_line_with_style(screen, row, i == ui.selection, style, format_args!("    {:<7} {} {:>8.1} {:>10}",
+                p.pid, Fit(&p.name, name_w.saturating_sub(12)), p.cpu_percent, HumanBytes(p.mem_bytes)));
+        }
+    }
+    ui.selected_pid = None;
+    ui.selected_cgroup = None;
+    if count > 0 {
+        let end_idx = count.min(scroll_top + visible);
+        draw_line_with_style(screen, height, false, colour(colours, STYLE_MUTED), format_args!("Showing {}-{} of {}", scroll_top + 1, end_idx, count));
+        let (c, r) = ui.cgroup_view.rows[ui.selection];
+        ui.selected_cgroup = Some(snap.cgroups[c as usize].path.clone());
+        ui.selected_pid = (r != NO_SLOT).then(|| snap.procs[r as usize].pid);
+    }
+}
+
+// The threads of the process the view was opened on, busiest first, in place
+// of the process list.
+fn draw_thread_table(screen: &mut Screen, row: &mut u16, ui: &mut Ui, snap: &Snapshot, width: usize, height: u16) {
+    let colours = ui.colours;
+    let pid = ui.threads_pid.unwrap_or(-1);
+    let name_w = width.saturating_sub(24).max(12);
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_SECTION), format_args!("{:<9} {:<name_w$} {:>8} {:>4}",
+        "TID", "THREAD", "CPU%▼", "CPU", name_w = name_w));
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}", Repeat('-', width.min(name_w + 24))));
+    let proc = snap.procs.iter().find(|p| p.pid == pid);
+    if snap.threads.is_empty() {
+        let why = if snap.replay.is_some() || !snap.hosts.is_empty() {
+            "Threads are only read on this machine"
+        } else if cfg!(target_os = "windows") {
+            "Per-thread readings are not available on Windows"
+        } else if proc.is_none() {
+            "The process has exited"
+        } else { "" };
+        draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}", why));
+    }
+
+    let visible = height.saturating_sub(*row) as usize;
+    let count = snap.threads.len();
+    if ui.selection >= count && count > 0 { ui.selection = count - 1; }
+    if count == 0 { ui.selection = 0; }
+    let mut scroll_top = ui.selection.saturating_sub(visible / 2);
+    if scroll_top > count.saturating_sub(visible) { scroll_top = count.saturating_sub(visible); }
+
+    for i in scroll_top..count.min(scroll_top + visible) {
+        let t = &snap.threads[i];
+        let style = process_row_style(t.cpu_percent, 0, snap.mem.total_bytes, colours);
+        draw_next_line_with_style(screen, row, i == ui.selection, style, format_args!("{:<9} {} {:>8.1} {:>4}",
+            t.tid, Fit(&t.name, name_w), t.cpu_percent, CpuNo(t.cpu)));
+    }
+    let name = proc.map_or("", |p| &*p.name);
+    if count > 0 {
+        draw_line_with_style(screen, height, false, colour(colours, STYLE_MUTED), format_args!("PID {} {}: showing {}-{} of {} threads",
+            pid, name, scroll_top + 1, count.min(scroll_top + visible), count));
+    } else {
+        draw_line_with_style(screen, height, false, colour(colours, STYLE_MUTED), format_args!("PID {} {}", pid, name));
+    }
+}
+
+// "name cpu%" of a host's busiest process; lines clip at the screen edge.
+struct TopProc<'a>(&'a Option<(Arc<str>, f64)>);
+
+impl fmt::Display for TopProc<'_> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self.0 {
+            Some((name, cpu)) => write!(f, "{} {:.1}%", name, cpu),
+            None => Ok(()),
+        }
+    }
+}
+
+// One line per --connect agent, in place of the process list; Enter opens
+// the selected host in the normal views.
+fn draw_host_table(screen: &mut Screen, row: &mut u16, ui: &mut Ui, snap: &Snapshot, width: usize, height: u16) {
+    let colours = ui.colours;
+    let name_w = 16;
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_SECTION), format_args!("{:<name_w$} {:<5} {:>6} {:>6} {:>10} {:>10} {:>10} {:>7} {:>9}  {}",
+        "HOST", "STATE", "CPU%", "MEM%", "MEM", "RX/s", "TX/s", "PROCS", "LINK/s", "TOP", name_w = name_w));
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}", Repeat('-', width.min(name_w + 84))));
+
+    let visible = height.saturating_sub(*row) as usize;
+    let count = snap.hosts.len();
+    if ui.selection >= count && count > 0 { ui.selection = count - 1; }
+    let mut scroll_top = ui.selection.saturating_sub(visible / 2);
+    if scroll_top > count.saturating_sub(visible) { scroll_top = count.saturating_sub(visible); }
+
+    let now = Instant::now();
+    for i in scroll_top..count.min(scroll_top + visible) {
+        let h = &snap.hosts[i];
+        let stale = h.frame_at.is_none_or(|t| now.duration_since(t) > REMOTE_STALE);
+        let state = match h.state {
+            HostState::Up if stale => "stale",
+            HostState::Up => "up",
+            HostState::Connecting => "dial",
+            HostState::Down => "down",
+        };
+        if h.state != HostState::Up || h.frame_at.is_none() {
+            draw_next_line_with_style(screen, row, i == ui.selection, colour(colours, STYLE_MUTED), format_args!("{} {:<5} {}",
+                Fit(&h.name, name_w), state, h.error.as_deref().unwrap_or("")));
+            continue;
+        }
+        let mem_pct = if h.mem_total > 0 { h.mem_used as f64 * 100.0 / h.mem_total as f64 } else { 0.0 };
+        let style = if stale { colour(colours, STYLE_MUTED) } else { usage_style(h.cpu.max(mem_pct), colours) };
+        draw_next_line_with_style(screen, row, i == ui.selection, style, format_args!("{} {:<5} {:>6.1} {:>6.1} {:>10} {:>10} {:>10} {:>7} {:>9}  {}",
+            Fit(&h.name, name_w), state, h.cpu, mem_pct, HumanBytes(h.mem_used), Rate(h.rx_rate), Rate(h.tx_rate), h.procs,
+            Rate(h.link_rate), TopProc(&h.top)));
+    }
+    if count > 0 {
+        draw_line_with_style(screen, height, false, colour(colours, STYLE_MUTED), format_args!("Showing {}-{} of {} hosts",
+            scroll_top + 1, count.min(scroll_top + visible), count));
+    }
+}
+
+// Every interface, busiest first, in place of the process list.
+fn draw_iface_table(screen: &mut Screen, row: &mut u16, width: usize, height: u16, net: &NetworkSnapshot, colours: bool) {
+    let name_w = width.saturating_sub(58).max(8);
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_SECTION), format_args!("{:<name_w$} {:>10} {:>10} {:>9} {:>9} {:>7} {:>7}",
+        "IFACE", "RX/s", "TX/s", "RXPKT/s", "TXPKT/s", "DROP/s", "ERR/s", name_w = name_w));
+    draw_next_line_with_style(screen, row, false, colour(colours, STYLE_MUTED), format_args!("{}", Repeat('-', width.min(name_w + 58))));
+    let visible = height.saturating_sub(*row) as usize;
+    for i in net.ifaces.iter().take(visible) {
+        let style = if i.errors > 0.0 || i.drops > 0.0 { colour(colours, STYLE_ACCENT) } else { STYLE_NONE };
+        draw_next_line_with_style(screen, row, false, style, format_args!("{} {:>10} {:>10} {:>9.0} {:>9.0} {:>7.0} {:>7.0}",
+            Fit(&i.name, name_w), HumanBytes(i.rx_rate as u64), HumanBytes(i.tx_rate as u64), i.rx_packets, i.tx_packets, i.drops, i.errors));
+    }
+    if !net.ifaces.is_empty() {
+        draw_line_with_style(screen, height, false, colour(colours, STYLE_MUTED), format_args!("Showing 1-{} of {} interfaces", net.ifaces.len().min(visible), net.ifaces.len()));
+    }
+}
+
+fn draw_next_line(screen: &mut Screen, row: &mut u16, reverse: bool, args: fmt::Arguments<'_>) {
+    draw_line(screen, *row, reverse, args);
+    *row = (*row).saturating_add(1);
+}
+
+fn draw_next_line_with_style(
+    screen: &mut Screen,
+    row: &mut u16,
+    reverse: bool,
+    style: &'static str,
+    args: fmt::Arguments<'_>,
+) {
+    draw_line_with_style(screen, *row, reverse, style, args);
+    *row = (*row).saturating_add(1);
+}
+
+#[cfg(target_os = "macos")]
+fn sysctl_into<T>(name: &str, value: &mut T) -> bool {
+    let Ok(name) = CString::new(name) else { return false; };
+    let mut len = std::mem::size_of::<T>() as libc::size_t;
+    unsafe {
+        libc::sysctlbyname(name.as_ptr(), value as *mut T as *mut libc::c_void, &mut len, std::ptr::null_mut(), 0) == 0
+    }
+}
+
+#[cfg(target_os = "macos")]
+fn mach_host_self() -> libc::host_t {
+    #[allow(deprecated)]
+    unsafe { libc::mach_host_self() }
+}
+
+#[cfg(target_os = "macos")]
+fn sysctl_i32(name: &str) -> Option<i32> {
+    let mut value = 0_i32;
+    sysctl_into(name, &mut value).then_some(value)
+}
+
+#[cfg(target_os = "macos")]
+fn sysctl_u64(name: &str) -> Option<u64> {
+    let mut value = 0_u64;
+    sysctl_into(name, &mut value).then_some(value)
+}
+
+#[cfg(target_os = "macos")]
+fn sysctl_string(name: &str) -> Option<String> {
+    let name = CString::new(name).ok()?;
+    unsafe {
+        let mut len = 0_usize;
+        if libc::sysctlbyname(name.as_ptr(), std::ptr::null_mut(), &mut len, std::ptr::null_mut(), 0) != 0 || len == 0 {
+            return None;
+        }
+        let mut buf = vec![0_u8; len];
+        if libc::sysctlbyname(name.as_ptr(), buf.as_mut_ptr() as *mut libc::c_void, &mut len, std::ptr::null_mut(), 0) != 0 {
+            return None;
+        }
+        while buf.last().copied() == Some(0) {
+            buf.pop();
+        }
+        String::from_utf8(buf).ok().filter(|s| !s.is_empty())
+    }
+}
+
+#[cfg(target_os = "macos")]
+fn c_char_array_to_string(buf: &[libc::c_char]) -> String {
+    let end = buf.iter().position(|&c| c == 0).unwrap_or(buf.len());
+    let bytes: Vec<u8> = buf[..end].iter().map(|&c| c as u8).collect();
+    String::from_utf8_lossy(&bytes).trim().to_string()
+}
+
+#[cfg(target_os = "linux")]
+fn read_cpu_temp(cached_path: &mut Option<String>) -> f64 {
+    if let Some(ref path) = *cached_path {
+        if let Ok(temp_str) = fs::read_to_string(path)
+            && let Ok(t) = temp_str.trim().parse::<f64>() {
+                return t / 1000.0;
+            }
+    }
+    // Discovery: scan once and cache the winning path
+    if let Ok(entries) = fs::read_dir(&*sys_path("/sys/class/thermal")) {
+        for entry in entries.flatten() {
+            let name_str = entry.file_name().to_string_lossy().to_string();
+            if name_str.starts_with("thermal_zone")
+                && let Ok(type_str) = fs::read_to_string(entry.path().join("type")) {
+                    let type_lower = type_str.to_lowercase();
+                    if type_lower.contains("pkg") || type_lower.contains("cpu") ||
+                       type_lower.contains("core") || type_lower.contains("soc") {
+                        let temp_path = entry.path().join("temp");
+                        if let Ok(temp_str) = fs::read_to_string(&temp_path)
+                            && let Ok(t) = temp_str.trim().parse::<f64>() {
+                                *cached_path = Some(temp_path.to_string_lossy().into_owned());
+                                return t / 1000.0;
+                            }
+                    }
+                }
+        }
+    }
+    if let Ok(entries) = fs::read_dir(&*sys_path("/sys/class/hwmon")) {
+        for entry in entries.flatten() {
+            if let Ok(name_str) = fs::read_to_string(entry.path().join("name")) {
+                let name_lower = name_str.to_lowercase();
+                if name_lower.contains("coretemp") || name_lower.contains("cpu") || name_lower.contains("k10temp") {
+                    let mut best = -1000.0;
+                    let mut best_path = String::new();
+                    if let Ok(subentries) = fs::read_dir(entry.path()) {
+                        for subentry in subentries.flatten() {
+                            let sname_str = subentry.file_name().to_string_lossy().to_string();
+                            if sname_str.starts_with("temp") && sname_str.contains("_input")
+                                && let Ok(t_str) = fs::read_to_string(subentry.path())
+                                    && let Ok(t) = t_str.trim().parse::<f64>() {
+                                        let t_c = t / 1000.0;
+                                        if t_c > best {
+                                            best = t_c;
+                                            best_path = subentry.path().to_string_lossy().into_owned();
+                                        }
+                                    }
+                        }
+                    }
+                    if best > -1000.0 {
+                        *cached_path = Some(best_path);
+                        return best;
+                    }
+                }
+            }
+        }
+    }
+    -1000.0
+}
+
+#[cfg(target_os = "macos")]
+fn read_cpu_temp(_cached_path: &mut Option<String>) -> f64 {
+    -1000.0
+}
+
+#[cfg(target_os = "windows")]
+fn win_reg_read_string(subkey: &[u16], value_name: &[u16]) -> Option<String> {
+    unsafe {
+        let mut hkey: windows_sys::Win32::System::Registry::HKEY = std::ptr::null_mut();
+        if RegOpenKeyExW(HKEY_LOCAL_MACHINE, subkey.as_ptr(), 0, KEY_READ, &mut hkey) != 0 {
+            return None;
+        }
+        let mut buf = [0u16; 512];
+        let mut buf_len = (buf.len() * 2) as u32;
+        let mut reg_type: u32 = 0;
+        let result = RegQueryValueExW(
+            hkey, value_name.as_ptr(), std::ptr::null(),
+            &mut reg_type, buf.as_mut_ptr() as *mut u8, &mut buf_len,
+        );
+        RegCloseKey(hkey);
+        if result != 0 || reg_type != REG_SZ { return None; }
+        let chars = buf_len as usize / 2;
+        let s = String::from_utf16_lossy(&buf[..chars]);
+        Some(s.trim_end_matches('\0').to_string())
+    }
+}
+
+#[cfg(target_os = "windows")]
+fn win_wstr(s: &str) -> Vec<u16> {
+    s.encode_utf16().chain(std::iter::once(0)).collect()
+}
+
+#[cfg(target_os = "windows")]
+fn read_cpu_temp(_cached_path: &mut Option<String>) -> f64 {
+    // Try wmic for CPU temperature
+    if let Ok(output) = std::process::Command::new("wmic")
+        .args(["path", "MSAcpi_ThermalZoneTemperature", "get", "CurrentTemperature", "/value"])
+        .output()
+        && output.status.success() {
+            let out_str = String::from_utf8_lossy(&output.stdout);
+            for line in out_str.lines() {
+                if let Some(val) = line.strip_prefix("CurrentTemperature=") {
+                    if let Ok(t) = val.trim().parse::<f64>() {
+                        return (t - 2732.0) / 10.0;
+                    }
+                }
+            }
+        }
+    -1000.0
+}
+
+#[cfg(target_os = "linux")]
+fn read_cpu_freq(cached_paths: &mut Vec<String>) -> f64 {
+    // Discover sysfs freq paths once and cache them
+    if cached_paths.is_empty() {
+        if let Ok(entries) = fs::read_dir(&*sys_path("/sys/devices/system/cpu")) {
+            for entry in entries.flatten() {
+                let name_str = entry.file_name().to_string_lossy().to_string();
+                if name_str.starts_with("cpu") && name_str.len() > 3
+                    && name_str.chars().nth(3).unwrap().is_ascii_digit() {
+                    let freq_path = entry.path().join("cpufreq/scaling_cur_freq");
+                    if fs::metadata(&freq_path).is_ok() {
+                        cached_paths.push(freq_path.to_string_lossy().into_owned());
+                    }
+                }
+            }
+        }
+    }
+    if !cached_paths.is_empty() {
+        let mut total = 0.0;
+        let mut count = 0;
+        for path in cached_paths.iter() {
+            if let Ok(khz_str) = fs::read_to_string(path)
+                && let Ok(khz) = khz_str.trim().parse::<f64>() {
+                    total += khz / 1000.0;
+                    count += 1;
+                }
+        }
+        if count > 0 { return total / count as f64; }
+    }
+    // Fall back to /proc/cpuinfo
+    if let Ok(content) = fs::read_to_string(&*sys_path("/proc/cpuinfo")) {
+        let mut total = 0.0;
+        let mut count = 0;
+        for line in content.lines() {
+            if line.starts_with("cpu MHz")
+                && let Some(p) = line.split(':').nth(1)
+                    && let Ok(freq) = p.trim().parse::<f64>() {
+                        total += freq;
+                        count += 1;
+                    }
+        }
+        if count > 0 {
+            return total / count as f64;
+        }
+    }
+    0.0
+}
+
+#[cfg(target_os = "macos")]
+fn read_cpu_freq(_cached_paths: &mut Vec<String>) -> f64 {
+    sysctl_u64("hw.cpufrequency")
+        .or_else(|| sysctl_u64("hw.cpufrequency_max"))
+        .map(|hz| hz as f64 / 1_000_000.0)
+        .unwrap_or(0.0)
+}
+
+#[cfg(target_os = "windows")]
+fn read_cpu_freq(_cached_paths: &mut Vec<String>) -> f64 {
+    unsafe {
+        let count = active_cpu_count() as usize;
+        if count == 0 { return 0.0; }
+
+        let mut pinfo: Vec<PROCESSOR_POWER_INFORMATION> = vec![std::mem::zeroed(); count];
+        let ret = CallNtPowerInformation(
+            ProcessorInformation, std::ptr::null(), 0,
+            pinfo.as_mut_ptr() as *mut core::ffi::c_void,
+            (count * std::mem::size_of::<PROCESSOR_POWER_INFORMATION>()) as u32,
+        );
+        if ret != 0 { return 0.0; }
+
+        // MhzLimit includes turbo headroom; CurrentMhz is the actual frequency.
+        // Pick the highest across all processors.
+        let mut best = pinfo[0].MaxMhz;
+        for p in &pinfo {
+            if p.CurrentMhz > best { best = p.CurrentMhz; }
+            if p.MhzLimit > best { best = p.MhzLimit; }
+        }
+        best as f64
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn read_gpu_cores() -> String {
+    let mut gpu_count = 0;
+    let mut unique_devices: HashSet<String> = HashSet::new();
+    let mut has_videocore = false;
+    
+    // Count physical GPUs via DRM, deduplicating by device path
+    if let Ok(entries) = fs::read_dir(&*sys_path("/sys/class/drm")) {
+        for entry in entries.flatten() {
+            let name = entry.file_name().to_string_lossy().to_string();
+            if name.starts_with("card") && !name.contains('-') {
+                let dev_path = format!("{}/sys/class/drm/{}/device", sys_root(), name);
+                let dev_id = fs::canonicalize(&dev_path)
+                    .map(|p| p.to_string_lossy().to_string())
+                    .unwrap_or_else(|_| name.clone());
+                
+                // VideoCore/Broadcom GPUs (Pi4, etc.) expose multiple DRM
+                // drivers (vc4 display + v3d render) for one physical GPU
+                let is_videocore =
+                    fs::read_to_string(format!("{}/uevent", dev_path))
+                        .is_ok_and(|u| u.contains("DRIVER=v3d") || u.contains("DRIVER=vc4"))
+                    || fs::read_to_string(format!("{}/vendor", dev_path))
+                        .is_ok_and(|v| v.contains("0x14e4"));
+                
+                if is_videocore {
+                    has_videocore = true;
+                } else if unique_devices.insert(dev_id) {
+                    gpu_count += 1;
+                }
+            }
+        }
+    }
+    if has_videocore {
+        gpu_count += 1;
+    }
+    
+    // Fallback to nvidia-smi if DRM didn't find any
+    if gpu_count == 0 {
+        if let Ok(output) = std::process::Command::new("/usr/bin/nvidia-smi").arg("-L").output() {
+            if output.status.success() {
+                let out_str = String::from_utf8_lossy(&output.stdout);
+                gpu_count = out_str.lines().filter(|l| l.starts_with("GPU")).count();
+            }
+        }
+    }
+
+    let gpu_str = if gpu_count == 1 { "GPU:" } else { "GPUs:" };
+    let count_prefix = if gpu_count > 0 { format!("{} {}, ", gpu_str, gpu_count) } else { String::new() };
+
+    // Try NVIDIA
+    if let Ok(output) = std::process::Command::new("/usr/bin/nvidia-settings")
+        .args(["-q", "CUDACores", "-t"])
+        .output()
+    {
+        if output.status.success() {
+            let out_str = String::from_utf8_lossy(&output.stdout);
+            if let Ok(cores) = out_str.trim().parse::<u32>() {
+                return format!("{}{} CUDA Cores", count_prefix, cores);
+            }
+        }
+    }
+
+    // Try AMD
+    if let Ok(entries) = fs::read_dir(&*sys_path("/sys/class/kfd/kfd/topology/nodes/")) {
+        let mut max_simd = 0;
+        for entry in entries.flatten() {
+            if let Ok(content) = fs::read_to_string(entry.path().join("properties")) {
+                for line in content.lines() {
+                    if line.starts_with("simd_count") {
+                        let parts: Vec<&str> = line.split_whitespace().collect();
+                        if parts.len() >= 2 {
+                            if let Ok(simd) = parts[1].parse::<u32>() {
+                                if simd > max_simd {
+                                    max_simd = simd;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        if max_simd > 0 {
+            let sps = max_simd * 64;
+            return format!("{}{} Stream Processors", count_prefix, sps);
+        }
+    }
+
+    if gpu_count > 0 {
+        format!("{} {}", gpu_str, gpu_count)
+    } else {
+        String::new()
+    }
+}
+
+#[cfg(target_os = "macos")]
+fn read_gpu_cores() -> String {
+    String::new()
+}
+
+#[cfg(target_os = "windows")]
+fn read_gpu_cores() -> String {
+    if let Ok(output) = std::process::Command::new("nvidia-smi")
+        .arg("-L")
+        .output()
+        && output.status.success() {
+            let out_str = String::from_utf8_lossy(&output.stdout);
+            let gpu_count = out_str.lines().filter(|l| l.starts_with("GPU")).count();
+            if gpu_count > 0 {
+                let gpu_str = if gpu_count == 1 { "GPU:" } else { "GPUs:" };
+                return format!("{} {}", gpu_str, gpu_count);
+            }
+        }
+    String::new()
+}
+
+#[cfg(target_os = "linux")]
+fn read_cpu_name() -> String {
+    if let Ok(content) = fs::read_to_string(&*sys_path("/proc/cpuinfo")) {
+        for line in content.lines() {
+            if line.starts_with("model name") {
+                if let Some(name) = line.split(':').nth(1) {
+                    let mut n = name.trim().replace("(R)", "").replace("(TM)", "").replace("(tm)", "").replace("(r)", "");
+                    n = n.replace(" CPU", "").replace(" Processor", "");
+                    let parts: Vec<&str> = n.split_whitespace().collect();
+                    n = parts.join(" ");
+                    n = n.replace("Intel Core ", "");
+                    n = n.replace("AMD Ryzen ", "Ryzen ");
+                    return n;
+                }
+            }
+        }
+    }
+    "CPU".to_string()
+}
+
+#[cfg(target_os = "macos")]
+fn read_cpu_name() -> String {
+    sysctl_string("machdep.cpu.brand_string")
+        .or_else(|| sysctl_string("hw.model"))
+        .unwrap_or_else(|| "CPU".to_string())
+}
+
+#[cfg(target_os = "windows")]
+fn read_cpu_name() -> String {
+    let subkey = win_wstr("HARDWARE\\DESCRIPTION\\System\\CentralProcessor\\0");
+    let value_name = win_wstr("ProcessorNameString");
+    if let Some(name) = win_reg_read_string(&subkey, &value_name) {
+        let mut n = name.replace("(R)", "").replace("(TM)", "").replace("(tm)", "").replace("(r)", "");
+        n = n.replace(" CPU", "").replace(" Processor", "");
+        let parts: Vec<&str> = n.split_whitespace().collect();
+        n = parts.join(" ");
+        n = n.replace("Intel Core ", "");
+        n = n.replace("AMD Ryzen ", "Ryzen ");
+        return n;
+    }
+    "CPU".to_string()
+}
+
+// Per-core counters are kept flat, core-major: core N's user, nice, system,
+// idle, iowait, irq, softirq and steal ticks at N * CPU_FIELDS.
+const CPU_FIELDS: usize = 8;
+const CPU_IDLE: usize = 3;
+const CPU_IOWAIT: usize = 4;
+
+// /proc/stat kept open and re-read with pread, plus the buffer it lands in;
+// on Windows the buffer for SystemProcessorPerformanceInformation.
+#[derive(Default)]
+struct CpuStatFile {
+    #[cfg(target_os = "linux")]
+    file: Option<File>,
+    #[cfg(target_os = "linux")]
+    buf: Vec<u8>,
+    #[cfg(target_os = "windows")]
+    nt: Vec<u64>,
+}
+
+// Parses the cpu lines that open /proc/stat: the aggregate into `total` and
+// each cpuN into `cores`, zero-filled for offline CPUs. False if the text ran
+// out while still on cpu lines, i.e. the read was cut short.
+#[cfg(target_os = "linux")]
+fn parse_stat_cpus(text: &[u8], total: &mut CpuTimes, cores: &mut Vec<u64>) -> bool {
+    cores.clear();
+    for line in text.split(|&b| b == b'\n') {
+        if !line.starts_with(b"cpu") {
+            return !line.is_empty();
+        }
+        let mut tokens = line.split(|&b| b == b' ').filter(|t| !t.is_empty());
+        let Some(name) = tokens.next() else { continue };
+        let mut fields = [0_u64; CPU_FIELDS];
+        for f in fields.iter_mut() {
+            *f = tokens.next().and_then(parse_dec).unwrap_or(0);
+        }
+        if name == b"cpu" {
+            *total = CpuTimes {
+                user: fields[0], nice: fields[1], sys: fields[2], idle: fields[3],
+                iowait: fields[4], irq: fields[5], softirq: fields[6], steal: fields[7],
+            };
+        } else if let Some(n) = parse_dec(&name[3..]) {
+            let at = n as usize * CPU_FIELDS;
+            if cores.len() < at + CPU_FIELDS {
+                cores.resize(at + CPU_FIELDS, 0);
+            }
+            cores[at..at + CPU_FIELDS].copy_from_slice(&fields);
+        }
+    }
+    false
+}
+
+// Busy percentage of every core between two flat counter arrays. Fixed-width
+// inner loops over CPU_FIELDS lanes so the compiler can vectorise the deltas
+// and sums; a core missing from `prev` (first tick, hotplug) counts from zero.
+fn core_busy(prev: &[u64], cur: &[u64], out: &mut Vec<f32>) {
+    out.clear();
+    let zero = [0_u64; CPU_FIELDS];
+    let mut prev = prev.chunks_exact(CPU_FIELDS);
+    for c in cur.chunks_exact(CPU_FIELDS) {
+        let p = prev.next().unwrap_or(&zero);
+        let mut d = [0_u64; CPU_FIELDS];
+        for k in 0..CPU_FIELDS {
+            d[k] = c[k].saturating_sub(p[k]);
+        }
+        let total: u64 = d.iter().sum();
+        let idle = d[CPU_IDLE] + d[CPU_IOWAIT];
+        out.push(if total > 0 { (total - idle) as f32 * 100.0 / total as f32 } else { 0.0 });
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn read_cpu_times(stat: &mut CpuStatFile, cores: &mut Vec<u64>) -> CpuTimes {
+    let mut t = CpuTimes::default();
+    cores.clear();
+    if stat.file.is_none() {
+        stat.file = File::open(&*sys_path("/proc/stat")).ok();
+    }
+    let Some(file) = &stat.file else { return t };
+    if stat.buf.is_empty() {
+        stat.buf.resize(16 * 1024, 0);
+    }
+    // Hundreds of cores (and the intr line after them) can outgrow the
+    // buffer; it doubles until the cpu lines fit and then stays that size.
+    loop {
+        let Ok(n) = file.read_at(&mut stat.buf, 0) else { return t };
+        if parse_stat_cpus(&stat.buf[..n], &mut t, cores) || n < stat.buf.len() || stat.buf.len() >= 16 << 20 {
+            return t;
+        }
+        let len = stat.buf.len() * 2;
+        stat.buf.resize(len, 0);
+    }
+}
+
+#[cfg(target_os = "macos")]
+fn read_cpu_times(_stat: &mut CpuStatFile, cores: &mut Vec<u64>) -> CpuTimes {
+    let mut t = CpuTimes::default();
+    read_core_times(cores);
+    unsafe {
+        let mut info = std::mem::zeroed::<libc::host_cpu_load_info>();
+        let mut count = libc::HOST_CPU_LOAD_INFO_COUNT;
+        let kr = libc::host_statistics64(
+            mach_host_self(),
+            libc::HOST_CPU_LOAD_INFO,
+            &mut info as *mut _ as libc::host_info64_t,
+            &mut count,
+        );
+        if kr == libc::KERN_SUCCESS {
+            t.user = info.cpu_ticks[libc::CPU_STATE_USER as usize] as u64;
+            t.sys = info.cpu_ticks[libc::CPU_STATE_SYSTEM as usize] as u64;
+            t.idle = info.cpu_ticks[libc::CPU_STATE_IDLE as usize] as u64;
+            t.nice = info.cpu_ticks[libc::CPU_STATE_NICE as usize] as u64;
+        }
+    }
+    t
+}
+
+// Per-core ticks from host_processor_info, which only reports user, system,
+// idle and nice; the other fields stay zero.
+#[cfg(target_os = "macos")]
+fn read_core_times(cores: &mut Vec<u64>) {
+    cores.clear();
+    let mut count: libc::natural_t = 0;
+    let mut info: libc::processor_info_array_t = std::ptr::null_mut();
+    let mut info_count: libc::mach_msg_type_number_t = 0;
+    let kr = unsafe {
+        libc::host_processor_info(mach_host_self(), libc::PROCESSOR_CPU_LOAD_INFO, &mut count, &mut info, &mut info_count)
+    };
+    if kr != libc::KERN_SUCCESS || info.is_null() {
+        return;
+    }
+    let states = libc::CPU_STATE_MAX as usize;
+    let ticks = unsafe { std::slice::from_raw_parts(info, info_count as usize) };
+    for cpu in ticks.chunks_exact(states).take(count as usize) {
+        let tick = |state: libc::c_int| cpu[state as usize] as u32 as u64;
+        cores.extend_from_slice(&[
+            tick(libc::CPU_STATE_USER), tick(libc::CPU_STATE_NICE), tick(libc::CPU_STATE_SYSTEM), tick(libc::CPU_STATE_IDLE),
+            0, 0, 0, 0,
+        ]);
+    }
+    #[allow(deprecated)]
+    unsafe {
+        libc::vm_deallocate(
+            libc::mach_task_self(),
+            info as libc::vm_address_t,
+            info_count as libc::vm_size_t * std::mem::size_of::<libc::integer_t>() as libc::vm_size_t,
+        );
+    }
+}
+
+#[cfg(target_os = "windows")]
+type NtQuerySystemInformationFn = unsafe extern "system" fn(u32, *mut std::ffi::c_void, u32, *mut u32) -> i32;
+
+#[cfg(target_os = "windows")]
+const SYSTEM_PROCESS_INFORMATION: u32 = 5;
+#[cfg(target_os = "windows")]
+const SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION: u32 = 8;
+#[cfg(target_os = "windows")]
+const STATUS_INFO_LENGTH_MISMATCH: i32 = 0xC000_0004_u32 as i32;
+// Past this the answer is not believed and the caller falls back.
+#[cfg(target_os = "windows")]
+const NT_QUERY_MAX_BYTES: usize = 256 << 20;
+
+// ntdll's NtQuerySystemInformation, looked up once. It has no import
+// library in windows-sys's default features, so it is resolved by name.
+#[cfg(target_os = "windows")]
+fn nt_query_system_information() -> Option<NtQuerySystemInformationFn> {
+    static QUERY: std::sync::OnceLock<Option<NtQuerySystemInformationFn>> = std::sync::OnceLock::new();
+    *QUERY.get_or_init(|| {
+        let wide = win_wstr("ntdll.dll");
+        let lib = unsafe { LoadLibraryW(wide.as_ptr()) };
+        if lib.is_null() { return None; }
+        let f = unsafe { GetProcAddress(lib, c"NtQuerySystemInformation".as_ptr() as *const u8) }?;
+        Some(unsafe { std::mem::transmute::<unsafe extern "system" fn() -> isize, NtQuerySystemInformationFn>(f) })
+    })
+}
+
+// Run one information class into `buf` and return the bytes filled in. The
+// buffer only ever grows, with some slack for processes started between
+// calls, so once it has settled a query allocates nothing. u64 elements keep
+// the records 8-byte aligned.
+#[cfg(target_os = "windows")]
+fn nt_query(class: u32, buf: &mut Vec<u64>) -> Option<usize> {
+    let query = nt_query_system_information()?;
+    if buf.is_empty() {
+        buf.resize(32 * 1024, 0);
+    }
+    loop {
+        let bytes = buf.len() * std::mem::size_of::<u64>();
+        let mut needed = 0_u32;
+        let status = unsafe { query(class, buf.as_mut_ptr() as *mut std::ffi::c_void, bytes as u32, &mut needed) };
+        if status >= 0 {
+            return Some((needed as usize).min(bytes));
+        }
+        if status != STATUS_INFO_LENGTH_MISMATCH || bytes >= NT_QUERY_MAX_BYTES {
+            return None;
+        }
+        let want = (needed as usize).div_ceil(std::mem::size_of::<u64>()) + buf.len() / 4;
+        buf.resize(want.max(buf.len() * 2), 0);
+    }
+}
+
+#[cfg(target_os = "windows")]
+#[repr(C)]
+struct NtUnicodeString {
+    length: u16,
+    _maximum_length: u16,
+    buffer: *const u16,
+}
+
+// The head of SYSTEM_PROCESS_INFORMATION, up to the working set; see
+// winternl.h and the NT headers for the fields it calls Reserved. Each
+// record is followed by one SYSTEM_THREAD_INFORMATION per thread, and
+// next_entry_offset skips those.
+#[cfg(target_os = "windows")]
+#[repr(C)]
+struct NtProcessInformation {
+    next_entry_offset: u32,
+    number_of_threads: u32,
+    _working_set_private_size: i64,
+    _hard_fault_count: u32,
+    _number_of_threads_high_watermark: u32,
+    _cycle_time: u64,
+    _create_time: i64,
+    user_time: i64,
+    kernel_time: i64,
+    image_name: NtUnicodeString,
+    _base_priority: i32,
+    unique_process_id: usize,
+    inherited_from_unique_process_id: usize,
+    _handle_count: u32,
+    _session_id: u32,
+    _unique_process_key: usize,
+    _peak_virtual_size: usize,
+    _virtual_size: usize,
+    _page_fault_count: u32,
+    _peak_working_set_size: usize,
+    working_set_size: usize,
+}
+
+// SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION, one per logical CPU, in 100 ns units.
+#[cfg(target_os = "windows")]
+#[repr(C)]
+struct NtProcessorPerformance {
+    idle_time: i64,
+    kernel_time: i64,
+    user_time: i64,
+    dpc_time: i64,
+    interrupt_time: i64,
+    _interrupt_count: u32,
+}
+
+// Every process's times, working set, thread count and parent from one
+// SystemProcessInformation snapshot, into the first slab. Unlike
+// OpenProcess this needs no access to the process, so protected and other
+// users' processes show up too. False if the query failed, leaving the
+// slabs empty.
+#[cfg(target_os = "windows")]
+fn read_nt_processes(s: &mut Sampler) -> bool {
+    for slab in s.slabs.iter_mut() {
+        slab.readings.clear();
+        slab.names.clear();
+    }
+    let Some(len) = nt_query(SYSTEM_PROCESS_INFORMATION, &mut s.nt_procs) else { return false; };
+    let base = s.nt_procs.as_ptr() as *const u8;
+    let mut off = 0_usize;
+    while off + std::mem::size_of::<NtProcessInformation>() <= len {
+        let p = unsafe { &*(base.add(off) as *const NtProcessInformation) };
+        let pid = p.unique_process_id as i32;
+        // PID 0 is the idle process, whose CPU time is the machine's idle time.
+        if pid != 0 {
+            let slot = s.procs.claim(pid);
+            let name: &[u16] = if p.image_name.buffer.is_null() { &[] } else {
+                unsafe { std::slice::from_raw_parts(p.image_name.buffer, p.image_name.length as usize / 2) }
+            };
+            if s.procs.name(slot).is_none_or(|n| !n.encode_utf16().eq(name.iter().copied())) {
+                s.procs.set_name(slot, Arc::from(String::from_utf16_lossy(name)));
+            }
+            s.slabs[0].readings.push(ProcReading {
+                slot,
+                ticks: p.kernel_time.saturating_add(p.user_time).max(0) as u64,
+                rss: p.working_set_size as u64,
+                threads: p.number_of_threads as i32,
+                ppid: p.inherited_from_unique_process_id as i32,
+                reset: false,
+            });
+        }
+        if p.next_entry_offset == 0 { break; }
+        off += p.next_entry_offset as usize;
+    }
+    true
+}
+
+// Per-core counters cover the calling thread's processor group, which is
+// every CPU on machines with up to 64 of them.
+#[cfg(target_os = "windows")]
+fn read_cpu_times(stat: &mut CpuStatFile, cores: &mut Vec<u64>) -> CpuTimes {
+    let mut t = CpuTimes::default();
+    cores.clear();
+    if let Some(len) = nt_query(SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION, &mut stat.nt) {
+        let n = len / std::mem::size_of::<NtProcessorPerformance>();
+        let perf = unsafe { std::slice::from_raw_parts(stat.nt.as_ptr() as *const NtProcessorPerformance, n) };
+        for c in perf {
+            // Kernel time includes idle, DPC and interrupt time.
+            let [idle, kernel, user, dpc, irq] = [c.idle_time, c.kernel_time, c.user_time, c.dpc_time, c.interrupt_time].map(|v| v.max(0) as u64);
+            let sys = kernel.saturating_sub(idle).saturating_sub(dpc).saturating_sub(irq);
+            cores.extend_from_slice(&[user, 0, sys, idle, 0, irq, dpc, 0]);
+        }
+    }
+    unsafe {
+        let mut idle_time: FILETIME = std::mem::zeroed();
+        let mut kernel_time: FILETIME = std::mem::zeroed();
+        let mut user_time: FILETIME = std::mem::zeroed();
+        if GetSystemTimes(&mut idle_time, &mut kernel_time, &mut user_time) != 0 {
+            let idle = ((idle_time.dwHighDateTime as u64) << 32) | idle_time.dwLowDateTime as u64;
+            let kernel = ((kernel_time.dwHighDateTime as u64) << 32) | kernel_time.dwLowDateTime as u64;
+            let user = ((user_time.dwHighDateTime as u64) << 32) | user_time.dwLowDateTime as u64;
+            // kernel includes idle time on Windows
+            t.sys = kernel.saturating_sub(idle);
+            t.user = user;
+            t.idle = idle;
+        }
+    }
+    t
+}
+
+#[cfg(target_os = "linux")]
+fn read_memory() -> MemorySnapshot {
+    let mut m = MemorySnapshot::default();
+    if let Ok(content) = fs::read_to_string(&*sys_path("/proc/meminfo")) {
         let mut total = 0;
         let mut avail = 0;
         let mut s_total = 0;
@@ -941,1071 +4914,4341 @@ fn read_memory() -> MemorySnapshot {
         let mut cma_free = 0;
         
         for line in content.lines() {
-            let mut parts = line.split_whitespace();
-            let key = parts.next().unwrap_or("");
-            let val = parts.next().unwrap_or("0").parse::<u64>().unwrap_or(0);
-            
-            match key {
-                "MemTotal:" => total = val,
-                "MemAvailable:" => avail = val,
-                "SwapTotal:" => s_total = val,
-                "SwapFree:" => s_free = val,
-                "CmaTotal:" => cma_total = val,
-                "CmaFree:" => cma_free = val,
+            let mut parts = line.split_whitespace();
+            let key = parts.next().unwrap_or("");
+            let val = parts.next().unwrap_or("0").parse::<u64>().unwrap_or(0);
+            
+            match key {
+                "MemTotal:" => total = val,
+                "MemAvailable:" => avail = val,
+                "SwapTotal:" => s_total = val,
+                "SwapFree:" => s_free = val,
+                "CmaTotal:" => cma_total = val,
+                "CmaFree:" => cma_free = val,
+                _ => {}
+            }
+        }
+        m.total_bytes = total * 1024;
+        m.used_bytes = total.saturating_sub(avail) * 1024;
+        m.swap_total_bytes = s_total * 1024;
+        m.swap_used_bytes = s_total.saturating_sub(s_free) * 1024;
+        m.cma_total_bytes = cma_total * 1024;
+        m.cma_used_bytes = cma_total.saturating_sub(cma_free) * 1024;
+    }
+    m
+}
+
+#[cfg(target_os = "macos")]
+fn read_memory() -> MemorySnapshot {
+    let mut m = MemorySnapshot::default();
+    m.total_bytes = sysctl_u64("hw.memsize").unwrap_or(0);
+
+    unsafe {
+        let mut stats = std::mem::zeroed::<libc::vm_statistics64>();
+        let mut count = libc::HOST_VM_INFO64_COUNT;
+        let kr = libc::host_statistics64(
+            mach_host_self(),
+            libc::HOST_VM_INFO64,
+            &mut stats as *mut _ as libc::host_info64_t,
+            &mut count,
+        );
+        if kr == libc::KERN_SUCCESS {
+            let page_size = libc::sysconf(libc::_SC_PAGESIZE).max(1) as u64;
+            let active = stats.active_count as u64;
+            let wire = stats.wire_count as u64;
+            let compressed = stats.compressor_page_count as u64;
+            let used = (active + wire + compressed).saturating_mul(page_size);
+            m.used_bytes = used.min(m.total_bytes);
+        }
+
+        let mut swap = std::mem::zeroed::<libc::xsw_usage>();
+        if sysctl_into("vm.swapusage", &mut swap) {
+            m.swap_total_bytes = swap.xsu_total;
+            m.swap_used_bytes = swap.xsu_used;
+        }
+    }
+
+    m
+}
+
+#[cfg(target_os = "windows")]
+unsafe extern "system" fn enum_pf_callback(
+    pcontext: *mut core::ffi::c_void,
+    ppagefileinfo: *mut ENUM_PAGE_FILE_INFORMATION,
+    _lpfilename: windows_sys::core::PCWSTR,
+) -> BOOL {
+    unsafe {
+        let info = &*ppagefileinfo;
+        let out = &mut *(pcontext as *mut (u64, u64));
+        // Called once per pagefile; accumulate so multiple pagefiles are summed.
+        out.0 += info.TotalInUse as u64;
+        out.1 += info.TotalSize as u64;
+    }
+    1
+}
+
+#[cfg(target_os = "windows")]
+fn read_memory() -> MemorySnapshot {
+    let mut m = MemorySnapshot::default();
+    unsafe {
+        let mut si: SYSTEM_INFO = std::mem::zeroed();
+        GetSystemInfo(&mut si);
+        let page_size = si.dwPageSize as u64;
+
+        let mut pi: PERFORMANCE_INFORMATION = std::mem::zeroed();
+        pi.cb = std::mem::size_of::<PERFORMANCE_INFORMATION>() as u32;
+        let cb = pi.cb;
+        if GetPerformanceInfo(&mut pi, cb) != 0 {
+            m.total_bytes = (pi.PhysicalTotal as u64) * page_size;
+            m.used_bytes = (pi.PhysicalTotal.saturating_sub(pi.PhysicalAvailable) as u64) * page_size;
+        }
+
+        let mut pf_info: (u64, u64) = (0, 0);
+        K32EnumPageFilesW(
+            Some(enum_pf_callback),
+            &mut pf_info as *mut _ as *mut core::ffi::c_void,
+        );
+        if pf_info.1 > 0 {
+            m.swap_total_bytes = pf_info.1 * page_size;
+            m.swap_used_bytes = std::cmp::min(pf_info.0 * page_size, pf_info.1 * page_size);
+        }
+    }
+    m
+}
+
+#[cfg(target_os = "linux")]
+fn read_cpu_count() -> String {
+    let mut cores = 0;
+    let mut physical_ids = std::collections::HashSet::new();
+
+    if let Ok(content) = fs::read_to_string(&*sys_path("/proc/cpuinfo")) {
+        for line in content.lines() {
+            if line.starts_with("processor") {
+                cores += 1;
+            } else if line.starts_with("physical id") {
+                if let Some(id_str) = line.split(':').nth(1) {
+                    if let Ok(id) = id_str.trim().parse::<u32>() {
+                        physical_ids.insert(id);
+                    }
+                }
+            }
+        }
+    }
+
+    if cores == 0 {
+        if let Ok(content) = fs::read_to_string(&*sys_path("/proc/stat")) {
+            for line in content.lines() {
+                if line.starts_with("cpu") && line.len() > 3 && line.chars().nth(3).unwrap().is_ascii_digit() {
+                    cores += 1;
+                }
+            }
+        }
+    }
+    if cores == 0 { cores = 1; }
+
+    let sockets = if physical_ids.is_empty() { 1 } else { physical_ids.len() };
+
+    let cpu_str = if sockets == 1 { "CPU:" } else { "CPUs:" };
+    let core_str = if cores == 1 { "core" } else { "cores" };
+
+    format!("{} {}, {} {}", cpu_str, sockets, cores, core_str)
+}
+
+#[cfg(target_os = "macos")]
+fn read_cpu_count() -> String {
+    let cores = read_logical_cpu_count();
+    let sockets = sysctl_i32("hw.packages").filter(|v| *v > 0).unwrap_or(1) as u64;
+    let cpu_str = if sockets == 1 { "CPU:" } else { "CPUs:" };
+    let core_str = if cores == 1 { "core" } else { "cores" };
+    format!("{} {}, {} {}", cpu_str, sockets, cores, core_str)
+}
+
+#[cfg(target_os = "macos")]
+fn read_logical_cpu_count() -> u64 {
+    sysctl_i32("hw.logicalcpu")
+        .or_else(|| sysctl_i32("hw.ncpu"))
+        .filter(|v| *v > 0)
+        .map(|v| v as u64)
+        .unwrap_or(1)
+}
+
+#[cfg(target_os = "windows")]
+fn read_cpu_count() -> String {
+    {
+        let cores = active_cpu_count();
+        let cpu_str = if cores == 1 { "CPU:" } else { "CPUs:" };
+        let core_str = if cores == 1 { "core" } else { "cores" };
+        format!("{} {}, {} {}", cpu_str, 1, cores, core_str)
+    }
+}
+
+// What startup finds out about the machine: the header strings, and the
+// files the temperature and frequency readings come from. Probing it reads
+// all of /proc/cpuinfo, walks DRM, thermal, hwmon and cpufreq in sysfs and
+// forks the GPU tools, which on a big box or a cold container delays the
+// first frame. So it is cached per boot; see load_discovery.
+#[derive(Clone, Default, PartialEq, Debug)]
+struct Discovery {
+    cpu_count: String,
+    cpu_name: String,
+    gpu_cores: String,
+    cpu_temp_path: Option<String>,
+    cpu_freq_paths: Vec<String>,
+    nvidia_smi_missing: bool,
+}
+
+const DISCOVERY_MAGIC: &str = "utop-discovery 1";
+
+impl Discovery {
+    // The header strings only; the first tick finds the sysfs files.
+    fn header() -> Self {
+        Self {
+            cpu_count: read_cpu_count(),
+            cpu_name: read_cpu_name(),
+            gpu_cores: read_gpu_cores(),
+            ..Self::default()
+        }
+    }
+
+    // Everything, including the scans the first tick would run.
+    fn probe() -> Self {
+        let mut found = Self::header();
+        read_cpu_temp(&mut found.cpu_temp_path);
+        read_cpu_freq(&mut found.cpu_freq_paths);
+        #[cfg(target_os = "linux")]
+        { found.nvidia_smi_missing = fs::metadata(NVIDIA_SMI).is_err(); }
+        found
+    }
+
+    // One "name value" line per field, after the magic and the key it was
+    // found under. None if a value would not survive the round trip.
+    fn encode(&self, key: &str) -> Option<String> {
+        use fmt::Write as _;
+        let mut out = format!("{}\nkey {}\ncpu_count {}\ncpu_name {}\ngpu_cores {}\n",
+            DISCOVERY_MAGIC, key, self.cpu_count, self.cpu_name, self.gpu_cores);
+        for path in self.cpu_temp_path.iter() {
+            let _ = writeln!(out, "cpu_temp {}", path);
+        }
+        for path in &self.cpu_freq_paths {
+            let _ = writeln!(out, "cpu_freq {}", path);
+        }
+        if self.nvidia_smi_missing {
+            out.push_str("nvidia_smi missing\n");
+        }
+        let lines = 5 + self.cpu_temp_path.iter().count() + self.cpu_freq_paths.len() + self.nvidia_smi_missing as usize;
+        (out.lines().count() == lines).then_some(out)
+    }
+
+    // The cached discovery, if the file was written under the same key.
+    fn decode(text: &str, key: &str) -> Option<Self> {
+        let mut lines = text.lines();
+        if lines.next()? != DISCOVERY_MAGIC || lines.next()?.strip_prefix("key ")? != key {
+            return None;
+        }
+        let mut found = Self::default();
+        for line in lines {
+            let (name, value) = line.split_once(' ').unwrap_or((line, ""));
+            match name {
+                "cpu_count" => found.cpu_count = value.to_string(),
+                "cpu_name" => found.cpu_name = value.to_string(),
+                "gpu_cores" => found.gpu_cores = value.to_string(),
+                "cpu_temp" => found.cpu_temp_path = Some(value.to_string()),
+                "cpu_freq" => found.cpu_freq_paths.push(value.to_string()),
+                "nvidia_smi" => found.nvidia_smi_missing = value == "missing",
                 _ => {}
             }
         }
-        m.total_bytes = total * 1024;
-        m.used_bytes = total.saturating_sub(avail) * 1024;
-        m.swap_total_bytes = s_total * 1024;
-        m.swap_used_bytes = s_total.saturating_sub(s_free) * 1024;
-        m.cma_total_bytes = cma_total * 1024;
-        m.cma_used_bytes = cma_total.saturating_sub(cma_free) * 1024;
+        (!found.cpu_count.is_empty()).then_some(found)
+    }
+}
+
+// What the cache is keyed by: this boot, so new hardware or a kernel update
+// always means a fresh probe, plus --root, which changes what is probed.
+// None where there is no boot ID to go by.
+fn discovery_key() -> Option<String> {
+    #[cfg(target_os = "linux")]
+    let boot = fs::read_to_string(&*sys_path("/proc/sys/kernel/random/boot_id")).ok().map(|id| id.trim().to_string());
+    #[cfg(target_os = "macos")]
+    let boot = sysctl_string("kern.bootsessionuuid");
+    #[cfg(target_os = "windows")]
+    let boot: Option<String> = None;
+    let boot = boot.filter(|id| !id.is_empty())?;
+    // Only Linux has --root, and another root is another machine's tree.
+    #[cfg(target_os = "linux")]
+    let boot = format!("{} {}", boot, sys_root());
+    Some(boot)
+}
+
+// $XDG_CACHE_HOME/utop/discovery, or under ~/.cache.
+fn discovery_cache_path() -> Option<String> {
+    let base = match std::env::var("XDG_CACHE_HOME") {
+        Ok(dir) if dir.starts_with('/') => dir,
+        _ => format!("{}/.cache", std::env::var("HOME").ok().filter(|h| !h.is_empty())?),
+    };
+    Some(format!("{}/utop/discovery", base))
+}
+
+fn load_discovery(path: &str, key: &str) -> Option<Discovery> {
+    Discovery::decode(&fs::read_to_string(path).ok()?, key)
+}
+
+// Written to a temporary file and renamed over the old one, so a reader
+// never sees half a cache.
+fn store_discovery(path: &str, key: &str, found: &Discovery) -> io::Result<()> {
+    let text = found.encode(key).ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "unencodable discovery"))?;
+    if let Some((dir, _)) = path.rsplit_once('/') {
+        fs::create_dir_all(dir)?;
+    }
+    let tmp = format!("{}.{}", path, std::process::id());
+    fs::write(&tmp, text)?;
+    fs::rename(&tmp, path).inspect_err(|_| { let _ = fs::remove_file(&tmp); })
+}
+
+// Probe again in the background, rewrite the cache if anything differs from
+// what this run started with, and, when it started from the cache, send the
+// fresh result so the header can catch up.
+fn spawn_discovery_check(path: String, key: String, cached: Option<Discovery>) -> mpsc::Receiver<Discovery> {
+    let (tx, rx) = mpsc::channel();
+    let _ = std::thread::Builder::new().name("utop-discovery".to_string()).spawn(move || {
+        let fresh = Discovery::probe();
+        if cached.as_ref() == Some(&fresh) {
+            return;
+        }
+        let _ = store_discovery(&path, &key, &fresh);
+        if cached.is_some() {
+            let _ = tx.send(fresh);
+        }
+    });
+    rx
+}
+
+// Where a sysfs GPU reports its load. Each variant keeps the winning file open
+// so a steady-state read is a single pread.
+#[cfg(target_os = "linux")]
+enum GpuUsageFile {
+    // A bare percentage: amdgpu gpu_busy_percent, i915 usage, kgsl gpu_busy_percentage.
+    Percent(File),
+    // V3D gpu_stats: per-queue "<queue> <timestamp> <jobs> <runtime>" counters.
+    V3dStats(File),
+    // kgsl gpubusy: "<busy> <total>".
+    BusyTotal(File),
+    // devfreq load: "<percent>@<freq>Hz".
+    DevfreqLoad(File),
+}
+
+// Result of one sysfs GPU discovery pass: the files that answered, already
+// open, plus the values that do not change while the device is present.
+#[cfg(target_os = "linux")]
+struct SysfsGpu {
+    name: String,
+    usage: Option<GpuUsageFile>,
+    temp: Option<File>,
+    vram_used: Option<File>,
+    vram_total: u64,
+    // SoC GPUs without VRAM draw from the CMA pool instead.
+    cma_mem: bool,
+}
+
+// Redo discovery this often even without errors, to pick up hotplugged cards.
+#[cfg(target_os = "linux")]
+const GPU_REDISCOVER_INTERVAL: Duration = Duration::from_secs(30);
+
+#[cfg(target_os = "linux")]
+fn open_first(paths: &[String]) -> Option<File> {
+    paths.iter().find_map(|p| File::open(p).ok())
+}
+
+#[cfg(target_os = "linux")]
+fn pread_str<'a>(file: &File, buf: &'a mut [u8]) -> Option<&'a str> {
+    let n = file.read_at(buf, 0).ok()?;
+    std::str::from_utf8(&buf[..n]).ok()
+}
+
+#[cfg(target_os = "linux")]
+fn parse_percent(content: &str) -> Option<f64> {
+    content.trim().parse::<f64>().ok()
+}
+
+#[cfg(target_os = "linux")]
+fn parse_busy_total(content: &str) -> Option<f64> {
+    let mut parts = content.split_whitespace();
+    let busy = parts.next()?.parse::<u64>().ok()?;
+    let total = parts.next()?.parse::<u64>().ok()?;
+    Some(if total > 0 { busy as f64 * 100.0 / total as f64 } else { 0.0 })
+}
+
+#[cfg(target_os = "linux")]
+fn parse_devfreq_load(content: &str) -> Option<f64> {
+    content.split('@').next()?.trim().parse::<f64>().ok()
+}
+
+// Folds one gpu_stats read into the per-queue history and returns the busiest
+// queue's utilisation since the previous read, if there was one.
+#[cfg(target_os = "linux")]
+fn v3d_usage(content: &str, stats: &mut Vec<V3dStats>) -> Option<f64> {
+    let mut usage = None;
+    for line in content.lines().skip(1) {
+        let mut parts = line.split_whitespace();
+        let (Some(q_name), Some(ts), Some(_), Some(rt)) = (parts.next(), parts.next(), parts.next(), parts.next()) else {
+            continue;
+        };
+        let (Ok(ts), Ok(rt)) = (ts.parse::<u64>(), rt.parse::<u64>()) else {
+            continue;
+        };
+        if let Some(st) = stats.iter_mut().find(|st| st.queue == q_name) {
+            if ts > st.last_ts {
+                let q_u = rt.saturating_sub(st.last_rt) as f64 * 100.0 / (ts - st.last_ts) as f64;
+                usage = Some(usage.map_or(q_u, |u: f64| u.max(q_u)));
+            }
+            st.last_ts = ts;
+            st.last_rt = rt;
+        } else if stats.len() < 16 {
+            stats.push(V3dStats { queue: q_name.to_string(), last_ts: ts, last_rt: rt });
+        }
+    }
+    usage
+}
+
+// Single-GPU discovery, used when no NVIDIA device answered through NVML or
+// nvidia-smi. Probes DRM cards, then Adreno/kgsl, then devfreq, in the same
+// order the readings are trusted, and keeps whichever files answered open.
+#[cfg(target_os = "linux")]
+fn discover_sysfs_gpu(mem: &MemorySnapshot) -> SysfsGpu {
+    let mut buf = [0u8; 256];
+    let thermal_zone = || File::open(&*sys_path("/sys/class/thermal/thermal_zone0/temp")).ok();
+    let mut gpu = SysfsGpu {
+        name: "GPU".to_string(),
+        usage: None,
+        temp: None,
+        vram_used: None,
+        vram_total: 0,
+        cma_mem: false,
+    };
+
+    // 1. DRM / sysfs
+    let mut cards: Vec<String> = fs::read_dir(&*sys_path("/sys/class/drm"))
+        .map(|entries| {
+            entries
+                .flatten()
+                .map(|e| e.file_name().to_string_lossy().into_owned())
+                .filter(|n| n.starts_with("card") && !n.contains('-'))
+                .collect()
+        })
+        .unwrap_or_default();
+    cards.sort();
+    for card in &cards {
+        let base = format!("{}/sys/class/drm/{}", sys_root(), card);
+        let usage_files = [
+            format!("{}/device/gpu_busy_percent", base),
+            format!("{}/gt/gt0/usage", base),
+            format!("{}/device/usage", base),
+            format!("{}/device/load", base),
+        ];
+        let mut usage = usage_files.iter().find_map(|p| {
+            let f = File::open(p).ok()?;
+            parse_percent(pread_str(&f, &mut buf)?)?;
+            Some(GpuUsageFile::Percent(f))
+        });
+        if usage.is_none() {
+            let mut stats_files = vec![format!("{}/device/gpu_stats", base)];
+            if let Some(card_num) = card.chars().nth(4)
+                && card_num.is_ascii_digit() {
+                    stats_files.push(format!("{}/sys/kernel/debug/dri/{}/gpu_stats", sys_root(), card_num));
+                }
+            usage = open_first(&stats_files).map(GpuUsageFile::V3dStats);
+        }
+
+        if let Ok(vendor) = fs::read_to_string(format!("{}/device/vendor", base)) {
+            if vendor.contains("0x1002") { gpu.name = "AMD GPU".to_string(); }
+            else if vendor.contains("0x8086") { gpu.name = "Intel GPU".to_string(); }
+            else if vendor.contains("0x10de") { gpu.name = "NVIDIA GPU".to_string(); }
+            else if vendor.contains("0x14e4") { gpu.name = "Broadcom GPU".to_string(); }
+        } else if let Ok(uevent) = fs::read_to_string(format!("{}/device/uevent", base))
+            && (uevent.contains("DRIVER=v3d") || uevent.contains("DRIVER=vc4")) {
+                gpu.name = "VideoCore GPU".to_string();
+            }
+
+        if let Ok(hdirs) = fs::read_dir(format!("{}/device/hwmon", base)) {
+            gpu.temp = hdirs
+                .flatten()
+                .filter(|h| h.file_name().to_string_lossy().starts_with("hwmon"))
+                .find_map(|h| File::open(h.path().join("temp1_input")).ok());
+        }
+
+        if gpu.vram_used.is_none() {
+            gpu.vram_used = File::open(format!("{}/tile0/vram0/used", base)).ok();
+            if let Ok(m_str) = fs::read_to_string(format!("{}/tile0/vram0/size", base))
+                && let Ok(m) = m_str.trim().parse::<u64>() {
+                    gpu.vram_total = m;
+                }
+        }
+
+        if (gpu.name == "Broadcom GPU" || gpu.name == "VideoCore GPU" || gpu.name == "GPU")
+            && mem.cma_total_bytes > 0 {
+                gpu.cma_mem = true;
+                if gpu.name == "GPU" { gpu.name = "VideoCore GPU".to_string(); }
+            }
+
+        if usage.is_some() {
+            gpu.usage = usage;
+            if gpu.temp.is_none() { gpu.temp = thermal_zone(); }
+            return gpu;
+        }
+    }
+    if gpu.temp.is_none() && !cards.is_empty() { gpu.temp = thermal_zone(); }
+
+    // 2. Adreno / kgsl
+    if let Ok(f) = File::open(&*sys_path("/sys/class/kgsl/kgsl-3d0/gpu_busy_percentage")) {
+        gpu.usage = Some(GpuUsageFile::Percent(f));
+    } else if let Ok(f) = File::open(&*sys_path("/sys/class/kgsl/kgsl-3d0/gpubusy"))
+        && pread_str(&f, &mut buf).and_then(parse_busy_total).is_some_and(|u| u > 0.0) {
+            gpu.usage = Some(GpuUsageFile::BusyTotal(f));
+        }
+    if gpu.usage.is_some() {
+        gpu.name = "Adreno GPU".to_string();
+        gpu.temp = thermal_zone();
+        return gpu;
+    }
+
+    // 3. Generic devfreq
+    let devfreq_dirs = [sys_path("/sys/class/devfreq"), sys_path("/sys/devices/platform/soc/soc:gpu/devfreq")];
+    for dir in devfreq_dirs {
+        let Ok(entries) = fs::read_dir(&*dir) else { continue };
+        for entry in entries.flatten() {
+            let name_str = entry.file_name().to_string_lossy().into_owned();
+            if !(name_str.contains("v3d") || name_str.contains("gpu") || name_str.contains("mali") || name_str.contains("soc:gpu")) {
+                continue;
+            }
+            let Ok(f) = File::open(entry.path().join("load")) else { continue };
+            if pread_str(&f, &mut buf).and_then(parse_devfreq_load).is_none() {
+                continue;
+            }
+            gpu.usage = Some(GpuUsageFile::DevfreqLoad(f));
+            if name_str.contains("v3d") || name_str.contains("soc:gpu") { gpu.name = "VideoCore GPU".to_string(); }
+            else if name_str.contains("mali") { gpu.name = "Mali GPU".to_string(); }
+            if gpu.temp.is_none() { gpu.temp = thermal_zone(); }
+            return gpu;
+        }
+    }
+
+    // 4. Fallback for SoC (Broadcom/VideoCore)
+    if gpu.vram_used.is_none() && !gpu.cma_mem && mem.cma_total_bytes > 0 {
+        gpu.name = "VideoCore GPU".to_string();
+        gpu.cma_mem = true;
+        if gpu.temp.is_none() { gpu.temp = thermal_zone(); }
+    }
+
+    gpu
+}
+
+// One reading from the cached files. None means a file stopped answering,
+// which usually means the device went away; the caller rediscovers.
+#[cfg(target_os = "linux")]
+fn read_cached_gpu(gpu: &SysfsGpu, v3d_stats: &mut Vec<V3dStats>, mem: &MemorySnapshot) -> Option<GpuSnapshot> {
+    let mut buf = [0u8; 4096];
+    let mut g = GpuSnapshot { name: gpu.name.clone(), ..GpuSnapshot::default() };
+
+    let usage = match &gpu.usage {
+        Some(GpuUsageFile::Percent(f)) => Some(parse_percent(pread_str(f, &mut buf)?)?),
+        Some(GpuUsageFile::V3dStats(f)) => v3d_usage(pread_str(f, &mut buf)?, v3d_stats),
+        Some(GpuUsageFile::BusyTotal(f)) => Some(parse_busy_total(pread_str(f, &mut buf)?)?),
+        Some(GpuUsageFile::DevfreqLoad(f)) => Some(parse_devfreq_load(pread_str(f, &mut buf)?)?),
+        None => None,
+    };
+    if let Some(u) = usage {
+        g.usage = u;
+        g.has_usage = true;
+    }
+
+    if let Some(f) = &gpu.temp {
+        g.temp = parse_percent(pread_str(f, &mut buf)?)? / 1000.0;
+        g.has_temp = true;
+    }
+
+    if let Some(f) = &gpu.vram_used {
+        g.mem_used = pread_str(f, &mut buf)?.trim().parse::<u64>().ok()?;
+        g.mem_total = gpu.vram_total;
+        g.has_mem = true;
+    }
+    if gpu.cma_mem && mem.cma_total_bytes > 0 {
+        g.mem_used = mem.cma_used_bytes;
+        g.mem_total = mem.cma_total_bytes;
+        g.has_mem = true;
+    }
+
+    Some(g)
+}
+
+// Sysfs GPU fallback. Discovery runs once and again every
+// GPU_REDISCOVER_INTERVAL or after a read error; in between, a reading is a
+// handful of preads on the files discovery left open.
+#[cfg(target_os = "linux")]
+fn read_sysfs_gpu(s: &mut Sampler, mem: &MemorySnapshot) -> GpuSnapshot {
+    let now = Instant::now();
+    if now.duration_since(s.sysfs_gpu_found) >= GPU_REDISCOVER_INTERVAL {
+        s.sysfs_gpu = None;
+    }
+    for _ in 0..2 {
+        if s.sysfs_gpu.is_none() {
+            s.sysfs_gpu = Some(discover_sysfs_gpu(mem));
+            s.sysfs_gpu_found = now;
+        }
+        if let Some(gpu) = &s.sysfs_gpu
+            && let Some(g) = read_cached_gpu(gpu, &mut s.v3d_stats, mem) {
+                return g;
+            }
+        s.sysfs_gpu = None;
+    }
+    GpuSnapshot::default()
+}
+
+#[cfg_attr(not(target_os = "linux"), allow(unused_variables))]
+fn read_gpu(s: &mut Sampler, mem: &MemorySnapshot, out: &mut Vec<GpuSnapshot>) {
+    out.clear();
+
+    #[cfg(any(target_os = "linux", target_os = "windows"))]
+    {
+        if !s.nvml_tried {
+            s.nvml = Nvml::load();
+            s.nvml_tried = true;
+        }
+        if let Some(nvml) = &s.nvml {
+            nvml.read(out);
+        }
+        if out.is_empty() && !s.nvidia_smi_missing {
+            s.nvidia_smi_missing = !read_nvidia_smi(out);
+        }
+    }
+
+    #[cfg(target_os = "linux")]
+    if out.is_empty() {
+        let g = read_sysfs_gpu(s, mem);
+        if g.has_usage || g.has_mem {
+            out.push(g);
+        }
+    }
+}
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+fn short_gpu_name(name: &str) -> String {
+    name.replace("NVIDIA GeForce ", "").replace("NVIDIA ", "")
+}
+
+#[cfg(target_os = "linux")]
+const NVIDIA_SMI: &str = "/usr/bin/nvidia-smi";
+#[cfg(target_os = "windows")]
+const NVIDIA_SMI: &str = "nvidia-smi";
+
+// Fallback for drivers without a loadable NVML: one CSV line per GPU. Returns
+// false when nvidia-smi is not installed, so the caller can stop forking it.
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+fn read_nvidia_smi(out: &mut Vec<GpuSnapshot>) -> bool {
+    let output = match std::process::Command::new(NVIDIA_SMI)
+        .args(["--query-gpu=name,utilization.gpu,memory.used,memory.total,temperature.gpu", "--format=csv,noheader,nounits"])
+        .output()
+    {
+        Ok(output) => output,
+        Err(e) => return e.kind() != io::ErrorKind::NotFound,
+    };
+    if output.status.success() {
+        parse_nvidia_smi_csv(&String::from_utf8_lossy(&output.stdout), out);
+    }
+    true
+}
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+fn parse_nvidia_smi_csv(text: &str, out: &mut Vec<GpuSnapshot>) {
+    for line in text.lines() {
+        let parts: Vec<&str> = line.split(',').map(|p| p.trim()).collect();
+        if parts.len() >= 5 {
+            let mut g = GpuSnapshot::default();
+            g.name = short_gpu_name(parts[0]);
+            g.usage = parts[1].parse().unwrap_or(0.0);
+            g.has_usage = true;
+            g.mem_used = parts[2].parse::<u64>().unwrap_or(0) * 1024 * 1024;
+            g.has_mem = true;
+            g.mem_total = parts[3].parse::<u64>().unwrap_or(0) * 1024 * 1024;
+            g.temp = parts[4].parse().unwrap_or(-1000.0);
+            g.has_temp = true;
+            out.push(g);
+        }
+    }
+}
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+type NvmlDevice = *mut std::ffi::c_void;
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+#[repr(C)]
+#[derive(Default)]
+struct NvmlUtilization {
+    gpu: u32,
+    memory: u32,
+}
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+#[repr(C)]
+#[derive(Default)]
+struct NvmlMemory {
+    total: u64,
+    free: u64,
+    used: u64,
+}
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+const NVML_SUCCESS: i32 = 0;
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+const NVML_TEMPERATURE_GPU: u32 = 0;
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+const NVML_DEVICE_NAME_BUFFER_SIZE: usize = 96;
+
+// NVML entry points resolved from the driver library at runtime, so utop
+// neither links against nor requires it. Device handles are opened once and
+// queried in-process on every GPU read.
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+struct Nvml {
+    shutdown: unsafe extern "C" fn() -> i32,
+    utilization: unsafe extern "C" fn(NvmlDevice, *mut NvmlUtilization) -> i32,
+    memory: unsafe extern "C" fn(NvmlDevice, *mut NvmlMemory) -> i32,
+    temperature: unsafe extern "C" fn(NvmlDevice, u32, *mut u32) -> i32,
+    devices: Vec<(NvmlDevice, String)>,
+}
+
+// Safety: NVML handles are process-wide and the library is thread-safe; the
+// Sampler that owns this only moves between threads, it is never shared.
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+unsafe impl Send for Nvml {}
+
+#[cfg(target_os = "linux")]
+fn nvml_library() -> Option<*mut std::ffi::c_void> {
+    let lib = unsafe { libc::dlopen(c"libnvidia-ml.so.1".as_ptr(), libc::RTLD_NOW | libc::RTLD_LOCAL) };
+    (!lib.is_null()).then_some(lib)
+}
+
+#[cfg(target_os = "linux")]
+fn nvml_symbol(lib: *mut std::ffi::c_void, name: &CStr) -> Option<*mut std::ffi::c_void> {
+    let sym = unsafe { libc::dlsym(lib, name.as_ptr()) };
+    (!sym.is_null()).then_some(sym)
+}
+
+#[cfg(target_os = "windows")]
+fn nvml_library() -> Option<*mut std::ffi::c_void> {
+    // Current drivers install nvml.dll into System32; older ones only under NVSMI.
+    for path in ["nvml.dll", "C:\\Program Files\\NVIDIA Corporation\\NVSMI\\nvml.dll"] {
+        let wide = win_wstr(path);
+        let lib = unsafe { LoadLibraryW(wide.as_ptr()) };
+        if !lib.is_null() {
+            return Some(lib);
+        }
+    }
+    None
+}
+
+#[cfg(target_os = "windows")]
+fn nvml_symbol(lib: *mut std::ffi::c_void, name: &CStr) -> Option<*mut std::ffi::c_void> {
+    unsafe { GetProcAddress(lib, name.as_ptr() as *const u8) }.map(|f| f as *mut std::ffi::c_void)
+}
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+impl Nvml {
+    fn load() -> Option<Self> {
+        let lib = nvml_library()?;
+        // The library is never unloaded; it lives as long as the process.
+        unsafe {
+            let init = std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn() -> i32>(nvml_symbol(lib, c"nvmlInit_v2")?);
+            let count = std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn(*mut u32) -> i32>(nvml_symbol(lib, c"nvmlDeviceGetCount_v2")?);
+            let by_index = std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn(u32, *mut NvmlDevice) -> i32>(nvml_symbol(lib, c"nvmlDeviceGetHandleByIndex_v2")?);
+            let get_name = std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn(NvmlDevice, *mut std::ffi::c_char, u32) -> i32>(nvml_symbol(lib, c"nvmlDeviceGetName")?);
+            let mut nvml = Nvml {
+                shutdown: std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn() -> i32>(nvml_symbol(lib, c"nvmlShutdown")?),
+                utilization: std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn(NvmlDevice, *mut NvmlUtilization) -> i32>(nvml_symbol(lib, c"nvmlDeviceGetUtilizationRates")?),
+                memory: std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn(NvmlDevice, *mut NvmlMemory) -> i32>(nvml_symbol(lib, c"nvmlDeviceGetMemoryInfo")?),
+                temperature: std::mem::transmute::<*mut std::ffi::c_void, unsafe extern "C" fn(NvmlDevice, u32, *mut u32) -> i32>(nvml_symbol(lib, c"nvmlDeviceGetTemperature")?),
+                devices: Vec::new(),
+            };
+            if init() != NVML_SUCCESS {
+                return None;
+            }
+
+            let mut n = 0_u32;
+            if count(&mut n) != NVML_SUCCESS || n == 0 {
+                return None;
+            }
+            for i in 0..n {
+                let mut dev: NvmlDevice = std::ptr::null_mut();
+                if by_index(i, &mut dev) != NVML_SUCCESS {
+                    continue;
+                }
+                let mut buf = [0 as std::ffi::c_char; NVML_DEVICE_NAME_BUFFER_SIZE];
+                let name = if get_name(dev, buf.as_mut_ptr(), buf.len() as u32) == NVML_SUCCESS {
+                    short_gpu_name(&CStr::from_ptr(buf.as_ptr()).to_string_lossy())
+                } else {
+                    format!("NVIDIA GPU {}", i)
+                };
+                nvml.devices.push((dev, name));
+            }
+            (!nvml.devices.is_empty()).then_some(nvml)
+        }
+    }
+
+    fn read(&self, out: &mut Vec<GpuSnapshot>) {
+        for (dev, name) in &self.devices {
+            let mut g = GpuSnapshot { name: name.clone(), ..GpuSnapshot::default() };
+            let mut util = NvmlUtilization::default();
+            let mut mem = NvmlMemory::default();
+            let mut temp = 0_u32;
+            unsafe {
+                if (self.utilization)(*dev, &mut util) == NVML_SUCCESS {
+                    g.usage = util.gpu as f64;
+                    g.has_usage = true;
+                }
+                if (self.memory)(*dev, &mut mem) == NVML_SUCCESS {
+                    g.mem_used = mem.used;
+                    g.mem_total = mem.total;
+                    g.has_mem = true;
+                }
+                if (self.temperature)(*dev, NVML_TEMPERATURE_GPU, &mut temp) == NVML_SUCCESS {
+                    g.temp = temp as f64;
+                    g.has_temp = true;
+                }
+            }
+            out.push(g);
+        }
+    }
+}
+
+#[cfg(any(target_os = "linux", target_os = "windows"))]
+impl Drop for Nvml {
+    fn drop(&mut self) {
+        unsafe { (self.shutdown)(); }
+    }
+}
+
+// Interface counters in the order rtnl_link_stats64 starts with, so the
+// netlink reader can copy them straight across.
+const NET_RX_PACKETS: usize = 0;
+const NET_TX_PACKETS: usize = 1;
+const NET_RX_BYTES: usize = 2;
+const NET_TX_BYTES: usize = 3;
+const NET_RX_ERRORS: usize = 4;
+const NET_TX_ERRORS: usize = 5;
+const NET_RX_DROPS: usize = 6;
+const NET_TX_DROPS: usize = 7;
+const NET_COUNTERS: usize = 8;
+
+struct IfaceCounters {
+    name: String,
+    loopback: bool,
+    cur: [u64; NET_COUNTERS],
+    prev: [u64; NET_COUNTERS],
+    tick: u32,
+}
+
+// Every interface's counters from this read and the one before. Entries
+// are reused from read to read, so only a new interface allocates.
+#[derive(Default)]
+struct NetTable {
+    ifaces: Vec<IfaceCounters>,
+    tick: u32,
+    // Interfaces come back in the same order, so the next one is usually here.
+    hint: usize,
+}
+
+impl NetTable {
+    fn begin(&mut self) {
+        self.tick = self.tick.wrapping_add(1);
+        self.hint = 0;
+    }
+
+    fn update(&mut self, name: &[u8], loopback: bool, counters: [u64; NET_COUNTERS]) {
+        let i = if self.ifaces.get(self.hint).is_some_and(|f| f.name.as_bytes() == name) {
+            self.hint
+        } else if let Some(i) = self.ifaces.iter().position(|f| f.name.as_bytes() == name) {
+            i
+        } else {
+            // A new interface counts from its first reading.
+            self.ifaces.push(IfaceCounters {
+                name: String::from_utf8_lossy(name).into_owned(),
+                loopback,
+                cur: counters,
+                prev: counters,
+                tick: self.tick,
+            });
+            self.ifaces.len() - 1
+        };
+        let f = &mut self.ifaces[i];
+        f.prev = f.cur;
+        f.cur = counters;
+        f.loopback = loopback;
+        f.tick = self.tick;
+        self.hint = i + 1;
+    }
+
+    // Forget interfaces this read did not see and write the rates out. The
+    // summary is the non-loopback interface with the most bytes overall.
+    fn finish(&mut self, elapsed: f64, out: &mut NetworkSnapshot) {
+        let tick = self.tick;
+        self.ifaces.retain(|f| f.tick == tick);
+        out.ifaces.truncate(self.ifaces.len());
+        out.ifaces.resize_with(self.ifaces.len(), IfaceRates::default);
+        out.iface.clear();
+        out.rx_rate = 0.0;
+        out.tx_rate = 0.0;
+        let mut best_total = 0;
+        for (f, o) in self.ifaces.iter().zip(out.ifaces.iter_mut()) {
+            let rate = |k: usize| f.cur[k].saturating_sub(f.prev[k]) as f64 / elapsed;
+            o.name.clear();
+            o.name.push_str(&f.name);
+            o.rx_rate = rate(NET_RX_BYTES);
+            o.tx_rate = rate(NET_TX_BYTES);
+            o.rx_packets = rate(NET_RX_PACKETS);
+            o.tx_packets = rate(NET_TX_PACKETS);
+            o.drops = rate(NET_RX_DROPS) + rate(NET_TX_DROPS);
+            o.errors = rate(NET_RX_ERRORS) + rate(NET_TX_ERRORS);
+            let total = f.cur[NET_RX_BYTES] + f.cur[NET_TX_BYTES];
+            if !f.loopback && total > best_total {
+                best_total = total;
+                out.iface.clear();
+                out.iface.push_str(&f.name);
+                out.rx_rate = o.rx_rate;
+                out.tx_rate = o.tx_rate;
+            }
+        }
+        if out.iface.is_empty() {
+            out.iface.push('-');
+        }
+        out.ifaces.sort_unstable_by(|a, b| (b.rx_rate + b.tx_rate).total_cmp(&(a.rx_rate + a.tx_rate)).then_with(|| a.name.cmp(&b.name)));
+    }
+}
+
+#[derive(Default)]
+struct NetReader {
+    table: NetTable,
+    // /proc/net/dev kept open and re-read with pread.
+    #[cfg(target_os = "linux")]
+    dev_file: Option<File>,
+    #[cfg(target_os = "linux")]
+    buf: Vec<u8>,
+    #[cfg(target_os = "linux")]
+    netlink: Option<NetlinkStats>,
+}
+
+// Feed every interface in a /proc/net/dev read into the table.
+#[cfg(target_os = "linux")]
+fn parse_net_dev(text: &[u8], table: &mut NetTable) {
+    for line in text.split(|&b| b == b'\n').skip(2) {
+        let Some(colon) = line.iter().position(|&b| b == b':') else { continue; };
+        let name = line[..colon].trim_ascii();
+        // rx: bytes packets errs drop fifo frame compressed multicast,
+        // then tx: bytes packets errs drop.
+        let mut fields = [0_u64; 12];
+        let mut tokens = line[colon + 1..].split(|b| b.is_ascii_whitespace()).filter(|t| !t.is_empty());
+        for f in fields.iter_mut() {
+            *f = tokens.next().and_then(parse_dec).unwrap_or(0);
+        }
+        let mut c = [0_u64; NET_COUNTERS];
+        c[NET_RX_BYTES] = fields[0];
+        c[NET_RX_PACKETS] = fields[1];
+        c[NET_RX_ERRORS] = fields[2];
+        c[NET_RX_DROPS] = fields[3];
+        c[NET_TX_BYTES] = fields[8];
+        c[NET_TX_PACKETS] = fields[9];
+        c[NET_TX_ERRORS] = fields[10];
+        c[NET_TX_DROPS] = fields[11];
+        table.update(name, name == b"lo", c);
+    }
+}
+
+#[cfg(target_os = "linux")]
+fn read_network(net: &mut NetReader, elapsed: f64, out: &mut NetworkSnapshot) {
+    net.table.begin();
+    // A failed dump means /proc/net/dev from then on.
+    let from_netlink = match net.netlink.as_mut() {
+        Some(nl) => {
+            let ok = nl.read(&mut net.table).is_ok();
+            if !ok {
+                net.netlink = None;
+                net.table.begin();
+            }
+            ok
+        }
+        None => false,
+    };
+    if !from_netlink {
+        if net.dev_file.is_none() {
+            net.dev_file = File::open(&*sys_path("/proc/net/dev")).ok();
+        }
+        if let Some(file) = &net.dev_file {
+            if net.buf.is_empty() {
+                net.buf.resize(16 * 1024, 0);
+            }
+            // Grow until one read holds the whole file, as for /proc/stat.
+            while let Ok(n) = file.read_at(&mut net.buf, 0) {
+                if n < net.buf.len() || net.buf.len() >= 16 << 20 {
+                    parse_net_dev(&net.buf[..n], &mut net.table);
+                    break;
+                }
+                let len = net.buf.len() * 2;
+                net.buf.resize(len, 0);
+            }
+        }
+    }
+    net.table.finish(elapsed, out);
+}
+
+// rtnetlink RTM_GETSTATS dumps every interface's rtnl_link_stats64 in one
+// binary reply, with no text to parse. Replies carry only the ifindex; names
+// come from if_indextoname once per new index.
+#[cfg(target_os = "linux")]
+const RTM_NEWSTATS: u16 = 92;
+#[cfg(target_os = "linux")]
+const RTM_GETSTATS: u16 = 94;
+#[cfg(target_os = "linux")]
+const IFLA_STATS_LINK_64: u16 = 1;
+// nlmsghdr, then if_stats_msg { family, pad1, pad2: u16, ifindex, filter_mask }.
+#[cfg(target_os = "linux")]
+const NLMSG_HDR: usize = 16;
+#[cfg(target_os = "linux")]
+const IF_STATS_MSG: usize = 12;
+
+#[cfg(target_os = "linux")]
+struct IfName {
+    index: u32,
+    name: [u8; libc::IF_NAMESIZE],
+    len: usize,
+    // The dump this index was last seen in; indexes can be reused.
+    tick: u32,
+}
+
+#[cfg(target_os = "linux")]
+struct NetlinkStats {
+    fd: std::os::fd::OwnedFd,
+    seq: u32,
+    buf: Vec<u8>,
+    names: Vec<IfName>,
+    tick: u32,
+}
+
+#[cfg(target_os = "linux")]
+impl NetlinkStats {
+    fn open() -> io::Result<Self> {
+        use std::os::fd::FromRawFd as _;
+        let fd = unsafe { libc::socket(libc::AF_NETLINK, libc::SOCK_RAW | libc::SOCK_CLOEXEC, libc::NETLINK_ROUTE) };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let fd = unsafe { std::os::fd::OwnedFd::from_raw_fd(fd) };
+        // Never wait on the kernel for more than a second.
+        let tv = libc::timeval { tv_sec: 1, tv_usec: 0 };
+        unsafe {
+            libc::setsockopt(fd.as_raw_fd(), libc::SOL_SOCKET, libc::SO_RCVTIMEO, &tv as *const _ as *const libc::c_void, std::mem::size_of::<libc::timeval>() as libc::socklen_t);
+        }
+        let mut nl = Self { fd, seq: 0, buf: vec![0; 64 * 1024], names: Vec::new(), tick: 0 };
+        // One dump up front so an unsupported kernel is caught here.
+        nl.read(&mut NetTable::default())?;
+        Ok(nl)
+    }
+
+    fn name(&mut self, index: u32) -> Option<&[u8]> {
+        let i = match self.names.iter().position(|e| e.index == index) {
+            Some(i) => i,
+            None => {
+                let mut name = [0u8; libc::IF_NAMESIZE];
+                if unsafe { libc::if_indextoname(index, name.as_mut_ptr() as *mut libc::c_char) }.is_null() {
+                    return None;
+                }
+                let len = name.iter().position(|&b| b == 0).unwrap_or(name.len());
+                self.names.push(IfName { index, name, len, tick: self.tick });
+                self.names.len() - 1
+            }
+        };
+        let e = &mut self.names[i];
+        e.tick = self.tick;
+        Some(&e.name[..e.len])
+    }
+
+    fn read(&mut self, table: &mut NetTable) -> io::Result<()> {
+        self.seq = self.seq.wrapping_add(1);
+        self.tick = self.tick.wrapping_add(1);
+        let mut req = [0u8; NLMSG_HDR + IF_STATS_MSG];
+        req[0..4].copy_from_slice(&((NLMSG_HDR + IF_STATS_MSG) as u32).to_ne_bytes());
+        req[4..6].copy_from_slice(&RTM_GETSTATS.to_ne_bytes());
+        req[6..8].copy_from_slice(&((libc::NLM_F_REQUEST | libc::NLM_F_DUMP) as u16).to_ne_bytes());
+        req[8..12].copy_from_slice(&self.seq.to_ne_bytes());
+        req[NLMSG_HDR] = libc::AF_UNSPEC as u8;
+        req[NLMSG_HDR + 8..].copy_from_slice(&(1u32 << (IFLA_STATS_LINK_64 - 1)).to_ne_bytes());
+        if unsafe { libc::send(self.fd.as_raw_fd(), req.as_ptr() as *const libc::c_void, req.len(), 0) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        let u16_at = |b: &[u8], at: usize| u16::from_ne_bytes([b[at], b[at + 1]]);
+        let u32_at = |b: &[u8], at: usize| u32::from_ne_bytes(b[at..at + 4].try_into().unwrap());
+        loop {
+            let n = unsafe { libc::recv(self.fd.as_raw_fd(), self.buf.as_mut_ptr() as *mut libc::c_void, self.buf.len(), 0) };
+            if n < 0 {
+                return Err(io::Error::last_os_error());
+            }
+            let mut at = 0;
+            let n = n as usize;
+            while at + NLMSG_HDR <= n {
+                let len = u32_at(&self.buf, at) as usize;
+                let kind = u16_at(&self.buf, at + 4);
+                if len < NLMSG_HDR || at + len > n {
+                    return Err(io::Error::from(io::ErrorKind::InvalidData));
+                }
+                if u32_at(&self.buf, at + 8) == self.seq {
+                    match kind {
+                        k if k == libc::NLMSG_DONE as u16 => {
+                            let tick = self.tick;
+                            self.names.retain(|e| e.tick == tick);
+                            return Ok(());
+                        }
+                        k if k == libc::NLMSG_ERROR as u16 => {
+                            let errno = if len >= NLMSG_HDR + 4 { -(u32_at(&self.buf, at + NLMSG_HDR) as i32) } else { libc::EINVAL };
+                            return Err(io::Error::from_raw_os_error(errno));
+                        }
+                        RTM_NEWSTATS if len >= NLMSG_HDR + IF_STATS_MSG => {
+                            let index = u32_at(&self.buf, at + NLMSG_HDR + 4);
+                            let mut a = at + NLMSG_HDR + IF_STATS_MSG;
+                            while a + 4 <= at + len {
+                                let (alen, atype) = (u16_at(&self.buf, a) as usize, u16_at(&self.buf, a + 2));
+                                if alen < 4 || a + alen > at + len { break; }
+                                if atype == IFLA_STATS_LINK_64 && alen >= 4 + NET_COUNTERS * 8 {
+                                    let mut c = [0_u64; NET_COUNTERS];
+                                    for (k, v) in c.iter_mut().enumerate() {
+                                        *v = u64::from_ne_bytes(self.buf[a + 4 + k * 8..a + 12 + k * 8].try_into().unwrap());
+                                    }
+                                    if let Some(name) = self.name(index) {
+                                        table.update(name, name == b"lo", c);
+                                    }
+                                }
+                                a += alen.next_multiple_of(4);
+                            }
+                        }
+                        _ => {}
+                    }
+                }
+                at += len.next_multiple_of(4);
+            }
+        }
+    }
+}
+
+#[cfg(target_os = "macos")]
+fn read_network(net: &mut NetReader, elapsed: f64, out: &mut NetworkSnapshot) {
+    net.table.begin();
+    unsafe {
+        let mut addrs: *mut libc::ifaddrs = std::ptr::null_mut();
+        if libc::getifaddrs(&mut addrs) == 0 {
+            let mut p = addrs;
+            while !p.is_null() {
+                let ifa = &*p;
+                if !ifa.ifa_addr.is_null()
+                    && (*ifa.ifa_addr).sa_family as i32 == libc::AF_LINK
+                    && !ifa.ifa_data.is_null()
+                {
+                    let data = &*(ifa.ifa_data as *const libc::if_data);
+                    let mut c = [0_u64; NET_COUNTERS];
+                    c[NET_RX_BYTES] = data.ifi_ibytes as u64;
+                    c[NET_TX_BYTES] = data.ifi_obytes as u64;
+                    c[NET_RX_PACKETS] = data.ifi_ipackets as u64;
+                    c[NET_TX_PACKETS] = data.ifi_opackets as u64;
+                    c[NET_RX_ERRORS] = data.ifi_ierrors as u64;
+                    c[NET_TX_ERRORS] = data.ifi_oerrors as u64;
+                    c[NET_RX_DROPS] = data.ifi_iqdrops as u64;
+                    let loopback = ifa.ifa_flags & libc::IFF_LOOPBACK as u32 != 0;
+                    net.table.update(CStr::from_ptr(ifa.ifa_name).to_bytes(), loopback, c);
+                }
+                p = ifa.ifa_next;
+            }
+            libc::freeifaddrs(addrs);
+        }
+    }
+    net.table.finish(elapsed, out);
+}
+
+#[cfg(target_os = "windows")]
+fn read_network(net: &mut NetReader, elapsed: f64, out: &mut NetworkSnapshot) {
+    net.table.begin();
+    unsafe {
+        let mut table: *mut MIB_IF_TABLE2 = std::ptr::null_mut();
+        if GetIfTable2(&mut table) == 0 {
+            let entries = (*table).NumEntries as usize;
+            let rows = std::slice::from_raw_parts((*table).Table.as_ptr(), entries);
+            for row in rows {
+                let name = String::from_utf16_lossy(&row.Description);
+                let mut c = [0_u64; NET_COUNTERS];
+                c[NET_RX_BYTES] = row.InOctets;
+                c[NET_TX_BYTES] = row.OutOctets;
+                c[NET_RX_PACKETS] = row.InUcastPkts + row.InNUcastPkts;
+                c[NET_TX_PACKETS] = row.OutUcastPkts + row.OutNUcastPkts;
+                c[NET_RX_ERRORS] = row.InErrors;
+                c[NET_TX_ERRORS] = row.OutErrors;
+                c[NET_RX_DROPS] = row.InDiscards;
+                c[NET_TX_DROPS] = row.OutDiscards;
+                net.table.update(name.trim_end_matches('\0').as_bytes(), false, c);
+            }
+            FreeMibTable(table as *mut _);
+        }
+    }
+    net.table.finish(elapsed, out);
+}
+
+// One statvfs on a dead NFS server or a wedged FUSE daemon can block for
+// minutes, so mounts are stat'ed on a worker thread. A stat that outlives
+// STAT_TIMEOUT leaves its thread behind and the rest of the queue moves to a
+// fresh one; a pass waits at most STORAGE_WAIT before showing what it has.
+#[cfg(target_os = "linux")]
+const STAT_TIMEOUT: Duration = Duration::from_millis(100);
+#[cfg(target_os = "linux")]
+const STORAGE_WAIT: Duration = Duration::from_millis(250);
+
+// (mount point, (used, total) bytes, or None if it could not be stat'ed).
+#[cfg(target_os = "linux")]
+type StatResult = (Arc<str>, Option<(u64, u64)>);
+
+#[cfg(target_os = "linux")]
+fn statvfs_usage(mount_point: &str) -> Option<(u64, u64)> {
+    let path = std::ffi::CString::new(mount_point).ok()?;
+    let mut stat: libc::statvfs = unsafe { std::mem::zeroed() };
+    if unsafe { libc::statvfs(path.as_ptr(), &mut stat) } != 0 {
+        return None;
+    }
+    let frsize = if stat.f_frsize > 0 { stat.f_frsize as u64 } else { stat.f_bsize as u64 };
+    let total = stat.f_blocks as u64 * frsize;
+    let free = stat.f_bfree as u64 * frsize;
+    (total > 0).then(|| (total.saturating_sub(free), total))
+}
+
+// The /dev mounts in a mounts file, as (mount point, device). The first
+// entry for a mount point wins, e.g. when a partition is mounted again on top.
+#[cfg(target_os = "linux")]
+fn parse_mounts(text: &str, out: &mut Vec<(Arc<str>, String)>) {
+    out.clear();
+    let mut seen = HashSet::new();
+    for line in text.lines() {
+        let mut parts = line.split_whitespace();
+        let (Some(device), Some(mount_point), Some(_fs_type)) = (parts.next(), parts.next(), parts.next()) else { continue; };
+        if !device.starts_with("/dev/") || !seen.insert(mount_point) { continue; }
+        out.push((Arc::from(mount_point), device.to_string()));
+    }
+}
+
+#[cfg(target_os = "linux")]
+struct MountUsage {
+    used: u64,
+    total: u64,
+    // The pass it was read in.
+    pass: u64,
+}
+
+#[cfg(target_os = "linux")]
+struct StorageWorker {
+    stat: fn(&str) -> Option<(u64, u64)>,
+    jobs: Option<mpsc::Sender<Arc<str>>>,
+    // Set when the current thread is given up on, so that it stops taking
+    // jobs from its channel once its stuck stat returns.
+    abandoned: Arc<AtomicBool>,
+    results_tx: mpsc::Sender<StatResult>,
+    results: mpsc::Receiver<StatResult>,
+    // Sent to the current thread and not answered yet, oldest first; it is
+    // on the front one.
+    queue: VecDeque<Arc<str>>,
+    queued: HashSet<Arc<str>>,
+    front_since: Instant,
+    // Mounts whose stat timed out; not retried until that stat returns.
+    hung: HashSet<Arc<str>>,
+    known: HashMap<Arc<str>, MountUsage>,
+    pass: u64,
+    mounts: Vec<(Arc<str>, String)>,
+    // Kept open to poll for POLLPRI, which flags a changed mount table.
+    mounts_file: Option<File>,
+}
+
+#[cfg(target_os = "linux")]
+impl StorageWorker {
+    fn new(stat: fn(&str) -> Option<(u64, u64)>) -> Self {
+        let (results_tx, results) = mpsc::channel();
+        Self {
+            stat,
+            jobs: None,
+            abandoned: Arc::new(AtomicBool::new(false)),
+            results_tx,
+            results,
+            queue: VecDeque::new(),
+            queued: HashSet::new(),
+            front_since: Instant::now(),
+            hung: HashSet::new(),
+            known: HashMap::new(),
+            pass: 0,
+            mounts: Vec::new(),
+            mounts_file: None,
+        }
+    }
+
+    fn spawn(&mut self) {
+        let (tx, rx) = mpsc::channel::<Arc<str>>();
+        let (results, stat) = (self.results_tx.clone(), self.stat);
+        let abandoned = Arc::new(AtomicBool::new(false));
+        self.abandoned = abandoned.clone();
+        let spawned = std::thread::Builder::new()
+            .name("utop-storage".to_string())
+            .spawn(move || {
+                for mount_point in rx {
+                    if abandoned.load(AtomicOrdering::Relaxed) { break; }
+                    let usage = stat(&mount_point);
+                    if results.send((mount_point, usage)).is_err() { break; }
+                }
+            });
+        self.jobs = spawned.is_ok().then_some(tx);
+    }
+
+    fn send(&mut self, mount_point: Arc<str>) {
+        if self.jobs.is_none() {
+            self.spawn();
+        }
+        let Some(jobs) = &self.jobs else { return; };
+        if jobs.send(mount_point.clone()).is_ok() {
+            if self.queue.is_empty() {
+                self.front_since = Instant::now();
+            }
+            self.queue.push_back(mount_point.clone());
+            self.queued.insert(mount_point);
+        }
+    }
+
+    fn receive(&mut self, (mount_point, usage): StatResult) {
+        self.hung.remove(&mount_point);
+        if self.queued.remove(&mount_point)
+            && let Some(i) = self.queue.iter().position(|m| *m == mount_point) {
+                self.queue.remove(i);
+                if i == 0 {
+                    self.front_since = Instant::now();
+                }
+            }
+        match usage {
+            Some((used, total)) => { self.known.insert(mount_point, MountUsage { used, total, pass: self.pass }); }
+            None => { self.known.remove(&mount_point); }
+        }
+    }
+
+    // The worker is stuck on the front mount: leave the thread to it and
+    // requeue everything else it was sent on a new one. The old thread
+    // answers for the front mount whenever its stat returns, then exits
+    // without running the jobs still in its channel.
+    fn abandon_front(&mut self) {
+        let Some(mount_point) = self.queue.pop_front() else { return; };
+        self.queued.remove(&mount_point);
+        self.hung.insert(mount_point);
+        self.abandoned.store(true, AtomicOrdering::Relaxed);
+        self.jobs = None;
+        let rest: Vec<_> = self.queue.drain(..).collect();
+        self.queued.clear();
+        for m in rest {
+            self.send(m);
+        }
+    }
+
+    fn refresh_mounts(&mut self) {
+        let changed = match &self.mounts_file {
+            Some(f) => {
+                let mut pfd = libc::pollfd { fd: f.as_raw_fd(), events: libc::POLLPRI, revents: 0 };
+                (unsafe { libc::poll(&mut pfd, 1, 0) }) > 0 && pfd.revents & (libc::POLLPRI | libc::POLLERR) != 0
+            }
+            None => {
+                self.mounts_file = File::open("/proc/self/mounts").ok();
+                true
+            }
+        };
+        if !changed { return; }
+        let Ok(text) = fs::read_to_string("/proc/self/mounts") else { return; };
+        parse_mounts(&text, &mut self.mounts);
+        let live: HashSet<&str> = self.mounts.iter().map(|(m, _)| &**m).collect();
+        self.known.retain(|m, _| live.contains(&**m));
+        self.hung.retain(|m| live.contains(&**m));
+    }
+
+    fn read(&mut self, out: &mut Vec<StorageSnapshot>) {
+        self.refresh_mounts();
+        self.collect(out);
+    }
+
+    // Stat every mount not already in flight and wait for the answers, within
+    // the time limits; mounts still out keep their last values, marked stale.
+    fn collect(&mut self, out: &mut Vec<StorageSnapshot>) {
+        self.pass += 1;
+        while let Ok(result) = self.results.try_recv() {
+            self.receive(result);
+        }
+        for i in 0..self.mounts.len() {
+            let m = &self.mounts[i].0;
+            if !self.queued.contains(m) && !self.hung.contains(m) {
+                self.send(m.clone());
+            }
+        }
+        let deadline = Instant::now() + STORAGE_WAIT;
+        while !self.queue.is_empty() {
+            let now = Instant::now();
+            if now >= deadline { break; }
+            let front_deadline = self.front_since + STAT_TIMEOUT;
+            if now >= front_deadline {
+                self.abandon_front();
+                continue;
+            }
+            match self.results.recv_timeout(front_deadline.min(deadline) - now) {
+                Ok(result) => self.receive(result),
+                Err(mpsc::RecvTimeoutError::Timeout) => {}
+                Err(mpsc::RecvTimeoutError::Disconnected) => break,
+            }
+        }
+
+        out.clear();
+        for (m, device) in &self.mounts {
+            let Some(u) = self.known.get(m) else { continue; };
+            out.push(StorageSnapshot {
+                mount_point: m.to_string(),
+                device: device.clone(),
+                used_bytes: u.used,
+                total_bytes: u.total,
+                stale: u.pass != self.pass,
+                read_rate: f64::NAN,
+                write_rate: f64::NAN,
+            });
+        }
+        // Sort by total size (descending), ensuring / is always first
+        out.sort_by(|a, b| {
+            if a.mount_point == "/" { std::cmp::Ordering::Less }
+            else if b.mount_point == "/" { std::cmp::Ordering::Greater }
+            else {
+                b.total_bytes.cmp(&a.total_bytes)
+                    .then_with(|| a.mount_point.cmp(&b.mount_point))
+            }
+        });
+    }
+}
+
+#[cfg(target_os = "macos")]
+fn read_storage() -> Vec<StorageSnapshot> {
+    let mut snapshots = Vec::new();
+    unsafe {
+        let count = libc::getfsstat(std::ptr::null_mut(), 0, libc::MNT_NOWAIT);
+        if count <= 0 {
+            return snapshots;
+        }
+
+        let mut mounts = vec![std::mem::zeroed::<libc::statfs>(); count as usize];
+        let mut seen = HashSet::new();
+        let bytes = (mounts.len() * std::mem::size_of::<libc::statfs>()) as libc::c_int;
+        let actual = libc::getfsstat(mounts.as_mut_ptr(), bytes, libc::MNT_NOWAIT);
+        if actual <= 0 {
+            return snapshots;
+        }
+
+        for mount in mounts.iter().take(actual as usize) {
+            let device = c_char_array_to_string(&mount.f_mntfromname);
+            if !device.starts_with("/dev/") { continue; }
+            let mount_point = c_char_array_to_string(&mount.f_mntonname);
+            if !seen.insert(mount_point.clone()) { continue; }
+
+            let total = mount.f_blocks.saturating_mul(mount.f_bsize as u64);
+            let free = mount.f_bfree.saturating_mul(mount.f_bsize as u64);
+            let used = total.saturating_sub(free);
+            if total > 0 {
+                snapshots.push(StorageSnapshot {
+                    mount_point,
+                    device,
+                    used_bytes: used,
+                    total_bytes: total,
+                    stale: false,
+                    read_rate: f64::NAN,
+                    write_rate: f64::NAN,
+                });
+            }
+        }
+    }
+
+    snapshots.sort_by(|a, b| {
+        if a.mount_point == "/" { std::cmp::Ordering::Less }
+        else if b.mount_point == "/" { std::cmp::Ordering::Greater }
+        else {
+            b.total_bytes.cmp(&a.total_bytes)
+                .then_with(|| a.mount_point.cmp(&b.mount_point))
+        }
+    });
+    snapshots
+}
+
+#[cfg(target_os = "windows")]
+fn read_storage() -> Vec<StorageSnapshot> {
+    let mut snapshots = Vec::new();
+    unsafe {
+        let mut buf = [0u16; 512];
+        if GetLogicalDriveStringsW(buf.len() as u32, buf.as_mut_ptr()) == 0 {
+            return snapshots;
+        }
+        let mut i = 0;
+        while i < buf.len() && buf[i] != 0 {
+            let end = i + buf[i..].iter().position(|&c| c == 0).unwrap_or(buf.len() - i);
+            let root = String::from_utf16_lossy(&buf[i..end]);
+            i = end + 1;
+            let root_w = root.encode_utf16().chain(std::iter::once(0)).collect::<Vec<_>>();
+            let mut free_bytes: u64 = 0;
+            let mut total_bytes: u64 = 0;
+            let mut total_free: u64 = 0;
+            if GetDiskFreeSpaceExW(root_w.as_ptr(), &mut free_bytes, &mut total_bytes, &mut total_free) != 0 && total_bytes > 0 {
+                let used = total_bytes.saturating_sub(free_bytes);
+                let device = root.trim_end_matches('\\').to_string();
+                snapshots.push(StorageSnapshot {
+                    mount_point: root,
+                    device,
+                    used_bytes: used,
+                    total_bytes,
+                    stale: false,
+                    read_rate: f64::NAN,
+                    write_rate: f64::NAN,
+                });
+            }
+        }
+    }
+    snapshots.sort_by(|a, b| b.total_bytes.cmp(&a.total_bytes));
+    snapshots
+}
+
+// Collects one frame into `out` with every collector, due or not. Only the
+// first `sort_rows` processes are guaranteed to be in order.
+fn sample(s: &mut Sampler, sort: SortMode, sort_rows: usize, out: &mut Snapshot) {
+    sample_due(s, true, sort, sort_rows, ViewNeeds::default(), out);
+}
+
+// Readings only some views show, and so only collected while they are up.
+#[derive(Clone, Copy, Default)]
+struct ViewNeeds<'a> {
+    tree: bool,
+    cgroups: bool,
+    // Leading rows that show I/O rates, 0 without the I/O columns. Sorting
+    // by I/O reads every process.
+    io_rows: usize,
+    // With a filter up, the rows that show them instead of the leading ones.
+    io_pids: &'a [i32],
+    // The process whose threads the thread view shows.
+    threads: Option<i32>,
+}
+
+// Runs the collectors that are due, or all of them when `force` is set, and
+// fills `out` with the latest readings of each, plus whatever `needs` asks
+// for. On-demand collectors run only when needed. Returns which ones ran.
+fn sample_due(s: &mut Sampler, force: bool, sort: SortMode, sort_rows: usize, needs: ViewNeeds<'_>, out: &mut Snapshot) -> [bool; COLLECTORS.len()] {
+    let now = Instant::now();
+    s.schedule.enable(Collector::Cgroup, needs.cgroups, now);
+    s.schedule.enable(Collector::Threads, needs.threads.is_some(), now);
+    if needs.threads.is_none() && s.threads.pid >= 0 {
+        s.threads.close();
+    }
+    let mut due = COLLECTORS.map(|c| !s.schedule.off[c as usize] && (force || s.schedule.due(c, now)));
+    due[Collector::Cpu as usize] |= due[Collector::Procs as usize];
+    let mut latest = std::mem::take(&mut s.latest);
+    let mut cpu_total = 0;
+
+    if due[Collector::Cpu as usize] {
+        let t = s.profile.start();
+        s.schedule.start(Collector::Cpu, now);
+        std::mem::swap(&mut s.core_ticks, &mut s.prev_core_ticks);
+        let cur_cpu = read_cpu_times(&mut s.cpu_stat, &mut s.core_ticks);
+        core_busy(&s.prev_core_ticks, &s.core_ticks, &mut latest.cores);
+        cpu_total = cur_cpu.total();
+        let total_delta = cpu_total.saturating_sub(s.prev_cpu.total());
+        let idle_delta = (cur_cpu.idle + cur_cpu.iowait).saturating_sub(s.prev_cpu.idle + s.prev_cpu.iowait);
+        latest.cpu = if total_delta > 0 { (total_delta - idle_delta) as f64 * 100.0 / total_delta as f64 } else { 0.0 };
+        latest.seq += 1;
+        s.prev_cpu = cur_cpu;
+        let took = s.profile.finish(Collector::Cpu as usize, t, 0);
+        s.schedule.finish(Collector::Cpu, now, took);
+    }
+    if due[Collector::Mem as usize] {
+        let t = s.profile.start();
+        s.schedule.start(Collector::Mem, now);
+        latest.mem = read_memory();
+        let took = s.profile.finish(Collector::Mem as usize, t, 0);
+        s.schedule.finish(Collector::Mem, now, took);
+    }
+    if due[Collector::Net as usize] {
+        let t = s.profile.start();
+        let elapsed = s.schedule.start(Collector::Net, now);
+        read_network(&mut s.net, elapsed, &mut latest.net);
+        let took = s.profile.finish(Collector::Net as usize, t, 0);
+        s.schedule.finish(Collector::Net, now, took);
+    }
+    if due[Collector::Gpu as usize] {
+        let t = s.profile.start();
+        s.schedule.start(Collector::Gpu, now);
+        read_gpu(s, &latest.mem, &mut latest.gpus);
+        let took = s.profile.finish(Collector::Gpu as usize, t, 0);
+        s.schedule.finish(Collector::Gpu, now, took);
+    }
+    if due[Collector::Storage as usize] {
+        let t = s.profile.start();
+        s.schedule.start(Collector::Storage, now);
+        #[cfg(target_os = "linux")]
+        s.storage.read(&mut latest.storage);
+        #[cfg(not(target_os = "linux"))]
+        { latest.storage = read_storage(); }
+        let took = s.profile.finish(Collector::Storage as usize, t, 0);
+        s.schedule.finish(Collector::Storage, now, took);
+    }
+    if due[Collector::DiskIo as usize] {
+        let t = s.profile.start();
+        let elapsed = s.schedule.start(Collector::DiskIo, now);
+        #[cfg(target_os = "linux")]
+        s.disks.read(elapsed);
+        #[cfg(not(target_os = "linux"))]
+        let _ = elapsed;
+        let took = s.profile.finish(Collector::DiskIo as usize, t, 0);
+        s.schedule.finish(Collector::DiskIo, now, took);
+    }
+    // Storage replaces the DSK entries; throughput goes back onto them.
+    #[cfg(target_os = "linux")]
+    if due[Collector::Storage as usize] || due[Collector::DiskIo as usize] {
+        s.disks.apply(&mut latest.storage);
+    }
+    if due[Collector::Temp as usize] {
+        let t = s.profile.start();
+        s.schedule.start(Collector::Temp, now);
+        latest.cpu_temp = read_cpu_temp(&mut s.cpu_temp_path);
+        let took = s.profile.finish(Collector::Temp as usize, t, 0);
+        s.schedule.finish(Collector::Temp, now, took);
+    }
+    if due[Collector::Freq as usize] {
+        let t = s.profile.start();
+        s.schedule.start(Collector::Freq, now);
+        latest.cpu_freq = read_cpu_freq(&mut s.cpu_freq_paths);
+        let took = s.profile.finish(Collector::Freq as usize, t, 0);
+        s.schedule.finish(Collector::Freq, now, took);
+    }
+    out.copy_system_from(&latest);
+    s.latest = latest;
+    if due[Collector::Procs as usize] {
+        let t = s.profile.start();
+        let elapsed = s.schedule.start(Collector::Procs, now);
+        sample_procs(s, cpu_total, elapsed);
+        s.procs_elapsed = elapsed;
+        if needs.io_rows > 0 && sort == SortMode::Io {
+            for i in 0..s.procs.pid.len() {
+                if s.procs.read[i] == s.procs.tick { s.procs.read_io(i, elapsed); }
+            }
+        } else if needs.io_rows > 0 {
+            for pid in needs.io_pids {
+                let Some(&slot) = s.procs.slots.get(pid) else { continue; };
+                if s.procs.read[slot as usize] == s.procs.tick { s.procs.read_io(slot as usize, elapsed); }
+            }
+        }
+        let took = s.profile.finish(Collector::Procs as usize, t, 0);
+        s.schedule.finish(Collector::Procs, now, took);
+    }
+    if due[Collector::Cgroup as usize] {
+        let t = s.profile.start();
+        let elapsed = s.schedule.start(Collector::Cgroup, now);
+        #[cfg(target_os = "linux")]
+        {
+            s.cgroups.read(elapsed, s.core_ticks.len() / CPU_FIELDS);
+            s.cgroups.map_pids(&mut s.procs);
+        }
+        #[cfg(not(target_os = "linux"))]
+        let _ = elapsed;
+        let took = s.profile.finish(Collector::Cgroup as usize, t, 0);
+        s.schedule.finish(Collector::Cgroup, now, took);
+    }
+    if due[Collector::Threads as usize] && let Some(pid) = needs.threads {
+        let t = s.profile.start();
+        let elapsed = s.schedule.start(Collector::Threads, now);
+        #[cfg(target_os = "linux")]
+        let cpus = s.core_ticks.len() / CPU_FIELDS;
+        #[cfg(not(target_os = "linux"))]
+        let cpus = s.logical_cpus as usize;
+        s.threads.read(pid, elapsed, cpus);
+        let took = s.profile.finish(Collector::Threads as usize, t, 0);
+        s.schedule.finish(Collector::Threads, now, took);
+    }
+
+    // Between reads the table still holds the last one, so a new sort order
+    // never has to wait for the next pass over the processes.
+    let t = s.profile.start();
+    out.procs.clear();
+    s.procs.emit(&mut out.procs);
+    for p in out.procs.iter_mut() {
+        p.sort_key = sort_key(p, sort);
+    }
+    out.sorted = 0;
+    sort_prefix(&mut out.procs, &mut out.sorted, sort_rows);
+    // Otherwise only the rows on screen read their I/O: the ones the view
+    // named, or without a filter the leading ones, once the sort has said
+    // which those are.
+    if due[Collector::Procs as usize] && needs.io_rows > 0 && needs.io_pids.is_empty() && sort != SortMode::Io {
+        for p in out.procs.iter_mut().take(needs.io_rows.min(out.sorted)) {
+            let Some(&slot) = s.procs.slots.get(&p.pid) else { continue; };
+            s.procs.read_io(slot as usize, s.procs_elapsed);
+            let rate = s.procs.io_rate[slot as usize];
+            (p.read_rate, p.write_rate) = (rate[0], rate[1]);
+        }
+    }
+    out.tree.clear();
+    if needs.tree {
+        s.procs.build_tree(&out.procs, sort, &mut out.tree);
+    }
+    out.cgroups.clear();
+    #[cfg(target_os = "linux")]
+    if needs.cgroups {
+        s.cgroups.emit(sort, &mut out.cgroups);
+    }
+    out.threads.clear();
+    if needs.threads.is_some_and(|pid| pid == s.threads.pid) {
+        s.threads.emit(&mut out.threads);
+    }
+    s.profile.finish(STAGE_SORT, t, 0);
+    due
+}
+
+// Read every process into the table. Linux scales CPU% by `cpu_total`, the
+// tick count just read; elsewhere by `elapsed`, seconds since the last call.
+#[allow(unused_variables)]
+fn sample_procs(s: &mut Sampler, cpu_total: u64, elapsed: f64) {
+    s.procs.begin();
+    // Ticks a fully busy machine accrues over the interval.
+    #[cfg(target_os = "linux")]
+    let denominator = cpu_total.saturating_sub(std::mem::replace(&mut s.procs_prev_total, cpu_total)) as f64;
+    #[cfg(target_os = "macos")]
+    let denominator = elapsed * s.logical_cpus.max(1) as f64 * 1_000_000_000.0;
+    #[cfg(target_os = "windows")]
+    let denominator = elapsed * s.logical_cpus.max(1) as f64 * 10_000_000.0;
+
+    #[cfg(target_os = "linux")]
+    let from_bpf = match s.task_iter.as_mut() {
+        Some(it) => {
+            for slab in s.slabs.iter_mut() {
+                slab.readings.clear();
+                slab.names.clear();
+            }
+            let ok = it.sample(&mut s.procs, s.page_size as u64, &mut s.slabs[0]).is_ok();
+            // A failed pass (the program was unloaded, say) means /proc from
+            // now on; this tick's partial readings are dropped.
+            if !ok {
+                s.task_iter = None;
+                s.slabs[0].readings.clear();
+                s.slabs[0].names.clear();
+            }
+            ok
+        }
+        None => false,
+    };
+    #[cfg(target_os = "linux")]
+    if !from_bpf
+        && let Some(pd) = s.proc_dir.as_mut()
+        && pd.scan() {
+            for entry in pd.entries.iter_mut() {
+                entry.slot = s.procs.claim(entry.pid);
+            }
+            let dir_fd = pd.dir.as_raw_fd();
+            let page_size = s.page_size as u64;
+            let table = &s.procs;
+            run_chunked(&mut pd.entries, &mut s.slabs, |entries, slab| {
+                let mut buf = [0u8; 1024];
+                for entry in entries {
+                    let Some(n) = read_stat(dir_fd, entry, &mut buf) else { continue; };
+                    let Some(f) = parse_proc_stat(&buf[..n]) else { continue; };
+                    // Re-intern only when comm changed (exec, prctl(PR_SET_NAME)).
+                    if table.name(entry.slot).is_none_or(|name| name.as_bytes() != f.comm) {
+                        slab.names.push((entry.slot, Arc::from(String::from_utf8_lossy(f.comm).as_ref())));
+                    }
+                    slab.readings.push(ProcReading {
+                        slot: entry.slot,
+                        ticks: f.utime + f.stime,
+                        rss: f.rss * page_size,
+                        threads: f.threads,
+                        ppid: f.ppid,
+                        reset: std::mem::take(&mut entry.recycled),
+                    });
+                }
+            });
+        }
+
+    #[cfg(target_os = "macos")]
+    {
+        let initial_bytes = unsafe { libc::proc_listallpids(std::ptr::null_mut(), 0) };
+        if initial_bytes > 0 {
+            let initial_count = initial_bytes as usize / std::mem::size_of::<i32>();
+            let mut pids = vec![0_i32; initial_count + 64];
+            let bytes = (pids.len() * std::mem::size_of::<i32>()) as libc::c_int;
+            let actual_bytes = unsafe {
+                libc::proc_listallpids(pids.as_mut_ptr() as *mut libc::c_void, bytes)
+            };
+
+            if actual_bytes > 0 {
+                let actual_count = actual_bytes as usize / std::mem::size_of::<i32>();
+                s.listed.clear();
+                for &pid in &pids[..actual_count] {
+                    if pid > 0 {
+                        s.listed.push((pid, s.procs.claim(pid)));
+                    }
+                }
+                let table = &s.procs;
+                run_chunked(&mut s.listed, &mut s.slabs, |procs, slab| {
+                    for &mut (pid, slot) in procs {
+                        // Only the full info has the parent; known PIDs keep theirs.
+                        let (total_ticks, resident_size, threadnum, ppid) = if table.name(slot).is_some() {
+                            let mut info = unsafe { std::mem::zeroed::<libc::proc_taskinfo>() };
+                            let info_size = std::mem::size_of::<libc::proc_taskinfo>() as libc::c_int;
+                            let read = unsafe {
+                                libc::proc_pidinfo(
+                                    pid,
+                                    libc::PROC_PIDTASKINFO,
+                                    0,
+                                    &mut info as *mut _ as *mut libc::c_void,
+                                    info_size,
+                                )
+                            };
+                            if read < info_size { continue; }
+                            (info.pti_total_user.saturating_add(info.pti_total_system), info.pti_resident_size, info.pti_threadnum, -1)
+                        } else {
+                            let mut info = unsafe { std::mem::zeroed::<libc::proc_taskallinfo>() };
+                            let info_size = std::mem::size_of::<libc::proc_taskallinfo>() as libc::c_int;
+                            let read = unsafe {
+                                libc::proc_pidinfo(
+                                    pid,
+                                    libc::PROC_PIDTASKALLINFO,
+                                    0,
+                                    &mut info as *mut _ as *mut libc::c_void,
+                                    info_size,
+                                )
+                            };
+                            if read < info_size { continue; }
+                            let mut name = c_char_array_to_string(&info.pbsd.pbi_name);
+                            if name.is_empty() {
+                                name = c_char_array_to_string(&info.pbsd.pbi_comm);
+                            }
+                            if name.is_empty() {
+                                name = format!("[{}]", pid);
+                            }
+                            slab.names.push((slot, Arc::from(name)));
+                            (info.ptinfo.pti_total_user.saturating_add(info.ptinfo.pti_total_system), info.ptinfo.pti_resident_size, info.ptinfo.pti_threadnum,
+                                info.pbsd.pbi_ppid as i32)
+                        };
+
+                        slab.readings.push(ProcReading {
+                            slot,
+                            ticks: total_ticks,
+                            rss: resident_size,
+                            threads: threadnum,
+                            ppid,
+                            reset: false,
+                        });
+                    }
+                });
+            }
+        }
+    }
+
+    // Toolhelp plus OpenProcess per process is the fallback should the
+    // single NT snapshot fail.
+    #[cfg(target_os = "windows")]
+    if !read_nt_processes(s) {
+        s.win_procs.clear();
+        unsafe {
+            let snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+            if snapshot != INVALID_HANDLE_VALUE {
+                let mut entry: PROCESSENTRY32W = std::mem::zeroed();
+                entry.dwSize = std::mem::size_of::<PROCESSENTRY32W>() as u32;
+                let mut ok = Process32FirstW(snapshot, &mut entry) != 0;
+                while ok {
+                    let pid = entry.th32ProcessID as i32;
+                    let slot = s.procs.claim(pid);
+                    let exe_len = entry.szExeFile.iter().position(|&c| c == 0).unwrap_or(entry.szExeFile.len());
+                    let exe = &entry.szExeFile[..exe_len];
+                    if s.procs.name(slot).is_none_or(|name| !name.encode_utf16().eq(exe.iter().copied())) {
+                        s.procs.set_name(slot, Arc::from(String::from_utf16_lossy(exe)));
+                    }
+                    s.win_procs.push((pid, slot, entry.cntThreads as i32, entry.th32ParentProcessID as i32));
+                    ok = Process32NextW(snapshot, &mut entry) != 0;
+                }
+                CloseHandle(snapshot);
+            }
+        }
+
+        run_chunked(&mut s.win_procs, &mut s.slabs, |procs, slab| unsafe {
+            for &mut (pid, slot, threads, ppid) in procs {
+                let handle = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, 0, pid as u32);
+                if handle.is_null() { continue; }
+                let mut create_time: FILETIME = std::mem::zeroed();
+                let mut exit_time: FILETIME = std::mem::zeroed();
+                let mut kernel_time: FILETIME = std::mem::zeroed();
+                let mut user_time: FILETIME = std::mem::zeroed();
+                let mut mem_bytes = 0u64;
+                if GetProcessTimes(handle, &mut create_time, &mut exit_time, &mut kernel_time, &mut user_time) != 0 {
+                    let kt = ((kernel_time.dwHighDateTime as u64) << 32) | kernel_time.dwLowDateTime as u64;
+                    let ut = ((user_time.dwHighDateTime as u64) << 32) | user_time.dwLowDateTime as u64;
+
+                    let mut pmc: windows_sys::Win32::System::ProcessStatus::PROCESS_MEMORY_COUNTERS = std::mem::zeroed();
+                    pmc.cb = std::mem::size_of::<windows_sys::Win32::System::ProcessStatus::PROCESS_MEMORY_COUNTERS>() as u32;
+                    if K32GetProcessMemoryInfo(handle, &mut pmc, pmc.cb) != 0 {
+                        mem_bytes = pmc.WorkingSetSize as u64;
+                    }
+
+                    slab.readings.push(ProcReading {
+                        slot,
+                        ticks: kt + ut,
+                        rss: mem_bytes,
+                        threads,
+                        ppid,
+                        reset: false,
+                    });
+                }
+                CloseHandle(handle);
+            }
+        });
+    }
+
+    for slab in s.slabs.iter_mut() {
+        for (slot, name) in slab.names.drain(..) {
+            s.procs.set_name(slot, name);
+        }
+        for r in &slab.readings {
+            s.procs.apply(r, denominator);
+        }
+    }
+    s.procs.sweep();
+    s.procs.denominator = denominator;
+}
+
+// Bytes a process has read from and written to storage, from the storage
+// layer's side (read_bytes and write_bytes, so page cache hits don't count).
+// None without permission to look, e.g. for other users' processes.
+#[cfg(target_os = "linux")]
+fn read_proc_io(pid: i32) -> Option<[u64; 2]> {
+    let file = File::open(&*sys_path(&format!("/proc/{}/io", pid))).ok()?;
+    let mut buf = [0u8; 512];
+    let n = file.read_at(&mut buf, 0).ok()?;
+    let mut out = [None; 2];
+    for line in buf[..n].split(|&b| b == b'\n') {
+        if let Some(v) = line.strip_prefix(b"read_bytes: ") { out[0] = parse_dec(v); }
+        if let Some(v) = line.strip_prefix(b"write_bytes: ") { out[1] = parse_dec(v); }
+    }
+    Some([out[0]?, out[1]?])
+}
+
+#[cfg(target_os = "macos")]
+fn read_proc_io(pid: i32) -> Option<[u64; 2]> {
+    let mut info = unsafe { std::mem::zeroed::<libc::rusage_info_v2>() };
+    let ok = unsafe { libc::proc_pid_rusage(pid, libc::RUSAGE_INFO_V2, &mut info as *mut _ as *mut libc::rusage_info_t) } == 0;
+    ok.then_some([info.ri_diskio_bytesread, info.ri_diskio_byteswritten])
+}
+
+// Windows counts every read and write call, files, pipes and sockets alike.
+#[cfg(target_os = "windows")]
+fn read_proc_io(pid: i32) -> Option<[u64; 2]> {
+    unsafe {
+        let handle = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, 0, pid as u32);
+        if handle.is_null() { return None; }
+        let mut counters: IO_COUNTERS = std::mem::zeroed();
+        let ok = GetProcessIoCounters(handle, &mut counters) != 0;
+        CloseHandle(handle);
+        ok.then_some([counters.ReadTransferCount, counters.WriteTransferCount])
+    }
+}
+
+enum KeyType {
+    None, Quit, Up, Down, Left, Right, Backspace, Enter, Esc, Char(char),
+}
+
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+fn read_key() -> KeyType {
+    let mut buf = [0u8; 16];
+    let n = unsafe { libc::read(libc::STDIN_FILENO, buf.as_mut_ptr() as *mut libc::c_void, buf.len()) };
+    if n <= 0 { return KeyType::None; }
+    let n = n as usize;
+
+    if buf[0] == 3 { return KeyType::Quit; }
+
+    if n == 1 {
+        if buf[0] == 27 { return KeyType::Esc; }
+        if buf[0] == 127 || buf[0] == 8 { return KeyType::Backspace; }
+        if buf[0] == 10 || buf[0] == 13 { return KeyType::Enter; }
+        if buf[0].is_ascii_graphic() || buf[0] == b' ' { return KeyType::Char(buf[0] as char); }
+    } else if n >= 3 && buf[0] == 27 && buf[1] == b'[' {
+        if buf[2] == b'A' { return KeyType::Up; }
+        if buf[2] == b'B' { return KeyType::Down; }
+        if buf[2] == b'C' { return KeyType::Right; }
+        if buf[2] == b'D' { return KeyType::Left; }
+    }
+    KeyType::None
+}
+
+#[cfg(target_os = "windows")]
+fn read_key() -> KeyType {
+    let mut num_events: u32 = 0;
+    unsafe {
+        let h = GetStdHandle(STD_INPUT_HANDLE);
+        // Non-blocking: return None immediately if no events pending
+        if GetNumberOfConsoleInputEvents(h, &mut num_events) == 0 || num_events == 0 {
+            return KeyType::None;
+        }
+        let mut record: INPUT_RECORD = std::mem::zeroed();
+        let mut events_read: u32 = 0;
+        if ReadConsoleInputW(h, &mut record, 1, &mut events_read) == 0 || events_read == 0 {
+            return KeyType::None;
+        }
+        if record.EventType == 4 /* WINDOW_BUFFER_SIZE_EVENT */ {
+            RESIZED.store(true, AtomicOrdering::SeqCst);
+        }
+        if record.EventType != 1 /* KEY_EVENT */ { return KeyType::None; }
+        let ke: KEY_EVENT_RECORD = record.Event.KeyEvent;
+        if ke.bKeyDown == 0 { return KeyType::None; }
+        let ch = ke.uChar.UnicodeChar;
+        if ch != 0 {
+            let byte = ch as u8;
+            if byte == 3 { return KeyType::Quit; }
+            if byte == 27 { return KeyType::Esc; }
+            if byte == 127 || byte == 8 { return KeyType::Backspace; }
+            if byte == 10 || byte == 13 { return KeyType::Enter; }
+            if byte.is_ascii_graphic() || byte == b' ' { return KeyType::Char(byte as char); }
+            return KeyType::None;
+        }
+        match ke.wVirtualKeyCode {
+            0x26 /* VK_UP */ => KeyType::Up,
+            0x28 /* VK_DOWN */ => KeyType::Down,
+            0x25 /* VK_LEFT */ => KeyType::Left,
+            0x27 /* VK_RIGHT */ => KeyType::Right,
+            _ => KeyType::None,
+        }
+    }
+}
+
+#[derive(Clone, Copy, Default, PartialEq, Debug)]
+enum ExportFormat {
+    #[default]
+    Jsonl,
+    Csv,
+}
+
+const DEFAULT_BATCH_INTERVAL: Duration = Duration::from_secs(1);
+const DEFAULT_BATCH_TOP: usize = 10;
+
+// "500ms", "2s", "1m", or a bare number of seconds ("0.5").
+fn parse_duration(v: &str) -> Option<Duration> {
+    let (num, scale) = if let Some(n) = v.strip_suffix("ms") {
+        (n, 0.001)
+    } else if let Some(n) = v.strip_suffix('s') {
+        (n, 1.0)
+    } else if let Some(n) = v.strip_suffix('m') {
+        (n, 60.0)
+    } else {
+        (v, 1.0)
+    };
+    let secs = num.parse::<f64>().ok()? * scale;
+    (secs.is_finite() && secs > 0.0).then(|| Duration::from_secs_f64(secs))
+}
+
+// JSON string literal. Only ASCII needs escaping; UTF-8 passes through.
+fn write_json_str(out: &mut Vec<u8>, s: &str) {
+    out.push(b'"');
+    for &b in s.as_bytes() {
+        match b {
+            b'"' => out.extend_from_slice(b"\\\""),
+            b'\\' => out.extend_from_slice(b"\\\\"),
+            b'\n' => out.extend_from_slice(b"\\n"),
+            b'\r' => out.extend_from_slice(b"\\r"),
+            b'\t' => out.extend_from_slice(b"\\t"),
+            0..=0x1F | 0x7F => { let _ = write!(out, "\\u{:04x}", b); }
+            _ => out.push(b),
+        }
+    }
+    out.push(b'"');
+}
+
+// CSV field, quoted only when it holds a separator, quote or line break.
+fn write_csv_str(out: &mut Vec<u8>, s: &str) {
+    if !s.bytes().any(|b| matches!(b, b',' | b'"' | b'\n' | b'\r')) {
+        out.extend_from_slice(s.as_bytes());
+        return;
+    }
+    out.push(b'"');
+    for &b in s.as_bytes() {
+        if b == b'"' {
+            out.push(b'"');
+        }
+        out.push(b);
     }
-    m
+    out.push(b'"');
 }
 
-#[cfg(target_os = "macos")]
-fn read_memory() -> MemorySnapshot {
-    let mut m = MemorySnapshot::default();
-    m.total_bytes = sysctl_u64("hw.memsize").unwrap_or(0);
+fn write_json_opt(out: &mut Vec<u8>, present: bool, value: f64) {
+    if present {
+        let _ = write!(out, "{:.1}", value);
+    } else {
+        out.extend_from_slice(b"null");
+    }
+}
 
-    unsafe {
-        let mut stats = std::mem::zeroed::<libc::vm_statistics64>();
-        let mut count = libc::HOST_VM_INFO64_COUNT;
-        let kr = libc::host_statistics64(
-            mach_host_self(),
-            libc::HOST_VM_INFO64,
-            &mut stats as *mut _ as libc::host_info64_t,
-            &mut count,
-        );
-        if kr == libc::KERN_SUCCESS {
-            let page_size = libc::sysconf(libc::_SC_PAGESIZE).max(1) as u64;
-            let active = stats.active_count as u64;
-            let wire = stats.wire_count as u64;
-            let compressed = stats.compressor_page_count as u64;
-            let used = (active + wire + compressed).saturating_mul(page_size);
-            m.used_bytes = used.min(m.total_bytes);
+fn write_json_u64(out: &mut Vec<u8>, value: Option<u64>) {
+    match value {
+        Some(v) => { let _ = write!(out, "{}", v); }
+        None => out.extend_from_slice(b"null"),
+    }
+}
+
+// Cumulative per-stage p50/p99 since startup plus utop's own footprint, for
+// --profile. Times in microseconds; null for a stage that has not run.
+fn write_json_profile(out: &mut Vec<u8>, profile: &Profile) {
+    let _ = write!(out, ",\"profile\":{{\"rss\":{},\"allocs\":{},\"stages\":{{", self_rss(), alloc_counter::total());
+    for (i, st) in profile.stages.iter().enumerate() {
+        if i > 0 { out.push(b','); }
+        let _ = write!(out, "\"{}\":{{\"runs\":{}", stage_name(i), st.time_ns.count());
+        for (key, h, scale) in [("time_us", &st.time_ns, 1000), ("syscalls", &st.syscalls, 1), ("bytes", &st.bytes_written, 1)] {
+            for (q, label) in [(0.5, "p50"), (0.99, "p99")] {
+                let _ = write!(out, ",\"{}_{}\":", key, label);
+                write_json_u64(out, h.percentile(q).map(|v| v / scale));
+            }
         }
+        out.push(b'}');
+    }
+    out.extend_from_slice(b"}}");
+}
 
-        let mut swap = std::mem::zeroed::<libc::xsw_usage>();
-        if sysctl_into("vm.swapusage", &mut swap) {
-            m.swap_total_bytes = swap.xsu_total;
-            m.swap_used_bytes = swap.xsu_used;
+// One JSON object per line: host totals, every GPU and filesystem, and the
+// first `top` processes in CPU order, then the profile if asked for.
+fn write_jsonl_record(out: &mut Vec<u8>, ts_ms: u64, snap: &Snapshot, top: usize, profile: Option<&Profile>) {
+    let _ = write!(out, "{{\"ts\":{},\"cpu\":{{\"usage\":{:.1},\"temp\":", ts_ms, snap.cpu);
+    write_json_opt(out, snap.cpu_temp > -1000.0, snap.cpu_temp);
+    out.extend_from_slice(b",\"freq_mhz\":");
+    write_json_opt(out, snap.cpu_freq > 0.0, snap.cpu_freq);
+    let m = &snap.mem;
+    let _ = write!(out, "}},\"mem\":{{\"used\":{},\"total\":{},\"swap_used\":{},\"swap_total\":{},\"cma_used\":{},\"cma_total\":{}}}",
+        m.used_bytes, m.total_bytes, m.swap_used_bytes, m.swap_total_bytes, m.cma_used_bytes, m.cma_total_bytes);
+
+    out.extend_from_slice(b",\"net\":{\"iface\":");
+    write_json_str(out, &snap.net.iface);
+    let _ = write!(out, ",\"rx_bps\":{:.0},\"tx_bps\":{:.0},\"ifaces\":[", snap.net.rx_rate, snap.net.tx_rate);
+    for (i, n) in snap.net.ifaces.iter().enumerate() {
+        if i > 0 { out.push(b','); }
+        out.extend_from_slice(b"{\"name\":");
+        write_json_str(out, &n.name);
+        let _ = write!(out, ",\"rx_bps\":{:.0},\"tx_bps\":{:.0},\"rx_pps\":{:.0},\"tx_pps\":{:.0},\"drops\":{:.0},\"errors\":{:.0}}}",
+            n.rx_rate, n.tx_rate, n.rx_packets, n.tx_packets, n.drops, n.errors);
+    }
+    out.extend_from_slice(b"]}");
+
+    out.extend_from_slice(b",\"gpus\":[");
+    for (i, g) in snap.gpus.iter().enumerate() {
+        if i > 0 { out.push(b','); }
+        out.extend_from_slice(b"{\"name\":");
+        write_json_str(out, &g.name);
+        out.extend_from_slice(b",\"usage\":");
+        write_json_opt(out, g.has_usage, g.usage);
+        if g.has_mem {
+            let _ = write!(out, ",\"mem_used\":{},\"mem_total\":{}", g.mem_used, g.mem_total);
+        } else {
+            out.extend_from_slice(b",\"mem_used\":null,\"mem_total\":null");
         }
+        out.extend_from_slice(b",\"temp\":");
+        write_json_opt(out, g.has_temp, g.temp);
+        out.push(b'}');
     }
 
-    m
+    out.extend_from_slice(b"],\"storage\":[");
+    for (i, s) in snap.storage.iter().enumerate() {
+        if i > 0 { out.push(b','); }
+        out.extend_from_slice(b"{\"mount\":");
+        write_json_str(out, &s.mount_point);
+        out.extend_from_slice(b",\"device\":");
+        write_json_str(out, &s.device);
+        let _ = write!(out, ",\"used\":{},\"total\":{},\"stale\":{},\"read_rate\":", s.used_bytes, s.total_bytes, s.stale);
+        write_json_u64(out, (s.read_rate >= 0.0).then_some(s.read_rate as u64));
+        out.extend_from_slice(b",\"write_rate\":");
+        write_json_u64(out, (s.write_rate >= 0.0).then_some(s.write_rate as u64));
+        out.push(b'}');
+    }
+
+    out.extend_from_slice(b"],\"procs\":[");
+    for (i, p) in snap.procs.iter().take(top.min(snap.sorted)).enumerate() {
+        if i > 0 { out.push(b','); }
+        let _ = write!(out, "{{\"pid\":{},\"ppid\":{},\"name\":", p.pid, p.ppid);
+        write_json_str(out, &p.name);
+        let _ = write!(out, ",\"cpu\":{:.1},\"mem\":{},\"threads\":{}}}", p.cpu_percent, p.mem_bytes, p.threads);
+    }
+    out.push(b']');
+    if let Some(p) = profile {
+        write_json_profile(out, p);
+    }
+    out.extend_from_slice(b"}\n");
 }
 
-#[cfg(target_os = "windows")]
-unsafe extern "system" fn enum_pf_callback(
-    pcontext: *mut core::ffi::c_void,
-    ppagefileinfo: *mut ENUM_PAGE_FILE_INFORMATION,
-    _lpfilename: windows_sys::core::PCWSTR,
-) -> BOOL {
-    unsafe {
-        let info = &*ppagefileinfo;
-        let out = &mut *(pcontext as *mut (u64, u64));
-        // Called once per pagefile; accumulate so multiple pagefiles are summed.
-        out.0 += info.TotalInUse as u64;
-        out.1 += info.TotalSize as u64;
+// CSV needs a fixed column set, so it carries the first GPU and filesystem and
+// `top` process column groups; hosts with more of either want JSON Lines.
+fn write_csv_header(out: &mut Vec<u8>, top: usize) {
+    out.extend_from_slice(b"timestamp_ms,cpu_percent,cpu_temp_c,cpu_freq_mhz,\
+mem_used,mem_total,swap_used,swap_total,net_iface,net_rx_bps,net_tx_bps,\
+gpu_name,gpu_percent,gpu_mem_used,gpu_mem_total,gpu_temp_c,disk_mount,disk_used,disk_total");
+    for i in 1..=top {
+        let _ = write!(out, ",proc{i}_pid,proc{i}_name,proc{i}_cpu,proc{i}_mem");
     }
-    1
+    out.push(b'\n');
 }
 
-#[cfg(target_os = "windows")]
-fn read_memory() -> MemorySnapshot {
-    let mut m = MemorySnapshot::default();
-    unsafe {
-        let mut si: SYSTEM_INFO = std::mem::zeroed();
-        GetSystemInfo(&mut si);
-        let page_size = si.dwPageSize as u64;
+fn write_csv_record(out: &mut Vec<u8>, ts_ms: u64, snap: &Snapshot, top: usize) {
+    let _ = write!(out, "{},{:.1},", ts_ms, snap.cpu);
+    if snap.cpu_temp > -1000.0 { let _ = write!(out, "{:.1}", snap.cpu_temp); }
+    out.push(b',');
+    if snap.cpu_freq > 0.0 { let _ = write!(out, "{:.0}", snap.cpu_freq); }
+    let m = &snap.mem;
+    let _ = write!(out, ",{},{},{},{},", m.used_bytes, m.total_bytes, m.swap_used_bytes, m.swap_total_bytes);
+    write_csv_str(out, &snap.net.iface);
+    let _ = write!(out, ",{:.0},{:.0},", snap.net.rx_rate, snap.net.tx_rate);
+
+    if let Some(g) = snap.gpus.first() {
+        write_csv_str(out, &g.name);
+        out.push(b',');
+        if g.has_usage { let _ = write!(out, "{:.1}", g.usage); }
+        out.push(b',');
+        if g.has_mem { let _ = write!(out, "{},{}", g.mem_used, g.mem_total); } else { out.push(b','); }
+        out.push(b',');
+        if g.has_temp { let _ = write!(out, "{:.1}", g.temp); }
+    } else {
+        out.extend_from_slice(b",,,,");
+    }
+    out.push(b',');
+    if let Some(s) = snap.storage.first() {
+        write_csv_str(out, &s.mount_point);
+        let _ = write!(out, ",{},{}", s.used_bytes, s.total_bytes);
+    } else {
+        out.extend_from_slice(b",,");
+    }
 
-        let mut pi: PERFORMANCE_INFORMATION = std::mem::zeroed();
-        pi.cb = std::mem::size_of::<PERFORMANCE_INFORMATION>() as u32;
-        let cb = pi.cb;
-        if GetPerformanceInfo(&mut pi, cb) != 0 {
-            m.total_bytes = (pi.PhysicalTotal as u64) * page_size;
-            m.used_bytes = (pi.PhysicalTotal.saturating_sub(pi.PhysicalAvailable) as u64) * page_size;
+    let shown = top.min(snap.sorted);
+    for p in snap.procs.iter().take(shown) {
+        let _ = write!(out, ",{},", p.pid);
+        write_csv_str(out, &p.name);
+        let _ = write!(out, ",{:.1},{}", p.cpu_percent, p.mem_bytes);
+    }
+    for _ in shown..top {
+        out.extend_from_slice(b",,,,");
+    }
+    out.push(b'\n');
+}
+
+// Headless mode: sample on this thread and stream one record per interval.
+// The snapshot and the serialisation buffer are reused, so after the first
+// few ticks nothing grows.
+fn run_batch(mut sampler: Sampler, config: &Config) -> io::Result<()> {
+    let interval = config.interval.unwrap_or(DEFAULT_BATCH_INTERVAL);
+    let top = config.top.unwrap_or(DEFAULT_BATCH_TOP);
+    sampler.profile.count_syscalls.store(config.profile, AtomicOrdering::Relaxed);
+    let mut out: Box<dyn Write> = match &config.output {
+        Some(path) if path != "-" => Box::new(File::create(path)?),
+        _ => Box::new(io::stdout().lock()),
+    };
+    let mut snap = Snapshot::default();
+    let mut buf = Vec::with_capacity(64 * 1024);
+    let mut recorder = match &config.record {
+        Some(path) => Some(Recorder::create(path, &sampler.cpu_count, &sampler.cpu_name, &sampler.gpu_cores)?),
+        None => None,
+    };
+    let mut alerts = Alerts::new(config, &sampler)?;
+
+    // The first sample only primes the CPU and network deltas.
+    sample(&mut sampler, SortMode::Cpu, top, &mut snap);
+    if config.format == ExportFormat::Csv {
+        write_csv_header(&mut buf, top);
+        out.write_all(&buf)?;
+    }
+
+    let mut written = 0_u64;
+    let mut next = Instant::now() + interval;
+    'records: while config.count.is_none_or(|n| written < n) {
+        loop {
+            if QUIT.load(AtomicOrdering::SeqCst) { break 'records; }
+            let now = Instant::now();
+            if now >= next { break; }
+            std::thread::sleep((next - now).min(Duration::from_millis(100)));
         }
+        next += interval;
+        let now = Instant::now();
+        if next < now { next = now + interval; }
 
-        let mut pf_info: (u64, u64) = (0, 0);
-        K32EnumPageFilesW(
-            Some(enum_pf_callback),
-            &mut pf_info as *mut _ as *mut core::ffi::c_void,
-        );
-        if pf_info.1 > 0 {
-            m.swap_total_bytes = pf_info.1 * page_size;
-            m.swap_used_bytes = std::cmp::min(pf_info.0 * page_size, pf_info.1 * page_size);
+        sample(&mut sampler, SortMode::Cpu, top, &mut snap);
+        let ts_ms = unix_ms();
+        if let Some(rec) = &mut recorder {
+            rec.write_frame(ts_ms, &sampler.procs, &snap)?;
+        }
+        if let Some(alerts) = &mut alerts {
+            alerts.check(ts_ms, &sampler.procs, &snap);
         }
+        let t = sampler.profile.start();
+        buf.clear();
+        match config.format {
+            ExportFormat::Jsonl => write_jsonl_record(&mut buf, ts_ms, &snap, top, config.profile.then_some(&*sampler.profile)),
+            ExportFormat::Csv => write_csv_record(&mut buf, ts_ms, &snap, top),
+        }
+        out.write_all(&buf)?;
+        out.flush()?;
+        sampler.profile.finish(STAGE_RENDER, t, buf.len() as u64);
+        written += 1;
     }
-    m
+    if let Some(rec) = recorder {
+        rec.finish()?;
+    }
+    out.flush()
 }
 
-#[cfg(target_os = "linux")]
-fn read_cpu_count() -> String {
-    let mut cores = 0;
-    let mut physical_ids = std::collections::HashSet::new();
+fn unix_ms() -> u64 {
+    std::time::SystemTime::now()
+        .duration_since(std::time::UNIX_EPOCH)
+        .map_or(0, |d| d.as_millis() as u64)
+}
 
-    if let Ok(content) = fs::read_to_string("/proc/cpuinfo") {
-        for line in content.lines() {
-            if line.starts_with("processor") {
-                cores += 1;
-            } else if line.starts_with("physical id") {
-                if let Some(id_str) = line.split(':').nth(1) {
-                    if let Ok(id) = id_str.trim().parse::<u32>() {
-                        physical_ids.insert(id);
-                    }
-                }
-            }
-        }
+// Recording file layout. After an 8-byte magic, everything is a record:
+// a kind byte, a varint payload length, then the payload. REC_STRING records
+// define strings in order of first use and everything else refers to them
+// by index; REC_KEYFRAME is a complete frame, REC_DELTA is a frame encoded
+// against the one before it. A cleanly closed file ends with REC_INDEX (the
+// string table and keyframe offsets again) and a footer giving its offset,
+// so opening it does not have to scan; a truncated file is scanned instead.
+const REC_MAGIC: &[u8; 8] = b"UTOPREC1";
+const REC_FOOTER_MAGIC: &[u8; 8] = b"UTOPIDX1";
+const REC_HEADER: u8 = 0;
+const REC_STRING: u8 = 1;
+const REC_KEYFRAME: u8 = 2;
+const REC_DELTA: u8 = 3;
+const REC_INDEX: u8 = 4;
+
+// A keyframe starts a new segment at least this often. Seeking decodes at most
+// one segment; a 10k-process keyframe is on the order of 100 KiB.
+const KEYFRAME_INTERVAL_MS: u64 = 5 * 60 * 1000;
+
+// How far one press of [ or ] moves replay.
+const REPLAY_SEEK_MS: i64 = 60 * 1000;
+
+// Flags on a changed process in a delta frame.
+const REC_TICKS: u8 = 1;
+const REC_RSS: u8 = 2;
+const REC_THREADS: u8 = 4;
+const REC_NAME: u8 = 8;
+
+const REC_HAS_USAGE: u8 = 1;
+const REC_HAS_MEM: u8 = 2;
+const REC_HAS_TEMP: u8 = 4;
+
+fn put_varint(out: &mut Vec<u8>, mut v: u64) {
+    while v >= 0x80 {
+        out.push(v as u8 | 0x80);
+        v >>= 7;
     }
+    out.push(v as u8);
+}
 
-    if cores == 0 {
-        if let Ok(content) = fs::read_to_string("/proc/stat") {
-            for line in content.lines() {
-                if line.starts_with("cpu") && line.len() > 3 && line.chars().nth(3).unwrap().is_ascii_digit() {
-                    cores += 1;
-                }
+fn put_zigzag(out: &mut Vec<u8>, v: i64) {
+    put_varint(out, ((v << 1) ^ (v >> 63)) as u64);
+}
+
+fn put_bytes(out: &mut Vec<u8>, b: &[u8]) {
+    put_varint(out, b.len() as u64);
+    out.extend_from_slice(b);
+}
+
+fn put_record(out: &mut Vec<u8>, kind: u8, payload: &[u8]) {
+    out.push(kind);
+    put_bytes(out, payload);
+}
+
+// Fixed-point encodings for the gauges; recordings keep 0.01% and 0.1°C.
+fn fixed(v: f64, scale: f64) -> i64 {
+    (v * scale).round() as i64
+}
+
+// Cursor over a record payload. Every read returns None on truncation, so a
+// recording cut off mid-write just ends at the last whole frame.
+struct RecReader<'a> {
+    buf: &'a [u8],
+    pos: usize,
+}
+
+impl<'a> RecReader<'a> {
+    fn varint(&mut self) -> Option<u64> {
+        let mut v = 0_u64;
+        for shift in (0..64).step_by(7) {
+            let b = *self.buf.get(self.pos)?;
+            self.pos += 1;
+            v |= ((b & 0x7F) as u64) << shift;
+            if b & 0x80 == 0 {
+                return Some(v);
             }
         }
+        None
     }
-    if cores == 0 { cores = 1; }
 
-    let sockets = if physical_ids.is_empty() { 1 } else { physical_ids.len() };
+    fn zigzag(&mut self) -> Option<i64> {
+        let v = self.varint()?;
+        Some((v >> 1) as i64 ^ -((v & 1) as i64))
+    }
 
-    let cpu_str = if sockets == 1 { "CPU:" } else { "CPUs:" };
-    let core_str = if cores == 1 { "core" } else { "cores" };
+    fn byte(&mut self) -> Option<u8> {
+        let b = *self.buf.get(self.pos)?;
+        self.pos += 1;
+        Some(b)
+    }
 
-    format!("{} {}, {} {}", cpu_str, sockets, cores, core_str)
+    fn bytes(&mut self) -> Option<&'a [u8]> {
+        let len = self.varint()? as usize;
+        let b = self.buf.get(self.pos..self.pos.checked_add(len)?)?;
+        self.pos += len;
+        Some(b)
+    }
+
+    // (kind, payload) of the record at the cursor.
+    fn record(&mut self) -> Option<(u8, &'a [u8])> {
+        let kind = self.byte()?;
+        Some((kind, self.bytes()?))
+    }
 }
 
-#[cfg(target_os = "macos")]
-fn read_cpu_count() -> String {
-    let cores = read_logical_cpu_count();
-    let sockets = sysctl_i32("hw.packages").filter(|v| *v > 0).unwrap_or(1) as u64;
-    let cpu_str = if sockets == 1 { "CPU:" } else { "CPUs:" };
-    let core_str = if cores == 1 { "core" } else { "cores" };
-    format!("{} {}, {} {}", cpu_str, sockets, cores, core_str)
+// One process as the recorder last wrote it.
+struct RecProc {
+    pid: i32,
+    name: Arc<str>,
+    name_id: u32,
+    ticks: u64,
+    rss_kib: u64,
+    threads: i32,
+    // Ticks since the previous sample, recovered from the table's CPU%. Only
+    // written for processes with no earlier frame to diff against.
+    dticks: u64,
 }
 
-#[cfg(target_os = "macos")]
-fn read_logical_cpu_count() -> u64 {
-    sysctl_i32("hw.logicalcpu")
-        .or_else(|| sysctl_i32("hw.ncpu"))
-        .filter(|v| *v > 0)
-        .map(|v| v as u64)
-        .unwrap_or(1)
+// Appends frames to a recording. Runs on the sampler thread right after each
+// sample, reading the full process table rather than the filtered snapshot.
+// --serve encodes into a Vec instead and hands the bytes to its viewers.
+struct Recorder<W: Write = io::BufWriter<File>> {
+    out: W,
+    offset: u64,
+    strings: HashMap<Arc<str>, u32>,
+    string_list: Vec<Arc<str>>,
+    prev: Vec<RecProc>,
+    cur: Vec<RecProc>,
+    frame: Vec<u8>,
+    sections: [Vec<u8>; 3],
+    keyframes: Vec<(u64, u64)>,
+    next_keyframe_ms: u64,
+    last_ms: u64,
 }
 
-#[cfg(target_os = "windows")]
-fn read_cpu_count() -> String {
-    {
-        let cores = active_cpu_count();
-        let cpu_str = if cores == 1 { "CPU:" } else { "CPUs:" };
-        let core_str = if cores == 1 { "core" } else { "cores" };
-        format!("{} {}, {} {}", cpu_str, 1, cores, core_str)
+impl Recorder {
+    fn create(path: &str, cpu_count: &str, cpu_name: &str, gpu_cores: &str) -> io::Result<Self> {
+        Self::new(io::BufWriter::with_capacity(256 * 1024, File::create(path)?), &[cpu_count, cpu_name, gpu_cores])
     }
 }
 
-#[cfg(target_os = "linux")]
-fn read_gpu(s: &mut Sampler, mem: &MemorySnapshot, cached_gpu: &mut GpuSnapshot, last_gpu_read: &mut Instant) -> GpuSnapshot {
-    let now = Instant::now();
-    if now.duration_since(*last_gpu_read) < Duration::from_millis(800) && last_gpu_read.elapsed() < Duration::from_secs(10000) {
-        return cached_gpu.clone();
+impl<W: Write> Recorder<W> {
+    // The header is the CPU count, CPU name and GPU cores lines; a stream
+    // from --serve adds the agent's hostname, which replay ignores.
+    fn new(out: W, header_fields: &[&str]) -> io::Result<Self> {
+        let mut rec = Self {
+            out,
+            offset: 0,
+            strings: HashMap::new(),
+            string_list: Vec::new(),
+            prev: Vec::new(),
+            cur: Vec::new(),
+            frame: Vec::with_capacity(64 * 1024),
+            sections: Default::default(),
+            keyframes: Vec::new(),
+            next_keyframe_ms: 0,
+            last_ms: 0,
+        };
+        rec.out.write_all(REC_MAGIC)?;
+        rec.offset = REC_MAGIC.len() as u64;
+        let mut header = Vec::new();
+        for field in header_fields {
+            put_bytes(&mut header, field.as_bytes());
+        }
+        rec.write_record(REC_HEADER, &header)?;
+        Ok(rec)
     }
-    *last_gpu_read = now;
 
-    let mut g = GpuSnapshot::default();
+    // Every string defined so far, for a reader joining mid-stream.
+    fn write_strings(&self, out: &mut Vec<u8>) {
+        for s in &self.string_list {
+            put_record(out, REC_STRING, s.as_bytes());
+        }
+    }
 
-    // 1. NVIDIA via nvidia-smi
-    if let Ok(output) = std::process::Command::new("/usr/bin/nvidia-smi")
-        .args(["--query-gpu=name,utilization.gpu,memory.used,memory.total,temperature.gpu", "--format=csv,noheader,nounits"])
-        .output()
-        && output.status.success() {
-            let out_str = String::from_utf8_lossy(&output.stdout);
-            if let Some(line) = out_str.lines().next() {
-                let parts: Vec<&str> = line.split(',').map(|p| p.trim()).collect();
-                if parts.len() >= 5 {
-                    g.name = parts[0].to_string().replace("NVIDIA GeForce ", "").replace("NVIDIA ", "");
-                    g.usage = parts[1].parse().unwrap_or(0.0);
-                    g.has_usage = true;
-                    g.mem_used = parts[2].parse::<u64>().unwrap_or(0) * 1024 * 1024;
-                    g.has_mem = true;
-                    g.mem_total = parts[3].parse::<u64>().unwrap_or(0) * 1024 * 1024;
-                    g.temp = parts[4].parse().unwrap_or(-1000.0);
-                    g.has_temp = true;
-                    *cached_gpu = g.clone();
-                    return g;
+    // Make the next frame a keyframe, so a reader that just joined can
+    // decode it without the frames before.
+    fn force_keyframe(&mut self) {
+        self.next_keyframe_ms = 0;
+    }
+
+    fn write_record(&mut self, kind: u8, payload: &[u8]) -> io::Result<()> {
+        let mut head = [0_u8; 11];
+        head[0] = kind;
+        let mut len = payload.len() as u64;
+        let mut n = 1;
+        while len >= 0x80 {
+            head[n] = len as u8 | 0x80;
+            len >>= 7;
+            n += 1;
+        }
+        head[n] = len as u8;
+        n += 1;
+        self.out.write_all(&head[..n])?;
+        self.out.write_all(payload)?;
+        self.offset += (n + payload.len()) as u64;
+        Ok(())
+    }
+
+    // Index of `s` in the string table, writing its definition on first use.
+    fn string_id(&mut self, s: &str) -> io::Result<u32> {
+        if let Some(&id) = self.strings.get(s) {
+            return Ok(id);
+        }
+        let id = self.string_list.len() as u32;
+        let s: Arc<str> = Arc::from(s);
+        self.write_record(REC_STRING, s.as_bytes())?;
+        self.strings.insert(s.clone(), id);
+        self.string_list.push(s);
+        Ok(id)
+    }
+
+    fn write_frame(&mut self, ts_ms: u64, table: &ProcTable, snap: &Snapshot) -> io::Result<()> {
+        let keyframe = ts_ms >= self.next_keyframe_ms || ts_ms < self.last_ms;
+        self.last_ms = ts_ms;
+
+        // This tick's processes in PID order, reusing the previous frame's
+        // string ids for names that did not change.
+        let mut cur = std::mem::take(&mut self.cur);
+        cur.clear();
+        let denominator = table.denominator;
+        for i in 0..table.pid.len() {
+            if table.read[i] != table.tick { continue; }
+            let Some(name) = &table.name[i] else { continue; };
+            cur.push(RecProc {
+                pid: table.pid[i],
+                name: name.clone(),
+                name_id: u32::MAX,
+                ticks: table.ticks[i],
+                rss_kib: table.rss[i] / 1024,
+                threads: table.threads[i],
+                dticks: (table.cpu[i] * denominator / 100.0).round() as u64,
+            });
+        }
+        cur.sort_unstable_by_key(|p| p.pid);
+        let mut j = 0;
+        for p in cur.iter_mut() {
+            while j < self.prev.len() && self.prev[j].pid < p.pid { j += 1; }
+            if let Some(old) = self.prev.get(j)
+                && old.pid == p.pid && Arc::ptr_eq(&old.name, &p.name) {
+                    p.name_id = old.name_id;
                 }
+        }
+        for p in cur.iter_mut() {
+            if p.name_id == u32::MAX {
+                p.name_id = self.string_id(&p.name)?;
             }
         }
+        let iface = self.string_id(&snap.net.iface)?;
+        let mut gpu_names = [0_u32; 16];
+        for (id, g) in gpu_names.iter_mut().zip(&snap.gpus) {
+            *id = self.string_id(&g.name)?;
+        }
+        let mut disk_names = [(0_u32, 0_u32); 16];
+        for (ids, s) in disk_names.iter_mut().zip(&snap.storage) {
+            *ids = (self.string_id(&s.mount_point)?, self.string_id(&s.device)?);
+        }
 
-    // 2. DRM / sysfs
-    if let Ok(entries) = fs::read_dir("/sys/class/drm") {
-        for entry in entries.flatten() {
-            let name_str = entry.file_name().to_string_lossy().to_string();
-            if name_str.starts_with("card") && !name_str.contains('-') {
-                let mut found_usage = false;
-                
-                let usage_files = [
-                    format!("/sys/class/drm/{}/device/gpu_busy_percent", name_str),
-                    format!("/sys/class/drm/{}/gt/gt0/usage", name_str),
-                    format!("/sys/class/drm/{}/device/usage", name_str),
-                    format!("/sys/class/drm/{}/device/load", name_str),
-                ];
-                
-                for path in &usage_files {
-                    if let Ok(val) = fs::read_to_string(path)
-                        && let Ok(usage) = val.trim().parse::<f64>() {
-                            g.usage = usage;
-                            g.has_usage = true;
-                            found_usage = true;
-                            break;
-                        }
-                }
-                
-                if !found_usage {
-                    let mut stats_path = format!("/sys/class/drm/{}/device/gpu_stats", name_str);
-                    if fs::metadata(&stats_path).is_err()
-                        && let Some(card_num) = name_str.chars().nth(4)
-                            && card_num.is_ascii_digit() {
-                                stats_path = format!("/sys/kernel/debug/dri/{}/gpu_stats", card_num);
-                            }
-                    if let Ok(content) = fs::read_to_string(&stats_path) {
-                        for line in content.lines().skip(1) {
-                            let parts: Vec<&str> = line.split_whitespace().collect();
-                            if parts.len() >= 4 {
-                                let q_name = parts[0];
-                                if let (Ok(ts), Ok(rt)) = (parts[1].parse::<u64>(), parts[3].parse::<u64>()) {
-                                    let mut idx = None;
-                                    for (i, st) in s.v3d_stats.iter().enumerate() {
-                                        if st.queue == q_name {
-                                            idx = Some(i);
-                                            break;
-                                        }
-                                    }
-                                    if let Some(i) = idx {
-                                        if ts > s.v3d_stats[i].last_ts {
-                                            let q_u = (rt - s.v3d_stats[i].last_rt) as f64 * 100.0 / (ts - s.v3d_stats[i].last_ts) as f64;
-                                            if q_u > g.usage { g.usage = q_u; }
-                                            g.has_usage = true;
-                                        }
-                                        s.v3d_stats[i].last_ts = ts;
-                                        s.v3d_stats[i].last_rt = rt;
-                                    } else if s.v3d_stats.len() < 16 {
-                                        s.v3d_stats.push(V3dStats {
-                                            queue: q_name.to_string(),
-                                            last_ts: ts,
-                                            last_rt: rt,
-                                        });
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-                
-                if let Ok(vendor) = fs::read_to_string(format!("/sys/class/drm/{}/device/vendor", name_str)) {
-                    if vendor.contains("0x1002") { g.name = "AMD GPU".to_string(); }
-                    else if vendor.contains("0x8086") { g.name = "Intel GPU".to_string(); }
-                    else if vendor.contains("0x10de") { g.name = "NVIDIA GPU".to_string(); }
-                    else if vendor.contains("0x14e4") { g.name = "Broadcom GPU".to_string(); }
-                } else if let Ok(uevent) = fs::read_to_string(format!("/sys/class/drm/{}/device/uevent", name_str))
-                    && (uevent.contains("DRIVER=v3d") || uevent.contains("DRIVER=vc4")) {
-                        g.name = "VideoCore GPU".to_string();
-                    }
-                
-                if let Ok(hdirs) = fs::read_dir(format!("/sys/class/drm/{}/device/hwmon", name_str)) {
-                    for hdir in hdirs.flatten() {
-                        let hname_str = hdir.file_name().to_string_lossy().to_string();
-                        if hname_str.starts_with("hwmon")
-                            && let Ok(t_str) = fs::read_to_string(hdir.path().join("temp1_input"))
-                                && let Ok(t) = t_str.trim().parse::<f64>() {
-                                    g.temp = t / 1000.0;
-                                    g.has_temp = true;
-                                    break;
-                                }
-                    }
-                }
-                if !g.has_temp
-                    && let Ok(t_str) = fs::read_to_string("/sys/class/thermal/thermal_zone0/temp")
-                        && let Ok(t) = t_str.trim().parse::<f64>() {
-                            g.temp = t / 1000.0;
-                            g.has_temp = true;
-                        }
-                
-                if !g.has_mem {
-                    if let Ok(m_str) = fs::read_to_string(format!("/sys/class/drm/{}/tile0/vram0/used", name_str))
-                        && let Ok(m) = m_str.trim().parse::<u64>() {
-                            g.mem_used = m;
-                            g.has_mem = true;
-                        }
-                    if let Ok(m_str) = fs::read_to_string(format!("/sys/class/drm/{}/tile0/vram0/size", name_str))
-                        && let Ok(m) = m_str.trim().parse::<u64>() {
-                            g.mem_total = m;
-                        }
+        let mut f = std::mem::take(&mut self.frame);
+        f.clear();
+        put_varint(&mut f, ts_ms);
+        put_varint(&mut f, denominator.max(0.0).round() as u64);
+        put_varint(&mut f, fixed(snap.cpu, 100.0).max(0) as u64);
+        put_zigzag(&mut f, fixed(snap.cpu_temp, 10.0));
+        put_varint(&mut f, snap.cpu_freq.max(0.0).round() as u64);
+        let m = &snap.mem;
+        for v in [m.used_bytes, m.total_bytes, m.swap_used_bytes, m.swap_total_bytes, m.cma_used_bytes, m.cma_total_bytes] {
+            put_varint(&mut f, v);
+        }
+        put_varint(&mut f, iface as u64);
+        put_varint(&mut f, snap.net.rx_rate.max(0.0).round() as u64);
+        put_varint(&mut f, snap.net.tx_rate.max(0.0).round() as u64);
+        let gpus = &snap.gpus[..snap.gpus.len().min(gpu_names.len())];
+        put_varint(&mut f, gpus.len() as u64);
+        for (g, &name) in gpus.iter().zip(&gpu_names) {
+            put_varint(&mut f, name as u64);
+            f.push((g.has_usage as u8 * REC_HAS_USAGE) | (g.has_mem as u8 * REC_HAS_MEM) | (g.has_temp as u8 * REC_HAS_TEMP));
+            put_varint(&mut f, fixed(g.usage, 10.0).max(0) as u64);
+            put_varint(&mut f, g.mem_used);
+            put_varint(&mut f, g.mem_total);
+            put_zigzag(&mut f, fixed(g.temp, 10.0));
+        }
+        let disks = &snap.storage[..snap.storage.len().min(disk_names.len())];
+        put_varint(&mut f, disks.len() as u64);
+        for (s, &(mount, device)) in disks.iter().zip(&disk_names) {
+            put_varint(&mut f, mount as u64);
+            put_varint(&mut f, device as u64);
+            put_varint(&mut f, s.used_bytes);
+            put_varint(&mut f, s.total_bytes);
+        }
+
+        // Removed, added and changed processes, each a PID-ascending list of
+        // gaps. A keyframe is every process "added" to an empty frame.
+        let [removed, added, changed] = &mut self.sections;
+        removed.clear();
+        added.clear();
+        changed.clear();
+        let mut counts = [0_u64; 3];
+        let mut last_pid = [0_i64; 3];
+        let mut gap = |sec: usize, pid: i32, out: &mut Vec<u8>| {
+            put_varint(out, (pid as i64 - last_pid[sec]) as u64);
+            last_pid[sec] = pid as i64;
+            counts[sec] += 1;
+        };
+        let prev: &[RecProc] = if keyframe { &[] } else { &self.prev };
+        let (mut i, mut j) = (0, 0);
+        while i < prev.len() || j < cur.len() {
+            let old_pid = prev.get(i).map_or(i32::MAX, |p| p.pid);
+            let new_pid = cur.get(j).map_or(i32::MAX, |p| p.pid);
+            if old_pid == new_pid {
+                let (o, n) = (&prev[i], &cur[j]);
+                let mut flags = 0;
+                if n.ticks != o.ticks { flags |= REC_TICKS; }
+                if n.rss_kib != o.rss_kib { flags |= REC_RSS; }
+                if n.threads != o.threads { flags |= REC_THREADS; }
+                if n.name_id != o.name_id { flags |= REC_NAME; }
+                if flags != 0 {
+                    gap(2, n.pid, changed);
+                    changed.push(flags);
+                    if flags & REC_TICKS != 0 { put_zigzag(changed, n.ticks as i64 - o.ticks as i64); }
+                    if flags & REC_RSS != 0 { put_zigzag(changed, n.rss_kib as i64 - o.rss_kib as i64); }
+                    if flags & REC_THREADS != 0 { put_zigzag(changed, (n.threads - o.threads) as i64); }
+                    if flags & REC_NAME != 0 { put_varint(changed, n.name_id as u64); }
                 }
-                
-                if (g.name == "Broadcom GPU" || g.name == "VideoCore GPU" || g.name == "GPU")
-                    && mem.cma_total_bytes > 0 {
-                        g.mem_used = mem.cma_used_bytes;
-                        g.mem_total = mem.cma_total_bytes;
-                        g.has_mem = true;
-                        if g.name == "GPU" { g.name = "VideoCore GPU".to_string(); }
-                    }
-                
-                if g.has_usage {
-                    *cached_gpu = g.clone();
-                    return g;
-                }
-            }
-        }
-    }
-
-    // 3. Adreno / kgsl
-    let adreno_paths = ["/sys/class/kgsl/kgsl-3d0/gpu_busy_percentage", "/sys/class/kgsl/kgsl-3d0/gpubusy"];
-    for (i, path) in adreno_paths.iter().enumerate() {
-        if let Ok(content) = fs::read_to_string(path) {
-            let mut usage = 0.0;
-            if i == 1 {
-                let parts: Vec<&str> = content.split_whitespace().collect();
-                if parts.len() >= 2
-                    && let (Ok(busy), Ok(total)) = (parts[0].parse::<u64>(), parts[1].parse::<u64>())
-                        && total > 0 { usage = busy as f64 * 100.0 / total as f64; }
-            } else if let Ok(val) = content.trim().parse::<f64>() {
-                usage = val;
-            }
-            if usage > 0.0 || i == 0 {
-                g.name = "Adreno GPU".to_string();
-                g.usage = usage;
-                g.has_usage = true;
-                if let Ok(t_str) = fs::read_to_string("/sys/class/thermal/thermal_zone0/temp")
-                    && let Ok(t) = t_str.trim().parse::<f64>() {
-                        g.temp = t / 1000.0;
-                        g.has_temp = true;
-                    }
-                *cached_gpu = g.clone();
-                return g;
+                i += 1;
+                j += 1;
+            } else if old_pid < new_pid {
+                gap(0, old_pid, removed);
+                i += 1;
+            } else {
+                let n = &cur[j];
+                gap(1, n.pid, added);
+                put_varint(added, n.name_id as u64);
+                put_varint(added, n.ticks);
+                put_varint(added, n.rss_kib);
+                put_varint(added, n.threads.max(0) as u64);
+                put_varint(added, n.dticks);
+                j += 1;
             }
         }
+        for (count, sec) in counts.iter().zip(&self.sections) {
+            put_varint(&mut f, *count);
+            f.extend_from_slice(sec);
+        }
+
+        if keyframe {
+            self.keyframes.push((ts_ms, self.offset));
+            self.next_keyframe_ms = ts_ms + KEYFRAME_INTERVAL_MS;
+        }
+        let kind = if keyframe { REC_KEYFRAME } else { REC_DELTA };
+        let res = self.write_record(kind, &f).and_then(|_| self.out.flush());
+        self.frame = f;
+        self.cur = std::mem::replace(&mut self.prev, cur);
+        res
     }
 
-    // 4. Generic devfreq
-    let devfreq_dirs = ["/sys/class/devfreq", "/sys/devices/platform/soc/soc:gpu/devfreq"];
-    for dir in devfreq_dirs {
-        if let Ok(entries) = fs::read_dir(dir) {
-            for entry in entries.flatten() {
-                let name_str = entry.file_name().to_string_lossy().to_string();
-                if (name_str.contains("v3d") || name_str.contains("gpu") || name_str.contains("mali") || name_str.contains("soc:gpu"))
-                    && let Ok(load_str) = fs::read_to_string(entry.path().join("load")) {
-                        let load = load_str.split('@').next().unwrap_or("").trim();
-                        if let Ok(usage) = load.parse::<f64>() {
-                            g.usage = usage;
-                            g.has_usage = true;
-                            if name_str.contains("v3d") || name_str.contains("soc:gpu") { g.name = "VideoCore GPU".to_string(); }
-                            else if name_str.contains("mali") { g.name = "Mali GPU".to_string(); }
-                            
-                            if !g.has_temp
-                                && let Ok(t_str) = fs::read_to_string("/sys/class/thermal/thermal_zone0/temp")
-                                    && let Ok(t) = t_str.trim().parse::<f64>() {
-                                        g.temp = t / 1000.0;
-                                        g.has_temp = true;
-                                    }
-                            *cached_gpu = g.clone();
-                            return g;
-                        }
-                    }
-            }
+    // Write the trailer index so the next open can skip the scan.
+    fn finish(mut self) -> io::Result<()> {
+        let mut index = Vec::new();
+        put_varint(&mut index, self.last_ms);
+        put_varint(&mut index, self.string_list.len() as u64);
+        for s in &self.string_list {
+            put_bytes(&mut index, s.as_bytes());
+        }
+        put_varint(&mut index, self.keyframes.len() as u64);
+        for &(ts, offset) in &self.keyframes {
+            put_varint(&mut index, ts);
+            put_varint(&mut index, offset);
+        }
+        let index_offset = self.offset;
+        self.write_record(REC_INDEX, &index)?;
+        self.out.write_all(&index_offset.to_le_bytes())?;
+        self.out.write_all(REC_FOOTER_MAGIC)?;
+        self.out.flush()
+    }
+}
+
+// Read-only view of a recording. Mapped on Unix so that opening an overnight
+// file touches only the pages replay actually decodes.
+struct MappedFile {
+    #[cfg(any(target_os = "linux", target_os = "macos"))]
+    ptr: *mut libc::c_void,
+    #[cfg(any(target_os = "linux", target_os = "macos"))]
+    len: usize,
+    #[cfg(target_os = "windows")]
+    data: Vec<u8>,
+}
+
+// The mapping is read-only and owned by whichever thread holds the value.
+unsafe impl Send for MappedFile {}
+
+impl MappedFile {
+    #[cfg(any(target_os = "linux", target_os = "macos"))]
+    fn open(path: &str) -> io::Result<Self> {
+        let file = File::open(path)?;
+        let len = file.metadata()?.len() as usize;
+        if len == 0 {
+            return Err(io::Error::new(io::ErrorKind::InvalidData, "empty recording"));
+        }
+        let ptr = unsafe {
+            libc::mmap(std::ptr::null_mut(), len, libc::PROT_READ, libc::MAP_PRIVATE, std::os::fd::AsRawFd::as_raw_fd(&file), 0)
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
         }
+        Ok(Self { ptr, len })
     }
 
-    // 5. Fallback for SoC (Broadcom/VideoCore)
-    if !g.has_usage && !g.has_mem && mem.cma_total_bytes > 0 {
-        g.name = "VideoCore GPU".to_string();
-        g.mem_used = mem.cma_used_bytes;
-        g.mem_total = mem.cma_total_bytes;
-        g.has_mem = true;
-        if !g.has_temp
-            && let Ok(t_str) = fs::read_to_string("/sys/class/thermal/thermal_zone0/temp")
-                && let Ok(t) = t_str.trim().parse::<f64>() {
-                    g.temp = t / 1000.0;
-                    g.has_temp = true;
-                }
+    #[cfg(target_os = "windows")]
+    fn open(path: &str) -> io::Result<Self> {
+        Ok(Self { data: fs::read(path)? })
     }
 
-    *cached_gpu = g.clone();
-    g
+    fn bytes(&self) -> &[u8] {
+        #[cfg(any(target_os = "linux", target_os = "macos"))]
+        return unsafe { std::slice::from_raw_parts(self.ptr as *const u8, self.len) };
+        #[cfg(target_os = "windows")]
+        return &self.data;
+    }
 }
 
-#[cfg(target_os = "macos")]
-fn read_gpu(
-    _s: &mut Sampler,
-    _mem: &MemorySnapshot,
-    cached_gpu: &mut GpuSnapshot,
-    last_gpu_read: &mut Instant,
-) -> GpuSnapshot {
-    let now = Instant::now();
-    if now.duration_since(*last_gpu_read) < Duration::from_millis(800) {
-        return cached_gpu.clone();
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr, self.len); }
     }
-    *last_gpu_read = now;
+}
+
+struct ReplayProc {
+    pid: i32,
+    name: u32,
+    ticks: u64,
+    rss_kib: u64,
+    threads: i32,
+    // Ticks since the previous frame; 0 for a process that did not change.
+    dticks: u64,
+}
 
-    let g = GpuSnapshot::default();
-    *cached_gpu = g.clone();
-    g
+// Where replay is in the recording, for the title line.
+#[derive(Clone, Copy, Default)]
+struct ReplayPos {
+    pos_ms: u64,
+    total_ms: u64,
+    speed: f64,
+    paused: bool,
 }
 
-#[cfg(target_os = "windows")]
-fn read_gpu(
-    _s: &mut Sampler,
-    _mem: &MemorySnapshot,
-    cached_gpu: &mut GpuSnapshot,
-    last_gpu_read: &mut Instant,
-) -> GpuSnapshot {
-    let now = Instant::now();
-    if now.duration_since(*last_gpu_read) < Duration::from_millis(800) {
-        return cached_gpu.clone();
-    }
-    *last_gpu_read = now;
+// The string table and latest decoded frame of a recording or a --serve
+// stream, which fill() turns into the same Snapshot the sampler produces.
+#[derive(Default)]
+struct FrameDecoder {
+    strings: Vec<Arc<str>>,
+    strings_lower: Vec<Arc<str>>,
+    denominator: u64,
+    system: Snapshot,
+    procs: Vec<ReplayProc>,
+    // Scratch for a frame's removed PIDs, kept to reuse its allocation.
+    removed: Vec<i32>,
+}
 
-    // Try nvidia-smi
-    if let Ok(output) = std::process::Command::new("nvidia-smi")
-        .args(["--query-gpu=name,utilization.gpu,memory.used,memory.total,temperature.gpu", "--format=csv,noheader,nounits"])
-        .output()
-        && output.status.success()
-    {
-        let out_str = String::from_utf8_lossy(&output.stdout);
-        if let Some(line) = out_str.lines().next() {
-            let parts: Vec<&str> = line.split(',').map(|p| p.trim()).collect();
-            if parts.len() >= 5 {
-                let mut g = GpuSnapshot::default();
-                g.name = parts[0].to_string().replace("NVIDIA GeForce ", "").replace("NVIDIA ", "");
-                g.usage = parts[1].parse().unwrap_or(0.0);
-                g.has_usage = true;
-                g.mem_used = parts[2].parse::<u64>().unwrap_or(0) * 1024 * 1024;
-                g.has_mem = true;
-                g.mem_total = parts[3].parse::<u64>().unwrap_or(0) * 1024 * 1024;
-                g.temp = parts[4].parse().unwrap_or(-1000.0);
-                g.has_temp = true;
-                *cached_gpu = g.clone();
-                return g;
-            }
-        }
+impl FrameDecoder {
+    fn define(&mut self, s: Arc<str>) {
+        self.strings_lower.push(lowercase(&s));
+        self.strings.push(s);
     }
 
-    *cached_gpu = GpuSnapshot::default();
-    cached_gpu.clone()
-}
+    fn string(&self, id: u64) -> Arc<str> {
+        self.strings.get(id as usize).cloned().unwrap_or_else(|| Arc::from("?"))
+    }
 
-#[cfg(target_os = "linux")]
-fn read_network(prev_net: &mut HashMap<String, (u64, u64)>, elapsed: f64) -> NetworkSnapshot {
-    let mut best = NetworkSnapshot { iface: "-".to_string(), rx_rate: 0.0, tx_rate: 0.0 };
-    if let Ok(content) = fs::read_to_string("/proc/net/dev") {
-        let mut cur_net: HashMap<String, (u64, u64)> = HashMap::new();
-        let mut best_total = 0;
+    // Apply a REC_KEYFRAME or REC_DELTA payload; returns its timestamp.
+    fn frame(&mut self, keyframe: bool, payload: &[u8]) -> Option<u64> {
+        let (ts_ms, denominator) = decode_frame(&self.strings, keyframe, payload, &mut self.system, &mut self.procs, &mut self.removed)?;
+        self.denominator = denominator;
+        self.system.seq += 1;
+        Some(ts_ms)
+    }
 
-        for line in content.lines().skip(2) {
-            let parts: Vec<&str> = line.split(':').collect();
-            if parts.len() == 2 {
-                let iface = parts[0].trim().to_string();
-                if iface == "lo" { continue; }
-                let stats: Vec<&str> = parts[1].split_whitespace().collect();
-                if stats.len() >= 9
-                    && let (Ok(rx), Ok(tx)) = (stats[0].parse::<u64>(), stats[8].parse::<u64>()) {
-                        let (prev_rx, prev_tx) = prev_net.get(&iface).copied().unwrap_or((rx, tx));
-                        let rx_r = if rx >= prev_rx { (rx - prev_rx) as f64 / elapsed } else { 0.0 };
-                        let tx_r = if tx >= prev_tx { (tx - prev_tx) as f64 / elapsed } else { 0.0 };
-                        if rx + tx > best_total {
-                            best_total = rx + tx;
-                            best.iface = iface.clone();
-                            best.rx_rate = rx_r;
-                            best.tx_rate = tx_r;
-                        }
-                        cur_net.insert(iface, (rx, tx));
-                    }
-            }
+    fn fill(&self, sort: SortMode, sort_rows: usize, out: &mut Snapshot) {
+        out.copy_system_from(&self.system);
+
+        out.procs.clear();
+        for q in &self.procs {
+            let name = self.string(q.name as u64);
+            let name_lower = self.strings_lower.get(q.name as usize).cloned().unwrap_or_else(|| name.clone());
+            let cpu_percent = if self.denominator > 0 {
+                q.dticks as f64 * 100.0 / self.denominator as f64
+            } else { 0.0 };
+            let mut p = ProcessInfo {
+                pid: q.pid,
+                ppid: -1,
+                name,
+                name_lower,
+                cpu_percent,
+                mem_bytes: q.rss_kib * 1024,
+                threads: q.threads,
+                read_rate: f64::NAN,
+                write_rate: f64::NAN,
+                cgroup: None,
+                sort_key: (0, 0, 0),
+            };
+            p.sort_key = sort_key(&p, sort);
+            out.procs.push(p);
         }
-        *prev_net = cur_net;
+        out.sorted = 0;
+        sort_prefix(&mut out.procs, &mut out.sorted, sort_rows);
+        out.tree.clear();
+        out.cgroups.clear();
     }
-    best
 }
 
-#[cfg(target_os = "macos")]
-fn read_network(prev_net: &mut HashMap<String, (u64, u64)>, elapsed: f64) -> NetworkSnapshot {
-    let mut best = NetworkSnapshot { iface: "-".to_string(), rx_rate: 0.0, tx_rate: 0.0 };
-    let mut cur_net: HashMap<String, (u64, u64)> = HashMap::new();
+// Decodes a recording frame by frame. Seeking looks up the keyframe for the
+// target's time slot and decodes forward from it.
+struct Replay {
+    file: MappedFile,
+    cpu_count: String,
+    cpu_name: String,
+    gpu_cores: String,
+    frames: FrameDecoder,
+    keyframes: Vec<(u64, usize)>,
+    // For each KEYFRAME_INTERVAL_MS slot since the start, the first keyframe at
+    // or after the slot start (or the last one before, if the slot has none).
+    slots: Vec<usize>,
+    start_ms: u64,
+    end_ms: u64,
+    // Offset of the next record to decode.
+    pos: usize,
+    ts_ms: u64,
+}
 
-    unsafe {
-        let mut addrs: *mut libc::ifaddrs = std::ptr::null_mut();
-        if libc::getifaddrs(&mut addrs) != 0 {
-            return best;
+impl Replay {
+    fn open(path: &str) -> io::Result<Self> {
+        let file = MappedFile::open(path)?;
+        let bad = |what: &str| io::Error::new(io::ErrorKind::InvalidData, format!("not a utop recording: {}", what));
+        let data = file.bytes();
+        if !data.starts_with(REC_MAGIC) {
+            return Err(bad("bad magic"));
         }
-
-        let mut p = addrs;
-        let mut best_total = 0_u64;
-        while !p.is_null() {
-            let ifa = &*p;
-            if !ifa.ifa_addr.is_null()
-                && (*ifa.ifa_addr).sa_family as i32 == libc::AF_LINK
-                && !ifa.ifa_data.is_null()
-                && (ifa.ifa_flags & libc::IFF_LOOPBACK as u32) == 0
-            {
-                let name = CStr::from_ptr(ifa.ifa_name).to_string_lossy().into_owned();
-                let data = &*(ifa.ifa_data as *const libc::if_data);
-                let rx = data.ifi_ibytes as u64;
-                let tx = data.ifi_obytes as u64;
-                let (prev_rx, prev_tx) = prev_net.get(&name).copied().unwrap_or((rx, tx));
-                let rx_r = if rx >= prev_rx { (rx - prev_rx) as f64 / elapsed } else { 0.0 };
-                let tx_r = if tx >= prev_tx { (tx - prev_tx) as f64 / elapsed } else { 0.0 };
-                if rx + tx > best_total {
-                    best_total = rx + tx;
-                    best.iface = name.clone();
-                    best.rx_rate = rx_r;
-                    best.tx_rate = tx_r;
+        let mut r = RecReader { buf: data, pos: REC_MAGIC.len() };
+        let (kind, header) = r.record().ok_or_else(|| bad("truncated header"))?;
+        if kind != REC_HEADER {
+            return Err(bad("missing header"));
+        }
+        let mut h = RecReader { buf: header, pos: 0 };
+        let mut text = || h.bytes().map(|b| String::from_utf8_lossy(b).into_owned()).ok_or_else(|| bad("truncated header"));
+        let (cpu_count, cpu_name, gpu_cores) = (text()?, text()?, text()?);
+        let first = r.pos;
+
+        let mut strings = Vec::new();
+        let mut keyframes = Vec::new();
+        let mut end_ms = 0;
+        if !Self::read_index(data, &mut strings, &mut keyframes, &mut end_ms) {
+            // No trailer (the recorder was killed): rebuild it from the records.
+            strings.clear();
+            keyframes.clear();
+            let mut r = RecReader { buf: data, pos: first };
+            loop {
+                let at = r.pos;
+                let Some((kind, payload)) = r.record() else { break };
+                let ts = RecReader { buf: payload, pos: 0 }.varint();
+                match kind {
+                    REC_STRING => strings.push(Arc::from(String::from_utf8_lossy(payload).as_ref())),
+                    REC_KEYFRAME => {
+                        keyframes.push((ts.unwrap_or(0), at));
+                        end_ms = ts.unwrap_or(end_ms);
+                    }
+                    REC_DELTA => end_ms = ts.unwrap_or(end_ms),
+                    _ => {}
                 }
-                cur_net.insert(name, (rx, tx));
             }
-            p = ifa.ifa_next;
+        }
+        if keyframes.is_empty() {
+            return Err(bad("no frames"));
         }
 
-        libc::freeifaddrs(addrs);
-    }
+        let start_ms = keyframes[0].0;
+        let slot_count = ((end_ms.saturating_sub(start_ms)) / KEYFRAME_INTERVAL_MS + 1) as usize;
+        let mut slots = Vec::with_capacity(slot_count);
+        let mut k = 0;
+        for slot in 0..slot_count as u64 {
+            let slot_start = start_ms + slot * KEYFRAME_INTERVAL_MS;
+            while k + 1 < keyframes.len() && keyframes[k].0 < slot_start { k += 1; }
+            slots.push(k);
+        }
 
-    *prev_net = cur_net;
-    best
-}
+        let mut replay = Self {
+            file,
+            cpu_count,
+            cpu_name,
+            gpu_cores,
+            frames: FrameDecoder { strings_lower: strings.iter().map(lowercase).collect(), strings, ..Default::default() },
+            keyframes,
+            slots,
+            start_ms,
+            end_ms,
+            pos: first,
+            ts_ms: start_ms,
+        };
+        replay.step();
+        Ok(replay)
+    }
 
-#[cfg(target_os = "windows")]
-fn read_network(prev_net: &mut HashMap<String, (u64, u64)>, elapsed: f64) -> NetworkSnapshot {
-    let mut best = NetworkSnapshot { iface: "-".to_string(), rx_rate: 0.0, tx_rate: 0.0 };
-    let mut cur_net: HashMap<String, (u64, u64)> = HashMap::new();
-    unsafe {
-        let mut table: *mut MIB_IF_TABLE2 = std::ptr::null_mut();
-        if GetIfTable2(&mut table) != 0 {
-            return best;
+    fn read_index(data: &[u8], strings: &mut Vec<Arc<str>>, keyframes: &mut Vec<(u64, usize)>, end_ms: &mut u64) -> bool {
+        let Some(footer) = data.len().checked_sub(16).map(|at| &data[at..]) else { return false };
+        if &footer[8..] != REC_FOOTER_MAGIC {
+            return false;
         }
-        let entries = (*table).NumEntries as usize;
-        let rows = std::slice::from_raw_parts((*table).Table.as_ptr(), entries);
-        let mut best_total = 0_u64;
-        for row in rows {
-            let name = String::from_utf16_lossy(&row.Description).trim_end_matches('\0').to_string();
-            let rx = row.InOctets;
-            let tx = row.OutOctets;
-            let (prev_rx, prev_tx) = prev_net.get(&name).copied().unwrap_or((rx, tx));
-            let rx_r = if rx >= prev_rx { (rx - prev_rx) as f64 / elapsed } else { 0.0 };
-            let tx_r = if tx >= prev_tx { (tx - prev_tx) as f64 / elapsed } else { 0.0 };
-            if rx + tx > best_total {
-                best_total = rx + tx;
-                best.iface = name.clone();
-                best.rx_rate = rx_r;
-                best.tx_rate = tx_r;
+        let offset = u64::from_le_bytes(footer[..8].try_into().unwrap()) as usize;
+        let mut r = RecReader { buf: data, pos: offset };
+        let Some((REC_INDEX, payload)) = r.record() else { return false };
+        let mut p = RecReader { buf: payload, pos: 0 };
+        let mut parse = || -> Option<()> {
+            *end_ms = p.varint()?;
+            for _ in 0..p.varint()? {
+                strings.push(Arc::from(String::from_utf8_lossy(p.bytes()?).as_ref()));
+            }
+            for _ in 0..p.varint()? {
+                keyframes.push((p.varint()?, p.varint()? as usize));
+            }
+            Some(())
+        };
+        parse().is_some()
+    }
+
+    // Timestamp of the next frame, without decoding it.
+    fn peek_ts(&self) -> Option<u64> {
+        let mut r = RecReader { buf: self.file.bytes(), pos: self.pos };
+        loop {
+            let (kind, payload) = r.record()?;
+            if kind == REC_KEYFRAME || kind == REC_DELTA {
+                return RecReader { buf: payload, pos: 0 }.varint();
             }
-            cur_net.insert(name, (rx, tx));
         }
-        FreeMibTable(table as *mut _);
     }
-    *prev_net = cur_net;
-    best
-}
 
-#[cfg(target_os = "linux")]
-fn read_storage() -> Vec<StorageSnapshot> {
-    let mut snapshots = Vec::new();
-    if let Ok(content) = fs::read_to_string("/proc/mounts") {
-        for line in content.lines() {
-            let parts: Vec<&str> = line.split_whitespace().collect();
-            if parts.len() >= 3 {
-                let device = parts[0];
-                let mount_point = parts[1];
-                let _fs_type = parts[2];
-
-                // Skip pseudo-filesystems, only want physical disks
-                if !device.starts_with("/dev/") { continue; }
-                
-                // Avoid duplicates (e.g. same partition mounted in multiple places)
-                if snapshots.iter().any(|s: &StorageSnapshot| s.mount_point == mount_point) { continue; }
-
-                let mut stat: libc::statvfs = unsafe { std::mem::zeroed() };
-                if let Ok(c_mount_point) = std::ffi::CString::new(mount_point) {
-                    if unsafe { libc::statvfs(c_mount_point.as_ptr(), &mut stat) } == 0 {
-                        let frsize = if stat.f_frsize > 0 { stat.f_frsize as u64 } else { stat.f_bsize as u64 };
-                        let total = stat.f_blocks as u64 * frsize;
-                        let free = stat.f_bfree as u64 * frsize;
-                        let used = total.saturating_sub(free);
-                        
-                        if total > 0 {
-                            snapshots.push(StorageSnapshot {
-                                mount_point: mount_point.to_string(),
-                                device: device.to_string(),
-                                used_bytes: used,
-                                total_bytes: total,
-                            });
-                        }
-                    }
-                }
+    // Decode the next frame into the replay state. False at the end.
+    fn step(&mut self) -> bool {
+        let mut r = RecReader { buf: self.file.bytes(), pos: self.pos };
+        loop {
+            let Some((kind, payload)) = r.record() else { return false };
+            if kind != REC_KEYFRAME && kind != REC_DELTA {
+                continue;
             }
+            let Some(ts_ms) = self.frames.frame(kind == REC_KEYFRAME, payload) else {
+                return false;
+            };
+            self.ts_ms = ts_ms;
+            self.pos = r.pos;
+            return true;
         }
     }
-    // Sort by total size (descending), ensuring / is always first
-    snapshots.sort_by(|a, b| {
-        if a.mount_point == "/" { std::cmp::Ordering::Less }
-        else if b.mount_point == "/" { std::cmp::Ordering::Greater }
-        else {
-            b.total_bytes.cmp(&a.total_bytes)
-                .then_with(|| a.mount_point.cmp(&b.mount_point))
+
+    // Jump to the last frame at or before `target_ms`.
+    fn seek(&mut self, target_ms: u64) {
+        let target = target_ms.clamp(self.start_ms, self.end_ms);
+        let slot = ((target - self.start_ms) / KEYFRAME_INTERVAL_MS) as usize;
+        let mut k = self.slots[slot.min(self.slots.len() - 1)];
+        if self.keyframes[k].0 > target && k > 0 {
+            k -= 1;
         }
-    });
-    snapshots
+        self.pos = self.keyframes[k].1;
+        self.step();
+        while self.peek_ts().is_some_and(|ts| ts <= target) {
+            if !self.step() { break; }
+        }
+    }
+
+    fn fill(&self, sort: SortMode, sort_rows: usize, out: &mut Snapshot) {
+        self.frames.fill(sort, sort_rows, out);
+    }
 }
 
-#[cfg(target_os = "macos")]
-fn read_storage() -> Vec<StorageSnapshot> {
-    let mut snapshots = Vec::new();
-    unsafe {
-        let count = libc::getfsstat(std::ptr::null_mut(), 0, libc::MNT_NOWAIT);
-        if count <= 0 {
-            return snapshots;
-        }
+// Decode one frame payload on top of the previous frame's state; returns the
+// frame's timestamp and CPU% denominator. None if the payload is malformed.
+fn decode_frame(strings: &[Arc<str>], keyframe: bool, payload: &[u8], sys: &mut Snapshot, procs: &mut Vec<ReplayProc>, removed: &mut Vec<i32>) -> Option<(u64, u64)> {
+    let mut p = RecReader { buf: payload, pos: 0 };
+    let ts_ms = p.varint()?;
+    let denominator = p.varint()?;
+    sys.cpu = p.varint()? as f64 / 100.0;
+    sys.cpu_temp = p.zigzag()? as f64 / 10.0;
+    sys.cpu_freq = p.varint()? as f64;
+    let m = &mut sys.mem;
+    for v in [&mut m.used_bytes, &mut m.total_bytes, &mut m.swap_used_bytes, &mut m.swap_total_bytes, &mut m.cma_used_bytes, &mut m.cma_total_bytes] {
+        *v = p.varint()?;
+    }
+    let iface = p.varint()?;
+    sys.net.iface.clear();
+    sys.net.iface.push_str(strings.get(iface as usize).map_or("?", |s| s));
+    sys.net.rx_rate = p.varint()? as f64;
+    sys.net.tx_rate = p.varint()? as f64;
+    sys.gpus.clear();
+    for _ in 0..p.varint()? {
+        let name = p.varint()?;
+        let flags = p.byte()?;
+        sys.gpus.push(GpuSnapshot {
+            name: strings.get(name as usize).map_or("?", |s| s).to_string(),
+            usage: p.varint()? as f64 / 10.0,
+            mem_used: p.varint()?,
+            mem_total: p.varint()?,
+            temp: p.zigzag()? as f64 / 10.0,
+            has_usage: flags & REC_HAS_USAGE != 0,
+            has_mem: flags & REC_HAS_MEM != 0,
+            has_temp: flags & REC_HAS_TEMP != 0,
+        });
+    }
+    sys.storage.clear();
+    for _ in 0..p.varint()? {
+        let (mount, device) = (p.varint()?, p.varint()?);
+        sys.storage.push(StorageSnapshot {
+            mount_point: strings.get(mount as usize).map_or("?", |s| s).to_string(),
+            device: strings.get(device as usize).map_or("?", |s| s).to_string(),
+            used_bytes: p.varint()?,
+            total_bytes: p.varint()?,
+            stale: false,
+            read_rate: f64::NAN,
+            write_rate: f64::NAN,
+        });
+    }
 
-        let mut mounts = vec![std::mem::zeroed::<libc::statfs>(); count as usize];
-        let bytes = (mounts.len() * std::mem::size_of::<libc::statfs>()) as libc::c_int;
-        let actual = libc::getfsstat(mounts.as_mut_ptr(), bytes, libc::MNT_NOWAIT);
-        if actual <= 0 {
-            return snapshots;
+    if keyframe {
+        procs.clear();
+    }
+    for q in procs.iter_mut() {
+        q.dticks = 0;
+    }
+    // Removals arrive in ascending PID order, like procs itself, so one
+    // merge pass drops them all.
+    let mut pid = 0_i64;
+    removed.clear();
+    for _ in 0..p.varint()? {
+        pid += p.varint()? as i64;
+        removed.push(pid as i32);
+    }
+    if !removed.is_empty() {
+        let mut next = removed.iter().peekable();
+        procs.retain(|q| {
+            while next.next_if(|&&r| r < q.pid).is_some() {}
+            next.next_if_eq(&&q.pid).is_none()
+        });
+    }
+    let mut pid = 0_i64;
+    let before = procs.len();
+    for _ in 0..p.varint()? {
+        pid += p.varint()? as i64;
+        procs.push(ReplayProc {
+            pid: pid as i32,
+            name: p.varint()? as u32,
+            ticks: p.varint()?,
+            rss_kib: p.varint()?,
+            threads: p.varint()? as i32,
+            dticks: p.varint()?,
+        });
+    }
+    if before > 0 && procs.len() > before {
+        procs.sort_unstable_by_key(|q| q.pid);
+    }
+    let mut pid = 0_i64;
+    for _ in 0..p.varint()? {
+        pid += p.varint()? as i64;
+        let flags = p.byte()?;
+        let i = procs.binary_search_by_key(&(pid as i32), |q| q.pid).ok()?;
+        let q = &mut procs[i];
+        if flags & REC_TICKS != 0 {
+            let d = p.zigzag()?;
+            q.ticks = q.ticks.saturating_add_signed(d);
+            q.dticks = d.max(0) as u64;
         }
+        if flags & REC_RSS != 0 { q.rss_kib = q.rss_kib.saturating_add_signed(p.zigzag()?); }
+        if flags & REC_THREADS != 0 { q.threads += p.zigzag()? as i32; }
+        if flags & REC_NAME != 0 { q.name = p.varint()? as u32; }
+    }
 
-        for mount in mounts.iter().take(actual as usize) {
-            let device = c_char_array_to_string(&mount.f_mntfromname);
-            if !device.starts_with("/dev/") { continue; }
-            let mount_point = c_char_array_to_string(&mount.f_mntonname);
-            if snapshots.iter().any(|s: &StorageSnapshot| s.mount_point == mount_point) { continue; }
+    Some((ts_ms, denominator))
+}
 
-            let total = mount.f_blocks.saturating_mul(mount.f_bsize as u64);
-            let free = mount.f_bfree.saturating_mul(mount.f_bsize as u64);
-            let used = total.saturating_sub(free);
-            if total > 0 {
-                snapshots.push(StorageSnapshot {
-                    mount_point,
-                    device,
-                    used_bytes: used,
-                    total_bytes: total,
-                });
+// Replay counterpart of spawn_sampler: publishes recorded frames at their
+// recorded pace scaled by `speed`, and applies pause and seek requests from
+// the render loop.
+fn spawn_replay(mut replay: Replay, speed: f64, mut writer: SnapshotWriter<Snapshot>, control: Arc<SamplerControl>) -> std::thread::JoinHandle<Option<io::Error>> {
+    std::thread::Builder::new()
+        .name("utop-replay".to_string())
+        .spawn(move || {
+            let mut sort = SortMode::Cpu;
+            let mut clock_ms = replay.ts_ms as f64;
+            let mut last_wall = Instant::now();
+            let mut dirty = true;
+            let mut was_paused = false;
+            let mut epoch = 0;
+            while !QUIT.load(AtomicOrdering::SeqCst) {
+                if control.requested.swap(false, AtomicOrdering::AcqRel) {
+                    sort = *control.sort.lock().unwrap();
+                    dirty = true;
+                }
+                let jump = control.seek_ms.swap(0, AtomicOrdering::AcqRel);
+                if jump != 0 {
+                    replay.seek(replay.ts_ms.saturating_add_signed(jump));
+                    clock_ms = replay.ts_ms as f64;
+                    epoch += 1;
+                    dirty = true;
+                }
+                let paused = control.paused.load(AtomicOrdering::Acquire);
+                if paused != was_paused {
+                    was_paused = paused;
+                    dirty = true;
+                }
+                let now = Instant::now();
+                if !paused {
+                    clock_ms += now.duration_since(last_wall).as_secs_f64() * 1000.0 * speed;
+                }
+                last_wall = now;
+                while let Some(ts) = replay.peek_ts() {
+                    if ts as f64 > clock_ms || !replay.step() { break; }
+                    dirty = true;
+                }
+                if replay.peek_ts().is_none() {
+                    clock_ms = clock_ms.min(replay.ts_ms as f64);
+                }
+
+                if dirty {
+                    let sort_rows = control.sort_rows.load(AtomicOrdering::Relaxed) + SORT_MARGIN;
+                    let back = writer.back_mut();
+                    replay.fill(sort, sort_rows, back);
+                    back.replay = Some(ReplayPos {
+                        pos_ms: replay.ts_ms - replay.start_ms,
+                        total_ms: replay.end_ms - replay.start_ms,
+                        speed,
+                        paused,
+                    });
+                    back.epoch = epoch;
+                    writer.publish();
+                    wake_main();
+                    dirty = false;
+                }
+
+                let wait = match replay.peek_ts() {
+                    Some(ts) if !paused => Duration::from_secs_f64(((ts as f64 - clock_ms) / speed / 1000.0).clamp(0.001, 0.25)),
+                    _ => Duration::from_millis(250),
+                };
+                std::thread::park_timeout(wait);
             }
-        }
+            None
+        })
+        .expect("failed to spawn replay thread")
+}
+
+// A replay position as h:mm:ss.
+struct Hms(u64);
+
+impl fmt::Display for Hms {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        let s = self.0 / 1000;
+        write!(f, "{}:{:02}:{:02}", s / 3600, s / 60 % 60, s % 60)
     }
+}
 
-    snapshots.sort_by(|a, b| {
-        if a.mount_point == "/" { std::cmp::Ordering::Less }
-        else if b.mount_point == "/" { std::cmp::Ordering::Greater }
-        else {
-            b.total_bytes.cmp(&a.total_bytes)
-                .then_with(|| a.mount_point.cmp(&b.mount_point))
-        }
-    });
-    snapshots
+// Port --serve listens on and --connect dials when the address has none.
+const DEFAULT_SERVE_PORT: u16 = 7373;
+// A viewer this far behind is dropped; it redials and starts again from a
+// keyframe rather than holding the agent's memory hostage.
+const SERVE_BACKLOG: usize = 4 << 20;
+// How long the viewer waits before redialling an agent it lost.
+const REMOTE_RETRY: Duration = Duration::from_secs(2);
+const REMOTE_CONNECT_TIMEOUT: Duration = Duration::from_secs(3);
+// Frames from hosts other than the focused one only change the dashboard,
+// so they are published at most this often.
+const REMOTE_SUMMARY_INTERVAL: Duration = Duration::from_millis(500);
+// The viewer's poll timeout, which bounds how late it sees a sort or focus
+// change from the render loop.
+const REMOTE_POLL: Duration = Duration::from_millis(50);
+// LINK/s averages over at least this long.
+const REMOTE_LINK_WINDOW: Duration = Duration::from_secs(5);
+// A host whose last frame is older than this shows as stale.
+const REMOTE_STALE: Duration = Duration::from_secs(5);
+
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+fn hostname() -> String {
+    let mut buf = [0_u8; 256];
+    if unsafe { libc::gethostname(buf.as_mut_ptr() as *mut libc::c_char, buf.len()) } != 0 {
+        return String::new();
+    }
+    let end = buf.iter().position(|&b| b == 0).unwrap_or(buf.len());
+    String::from_utf8_lossy(&buf[..end]).into_owned()
 }
 
 #[cfg(target_os = "windows")]
-fn read_storage() -> Vec<StorageSnapshot> {
-    let mut snapshots = Vec::new();
-    unsafe {
-        let mut buf = [0u16; 512];
-        if GetLogicalDriveStringsW(buf.len() as u32, buf.as_mut_ptr()) == 0 {
-            return snapshots;
-        }
-        let mut i = 0;
-        while i < buf.len() && buf[i] != 0 {
-            let end = i + buf[i..].iter().position(|&c| c == 0).unwrap_or(buf.len() - i);
-            let root = String::from_utf16_lossy(&buf[i..end]);
-            i = end + 1;
-            let root_w = root.encode_utf16().chain(std::iter::once(0)).collect::<Vec<_>>();
-            let mut free_bytes: u64 = 0;
-            let mut total_bytes: u64 = 0;
-            let mut total_free: u64 = 0;
-            if GetDiskFreeSpaceExW(root_w.as_ptr(), &mut free_bytes, &mut total_bytes, &mut total_free) != 0 && total_bytes > 0 {
-                let used = total_bytes.saturating_sub(free_bytes);
-                let device = root.trim_end_matches('\\').to_string();
-                snapshots.push(StorageSnapshot {
-                    mount_point: root,
-                    device,
-                    used_bytes: used,
-                    total_bytes,
-                });
+fn hostname() -> String {
+    std::env::var("COMPUTERNAME").unwrap_or_default()
+}
+
+// "host" or "[v6]" with DEFAULT_SERVE_PORT added; "host:port" as it is.
+fn with_default_port(addr: &str) -> String {
+    let colons = addr.matches(':').count();
+    let has_port = match addr.strip_prefix('[') {
+        Some(rest) => rest.contains("]:"),
+        None => colons == 1,
+    };
+    if has_port {
+        addr.to_string()
+    } else if colons > 1 && !addr.starts_with('[') {
+        format!("[{}]:{}", addr, DEFAULT_SERVE_PORT)
+    } else {
+        format!("{}:{}", addr, DEFAULT_SERVE_PORT)
+    }
+}
+
+// What --serve binds: a bare port or ":port" listens on loopback only, so
+// exposing the unauthenticated stream takes an explicit host.
+fn serve_addr(addr: &str) -> String {
+    if !addr.is_empty() && addr.bytes().all(|b| b.is_ascii_digit()) {
+        format!("127.0.0.1:{}", addr)
+    } else if let Some(port) = addr.strip_prefix(':') {
+        format!("127.0.0.1:{}", port)
+    } else {
+        with_default_port(addr)
+    }
+}
+
+// One viewer connected to --serve: the bytes it still has to be sent.
+struct ServeClient {
+    sock: TcpStream,
+    pending: Vec<u8>,
+    sent: usize,
+}
+
+impl ServeClient {
+    // Write as much as the socket takes without blocking. False once the
+    // viewer has gone away or fallen SERVE_BACKLOG behind.
+    fn flush(&mut self) -> bool {
+        while self.sent < self.pending.len() {
+            match self.sock.write(&self.pending[self.sent..]) {
+                Ok(0) => return false,
+                Ok(n) => self.sent += n,
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => break,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(_) => return false,
             }
         }
+        if self.sent == self.pending.len() {
+            self.pending.clear();
+            self.sent = 0;
+        } else if self.sent >= 64 * 1024 {
+            self.pending.drain(..self.sent);
+            self.sent = 0;
+        }
+        self.pending.len() - self.sent <= SERVE_BACKLOG
     }
-    snapshots.sort_by(|a, b| b.total_bytes.cmp(&a.total_bytes));
-    snapshots
 }
 
-#[cfg_attr(target_os = "windows", allow(unused_variables))]
-fn sample(
-    s: &mut Sampler, sort: SortMode, filter: &str,
-    out_cpu: &mut f64, out_mem: &mut MemorySnapshot, out_net: &mut NetworkSnapshot,
-    out_gpu: &mut GpuSnapshot, out_storage: &mut Vec<StorageSnapshot>, out_cpus: &mut String, cached_gpu: &mut GpuSnapshot, last_gpu_read: &mut Instant
-) {
-    let now = Instant::now();
-    let mut elapsed = now.duration_since(s.last_sample).as_secs_f64();
-    if elapsed < 0.001 { elapsed = 0.001; }
-    s.last_sample = now;
-
-    let cur_cpu = read_cpu_times();
-    let total_prev = s.prev_cpu.user + s.prev_cpu.nice + s.prev_cpu.sys + s.prev_cpu.idle + s.prev_cpu.iowait + s.prev_cpu.irq + s.prev_cpu.softirq + s.prev_cpu.steal;
-    let total_cur = cur_cpu.user + cur_cpu.nice + cur_cpu.sys + cur_cpu.idle + cur_cpu.iowait + cur_cpu.irq + cur_cpu.softirq + cur_cpu.steal;
-    let total_delta = total_cur.saturating_sub(total_prev);
-    let idle_delta = (cur_cpu.idle + cur_cpu.iowait).saturating_sub(s.prev_cpu.idle + s.prev_cpu.iowait);
-
-    *out_cpu = if total_delta > 0 { (total_delta - idle_delta) as f64 * 100.0 / total_delta as f64 } else { 0.0 };
-    *out_mem = read_memory();
-    *out_net = read_network(&mut s.prev_net, elapsed);
-    *out_gpu = read_gpu(s, out_mem, cached_gpu, last_gpu_read);
-    *out_storage = read_storage();
-    *out_cpus = s.cpu_count.clone();
-
-    s.procs.clear();
-    #[allow(unused_mut)]
-    let mut new_ticks: HashMap<i32, u64> = HashMap::with_capacity(s.prev_ticks.len());
-    #[cfg(any(target_os = "linux", target_os = "macos"))]
-    let filter_lower = filter.to_lowercase();
-
-    #[cfg(target_os = "linux")]
-    if let Ok(entries) = fs::read_dir("/proc") {
-        for entry in entries.flatten() {
-            let fname = entry.file_name();
-            let name_str = fname.to_string_lossy();
-            if name_str.chars().next().unwrap_or('a').is_ascii_digit()
-                && let Ok(pid) = name_str.parse::<i32>() {
-                    let stat_path = entry.path().join("stat");
-                    if let Ok(mut fd) = File::open(&stat_path) {
-                        let mut buf = [0u8; 1024];
-                        if let Ok(n) = fd.read(&mut buf) {
-                            let s_str = String::from_utf8_lossy(&buf[..n]);
-                            if let Some(p) = s_str.find('(')
-                                && let Some(endp) = s_str.rfind(')') {
-                                    let proc_name = s_str[p + 1..endp].to_string();
-
-                                    if !filter.is_empty() {
-                                        let pid_str = pid.to_string();
-                                        if !proc_name.to_lowercase().contains(&filter_lower) && !pid_str.contains(&filter_lower) {
-                                            continue;
-                                        }
-                                    }
+// --serve: sample on --interval like --batch does, and stream each frame in
+// the recording format to every connected viewer. A viewer that joins gets
+// the header and string table, and the next frame is a keyframe.
+fn run_serve(mut sampler: Sampler, config: &Config, addr: &str) -> io::Result<()> {
+    let interval = config.interval.unwrap_or(DEFAULT_BATCH_INTERVAL);
+    let listener = TcpListener::bind(addr)?;
+    listener.set_nonblocking(true)?;
+    let host = hostname();
+    let mut stream = Recorder::new(Vec::with_capacity(64 * 1024), &[&sampler.cpu_count, &sampler.cpu_name, &sampler.gpu_cores, &host])?;
+    let preamble = std::mem::take(&mut stream.out);
+    let mut recorder = match &config.record {
+        Some(path) => Some(Recorder::create(path, &sampler.cpu_count, &sampler.cpu_name, &sampler.gpu_cores)?),
+        None => None,
+    };
+    let mut alerts = Alerts::new(config, &sampler)?;
+    let mut clients: Vec<ServeClient> = Vec::new();
+    let mut joined = false;
+    let mut snap = Snapshot::default();
+    sample(&mut sampler, SortMode::Cpu, 0, &mut snap);
+    eprintln!("utop: serving {} on {}", host, listener.local_addr()?);
+
+    let mut next = Instant::now() + interval;
+    while !QUIT.load(AtomicOrdering::SeqCst) {
+        loop {
+            match listener.accept() {
+                Ok((sock, _)) => {
+                    if sock.set_nonblocking(true).is_err() { continue; }
+                    let _ = sock.set_nodelay(true);
+                    let mut pending = preamble.clone();
+                    stream.write_strings(&mut pending);
+                    clients.push(ServeClient { sock, pending, sent: 0 });
+                    joined = true;
+                }
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => break,
+                Err(e) if matches!(e.kind(), io::ErrorKind::Interrupted | io::ErrorKind::ConnectionAborted) => {}
+                Err(e) => return Err(e),
+            }
+        }
 
-                                    let after_paren = &s_str[endp + 2..];
-                                    let parts: Vec<&str> = after_paren.split_whitespace().collect();
-                                    if parts.len() >= 22
-                                        && let (Ok(utime), Ok(stime), Ok(threads), Ok(rss)) = (
-                                            parts[11].parse::<u64>(), parts[12].parse::<u64>(),
-                                            parts[17].parse::<i32>(), parts[21].parse::<i64>()
-                                        ) {
-                                            let total_ticks = utime + stime;
-                                            let prev_t = s.prev_ticks.get(&pid).copied().unwrap_or(0);
-                                            new_ticks.insert(pid, total_ticks);
-
-                                            let cpu_p = if total_delta > 0 {
-                                                total_ticks.saturating_sub(prev_t) as f64 * 100.0 / total_delta as f64
-                                            } else { 0.0 };
-
-                                            s.procs.push(ProcessInfo {
-                                                pid,
-                                                name: proc_name,
-                                                cpu_percent: cpu_p,
-                                                mem_bytes: (rss.max(0) as u64) * s.page_size as u64,
-                                                threads,
-                                            });
-                                        }
-                                }
-                        }
-                    }
+        let now = Instant::now();
+        if now >= next {
+            next += interval;
+            if next < now { next = now + interval; }
+            sample(&mut sampler, SortMode::Cpu, 0, &mut snap);
+            let ts_ms = unix_ms();
+            if let Some(rec) = &mut recorder {
+                rec.write_frame(ts_ms, &sampler.procs, &snap)?;
+            }
+            if let Some(alerts) = &mut alerts {
+                alerts.check(ts_ms, &sampler.procs, &snap);
+            }
+            if !clients.is_empty() {
+                if std::mem::take(&mut joined) { stream.force_keyframe(); }
+                stream.write_frame(ts_ms, &sampler.procs, &snap)?;
+                for c in &mut clients {
+                    c.pending.extend_from_slice(&stream.out);
                 }
+                stream.out.clear();
+            }
+        }
+        clients.retain_mut(|c| c.flush());
+
+        let now = Instant::now();
+        if now < next {
+            std::thread::sleep((next - now).min(Duration::from_millis(100)));
         }
     }
+    if let Some(rec) = recorder {
+        rec.finish()?;
+    }
+    Ok(())
+}
 
-    #[cfg(target_os = "macos")]
-    {
-        let initial_bytes = unsafe { libc::proc_listallpids(std::ptr::null_mut(), 0) };
-        if initial_bytes > 0 {
-            let initial_count = initial_bytes as usize / std::mem::size_of::<i32>();
-            let mut pids = vec![0_i32; initial_count + 64];
-            let bytes = (pids.len() * std::mem::size_of::<i32>()) as libc::c_int;
-            let actual_bytes = unsafe {
-                libc::proc_listallpids(pids.as_mut_ptr() as *mut libc::c_void, bytes)
-            };
+#[derive(Clone, Copy, PartialEq, Debug)]
+enum HostState {
+    Connecting,
+    Up,
+    Down,
+}
 
-            if actual_bytes > 0 {
-                let actual_count = actual_bytes as usize / std::mem::size_of::<i32>();
-                let proc_cpu_denominator = elapsed * s.logical_cpus.max(1) as f64 * 1_000_000_000.0;
-                for pid in pids.into_iter().take(actual_count).filter(|pid| *pid > 0) {
-                    let mut proc_name = String::new();
-                    let mut got_name = false;
-                    if let Some(name) = s.proc_names.get(&pid) {
-                        proc_name = name.clone();
-                        got_name = true;
-                    }
+// One agent's line on the --connect dashboard.
+#[derive(Clone)]
+struct HostSummary {
+    // The agent's hostname once its header arrives, the address until then.
+    name: Arc<str>,
+    cpus: Arc<str>,
+    cpu_name: Arc<str>,
+    gpu_cores: Arc<str>,
+    state: HostState,
+    // Why the last connection ended.
+    error: Option<Arc<str>>,
+    cpu: f64,
+    mem_used: u64,
+    mem_total: u64,
+    rx_rate: f64,
+    tx_rate: f64,
+    procs: usize,
+    // Busiest process in the last frame and its CPU%.
+    top: Option<(Arc<str>, f64)>,
+    // Bytes per second arriving from the agent.
+    link_rate: f64,
+    frame_at: Option<Instant>,
+}
 
-                    let (total_ticks, resident_size, threadnum) = if got_name {
-                        let mut info = unsafe { std::mem::zeroed::<libc::proc_taskinfo>() };
-                        let info_size = std::mem::size_of::<libc::proc_taskinfo>() as libc::c_int;
-                        let read = unsafe {
-                            libc::proc_pidinfo(
-                                pid,
-                                libc::PROC_PIDTASKINFO,
-                                0,
-                                &mut info as *mut _ as *mut libc::c_void,
-                                info_size,
-                            )
-                        };
-                        if read < info_size { continue; }
-                        (info.pti_total_user.saturating_add(info.pti_total_system), info.pti_resident_size, info.pti_threadnum)
-                    } else {
-                        let mut info = unsafe { std::mem::zeroed::<libc::proc_taskallinfo>() };
-                        let info_size = std::mem::size_of::<libc::proc_taskallinfo>() as libc::c_int;
-                        let read = unsafe {
-                            libc::proc_pidinfo(
-                                pid,
-                                libc::PROC_PIDTASKALLINFO,
-                                0,
-                                &mut info as *mut _ as *mut libc::c_void,
-                                info_size,
-                            )
-                        };
-                        if read < info_size { continue; }
-                        let mut name = c_char_array_to_string(&info.pbsd.pbi_name);
-                        if name.is_empty() {
-                            name = c_char_array_to_string(&info.pbsd.pbi_comm);
-                        }
-                        if name.is_empty() {
-                            name = format!("[{}]", pid);
-                        }
-                        proc_name = name.clone();
-                        s.proc_names.insert(pid, name);
-                        (info.ptinfo.pti_total_user.saturating_add(info.ptinfo.pti_total_system), info.ptinfo.pti_resident_size, info.ptinfo.pti_threadnum)
-                    };
+// Connection to one --serve agent. Bytes are buffered until a whole record
+// is in and then decoded just like a recording.
+struct RemoteAgent {
+    addr: String,
+    stream: Option<TcpStream>,
+    dialing: Option<mpsc::Receiver<io::Result<TcpStream>>>,
+    retry_at: Instant,
+    buf: Vec<u8>,
+    // Whether the magic and header have been read off this connection.
+    started: bool,
+    frames: FrameDecoder,
+    has_frame: bool,
+    link_bytes: u64,
+    link_since: Instant,
+    summary: HostSummary,
+}
 
-                    if !filter.is_empty() {
-                        let pid_str = pid.to_string();
-                        if !proc_name.to_lowercase().contains(&filter_lower) && !pid_str.contains(&filter_lower) {
-                            new_ticks.insert(pid, total_ticks);
-                            continue;
-                        }
-                    }
+// Connect to an agent in blocking mode, then switch the socket over.
+fn dial(addr: &str) -> io::Result<TcpStream> {
+    let mut last = io::Error::new(io::ErrorKind::NotFound, "no address");
+    for sa in addr.to_socket_addrs()? {
+        match TcpStream::connect_timeout(&sa, REMOTE_CONNECT_TIMEOUT) {
+            Ok(sock) => {
+                sock.set_nonblocking(true)?;
+                let _ = sock.set_nodelay(true);
+                return Ok(sock);
+            }
+            Err(e) => last = e,
+        }
+    }
+    Err(last)
+}
+
+impl RemoteAgent {
+    fn new(addr: &str) -> Self {
+        let now = Instant::now();
+        let empty: Arc<str> = Arc::from("");
+        Self {
+            addr: with_default_port(addr),
+            stream: None,
+            dialing: None,
+            retry_at: now,
+            buf: Vec::new(),
+            started: false,
+            frames: FrameDecoder::default(),
+            has_frame: false,
+            link_bytes: 0,
+            link_since: now,
+            summary: HostSummary {
+                name: Arc::from(addr),
+                cpus: empty.clone(),
+                cpu_name: empty.clone(),
+                gpu_cores: empty,
+                state: HostState::Connecting,
+                error: None,
+                cpu: 0.0,
+                mem_used: 0,
+                mem_total: 0,
+                rx_rate: 0.0,
+                tx_rate: 0.0,
+                procs: 0,
+                top: None,
+                link_rate: 0.0,
+                frame_at: None,
+            },
+        }
+    }
 
-                    let prev_t = s.prev_ticks.get(&pid).copied().unwrap_or(total_ticks);
-                    new_ticks.insert(pid, total_ticks);
+    // Start a dial when one is due and pick up the result of the last. std
+    // has no nonblocking connect, so each dial runs on a short-lived thread
+    // and only the finished socket joins the event loop.
+    fn poll_dial(&mut self, now: Instant) {
+        if let Some(rx) = &self.dialing {
+            let res = match rx.try_recv() {
+                Ok(res) => res,
+                Err(mpsc::TryRecvError::Empty) => return,
+                Err(mpsc::TryRecvError::Disconnected) => Err(io::Error::other("dial thread died")),
+            };
+            self.dialing = None;
+            match res {
+                Ok(sock) => {
+                    self.stream = Some(sock);
+                    self.buf.clear();
+                    self.started = false;
+                    // The sample count carries on, so the sparklines never
+                    // mistake the first frame after a redial for a repeat.
+                    let seq = self.frames.system.seq;
+                    self.frames = FrameDecoder::default();
+                    self.frames.system.seq = seq;
+                    self.has_frame = false;
+                    self.link_bytes = 0;
+                    self.link_since = now;
+                    self.summary.state = HostState::Up;
+                    self.summary.error = None;
+                }
+                Err(e) => self.disconnect(e.to_string(), now),
+            }
+        } else if self.stream.is_none() && now >= self.retry_at {
+            let (tx, rx) = mpsc::channel();
+            let addr = self.addr.clone();
+            let spawned = std::thread::Builder::new()
+                .name("utop-dial".to_string())
+                .spawn(move || { let _ = tx.send(dial(&addr)); });
+            match spawned {
+                Ok(_) => {
+                    self.dialing = Some(rx);
+                    self.summary.state = HostState::Connecting;
+                }
+                Err(e) => self.disconnect(e.to_string(), now),
+            }
+        }
+    }
 
-                    let cpu_p = if proc_cpu_denominator > 0.0 {
-                        total_ticks.saturating_sub(prev_t) as f64 * 100.0 / proc_cpu_denominator
-                    } else { 0.0 };
+    fn disconnect(&mut self, why: String, now: Instant) {
+        self.stream = None;
+        self.has_frame = false;
+        self.retry_at = now + REMOTE_RETRY;
+        self.summary.state = HostState::Down;
+        self.summary.error = Some(Arc::from(why));
+        self.summary.link_rate = 0.0;
+    }
 
-                    s.procs.push(ProcessInfo {
-                        pid,
-                        name: proc_name,
-                        cpu_percent: cpu_p,
-                        mem_bytes: resident_size,
-                        threads: threadnum,
-                    });
+    // Read whatever the socket has and decode it. Ok(true) if a new frame
+    // was decoded, Err once the connection is unusable.
+    fn receive(&mut self, now: Instant) -> Result<bool, String> {
+        let Some(sock) = &mut self.stream else { return Ok(false) };
+        let mut chunk = [0_u8; 16 * 1024];
+        loop {
+            match sock.read(&mut chunk) {
+                Ok(0) => return Err("closed by agent".to_string()),
+                Ok(n) => {
+                    self.buf.extend_from_slice(&chunk[..n]);
+                    self.link_bytes += n as u64;
                 }
-                s.proc_names.retain(|k, _| new_ticks.contains_key(k));
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => break,
+                Err(e) if e.kind() == io::ErrorKind::Interrupted => {}
+                Err(e) => return Err(e.to_string()),
             }
         }
+        let framed = self.decode()?;
+        if framed {
+            self.summarize(now);
+        }
+        Ok(framed)
     }
 
-    #[cfg(target_os = "windows")]
-    {
-        let filter_lower = filter.to_lowercase();
-        let logical_cpus = s.logical_cpus.max(1);
-        let proc_cpu_denominator = elapsed * logical_cpus as f64 * 10_000_000.0;
-        unsafe {
-            let snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
-            if snapshot != INVALID_HANDLE_VALUE {
-                let mut entry: PROCESSENTRY32W = std::mem::zeroed();
-                entry.dwSize = std::mem::size_of::<PROCESSENTRY32W>() as u32;
-                let mut ok = Process32FirstW(snapshot, &mut entry) != 0;
-                while ok {
-                    let pid = entry.th32ProcessID as i32;
-                    let name = String::from_utf16_lossy(&entry.szExeFile).trim_end_matches('\0').to_string();
-                    let threads = entry.cntThreads as i32;
-
-                    if !filter.is_empty() {
-                        let pid_str = pid.to_string();
-                        if !name.to_lowercase().contains(&filter_lower) && !pid_str.contains(&filter_lower) {
-                            ok = Process32NextW(snapshot, &mut entry) != 0;
-                            continue;
-                        }
+    // Decode every whole record in the buffer and keep the partial tail.
+    fn decode(&mut self) -> Result<bool, String> {
+        let mut r = RecReader { buf: &self.buf, pos: 0 };
+        if !self.started {
+            if self.buf.len() < REC_MAGIC.len() {
+                return Ok(false);
+            }
+            if !self.buf.starts_with(REC_MAGIC) {
+                return Err("not a utop agent".to_string());
+            }
+            r.pos = REC_MAGIC.len();
+            let Some((kind, header)) = r.record() else { return Ok(false) };
+            if kind != REC_HEADER {
+                return Err("missing header".to_string());
+            }
+            let mut h = RecReader { buf: header, pos: 0 };
+            let mut text = || h.bytes().map(|b| Arc::<str>::from(String::from_utf8_lossy(b).as_ref()));
+            let s = &mut self.summary;
+            if let (Some(cpus), Some(cpu_name), Some(gpu_cores)) = (text(), text(), text()) {
+                (s.cpus, s.cpu_name, s.gpu_cores) = (cpus, cpu_name, gpu_cores);
+            }
+            if let Some(name) = text().filter(|n| !n.is_empty()) {
+                s.name = name;
+            }
+            self.started = true;
+        }
+        let mut framed = false;
+        let mut used = r.pos;
+        while let Some((kind, payload)) = r.record() {
+            match kind {
+                REC_STRING => self.frames.define(Arc::from(String::from_utf8_lossy(payload).as_ref())),
+                REC_KEYFRAME | REC_DELTA => {
+                    if kind == REC_DELTA && !self.has_frame {
+                        return Err("stream starts mid-segment".to_string());
                     }
+                    self.frames.frame(kind == REC_KEYFRAME, payload).ok_or("malformed frame")?;
+                    self.has_frame = true;
+                    framed = true;
+                }
+                _ => {}
+            }
+            used = r.pos;
+        }
+        self.buf.drain(..used);
+        Ok(framed)
+    }
 
-                    let handle = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, 0, pid as u32);
-                    if !handle.is_null() {
-                        let mut create_time: FILETIME = std::mem::zeroed();
-                        let mut exit_time: FILETIME = std::mem::zeroed();
-                        let mut kernel_time: FILETIME = std::mem::zeroed();
-                        let mut user_time: FILETIME = std::mem::zeroed();
-                        let mut mem_bytes = 0u64;
-                        if GetProcessTimes(handle, &mut create_time, &mut exit_time, &mut kernel_time, &mut user_time) != 0 {
-                            let kt = ((kernel_time.dwHighDateTime as u64) << 32) | kernel_time.dwLowDateTime as u64;
-                            let ut = ((user_time.dwHighDateTime as u64) << 32) | user_time.dwLowDateTime as u64;
-                            let total_ticks = kt + ut;
-                            let prev_t = s.prev_ticks.get(&pid).copied().unwrap_or(total_ticks);
-                            new_ticks.insert(pid, total_ticks);
-                            let cpu_p = if proc_cpu_denominator > 0.0 {
-                                total_ticks.saturating_sub(prev_t) as f64 * 100.0 / proc_cpu_denominator
-                            } else { 0.0 };
-
-                            let mut pmc: windows_sys::Win32::System::ProcessStatus::PROCESS_MEMORY_COUNTERS = std::mem::zeroed();
-                            pmc.cb = std::mem::size_of::<windows_sys::Win32::System::ProcessStatus::PROCESS_MEMORY_COUNTERS>() as u32;
-                            if K32GetProcessMemoryInfo(handle, &mut pmc, pmc.cb) != 0 {
-                                mem_bytes = pmc.WorkingSetSize as u64;
-                            }
+    fn summarize(&mut self, now: Instant) {
+        let (f, s) = (&self.frames, &mut self.summary);
+        s.cpu = f.system.cpu;
+        s.mem_used = f.system.mem.used_bytes;
+        s.mem_total = f.system.mem.total_bytes;
+        s.rx_rate = f.system.net.rx_rate;
+        s.tx_rate = f.system.net.tx_rate;
+        s.procs = f.procs.len();
+        s.top = f.procs.iter().filter(|q| q.dticks > 0).max_by_key(|q| q.dticks)
+            .map(|q| (f.string(q.name as u64), q.dticks as f64 * 100.0 / f.denominator.max(1) as f64));
+        s.frame_at = Some(now);
+        let window = now.duration_since(self.link_since);
+        if window >= REMOTE_LINK_WINDOW {
+            s.link_rate = self.link_bytes as f64 / window.as_secs_f64();
+            self.link_bytes = 0;
+            self.link_since = now;
+        }
+    }
+}
+
+// Wait up to `timeout` for any of the agents' sockets to become readable.
+#[cfg(any(target_os = "linux", target_os = "macos"))]
+fn wait_readable(agents: &[RemoteAgent], pfds: &mut Vec<libc::pollfd>, timeout: Duration) {
+    use std::os::fd::AsRawFd as _;
+    pfds.clear();
+    pfds.extend(agents.iter().filter_map(|a| a.stream.as_ref())
+        .map(|s| libc::pollfd { fd: s.as_raw_fd(), events: libc::POLLIN, revents: 0 }));
+    unsafe { libc::poll(pfds.as_mut_ptr(), pfds.len() as libc::nfds_t, timeout.as_millis() as libc::c_int); }
+}
+
+// Without poll() here the loop simply naps for the timeout.
+#[cfg(target_os = "windows")]
+fn wait_readable(_agents: &[RemoteAgent], _pfds: &mut Vec<()>, timeout: Duration) {
+    std::thread::sleep(timeout);
+}
 
-                            s.procs.push(ProcessInfo {
-                                pid,
-                                name,
-                                cpu_percent: cpu_p,
-                                mem_bytes,
-                                threads,
-                            });
+// --connect: a single thread multiplexes every agent over nonblocking
+// sockets, keeps each one's decoded state, and publishes the focused host's
+// full frame plus a summary line for every host.
+fn spawn_remote(addrs: Vec<String>, mut writer: SnapshotWriter<Snapshot>, control: Arc<SamplerControl>) -> std::thread::JoinHandle<Option<io::Error>> {
+    std::thread::Builder::new()
+        .name("utop-remote".to_string())
+        .spawn(move || {
+            let mut agents: Vec<RemoteAgent> = addrs.iter().map(|a| RemoteAgent::new(a)).collect();
+            let mut pfds = Vec::with_capacity(agents.len());
+            let mut sort = SortMode::Cpu;
+            let mut focus = 0;
+            let mut focus_dirty = true;
+            let mut summary_dirty = false;
+            let mut last_publish = Instant::now();
+            while !QUIT.load(AtomicOrdering::SeqCst) {
+                if control.requested.swap(false, AtomicOrdering::AcqRel) {
+                    sort = *control.sort.lock().unwrap();
+                    focus_dirty = true;
+                }
+                let want = control.host.load(AtomicOrdering::Relaxed).min(agents.len() - 1);
+                if want != focus {
+                    focus = want;
+                    focus_dirty = true;
+                }
+                let now = Instant::now();
+                for (i, a) in agents.iter_mut().enumerate() {
+                    let before = a.summary.state;
+                    a.poll_dial(now);
+                    let framed = match a.receive(now) {
+                        Ok(framed) => framed,
+                        Err(why) => {
+                            a.disconnect(why, now);
+                            false
                         }
-                        CloseHandle(handle);
+                    };
+                    let changed = framed || a.summary.state != before;
+                    if i == focus { focus_dirty |= changed; } else { summary_dirty |= changed; }
+                }
+
+                if focus_dirty || (summary_dirty && now.duration_since(last_publish) >= REMOTE_SUMMARY_INTERVAL) {
+                    let sort_rows = control.sort_rows.load(AtomicOrdering::Relaxed) + SORT_MARGIN;
+                    let back = writer.back_mut();
+                    let a = &agents[focus];
+                    if a.has_frame {
+                        a.frames.fill(sort, sort_rows, back);
+                    } else {
+                        // Keeps the host's sample count, so the blank frame
+                        // adds nothing to the sparklines.
+                        *back = Snapshot { seq: a.frames.system.seq, ..Snapshot::default() };
                     }
-                    ok = Process32NextW(snapshot, &mut entry) != 0;
+                    back.hosts.clear();
+                    back.hosts.extend(agents.iter().map(|a| a.summary.clone()));
+                    back.host = focus;
+                    writer.publish();
+                    wake_main();
+                    focus_dirty = false;
+                    summary_dirty = false;
+                    last_publish = now;
                 }
-                CloseHandle(snapshot);
+                wait_readable(&agents, &mut pfds, REMOTE_POLL);
             }
+            None
+        })
+        .expect("failed to spawn remote thread")
+}
+
+// A capture keeps at least this much history before the alert that starts
+// it, and records this much after the last alert that extends it.
+const ALERT_PRE_ROLL_MS: u64 = 30_000;
+const ALERT_POST_ROLL_MS: u64 = 30_000;
+
+#[derive(Clone, Copy, PartialEq, Debug)]
+enum AlertMetric {
+    Cpu,
+    Mem,
+    Swap,
+    Temp,
+    Gpu,
+    NetRx,
+    NetTx,
+    Disk,
+    ProcCpu,
+    ProcMem,
+}
+
+// One --alert rule, parsed once; check() walks these in order every sample.
+// Thresholds are in percent, °C or bytes (per second for net), matching how
+// the metric is shown.
+#[derive(Clone, Debug)]
+struct AlertRule {
+    text: String,
+    metric: AlertMetric,
+    // The mount point, for AlertMetric::Disk.
+    mount: String,
+    above: bool,
+    threshold: f64,
+    hold_ms: u64,
+    // When the condition started holding, and for which process on the
+    // proc.* metrics; a different process starts the clock again.
+    since_ms: Option<u64>,
+    pid: i32,
+    fired: bool,
+}
+
+// "proc.cpu > 90% for 10s", "mem>95", "dsk:/ > 98%", "net.rx > 100M".
+fn parse_alert(text: &str) -> Option<AlertRule> {
+    let at = text.find(['>', '<'])?;
+    let name = text[..at].trim();
+    let above = text.as_bytes()[at] == b'>';
+    let rest = text[at + 1..].trim();
+    let (value, hold) = match rest.split_once(" for ") {
+        Some((v, t)) => (v.trim(), parse_duration(t.trim())?),
+        None => (rest, Duration::ZERO),
+    };
+    let (metric, mount) = match name {
+        "cpu" => (AlertMetric::Cpu, ""),
+        "mem" => (AlertMetric::Mem, ""),
+        "swap" => (AlertMetric::Swap, ""),
+        "temp" => (AlertMetric::Temp, ""),
+        "gpu" => (AlertMetric::Gpu, ""),
+        "net.rx" => (AlertMetric::NetRx, ""),
+        "net.tx" => (AlertMetric::NetTx, ""),
+        "proc.cpu" => (AlertMetric::ProcCpu, ""),
+        "proc.mem" => (AlertMetric::ProcMem, ""),
+        _ => (AlertMetric::Disk, name.strip_prefix("dsk:").filter(|m| !m.is_empty())?),
+    };
+    let bytes = matches!(metric, AlertMetric::NetRx | AlertMetric::NetTx | AlertMetric::ProcMem);
+    let (num, scale) = match value.as_bytes().last()? {
+        b'%' if !bytes && metric != AlertMetric::Temp => (&value[..value.len() - 1], 1.0),
+        b'K' | b'k' if bytes => (&value[..value.len() - 1], 1024.0),
+        b'M' if bytes => (&value[..value.len() - 1], 1024.0 * 1024.0),
+        b'G' if bytes => (&value[..value.len() - 1], 1024.0 * 1024.0 * 1024.0),
+        b'0'..=b'9' | b'.' => (value, 1.0),
+        _ => return None,
+    };
+    let threshold = num.trim().parse::<f64>().ok().filter(|v| v.is_finite())? * scale;
+    let per_proc = matches!(metric, AlertMetric::ProcCpu | AlertMetric::ProcMem);
+    if per_proc && !above {
+        return None;
+    }
+    Some(AlertRule {
+        text: text.trim().to_string(),
+        metric,
+        mount: mount.to_string(),
+        above,
+        threshold,
+        hold_ms: hold.as_millis() as u64,
+        since_ms: None,
+        pid: 0,
+        fired: false,
+    })
+}
+
+fn percent_of(used: u64, total: u64) -> Option<f64> {
+    (total > 0).then(|| used as f64 * 100.0 / total as f64)
+}
+
+impl AlertRule {
+    // The machine-wide value this rule watches, or None if the snapshot has
+    // no such reading.
+    fn system_value(&self, snap: &Snapshot) -> Option<f64> {
+        let m = &snap.mem;
+        match self.metric {
+            AlertMetric::Cpu => Some(snap.cpu),
+            AlertMetric::Mem => percent_of(m.used_bytes, m.total_bytes),
+            AlertMetric::Swap => percent_of(m.swap_used_bytes, m.swap_total_bytes),
+            AlertMetric::Temp => (snap.cpu_temp > -1000.0).then_some(snap.cpu_temp),
+            AlertMetric::Gpu => snap.gpus.first().filter(|g| g.has_usage).map(|g| g.usage),
+            AlertMetric::NetRx => Some(snap.net.rx_rate),
+            AlertMetric::NetTx => Some(snap.net.tx_rate),
+            AlertMetric::Disk => snap.storage.iter().find(|s| s.mount_point == self.mount)
+                .and_then(|s| percent_of(s.used_bytes, s.total_bytes)),
+            AlertMetric::ProcCpu | AlertMetric::ProcMem => None,
         }
     }
 
-    s.prev_ticks = new_ticks;
-    s.prev_cpu = cur_cpu;
+    fn hit(&self, v: f64) -> bool {
+        if self.above { v > self.threshold } else { v < self.threshold }
+    }
 
-    s.procs.sort_by(|a, b| {
-        if sort == SortMode::Cpu {
-            b.cpu_percent.partial_cmp(&a.cpu_percent).unwrap_or(Ordering::Equal)
-                .then_with(|| b.mem_bytes.cmp(&a.mem_bytes))
+    // Advance the rule by one sample; Some((value, pid)) on the sample where
+    // it has held for hold_ms. It fires again only after clearing.
+    fn step(&mut self, ts_ms: u64, snap: &Snapshot) -> Option<(f64, i32)> {
+        let found = if matches!(self.metric, AlertMetric::ProcCpu | AlertMetric::ProcMem) {
+            // Stay with the process already being timed while it is over;
+            // otherwise take the worst one.
+            let mut tracked = None;
+            let mut worst: Option<(f64, i32)> = None;
+            for p in &snap.procs {
+                let v = if self.metric == AlertMetric::ProcCpu { p.cpu_percent } else { p.mem_bytes as f64 };
+                if !self.hit(v) { continue; }
+                if p.pid == self.pid { tracked = Some(v); }
+                if worst.is_none_or(|(w, _)| v > w) { worst = Some((v, p.pid)); }
+            }
+            match (tracked, worst) {
+                (Some(v), _) if self.since_ms.is_some() => Some((v, self.pid)),
+                (_, w) => w,
+            }
         } else {
-            b.mem_bytes.cmp(&a.mem_bytes)
-                .then_with(|| b.cpu_percent.partial_cmp(&a.cpu_percent).unwrap_or(Ordering::Equal))
+            self.system_value(snap).filter(|&v| self.hit(v)).map(|v| (v, 0))
+        };
+        let Some((value, pid)) = found else {
+            self.since_ms = None;
+            self.fired = false;
+            return None;
+        };
+        if pid != self.pid {
+            self.pid = pid;
+            self.since_ms = None;
+            self.fired = false;
         }
-    });
+        let since = *self.since_ms.get_or_insert(ts_ms);
+        if self.fired || ts_ms.saturating_sub(since) < self.hold_ms {
+            return None;
+        }
+        self.fired = true;
+        Some((value, pid))
+    }
 }
 
-enum KeyType {
-    None, Quit, Up, Down, Left, Right, Backspace, Enter, Esc, Char(char),
+// Frames encoded in memory so an alert can save what led up to it. The
+// buffer is cut back to the previous keyframe every ALERT_PRE_ROLL_MS, so it
+// always holds one to two pre-rolls of full process tables.
+struct AlertCapture {
+    dir: String,
+    rec: Recorder<Vec<u8>>,
+    preamble: Vec<u8>,
+    // Strings defined before the start of rec.out, and the offset and string
+    // count at the newest keyframe.
+    kept_strings: usize,
+    mark: (usize, usize),
+    next_roll_ms: u64,
+    // The capture being written and when it ends.
+    file: Option<(io::BufWriter<File>, u64)>,
+    path: String,
 }
 
-#[cfg(any(target_os = "linux", target_os = "macos"))]
-fn read_key() -> KeyType {
-    let mut buf = [0u8; 16];
-    let n = unsafe { libc::read(libc::STDIN_FILENO, buf.as_mut_ptr() as *mut libc::c_void, buf.len()) };
-    if n <= 0 { return KeyType::None; }
-    let n = n as usize;
+impl AlertCapture {
+    fn new(dir: &str, sampler: &Sampler) -> io::Result<Self> {
+        fs::create_dir_all(dir)?;
+        let mut rec = Recorder::new(Vec::with_capacity(256 * 1024), &[&sampler.cpu_count, &sampler.cpu_name, &sampler.gpu_cores])?;
+        let preamble = std::mem::take(&mut rec.out);
+        Ok(Self { dir: dir.to_string(), rec, preamble, kept_strings: 0, mark: (0, 0), next_roll_ms: 0, file: None, path: String::new() })
+    }
 
-    if buf[0] == 3 { return KeyType::Quit; }
+    fn frame(&mut self, ts_ms: u64, table: &ProcTable, snap: &Snapshot) -> io::Result<()> {
+        if ts_ms >= self.next_roll_ms {
+            let (offset, strings) = self.mark;
+            self.rec.out.drain(..offset);
+            self.kept_strings = strings;
+            self.mark = (self.rec.out.len(), self.rec.string_list.len());
+            self.rec.force_keyframe();
+            self.next_roll_ms = ts_ms + ALERT_PRE_ROLL_MS;
+        }
+        let start = self.rec.out.len();
+        self.rec.write_frame(ts_ms, table, snap)?;
+        if let Some((file, until_ms)) = &mut self.file {
+            file.write_all(&self.rec.out[start..])?;
+            if ts_ms >= *until_ms {
+                file.flush()?;
+                self.file = None;
+            }
+        }
+        Ok(())
+    }
 
-    if n == 1 {
-        if buf[0] == 27 { return KeyType::Esc; }
-        if buf[0] == 127 || buf[0] == 8 { return KeyType::Backspace; }
-        if buf[0] == 10 || buf[0] == 13 { return KeyType::Enter; }
-        if buf[0].is_ascii_graphic() || buf[0] == b' ' { return KeyType::Char(buf[0] as char); }
-    } else if n >= 3 && buf[0] == 27 && buf[1] == b'[' {
-        if buf[2] == b'A' { return KeyType::Up; }
-        if buf[2] == b'B' { return KeyType::Down; }
-        if buf[2] == b'C' { return KeyType::Right; }
-        if buf[2] == b'D' { return KeyType::Left; }
+    // Start a capture file holding the pre-roll, or extend the open one.
+    // The file has no trailer index, so replay scans it on open.
+    fn trigger(&mut self, ts_ms: u64) -> io::Result<&str> {
+        if let Some((_, until_ms)) = &mut self.file {
+            *until_ms = ts_ms + ALERT_POST_ROLL_MS;
+            return Ok(&self.path);
+        }
+        self.path = format!("{}/utop-alert-{}.rec", self.dir.trim_end_matches('/'), ts_ms);
+        let mut file = io::BufWriter::new(File::create(&self.path)?);
+        let mut head = self.preamble.clone();
+        for s in &self.rec.string_list[..self.kept_strings] {
+            put_record(&mut head, REC_STRING, s.as_bytes());
+        }
+        file.write_all(&head)?;
+        file.write_all(&self.rec.out)?;
+        file.flush()?;
+        self.file = Some((file, ts_ms + ALERT_POST_ROLL_MS));
+        Ok(&self.path)
     }
-    KeyType::None
 }
 
-#[cfg(target_os = "windows")]
-fn read_key() -> KeyType {
-    let mut num_events: u32 = 0;
-    unsafe {
-        let h = GetStdHandle(STD_INPUT_HANDLE);
-        // Non-blocking: return None immediately if no events pending
-        if GetNumberOfConsoleInputEvents(h, &mut num_events) == 0 || num_events == 0 {
-            return KeyType::None;
+// --alert rules and what firing one does: print it to stderr, save a
+// capture if --alert-capture is set, and run --alert-exec with the details
+// in UTOP_ALERT_* variables.
+struct Alerts {
+    rules: Vec<AlertRule>,
+    exec: Option<String>,
+    capture: Option<AlertCapture>,
+    hooks: Vec<std::process::Child>,
+}
+
+impl Alerts {
+    fn new(config: &Config, sampler: &Sampler) -> io::Result<Option<Self>> {
+        if config.alerts.is_empty() {
+            return Ok(None);
         }
-        let mut record: INPUT_RECORD = std::mem::zeroed();
-        let mut events_read: u32 = 0;
-        if ReadConsoleInputW(h, &mut record, 1, &mut events_read) == 0 || events_read == 0 {
-            return KeyType::None;
+        let capture = match &config.alert_capture {
+            Some(dir) => Some(AlertCapture::new(dir, sampler)?),
+            None => None,
+        };
+        Ok(Some(Self { rules: config.alerts.clone(), exec: config.alert_exec.clone(), capture, hooks: Vec::new() }))
+    }
+
+    // Run once per sample, after the process table was read.
+    fn check(&mut self, ts_ms: u64, table: &ProcTable, snap: &Snapshot) {
+        self.hooks.retain_mut(|c| matches!(c.try_wait(), Ok(None)));
+        if let Some(cap) = &mut self.capture
+            && let Err(e) = cap.frame(ts_ms, table, snap) {
+                eprintln!("utop: alert capture: {}", e);
+                self.capture = None;
+            }
+        for i in 0..self.rules.len() {
+            if let Some((value, pid)) = self.rules[i].step(ts_ms, snap) {
+                self.fire(i, ts_ms, value, pid, snap);
+            }
         }
-        if record.EventType != 1 /* KEY_EVENT */ { return KeyType::None; }
-        let ke: KEY_EVENT_RECORD = record.Event.KeyEvent;
-        if ke.bKeyDown == 0 { return KeyType::None; }
-        let ch = ke.uChar.UnicodeChar;
-        if ch != 0 {
-            let byte = ch as u8;
-            if byte == 3 { return KeyType::Quit; }
-            if byte == 27 { return KeyType::Esc; }
-            if byte == 127 || byte == 8 { return KeyType::Backspace; }
-            if byte == 10 || byte == 13 { return KeyType::Enter; }
-            if byte.is_ascii_graphic() || byte == b' ' { return KeyType::Char(byte as char); }
-            return KeyType::None;
+    }
+
+    fn fire(&mut self, rule: usize, ts_ms: u64, value: f64, pid: i32, snap: &Snapshot) {
+        let rule = &self.rules[rule];
+        let proc_name = snap.procs.iter().find(|p| p.pid == pid && pid != 0).map(|p| p.name.clone());
+        let capture = match &mut self.capture {
+            Some(cap) => match cap.trigger(ts_ms) {
+                Ok(path) => Some(path.to_string()),
+                Err(e) => {
+                    eprintln!("utop: alert capture: {}", e);
+                    None
+                }
+            },
+            None => None,
+        };
+        match &proc_name {
+            Some(name) => eprintln!("utop: alert \"{}\": {:.1} (pid {} {}){}", rule.text, value, pid, name,
+                capture.as_deref().map_or(String::new(), |p| format!(", saved to {}", p))),
+            None => eprintln!("utop: alert \"{}\": {:.1}{}", rule.text, value,
+                capture.as_deref().map_or(String::new(), |p| format!(", saved to {}", p))),
         }
-        match ke.wVirtualKeyCode {
-            0x26 /* VK_UP */ => KeyType::Up,
-            0x28 /* VK_DOWN */ => KeyType::Down,
-            0x25 /* VK_LEFT */ => KeyType::Left,
-            0x27 /* VK_RIGHT */ => KeyType::Right,
-            _ => KeyType::None,
+        let Some(cmd) = &self.exec else { return };
+        #[cfg(any(target_os = "linux", target_os = "macos"))]
+        let mut command = std::process::Command::new("/bin/sh");
+        #[cfg(any(target_os = "linux", target_os = "macos"))]
+        command.arg("-c").arg(cmd);
+        #[cfg(target_os = "windows")]
+        let mut command = std::process::Command::new("cmd");
+        #[cfg(target_os = "windows")]
+        command.arg("/C").arg(cmd);
+        command.stdin(std::process::Stdio::null())
+            .env("UTOP_ALERT_RULE", &rule.text)
+            .env("UTOP_ALERT_VALUE", format!("{:.1}", value))
+            .env("UTOP_ALERT_TIME_MS", ts_ms.to_string());
+        if let Some(name) = &proc_name {
+            command.env("UTOP_ALERT_PID", pid.to_string()).env("UTOP_ALERT_PROC", &**name);
+        }
+        if let Some(path) = &capture {
+            command.env("UTOP_ALERT_CAPTURE", path);
+        }
+        match command.spawn() {
+            Ok(child) => self.hooks.push(child),
+            Err(e) => eprintln!("utop: --alert-exec: {}", e),
+        }
+    }
+}
+
+const USAGE: &str = "\
+usage: utop [options]
+
+options:
+  --sampler-threads N   read processes on N worker threads
+                        (default: one per 16 logical CPUs)
+  --proc-source S       procfs, or bpf for one BPF task iterator pass per
+                        sample (Linux, needs CAP_BPF; default: procfs)
+  --net-source S        procfs, or netlink for binary rtnetlink interface
+                        stats (Linux; default: procfs)
+  --batch               no TUI; stream snapshots to stdout or --output
+  --format jsonl|csv    batch record format (default: jsonl)
+  --interval T          time between batch records or served frames,
+                        e.g. 1s, 500ms (default: 1s)
+  --count N             stop after N batch records (default: run until killed)
+  --output PATH         write batch records to PATH instead of stdout
+  --top N               processes per batch record (default: 10)
+  --record PATH         also save every sample to a compact recording
+  --replay PATH         browse a recording instead of this machine
+  --speed X             replay speed multiplier (default: 1)
+  --alert RULE          with --batch or --serve, report when RULE holds, e.g.
+                        'proc.cpu > 90% for 10s', 'mem > 95%', 'dsk:/ > 98%'
+  --alert-exec CMD      run CMD through the shell when an alert fires
+  --alert-capture DIR   save a recording of the 30s around each alert in DIR
+  --serve ADDR          no TUI; stream samples to viewers connecting to
+                        ADDR, e.g. 10.0.0.5:7373 (a bare port listens on
+                        127.0.0.1 only; 0.0.0.0:7373 for every interface)
+  --connect H1,H2,...   watch the --serve agents at H1, H2, ... (port
+                        defaults to 7373)
+  --history N           samples kept for the sparklines (default: 120)
+  --root DIR            read proc/ and sys/ under DIR, e.g. a host's trees
+                        mounted into a container (Linux)
+  --profile             count syscalls per stage from the start, and add
+                        per-stage p50/p99 to batch JSONL records
+  --period C=T          how often collector C runs, e.g. storage=30s; C is
+                        procs, cpu, mem, net, storage, gpu, temp, freq,
+                        cgroup, diskio or threads
+  -h, --help            show this help
+";
+
+// Where Linux process stats come from; see TaskIter.
+#[derive(Clone, Copy, Default, PartialEq, Debug)]
+enum ProcSource {
+    #[default]
+    Procfs,
+    Bpf,
+}
+
+// Where Linux interface counters come from; see NetlinkStats.
+#[derive(Clone, Copy, Default, PartialEq, Debug)]
+enum NetSource {
+    #[default]
+    Procfs,
+    Netlink,
+}
+
+#[derive(Default)]
+struct Config {
+    sampler_threads: Option<usize>,
+    batch: bool,
+    format: ExportFormat,
+    interval: Option<Duration>,
+    count: Option<u64>,
+    output: Option<String>,
+    top: Option<usize>,
+    record: Option<String>,
+    replay: Option<String>,
+    speed: Option<f64>,
+    serve: Option<String>,
+    connect: Vec<String>,
+    alerts: Vec<AlertRule>,
+    alert_exec: Option<String>,
+    alert_capture: Option<String>,
+    history: Option<usize>,
+    proc_source: ProcSource,
+    net_source: NetSource,
+    profile: bool,
+    root: Option<String>,
+    periods: Vec<(Collector, Duration)>,
+}
+
+fn parse_args<I: Iterator<Item = String>>(mut args: I) -> Result<Config, String> {
+    let mut config = Config::default();
+    let mut batch_only = None;
+    while let Some(arg) = args.next() {
+        match arg.as_str() {
+            "--sampler-threads" => {
+                let v = args.next().ok_or("--sampler-threads needs a value")?;
+                let n = v.parse::<usize>().ok().filter(|n| *n > 0)
+                    .ok_or_else(|| format!("invalid --sampler-threads value '{}'", v))?;
+                config.sampler_threads = Some(n);
+            }
+            "--batch" => config.batch = true,
+            "--profile" => config.profile = true,
+            "--root" => config.root = Some(args.next().ok_or("--root needs a value")?),
+            "--format" => {
+                let v = args.next().ok_or("--format needs a value")?;
+                config.format = match v.as_str() {
+                    "jsonl" | "json" => ExportFormat::Jsonl,
+                    "csv" => ExportFormat::Csv,
+                    _ => return Err(format!("invalid --format value '{}'", v)),
+                };
+                batch_only = Some("--format");
+            }
+            "--interval" => {
+                let v = args.next().ok_or("--interval needs a value")?;
+                config.interval = Some(parse_duration(&v).ok_or_else(|| format!("invalid --interval value '{}'", v))?);
+                batch_only = Some("--interval");
+            }
+            "--count" => {
+                let v = args.next().ok_or("--count needs a value")?;
+                config.count = Some(v.parse::<u64>().ok().filter(|n| *n > 0)
+                    .ok_or_else(|| format!("invalid --count value '{}'", v))?);
+                batch_only = Some("--count");
+            }
+            "--output" => {
+                config.output = Some(args.next().ok_or("--output needs a value")?);
+                batch_only = Some("--output");
+            }
+            "--top" => {
+                let v = args.next().ok_or("--top needs a value")?;
+                config.top = Some(v.parse::<usize>().map_err(|_| format!("invalid --top value '{}'", v))?);
+                batch_only = Some("--top");
+            }
+            "--proc-source" => {
+                let v = args.next().ok_or("--proc-source needs a value")?;
+                config.proc_source = match v.as_str() {
+                    "procfs" => ProcSource::Procfs,
+                    "bpf" => ProcSource::Bpf,
+                    _ => return Err(format!("invalid --proc-source value '{}'", v)),
+                };
+            }
+            "--net-source" => {
+                let v = args.next().ok_or("--net-source needs a value")?;
+                config.net_source = match v.as_str() {
+                    "procfs" => NetSource::Procfs,
+                    "netlink" => NetSource::Netlink,
+                    _ => return Err(format!("invalid --net-source value '{}'", v)),
+                };
+            }
+            "--history" => {
+                let v = args.next().ok_or("--history needs a value")?;
+                config.history = Some(v.parse::<usize>().ok().filter(|n| (1..=MAX_HISTORY).contains(n))
+                    .ok_or_else(|| format!("invalid --history value '{}'", v))?);
+            }
+            "--period" => {
+                let v = args.next().ok_or("--period needs a value")?;
+                let period = v.split_once('=')
+                    .and_then(|(c, t)| Some((Collector::parse(c)?, parse_duration(t)?)))
+                    .ok_or_else(|| format!("invalid --period value '{}'", v))?;
+                config.periods.push(period);
+            }
+            "--record" => config.record = Some(args.next().ok_or("--record needs a value")?),
+            "--replay" => config.replay = Some(args.next().ok_or("--replay needs a value")?),
+            "--alert" => {
+                let v = args.next().ok_or("--alert needs a value")?;
+                config.alerts.push(parse_alert(&v).ok_or_else(|| format!("invalid --alert rule '{}'", v))?);
+            }
+            "--alert-exec" => config.alert_exec = Some(args.next().ok_or("--alert-exec needs a value")?),
+            "--alert-capture" => config.alert_capture = Some(args.next().ok_or("--alert-capture needs a value")?),
+            "--serve" => config.serve = Some(serve_addr(&args.next().ok_or("--serve needs a value")?)),
+            "--connect" => {
+                let v = args.next().ok_or("--connect needs a value")?;
+                config.connect = v.split(',').map(str::trim).filter(|h| !h.is_empty()).map(String::from).collect();
+                if config.connect.is_empty() {
+                    return Err(format!("invalid --connect value '{}'", v));
+                }
+            }
+            "--speed" => {
+                let v = args.next().ok_or("--speed needs a value")?;
+                config.speed = Some(v.parse::<f64>().ok().filter(|x| x.is_finite() && *x > 0.0)
+                    .ok_or_else(|| format!("invalid --speed value '{}'", v))?);
+            }
+            _ => return Err(format!("unknown option '{}'", arg)),
+        }
+    }
+    if let Some(opt) = batch_only
+        && !config.batch && !(opt == "--interval" && config.serve.is_some()) {
+            return Err(format!("{} needs --batch", opt));
         }
+    if (config.alert_exec.is_some() || config.alert_capture.is_some()) && config.alerts.is_empty() {
+        return Err(format!("{} needs --alert", if config.alert_exec.is_some() { "--alert-exec" } else { "--alert-capture" }));
+    }
+    if !config.alerts.is_empty() && !config.batch && config.serve.is_none() {
+        return Err("--alert needs --batch or --serve".to_string());
     }
+    if config.serve.is_some() && (config.batch || config.replay.is_some() || !config.connect.is_empty()) {
+        return Err(format!("--serve cannot be combined with {}",
+            if config.batch { "--batch" } else if config.replay.is_some() { "--replay" } else { "--connect" }));
+    }
+    if !config.connect.is_empty() && (config.batch || config.replay.is_some() || config.record.is_some() || config.root.is_some()) {
+        return Err(format!("--connect cannot be combined with {}",
+            if config.batch { "--batch" } else if config.replay.is_some() { "--replay" } else if config.record.is_some() { "--record" } else { "--root" }));
+    }
+    if config.replay.is_some() && (config.batch || config.record.is_some()) {
+        return Err(format!("--replay cannot be combined with {}", if config.batch { "--batch" } else { "--record" }));
+    }
+    if config.speed.is_some() && config.replay.is_none() {
+        return Err("--speed needs --replay".to_string());
+    }
+    if config.root.is_some() && config.replay.is_some() {
+        return Err("--root cannot be combined with --replay".to_string());
+    }
+    if config.profile && config.batch && config.format == ExportFormat::Csv {
+        return Err("--profile needs --format jsonl".to_string());
+    }
+    if !config.periods.is_empty() && (config.batch || config.serve.is_some() || config.replay.is_some() || !config.connect.is_empty()) {
+        return Err(format!("--period cannot be combined with {}",
+            if config.batch { "--batch" } else if config.serve.is_some() { "--serve" } else if config.replay.is_some() { "--replay" } else { "--connect" }));
+    }
+    Ok(config)
 }
 
 fn main() {
+    let args: Vec<String> = std::env::args().skip(1).collect();
+    if args.iter().any(|a| a == "-h" || a == "--help") {
+        print!("{}", USAGE);
+        return;
+    }
+    let config = match parse_args(args.into_iter()) {
+        Ok(c) => c,
+        Err(e) => {
+            eprint!("utop: {}\n\n{}", e, USAGE);
+            std::process::exit(2);
+        }
+    };
+
     #[cfg(any(target_os = "linux", target_os = "macos"))]
     unsafe {
         libc::signal(libc::SIGINT, signal_handler as *const () as libc::sighandler_t);
         libc::signal(libc::SIGTERM, signal_handler as *const () as libc::sighandler_t);
+        libc::signal(libc::SIGWINCH, resize_handler as *const () as libc::sighandler_t);
     }
     #[cfg(target_os = "windows")]
     unsafe {
         SetConsoleCtrlHandler(Some(ctrl_handler), TRUE);
     }
 
-    let _terminal = Terminal::init().ok();
-    
-    let mut sampler = Sampler::new();
-    let mut sort = SortMode::Cpu;
-    let mut filter = String::new();
-    let mut is_search = false;
-    let mut selection = 0_usize;
-    let colours = colour_enabled();
-
-    let mut last_sample = Instant::now();
+    let fail = |e: io::Error| -> ! {
+        eprintln!("utop: {}", e);
+        std::process::exit(1);
+    };
+    let fail_at = |path: &str, e: io::Error| -> ! {
+        eprintln!("utop: {}: {}", path, e);
+        std::process::exit(1);
+    };
+
+    // Samplers wake the render loop when they publish, so it can sleep.
+    #[cfg(any(target_os = "linux", target_os = "macos"))]
+    let wake_rx = open_wake_pipe().ok();
+    #[cfg(target_os = "windows")]
+    let wake_event = {
+        let event = unsafe { CreateEventW(std::ptr::null(), 0, 0, std::ptr::null()) };
+        WAKE_EVENT.store(event, AtomicOrdering::Relaxed);
+        event
+    };
+
+    let control = Arc::new(SamplerControl {
+        sort: Mutex::new(SortMode::Cpu),
+        requested: AtomicBool::new(false),
+        sort_rows: AtomicUsize::new(0),
+        seek_ms: AtomicI64::new(0),
+        paused: AtomicBool::new(false),
+        tree: AtomicBool::new(false),
+        cgroups: AtomicBool::new(false),
+        io_rows: AtomicUsize::new(0),
+        io_pids: Mutex::new(Vec::new()),
+        threads: AtomicI32::new(-1),
+        host: AtomicUsize::new(0),
+    });
+    let (writer, mut reader) = triple_buffer::<Snapshot>();
+    let mut rediscovered = None;
+    let (cpus, cpu_name, gpu_cores, profile, worker) = if !config.connect.is_empty() {
+        (String::new(), String::new(), String::new(), Arc::new(Profile::new()),
+            spawn_remote(config.connect.clone(), writer, control.clone()))
+    } else if let Some(path) = &config.replay {
+        let replay = Replay::open(path).unwrap_or_else(|e| fail_at(path, e));
+        (replay.cpu_count.clone(), replay.cpu_name.clone(), replay.gpu_cores.clone(), Arc::new(Profile::new()),
+            spawn_replay(replay, config.speed.unwrap_or(1.0), writer, control.clone()))
+    } else {
+        if let Some(root) = &config.root {
+            #[cfg(target_os = "linux")]
+            let _ = SYS_ROOT.set(root.trim_end_matches('/').to_string());
+            #[cfg(not(target_os = "linux"))]
+            eprintln!("utop: --root {} is Linux-only, ignoring it", root);
+        }
+        // Interactive runs start from the discovery cache, when this boot has
+        // one, and check it in the background.
+        let cache = (!config.batch && config.serve.is_none()).then(discovery_cache_path).flatten().zip(discovery_key());
+        let cached = cache.as_ref().and_then(|(path, key)| load_discovery(path, key));
+        let mut sampler = match &cached {
+            Some(found) => Sampler::discovered(found.clone()),
+            None => Sampler::new(),
+        };
+        if let Some((path, key)) = cache {
+            rediscovered = Some(spawn_discovery_check(path, key, cached));
+        }
+        if let Some(n) = config.sampler_threads {
+            sampler = sampler.with_sampler_threads(n);
+        }
+        sampler = sampler.with_proc_source(config.proc_source).with_net_source(config.net_source);
+        for &(c, period) in &config.periods {
+            sampler = sampler.with_period(c, period);
+        }
+        if config.batch {
+            if let Err(e) = run_batch(sampler, &config)
+                && e.kind() != io::ErrorKind::BrokenPipe {
+                    fail(e);
+                }
+            return;
+        }
+        if let Some(addr) = &config.serve {
+            if let Err(e) = run_serve(sampler, &config, addr) {
+                fail_at(addr, e);
+            }
+            return;
+        }
+        let recorder = config.record.as_deref()
+            .map(|path| Recorder::create(path, &sampler.cpu_count, &sampler.cpu_name, &sampler.gpu_cores)
+                .unwrap_or_else(|e| fail_at(path, e)));
+        sampler.profile.count_syscalls.store(config.profile, AtomicOrdering::Relaxed);
+        (sampler.cpu_count.clone(), sampler.cpu_name.clone(), sampler.gpu_cores.clone(), sampler.profile.clone(),
+            spawn_sampler(sampler, recorder, writer, control.clone()))
+    };
+    let sampler_thread = worker.thread().clone();
+    let terminal = Terminal::init().ok();
+
+    let mut ui = Ui {
+        cpus,
+        cpu_name,
+        gpu_cores,
+        sort: SortMode::Cpu,
+        filter: String::new(),
+        filter_lower: String::new(),
+        view: FilterView::default(),
+        is_search: false,
+        pane: if config.connect.is_empty() { Pane::Procs } else { Pane::Hosts },
+        io: false,
+        io_pids: Vec::new(),
+        tree: false,
+        tree_view: TreeView::default(),
+        cgroup_view: CgroupView::default(),
+        selection: 0,
+        selected_pid: None,
+        selected_cgroup: None,
+        threads_pid: None,
+        colours: colour_enabled(),
+    };
+
     let mut last_render = Instant::now();
 
-    let mut out = BufWriter::with_capacity(16384, io::stdout());
-    let mut cpu = 0.0;
-    let mut mem = MemorySnapshot::default();
-    let mut net = NetworkSnapshot::default();
-    let mut gpu = GpuSnapshot::default();
-    let mut storage: Vec<StorageSnapshot> = Vec::new();
-    let mut cached_gpu = GpuSnapshot::default();
-    let mut last_gpu_read = Instant::now().checked_sub(Duration::from_secs(10)).unwrap();
-    let mut cpus = String::new();
-    let mut needs_sample = true;
+    let mut out = io::stdout();
+    let mut screen = Screen::new();
+    let mut history = History::new(config.history.unwrap_or(DEFAULT_HISTORY));
+    let (mut history_host, mut history_epoch, mut history_seq) = (0, 0, 0);
+    let mut needs_sample = false;
     let mut needs_render = true;
 
-    let mut cpu_temp = -1000.0;
-    let mut cpu_freq = 0.0;
-
     loop {
         if QUIT.load(AtomicOrdering::SeqCst) { break; }
         let now = Instant::now();
+        if RESIZED.swap(false, AtomicOrdering::SeqCst) {
+            needs_render = true;
+        }
 
-        if now.duration_since(last_sample) >= Duration::from_millis(500) || needs_sample {
-            sample(&mut sampler, sort, &filter, &mut cpu, &mut mem, &mut net, &mut gpu, &mut storage, &mut cpus, &mut cached_gpu, &mut last_gpu_read);
-            cpu_temp = read_cpu_temp(&mut sampler.cpu_temp_path);
-            cpu_freq = read_cpu_freq(&mut sampler.cpu_freq_paths);
-            last_sample = now;
+        // Leaving the cgroup table stops its collector from the next pass;
+        // opening it asks for a pass straight away.
+        control.cgroups.store(ui.pane == Pane::Cgroups, AtomicOrdering::Relaxed);
+        control.threads.store(ui.threads_pid.filter(|_| ui.pane == Pane::Threads).unwrap_or(-1), AtomicOrdering::Relaxed);
+        if needs_sample {
+            *control.sort.lock().unwrap() = ui.sort;
+            control.requested.store(true, AtomicOrdering::Release);
+            sampler_thread.unpark();
             needs_sample = false;
+        }
+        if let Some(found) = rediscovered.as_ref().and_then(|rx: &mpsc::Receiver<Discovery>| rx.try_recv().ok()) {
+            (ui.cpus, ui.cpu_name, ui.gpu_cores) = (found.cpu_count, found.cpu_name, found.gpu_cores);
+            needs_render = true;
+        }
+        if reader.update() {
+            // The sparklines start over when --connect switches hosts or a
+            // replay seeks, and take a point only for a new sample.
+            let snap = reader.get_mut();
+            if snap.host != history_host || snap.epoch != history_epoch {
+                (history_host, history_epoch, history_seq) = (snap.host, snap.epoch, 0);
+                history = History::new(config.history.unwrap_or(DEFAULT_HISTORY));
+            }
+            if snap.seq != history_seq {
+                history_seq = snap.seq;
+                history.push(snap);
+            }
+            ui.view.current = false;
             needs_render = true;
         }
 
-        if needs_render && now.duration_since(last_render) >= Duration::from_millis(16) {
+        if needs_render && now.duration_since(last_render) >= RENDER_INTERVAL {
+            let probe = profile.start();
             #[cfg(any(target_os = "linux", target_os = "macos"))]
             let (term_height, term_width) = {
                 let mut ws: libc::winsize = unsafe { std::mem::zeroed() };
@@ -2023,200 +9266,207 @@ fn main() {
                     let h = (csbi.srWindow.Bottom - csbi.srWindow.Top + 1) as u16;
                     (h, w)
                 } else {
-                    (24u16, 80usize)
-                }
-            };
-            let mut row = 1_u16;
-
-            let _ = write!(out, "\x1B[H");
-            let gpu_cores_str = if !sampler.gpu_cores.is_empty() { format!("    {}", sampler.gpu_cores) } else { String::new() };
-            draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_TITLE), format_args!("utop (Rust version)    {}{}", cpus, gpu_cores_str));
-
-            let temp_str = if cpu_temp > -1000.0 { format!(" {:.1}°C", cpu_temp) } else { String::new() };
-            let freq_str = if cpu_freq > 0.0 { format!(" @ {:.2} GHz", cpu_freq / 1000.0) } else { String::new() };
-
-            draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, usage_style(cpu, colours), format_args!("{}: {:5.1}%{}{}", sampler.cpu_name, cpu, freq_str, temp_str));
-            let mem_pct = if mem.total_bytes > 0 { mem.used_bytes as f64 * 100.0 / mem.total_bytes as f64 } else { 0.0 };
-            draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, usage_style(mem_pct, colours), format_args!("MEM: {:5.1}% {} / {}", mem_pct, human_bytes(mem.used_bytes), human_bytes(mem.total_bytes)));
-
-            if mem.swap_total_bytes > 0 {
-                let swp_pct = mem.swap_used_bytes as f64 * 100.0 / mem.swap_total_bytes as f64;
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, usage_style(swp_pct, colours), format_args!("SWP: {:5.1}% {} / {}", swp_pct, human_bytes(mem.swap_used_bytes), human_bytes(mem.swap_total_bytes)));
-            } else {
-                draw_next_line(&mut out, &mut row, term_height, term_width, false, format_args!(""));
-            }
-
-            if gpu.has_usage || gpu.has_mem {
-                let g_temp = if gpu.has_temp { format!(" {:.1}°C", gpu.temp) } else { String::new() };
-                let g_vram = if gpu.has_mem {
-                    let pct = if gpu.mem_total > 0 { gpu.mem_used as f64 * 100.0 / gpu.mem_total as f64 } else { 0.0 };
-                    format!("  VRAM: {:5.1}% {} / {}", pct, human_bytes(gpu.mem_used), human_bytes(gpu.mem_total))
-                } else { String::new() };
-                let g_usage = if gpu.has_usage { format!("{:5.1}%", gpu.usage) } else { String::new() };
-                let gpu_pct = if gpu.has_usage {
-                    gpu.usage
-                } else if gpu.has_mem && gpu.mem_total > 0 {
-                    gpu.mem_used as f64 * 100.0 / gpu.mem_total as f64
-                } else {
-                    0.0
-                };
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, usage_style(gpu_pct, colours), format_args!("{}: {}{}{}", gpu.name, g_usage, g_temp, g_vram));
-            } else {
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_MUTED), format_args!("GPU:"));
-            }
-
-            if mem.cma_total_bytes > 0 && (!gpu.has_mem || mem.cma_total_bytes != gpu.mem_total) {
-                let cma_pct = mem.cma_used_bytes as f64 * 100.0 / mem.cma_total_bytes as f64;
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, usage_style(cma_pct, colours), format_args!("CMA: {:5.1}% {} / {}", cma_pct, human_bytes(mem.cma_used_bytes), human_bytes(mem.cma_total_bytes)));
-            }
-
-            draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_INFO), format_args!("NET: {}  rx {}/s  tx {}/s", net.iface, human_bytes(net.rx_rate as u64), human_bytes(net.tx_rate as u64)));
-            
-            for s in storage.iter().take(3) {
-                let pct = if s.total_bytes > 0 { s.used_bytes as f64 * 100.0 / s.total_bytes as f64 } else { 0.0 };
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, usage_style(pct, colours), format_args!("DSK: {:<10} {:5.1}% {} / {} [{}]", s.mount_point, pct, human_bytes(s.used_bytes), human_bytes(s.total_bytes), s.device));
-            }
-
-            draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_MUTED), format_args!("Controls: q:quit, j/k/arrows:move, h/l/arrows:sort, /:filter [{}]", if is_search { "SEARCHING" } else { "NORMAL" }));
-
-            if is_search {
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_ACCENT), format_args!("Filter: /{}_", filter));
-            } else if !filter.is_empty() {
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_ACCENT), format_args!("Filter: {} (press / to edit)", filter));
-            } else {
-                draw_next_line(&mut out, &mut row, term_height, term_width, false, format_args!(""));
-            }
-            draw_next_line(&mut out, &mut row, term_height, term_width, false, format_args!(""));
-
-            let pid_w = 7;
-            let cpu_w = 8;
-            let mem_w = 12;
-            let thr_w = 4;
-
-            let cpu_hdr = if sort == SortMode::Cpu { "CPU%▼" } else { "CPU%" };
-            let mem_hdr = if sort == SortMode::Mem { "MEM▼" } else { "MEM" };
-
-            let sort_extra = (if sort == SortMode::Cpu { 2isize } else { 0 }) + (if sort == SortMode::Mem { 2 } else { 0 });
-            let name_w = (term_width as isize - (pid_w as isize + cpu_w as isize + mem_w as isize + thr_w as isize + 9 + sort_extra)).max(12) as usize;
-
-            let w1 = cpu_w + if sort == SortMode::Cpu { 2 } else { 0 };
-            let w2 = mem_w + if sort == SortMode::Mem { 2 } else { 0 };
-
-            draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_SECTION), format_args!("{:<pid_w$} {:<name_w$} {:>w1$} {:>w2$} {:>thr_w$}", "PID", "NAME", cpu_hdr, mem_hdr, "THR",
-                pid_w=pid_w, name_w=name_w, w1=w1, w2=w2, thr_w=thr_w));
-
-            let max_dashes = term_width;
-            let req_dashes = pid_w + name_w + cpu_w + mem_w + thr_w + 4;
-            let num_dashes = max_dashes.min(req_dashes);
-            draw_next_line_with_style(&mut out, &mut row, term_height, term_width, false, colour(colours, STYLE_MUTED), format_args!("{}", "-".repeat(num_dashes)));
-
-            let visible = term_height.saturating_sub(row) as usize;
-            let count = sampler.procs.len();
-            if selection >= count && count > 0 { selection = count - 1; }
-            if count == 0 { selection = 0; }
-
-            let mut scroll_top = selection.saturating_sub(visible / 2);
-            if scroll_top > count.saturating_sub(visible) { scroll_top = count.saturating_sub(visible); }
-
-            for i in scroll_top..count.min(scroll_top + visible) {
-                let p = &sampler.procs[i];
-                let mut p_name = p.name.clone();
-                if p_name.chars().count() > name_w {
-                    p_name = p_name.chars().take(name_w).collect();
+                    (24u16, 80usize)
                 }
-
-                let row_style = process_row_style(p.cpu_percent, p.mem_bytes, mem.total_bytes, colours);
-                draw_next_line_with_style(&mut out, &mut row, term_height, term_width, i == selection, row_style, format_args!("{:<pid_w$} {:<name_w$} {:>w1$.1} {:>mem_w$} {:>thr_w$}",
-                    p.pid, p_name, p.cpu_percent, human_bytes(p.mem_bytes), p.threads,
-                    pid_w=pid_w, name_w=name_w, w1=w1, mem_w=w2, thr_w=thr_w));
-            }
-            let clear_row = row.min(term_height);
-            let _ = write!(out, "\x1B[{};1H\x1B[J", clear_row);
-            if count > 0 {
-                let end_idx = count.min(scroll_top + visible);
-                let _ = draw_line_with_style(&mut out, term_height, term_width, false, colour(colours, STYLE_MUTED), format_args!("Showing {}-{} of {}", scroll_top + 1, end_idx, count));
+            };
+            let rows = draw_frame(&mut screen, &mut ui, reader.get_mut(), &history, &profile, term_width, term_height);
+            if let Some(rows) = rows {
+                control.sort_rows.store(rows, AtomicOrdering::Relaxed);
             }
-            let _ = out.flush();
+            control.io_rows.store(if ui.io { rows.unwrap_or(0) } else { 0 }, AtomicOrdering::Relaxed);
+            control.io_pids.lock().unwrap().clone_from(&ui.io_pids);
+            let written = screen.flush(&mut out).unwrap_or(0);
+            profile.finish(STAGE_RENDER, probe, written as u64);
             last_render = now;
             needs_render = false;
         }
 
+        // Sleep until input, a resize, a published frame or a signal; only a
+        // frame held back by the 16 ms render pacing sets a timeout. Without a
+        // wake channel fall back to polling.
+        let mut timeout = needs_render.then(|| RENDER_INTERVAL.saturating_sub(Instant::now().duration_since(last_render)));
         #[cfg(any(target_os = "linux", target_os = "macos"))]
         let has_input = {
-            let mut pfd = libc::pollfd { fd: libc::STDIN_FILENO, events: libc::POLLIN, revents: 0 };
-            (unsafe { libc::poll(&mut pfd, 1, 10) }) > 0
+            if wake_rx.is_none() {
+                timeout = Some(timeout.map_or(WAKE_FALLBACK, |t| t.min(WAKE_FALLBACK)));
+            }
+            let ms = timeout.map_or(-1, |t| t.as_micros().div_ceil(1000) as libc::c_int);
+            let mut pfds = [
+                libc::pollfd { fd: libc::STDIN_FILENO, events: libc::POLLIN, revents: 0 },
+                libc::pollfd { fd: wake_rx.unwrap_or(-1), events: libc::POLLIN, revents: 0 },
+            ];
+            let n = unsafe { libc::poll(pfds.as_mut_ptr(), pfds.len() as libc::nfds_t, ms) };
+            if n > 0 && pfds[1].revents != 0 {
+                let mut drain = [0u8; 64];
+                while unsafe { libc::read(pfds[1].fd, drain.as_mut_ptr() as *mut libc::c_void, drain.len()) } > 0 {}
+            }
+            n > 0 && pfds[0].revents != 0
         };
         #[cfg(target_os = "windows")]
-        let has_input = unsafe { WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), 10) == 0 };
+        let has_input = {
+            if wake_event.is_null() {
+                timeout = Some(timeout.map_or(WAKE_FALLBACK, |t| t.min(WAKE_FALLBACK)));
+            }
+            let ms = timeout.map_or(INFINITE, |t| t.as_micros().div_ceil(1000) as u32);
+            let handles = [unsafe { GetStdHandle(STD_INPUT_HANDLE) }, wake_event];
+            let count = if wake_event.is_null() { 1 } else { 2 };
+            unsafe { WaitForMultipleObjects(count, handles.as_ptr(), 0, ms) == WAIT_OBJECT_0 }
+        };
 
         if has_input {
             loop {
                 let k = read_key();
                 match k {
                     KeyType::None => break,
-                    KeyType::Quit => { return; }
+                    KeyType::Quit => {
+                        QUIT.store(true, AtomicOrdering::SeqCst);
+                        break;
+                    }
                     _ => {
-                        if is_search {
+                        if ui.is_search {
                             match k {
                                 KeyType::Esc => {
-                                    is_search = false;
-                                    filter.clear();
-                                    needs_sample = true;
+                                    ui.is_search = false;
+                                    ui.filter.clear();
+                                    ui.filter_edited();
                                     needs_render = true;
                                 }
                                 KeyType::Enter => {
-                                    is_search = false;
+                                    ui.is_search = false;
                                     needs_render = true;
                                 }
                                 KeyType::Backspace => {
-                                    if !filter.is_empty() {
-                                        filter.pop();
-                                        selection = 0;
-                                        needs_sample = true;
+                                    if !ui.filter.is_empty() {
+                                        ui.filter.pop();
+                                        ui.filter_edited();
+                                        ui.selection = 0;
+                                        needs_render = true;
                                     } else {
-                                        is_search = false;
+                                        ui.is_search = false;
                                         needs_render = true;
                                     }
                                 }
                                 KeyType::Char(c)
-                                    if filter.len() < 63 => {
-                                        filter.push(c);
-                                        selection = 0;
-                                        needs_sample = true;
+                                    if ui.filter.len() < 63 => {
+                                        ui.filter.push(c);
+                                        ui.filter_edited();
+                                        ui.selection = 0;
+                                        needs_render = true;
                                     }
                                 _ => {}
                             }
                         } else {
                             match k {
                                 KeyType::Up => {
-                                    selection = selection.saturating_sub(1);
+                                    ui.selection = ui.selection.saturating_sub(1);
                                     needs_render = true;
                                 }
                                 KeyType::Down => {
-                                    selection += 1;
+                                    ui.selection += 1;
                                     needs_render = true;
                                 }
                                 KeyType::Left => {
-                                    sort = SortMode::Cpu;
+                                    ui.sort = ui.sort_left();
                                     needs_sample = true;
                                 }
                                 KeyType::Right => {
-                                    sort = SortMode::Mem;
+                                    ui.sort = ui.sort_right();
                                     needs_sample = true;
                                 }
-                                KeyType::Esc
-                                    if !filter.is_empty() => {
-                                        filter.clear();
-                                        selection = 0;
+                                KeyType::Enter
+                                    if ui.tree && ui.pane == Pane::Procs => {
+                                        if let Some(pid) = ui.selected_pid
+                                            && !ui.tree_view.collapsed.remove(&pid) {
+                                                ui.tree_view.collapsed.insert(pid);
+                                            }
+                                        needs_render = true;
+                                    }
+                                KeyType::Enter
+                                    if ui.pane == Pane::Hosts => {
+                                        control.host.store(ui.selection, AtomicOrdering::Relaxed);
+                                        ui.pane = Pane::Procs;
+                                        ui.selection = 0;
+                                        needs_sample = true;
+                                    }
+                                KeyType::Enter
+                                    if ui.pane == Pane::Cgroups => {
+                                        if let Some(path) = ui.selected_cgroup.take()
+                                            && !ui.cgroup_view.expanded.remove(&path) {
+                                                ui.cgroup_view.expanded.insert(path);
+                                            }
+                                        needs_render = true;
+                                    }
+                                KeyType::Enter
+                                    if ui.pane == Pane::Procs && ui.selected_pid.is_some() => {
+                                        ui.threads_pid = ui.selected_pid;
+                                        ui.pane = Pane::Threads;
+                                        ui.selection = 0;
                                         needs_sample = true;
                                     }
+                                KeyType::Enter | KeyType::Esc
+                                    if ui.pane == Pane::Threads => {
+                                        ui.pane = Pane::Procs;
+                                        ui.selection = 0;
+                                        needs_render = true;
+                                    }
+                                KeyType::Esc
+                                    if !ui.filter.is_empty() => {
+                                        ui.filter.clear();
+                                        ui.filter_edited();
+                                        ui.selection = 0;
+                                        needs_render = true;
+                                    }
                                 KeyType::Char(c) => {
-                                    if c == 'q' { return; }
-                                    if c == 'j' { selection += 1; needs_render = true; }
-                                    if c == 'k' { selection = selection.saturating_sub(1); needs_render = true; }
-                                    if c == 'h' { sort = SortMode::Cpu; needs_sample = true; }
-                                    if c == 'l' { sort = SortMode::Mem; needs_sample = true; }
-                                    if c == '/' { is_search = true; filter.clear(); needs_render = true; }
+                                    if c == 'q' { QUIT.store(true, AtomicOrdering::SeqCst); break; }
+                                    if c == 'j' { ui.selection += 1; needs_render = true; }
+                                    if c == 'k' { ui.selection = ui.selection.saturating_sub(1); needs_render = true; }
+                                    if c == 'h' { ui.sort = ui.sort_left(); needs_sample = true; }
+                                    if c == 'l' { ui.sort = ui.sort_right(); needs_sample = true; }
+                                    if c == 'i' {
+                                        ui.io = !ui.io;
+                                        if !ui.io && ui.sort == SortMode::Io { ui.sort = SortMode::Mem; }
+                                        needs_sample = true;
+                                    }
+                                    if c == '/' { ui.is_search = true; ui.filter.clear(); ui.filter_edited(); needs_render = true; }
+                                    if c == 't' {
+                                        ui.tree = !ui.tree;
+                                        control.tree.store(ui.tree, AtomicOrdering::Relaxed);
+                                        needs_sample = true;
+                                    }
+                                    if c == 'c' {
+                                        ui.pane = if ui.pane == Pane::Cgroups { Pane::Procs } else { Pane::Cgroups };
+                                        ui.selection = 0;
+                                        needs_sample = true;
+                                    }
+                                    if c == 'T' {
+                                        if ui.pane == Pane::Threads {
+                                            ui.pane = Pane::Procs;
+                                        } else if matches!(ui.pane, Pane::Procs | Pane::Cgroups) && ui.selected_pid.is_some() {
+                                            ui.threads_pid = ui.selected_pid;
+                                            ui.pane = Pane::Threads;
+                                        }
+                                        ui.selection = 0;
+                                        needs_sample = true;
+                                    }
+                                    if c == 'd' && !config.connect.is_empty() {
+                                        ui.pane = if ui.pane == Pane::Hosts { Pane::Procs } else { Pane::Hosts };
+                                        ui.selection = if ui.pane == Pane::Hosts { control.host.load(AtomicOrdering::Relaxed) } else { 0 };
+                                        needs_render = true;
+                                    }
+                                    if c == 'n' { ui.pane = if ui.pane == Pane::Net { Pane::Procs } else { Pane::Net }; needs_render = true; }
+                                    if c == 'p' {
+                                        ui.pane = if ui.pane == Pane::Profile { Pane::Procs } else { Pane::Profile };
+                                        profile.count_syscalls.store(config.profile || ui.pane == Pane::Profile, AtomicOrdering::Relaxed);
+                                        needs_render = true;
+                                    }
+                                    if c == ' ' {
+                                        control.paused.fetch_xor(true, AtomicOrdering::AcqRel);
+                                        sampler_thread.unpark();
+                                    }
+                                    if c == '[' || c == ']' {
+                                        control.seek_ms.fetch_add(if c == '[' { -REPLAY_SEEK_MS } else { REPLAY_SEEK_MS }, AtomicOrdering::AcqRel);
+                                        sampler_thread.unpark();
+                                    }
                                 }
                                 _ => {}
                             }
@@ -2226,6 +9476,65 @@ fn main() {
             }
         }
     }
+
+    // Let the sampler finish the recording before the terminal is restored,
+    // so anything it reports lands on a normal screen.
+    QUIT.store(true, AtomicOrdering::SeqCst);
+    sampler_thread.unpark();
+    let error = worker.join().ok().flatten();
+    drop(terminal);
+    if let Some(e) = error {
+        fail(e);
+    }
+}
+
+// Counts heap allocations: process-wide for the profiling overlay, and per
+// thread for tests that assert a hot path does not touch the heap (so that
+// concurrently running tests don't interfere).
+mod alloc_counter {
+    use std::alloc::{GlobalAlloc, Layout, System};
+    use std::sync::atomic::{AtomicU64, Ordering};
+
+    static TOTAL: AtomicU64 = AtomicU64::new(0);
+
+    #[cfg(test)]
+    thread_local! {
+        static ALLOCS: std::cell::Cell<usize> = const { std::cell::Cell::new(0) };
+    }
+
+    fn count() {
+        TOTAL.fetch_add(1, Ordering::Relaxed);
+        #[cfg(test)]
+        let _ = ALLOCS.try_with(|c| c.set(c.get() + 1));
+    }
+
+    struct Counting;
+
+    unsafe impl GlobalAlloc for Counting {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            count();
+            unsafe { System.alloc(layout) }
+        }
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            unsafe { System.dealloc(ptr, layout) }
+        }
+        unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+            count();
+            unsafe { System.realloc(ptr, layout, new_size) }
+        }
+    }
+
+    #[global_allocator]
+    static GLOBAL: Counting = Counting;
+
+    pub fn total() -> u64 {
+        TOTAL.load(Ordering::Relaxed)
+    }
+
+    #[cfg(test)]
+    pub fn allocations() -> usize {
+        ALLOCS.with(|c| c.get())
+    }
 }
 
 #[cfg(test)]
@@ -2234,10 +9543,11 @@ mod tests {
 
     #[test]
     fn test_human_bytes() {
-        assert_eq!(human_bytes(100), "100 B");
-        assert_eq!(human_bytes(1024), "1.0 KiB");
-        assert_eq!(human_bytes(1024 * 1024), "1.0 MiB");
-        assert_eq!(human_bytes(1024 * 1024 * 1024), "1.00 GiB");
+        assert_eq!(HumanBytes(100).to_string(), "100 B");
+        assert_eq!(HumanBytes(1024).to_string(), "1.0 KiB");
+        assert_eq!(HumanBytes(1024 * 1024).to_string(), "1.0 MiB");
+        assert_eq!(HumanBytes(1024 * 1024 * 1024).to_string(), "1.00 GiB");
+        assert_eq!(format!("[{:>9}]", HumanBytes(2048)), "[  2.0 KiB]");
     }
 
     #[test]
@@ -2250,8 +9560,11 @@ mod tests {
 
     #[test]
     fn test_styled_line_clips_visible_text() {
+        let mut screen = Screen::new();
+        screen.begin(3, 1);
+        draw_line_with_style(&mut screen, 1, false, STYLE_OK, format_args!("abcdef"));
         let mut out = Vec::new();
-        draw_line_with_style(&mut out, 1, 3, false, STYLE_OK, format_args!("abcdef")).unwrap();
+        screen.flush(&mut out).unwrap();
         let rendered = String::from_utf8(out).unwrap();
 
         assert!(rendered.contains(STYLE_OK));
@@ -2259,6 +9572,82 @@ mod tests {
         assert!(!rendered.contains("abcd"));
     }
 
+    #[test]
+    fn test_row_formatting_is_allocation_free() {
+        let mut screen = Screen::new();
+        screen.begin(30, 1);
+        let name: Arc<str> = Arc::from("名前-worker");
+        let before = alloc_counter::allocations();
+        draw_line_with_style(&mut screen, 1, false, STYLE_WARN, format_args!("{:<5} {} {:>10}|",
+            42, Fit(&name, 6), HumanBytes(3 * 1024 * 1024)));
+        assert_eq!(alloc_counter::allocations() - before, 0);
+
+        // The wide name is clipped to six columns, not six characters.
+        let text: String = screen.back.iter().map(|c| c.ch).filter(|&c| c != WIDE_TAIL).collect();
+        assert_eq!(text.trim_end(), "42    名前-w    3.0 MiB|");
+        assert_eq!(screen.back[7].ch, WIDE_TAIL);
+    }
+
+    #[test]
+    fn test_history_ring_and_sparkline() {
+        let mut ring = Ring::new(4, 0.0_f32);
+        for v in [10.0, 20.0, 30.0] {
+            ring.push(v);
+        }
+        assert_eq!(ring.last(8).collect::<Vec<_>>(), vec![10.0, 20.0, 30.0]);
+        ring.push(40.0);
+        ring.push(f32::NAN);
+        assert_eq!(ring.last(2).next(), Some(40.0));
+        assert_eq!(Spark { ring: &ring, width: 6, max: 40.0 }.to_string(), "  ▄▆█ ");
+
+        // Pushing frames neither allocates nor loses track of the leading rows.
+        let mut history = History::new(16);
+        let proc_at = |pid, cpu_percent| ProcessInfo { pid, ppid: -1, name: Arc::from("p"), name_lower: Arc::from("p"), cpu_percent, mem_bytes: 0, threads: 1, read_rate: f64::NAN, write_rate: f64::NAN, cgroup: None, sort_key: (0, 0, 0) };
+        let mut snap = Snapshot { procs: (0..20).map(|i| proc_at(i, 50.0)).collect(), sorted: 20, ..Snapshot::default() };
+        let before = alloc_counter::allocations();
+        for tick in 0..40 {
+            snap.cpu = tick as f64;
+            snap.procs[0].pid = if tick < 30 { 1000 } else { 2000 };
+            history.push(&snap);
+        }
+        assert_eq!(alloc_counter::allocations(), before);
+        assert_eq!(history.cpu.last(1).next(), Some(39.0));
+        assert!(history.gpu.last(1).next().unwrap().is_nan());
+        assert_eq!(history.proc_cpu(2000).map(|r| r.last(16).len()), Some(10));
+        // Every slot was in use, so the newcomer took the dropped-out PID's.
+        assert!(history.proc_cpu(1000).is_none());
+        assert_eq!(history.proc_cpu(1).map(|r| r.last(16).len()), Some(16));
+    }
+
+    #[test]
+    fn test_screen_writes_only_changed_cells() {
+        let mut screen = Screen::new();
+        let frame = |screen: &mut Screen, cpu: &str| {
+            screen.begin(40, 3);
+            draw_line_with_style(screen, 1, false, STYLE_TITLE, format_args!("utop"));
+            draw_line_with_style(screen, 2, false, STYLE_OK, format_args!("CPU: {}%", cpu));
+            let mut out = Vec::new();
+            screen.flush(&mut out).unwrap();
+            String::from_utf8(out).unwrap()
+        };
+
+        let first = frame(&mut screen, "12.5");
+        assert!(first.contains("\x1B[2J") && first.contains("utop"));
+
+        let same = frame(&mut screen, "12.5");
+        assert!(same.is_empty());
+        assert_eq!(screen.last_frame_bytes, 0);
+
+        let changed = frame(&mut screen, "13.5");
+        assert!(changed.starts_with("\x1B[2;7H"));
+        assert!(changed.contains('3') && !changed.contains("utop") && !changed.contains("CPU"));
+        assert_eq!(screen.total_bytes as usize, first.len() + changed.len());
+
+        // Shrinking a line clears the leftover cells with a single EL.
+        let shorter = frame(&mut screen, "9");
+        assert!(shorter.contains("9%") && shorter.ends_with("\x1B[K"));
+    }
+
     #[test]
     fn test_colour_enabled_env_overrides() {
         // colour_enabled() reads process-global env vars, so run the cases
@@ -2307,36 +9696,984 @@ mod tests {
     #[test]
     fn test_sample_populates_core_data() {
         let mut sampler = Sampler::new();
-        let mut cpu = 0.0;
-        let mut mem = MemorySnapshot::default();
-        let mut net = NetworkSnapshot::default();
-        let mut gpu = GpuSnapshot::default();
-        let mut storage = Vec::new();
-        let mut cpus = String::new();
-        let mut cached_gpu = GpuSnapshot::default();
-        let mut last_gpu_read = Instant::now().checked_sub(Duration::from_secs(10)).unwrap();
-
-        sample(
-            &mut sampler,
-            SortMode::Cpu,
-            "",
-            &mut cpu,
-            &mut mem,
-            &mut net,
-            &mut gpu,
-            &mut storage,
-            &mut cpus,
-            &mut cached_gpu,
-            &mut last_gpu_read,
-        );
+        let mut snap = Snapshot::default();
+
+        sample(&mut sampler, SortMode::Cpu, usize::MAX, &mut snap);
 
-        assert!(!cpus.is_empty());
-        assert!(cpu >= 0.0);
-        assert!(mem.total_bytes > 0);
-        assert!(!sampler.procs.is_empty());
+        assert!(!sampler.cpu_count.is_empty());
+        assert!(snap.cpu >= 0.0);
+        assert!(snap.mem.total_bytes > 0);
+        assert!(!snap.procs.is_empty());
 
         #[cfg(target_os = "macos")]
-        assert!(!storage.is_empty());
+        assert!(!snap.storage.is_empty());
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_storage_worker_survives_hung_mount() {
+        let mut mounts = Vec::new();
+        parse_mounts("/dev/sda1 / ext4 rw 0 0\nproc /proc proc rw 0 0\n/dev/sda1 / ext4 rw 0 0\n\
+            /dev/sdb1 /a ext4 rw 0 0\n/dev/nfs /hung nfs rw 0 0\n/dev/sdc1 /b xfs rw 0 0\n", &mut mounts);
+        assert_eq!(mounts.iter().map(|(m, _)| &**m).collect::<Vec<_>>(), vec!["/", "/a", "/hung", "/b"]);
+
+        // Each stat of /hung blocks until the test releases it: (stats
+        // entered, stats released).
+        static GATE: (Mutex<(usize, usize)>, std::sync::Condvar) = (Mutex::new((0, 0)), std::sync::Condvar::new());
+        static STATS_B: AtomicUsize = AtomicUsize::new(0);
+        fn stat(mount_point: &str) -> Option<(u64, u64)> {
+            match mount_point {
+                "/hung" => {
+                    let mut gate = GATE.0.lock().unwrap();
+                    let ticket = gate.0;
+                    gate.0 += 1;
+                    while gate.1 <= ticket {
+                        gate = GATE.1.wait(gate).unwrap();
+                    }
+                }
+                "/b" => { STATS_B.fetch_add(1, AtomicOrdering::Relaxed); }
+                _ => {}
+            }
+            Some((1, 2))
+        }
+        let release = || {
+            GATE.0.lock().unwrap().1 += 1;
+            GATE.1.notify_all();
+        };
+        let mut worker = StorageWorker::new(stat);
+        worker.mounts = mounts;
+        let mut out = Vec::new();
+        let points = |out: &[StorageSnapshot]| out.iter().map(|s| (s.mount_point.clone(), s.stale)).collect::<Vec<_>>();
+        let started = Instant::now();
+        worker.collect(&mut out);
+        assert!(started.elapsed() < STORAGE_WAIT + STAT_TIMEOUT);
+        // The hung mount is given up on and the ones queued behind it still
+        // get read, once, by the replacement thread.
+        assert_eq!(points(&out), vec![("/".into(), false), ("/a".into(), false), ("/b".into(), false)]);
+        assert_eq!(STATS_B.load(AtomicOrdering::Relaxed), 1);
+        assert!(worker.queue.is_empty() && worker.hung.contains("/hung"));
+
+        // Once it answers it shows up; while it is stuck again it keeps that
+        // value, marked stale.
+        release();
+        let answer = worker.results.recv().unwrap();
+        assert_eq!(&*answer.0, "/hung");
+        worker.receive(answer);
+        assert!(worker.hung.is_empty());
+        worker.collect(&mut out);
+        assert_eq!(points(&out), vec![("/".into(), false), ("/a".into(), false), ("/b".into(), false), ("/hung".into(), true)]);
+        release();
+    }
+
+    #[test]
+    fn test_schedule_backs_off_slow_collectors() {
+        let mut schedule = Schedule::new();
+        let now = Instant::now();
+        assert!(COLLECTORS.iter().all(|&c| schedule.due(c, now)));
+
+        let storage = Collector::Storage.default_period();
+        schedule.finish(Collector::Storage, now, Duration::from_millis(1));
+        assert!(!schedule.due(Collector::Storage, now + storage / 2));
+        assert!(schedule.due(Collector::Storage, now + storage));
+
+        // A hung statvfs keeps doubling the interval up to the cap...
+        for _ in 0..10 {
+            schedule.finish(Collector::Storage, now, Duration::from_secs(3600));
+        }
+        assert_eq!(schedule.interval(Collector::Storage), storage * (1 << MAX_BACKOFF));
+        // ...and quick runs bring it back down one step at a time.
+        schedule.finish(Collector::Storage, now, Duration::from_millis(1));
+        assert_eq!(schedule.interval(Collector::Storage), storage * (1 << (MAX_BACKOFF - 1)));
+        for c in COLLECTORS {
+            schedule.finish(c, now, Duration::ZERO);
+        }
+        assert_eq!(schedule.next_deadline(), now + Collector::Procs.default_period());
+
+        // Right after a full pass nothing is due, but the frame is still whole.
+        let mut sampler = Sampler::new().with_period(Collector::Mem, Duration::from_secs(60));
+        let mut snap = Snapshot::default();
+        sample(&mut sampler, SortMode::Cpu, usize::MAX, &mut snap);
+        let mut next = Snapshot::default();
+        let ran = sample_due(&mut sampler, false, SortMode::Mem, usize::MAX, ViewNeeds::default(), &mut next);
+        assert_eq!(ran, [false; COLLECTORS.len()]);
+        assert_eq!(next.seq, snap.seq, "a republish is not a new sample");
+        assert_eq!(next.mem.total_bytes, snap.mem.total_bytes);
+        assert_eq!(next.procs.len(), snap.procs.len());
+        assert!(next.procs.windows(2).all(|w| w[0].mem_bytes >= w[1].mem_bytes));
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_parse_stat_cpus() {
+        let stat = b"cpu  30 0 10 160 0 0 0 0 0 0\ncpu0 10 0 5 85 0 0 0 0 0 0\ncpu2 20 0 5 75 0 0 0 0 0 0\nintr 1 2 3\n";
+        let mut total = CpuTimes::default();
+        let mut cores = Vec::new();
+        assert!(parse_stat_cpus(stat, &mut total, &mut cores));
+        assert_eq!((total.user, total.sys, total.idle), (30, 10, 160));
+        // cpu1 is offline and reads as zeros.
+        assert_eq!(cores.len(), 3 * CPU_FIELDS);
+        assert_eq!(&cores[CPU_FIELDS..2 * CPU_FIELDS], &[0; CPU_FIELDS]);
+        assert!(!parse_stat_cpus(&stat[..60], &mut total, &mut cores), "cut off mid cpu lines");
+    }
+
+    #[test]
+    fn test_core_busy_and_heatmap() {
+        let prev = [10, 0, 5, 85, 0, 0, 0, 0, 0, 0, 0, 100, 0, 0, 0, 0];
+        let cur = [40, 0, 15, 95, 10, 0, 0, 0, 0, 0, 0, 200, 0, 0, 0, 0];
+        let mut busy = Vec::new();
+        core_busy(&prev, &cur, &mut busy);
+        assert_eq!(busy, vec![40.0 * 100.0 / 60.0, 0.0]);
+        core_busy(&[], &cur, &mut busy);
+        assert_eq!(busy.len(), 2, "a new core counts from zero");
+
+        // 300 cores on 80 columns: eight groups of eight per row, so each
+        // cell covers two cores to stay within the row cap.
+        let mut cores = vec![0.0_f32; 300];
+        cores[299] = 100.0;
+        let mut screen = Screen::new();
+        screen.begin(80, 10);
+        let mut row = 1;
+        draw_core_heatmap(&mut screen, &mut row, &cores, false);
+        assert_eq!(row as usize, 1 + 3);
+        let line: String = screen.back[2 * 80..3 * 80].iter().map(|c| c.ch).collect();
+        assert_eq!(line.trim_end(), " 256 ▁▁▁▁▁▁▁▁ ▁▁▁▁▁▁▁▁ ▁▁▁▁▁█");
+    }
+
+    #[test]
+    #[cfg(target_os = "linux")]
+    fn test_btf_member_offsets() {
+        // A hand-built BTF blob: mm_struct wraps its fields in an anonymous
+        // struct, and rss_stat is an array of percpu_counter, as on 6.2+.
+        let names = b"\0long\0percpu_counter\0lock\0count\0rss_stat\0mm_struct\0bpf_iter_task\0";
+        let name = |n: &[u8]| names.windows(n.len() + 2).position(|w| w[0] == 0 && &w[1..=n.len()] == n && w[n.len() + 1] == 0).unwrap() as u32 + 1;
+        let mut types: Vec<u32> = Vec::new();
+        let info = |kind: u32, vlen: u32| kind << 24 | vlen;
+        types.extend([name(b"long"), info(BTF_KIND_INT, 0), 8, 64]);                    // 1
+        types.extend([name(b"percpu_counter"), info(BTF_KIND_STRUCT, 2), 40,
+            name(b"lock"), 1, 0, name(b"count"), 1, 64]);                                 // 2
+        types.extend([0, info(BTF_KIND_ARRAY, 0), 0, 2, 1, 4]);                            // 3
+        types.extend([0, info(BTF_KIND_STRUCT, 1), 200, name(b"rss_stat"), 3, 16 * 8]);   // 4
+        types.extend([name(b"mm_struct"), info(BTF_KIND_STRUCT, 1), 200, 0, 4, 0]);       // 5
+        types.extend([name(b"bpf_iter_task"), info(BTF_KIND_FUNC, 0), 0]);                // 6
+        let type_len = types.len() as u32 * 4;
+        let mut blob = vec![0x9F, 0xEB, 1, 0];
+        for v in [24, 0, type_len, type_len, names.len() as u32] {
+            blob.extend_from_slice(&v.to_le_bytes());
+        }
+        for v in types {
+            blob.extend_from_slice(&v.to_le_bytes());
+        }
+        blob.extend_from_slice(names);
+
+        let btf = Btf::parse(blob).unwrap();
+        let mm = btf.find(BTF_KIND_STRUCT, b"mm_struct").unwrap();
+        assert_eq!(btf.offset(mm, b"rss_stat"), Some(16));
+        assert_eq!(btf.rss_counters(mm), Some([24, 64, 144]));
+        assert_eq!(btf.find(BTF_KIND_FUNC, b"bpf_iter_task"), Some(6));
+        assert_eq!(btf.offset(mm, b"missing"), None);
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_parse_pid() {
+        assert_eq!(parse_pid(b"1234\0"), Some(1234));
+        assert_eq!(parse_pid(b"1\0\0\0"), Some(1));
+        assert_eq!(parse_pid(b"self\0"), None);
+        assert_eq!(parse_pid(b"12a\0"), None);
+        assert_eq!(parse_pid(b"\0"), None);
+        assert_eq!(parse_pid(b"99999999999\0"), None);
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_proc_dir_caches_stat_fds() {
+        let mut pd = ProcDir::open().expect("/proc should be readable");
+        assert!(pd.scan());
+        let me = std::process::id() as i32;
+        assert!(pd.pids.contains(&me), "scan should list our own pid");
+
+        let mut buf = [0u8; 1024];
+        let dir_fd = pd.dir.as_raw_fd();
+        let idx = pd.entries.iter().position(|e| e.pid == me).expect("entry for our pid");
+        let n = read_stat(dir_fd, &mut pd.entries[idx], &mut buf).expect("own stat should be readable");
+        assert!(buf[..n].starts_with(format!("{} (", me).as_bytes()));
+        assert!(pd.entries[idx].file.is_some());
+
+        // A rescan keeps the entry, and its open fd, for a PID that is still listed.
+        assert!(pd.scan());
+        let idx = pd.entries.iter().position(|e| e.pid == me).expect("entry for our pid");
+        assert!(pd.entries[idx].file.is_some(), "fd should stay cached across scans");
+        assert!(pd.entries.is_sorted_by_key(|e| e.pid));
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_thread_table_reads_own_threads() {
+        let line = b"77 (wor ker) R 1 2 3 0 -1 0 0 0 0 0 40 2 0 0 20 0 9 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 17 5 0 0\n";
+        assert_eq!(parse_thread_stat(line), Some((&b"wor ker"[..], 42, 5)));
+        assert_eq!(parse_thread_stat(b"77 (short) R 1 2 3"), None);
+
+        let stop = Arc::new(AtomicBool::new(false));
+        let spin = std::thread::Builder::new().name("utop-spin".to_string()).spawn({
+            let stop = stop.clone();
+            move || while !stop.load(AtomicOrdering::Relaxed) { std::hint::spin_loop(); }
+        }).unwrap();
+        let me = std::process::id() as i32;
+        let mut table = ThreadTable::new();
+        table.read(me, 1.0, 1);
+        std::thread::sleep(Duration::from_millis(100));
+        table.read(me, 0.1, 1);
+        stop.store(true, AtomicOrdering::Relaxed);
+        spin.join().unwrap();
+
+        assert!(table.entries.is_sorted_by_key(|e| e.info.tid));
+        assert!(table.entries.iter().any(|e| e.info.tid == me as u64), "the main thread is a task too");
+        let e = table.entries.iter().find(|e| &*e.info.name == "utop-spin").expect("spinning thread listed");
+        assert!(e.info.cpu_percent > 20.0, "spinning thread at {}%", e.info.cpu_percent);
+        assert!(e.info.cpu.is_some());
+        assert!(e.stat.file.is_some(), "thread stat fd should stay cached");
+
+        let mut out = Vec::new();
+        table.emit(&mut out);
+        assert_eq!(out.len(), table.entries.len());
+        assert!(out.windows(2).all(|w| w[0].cpu_percent >= w[1].cpu_percent));
+        table.close();
+        assert!(table.entries.is_empty() && table.dir.is_none());
+        // Thread fds are reserved out of the process stat fd budget.
+        let budget = ProcDir::open().unwrap().fd_budget + table.fd_budget;
+        assert_eq!(budget, raise_nofile_limit().saturating_sub(FD_HEADROOM));
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_parse_proc_stat_awkward_comm() {
+        let line = b"4242 (a) b (c)) S 1 4242 4242 0 -1 4194560 100 0 0 0 17 5 0 0 20 0 3 0 123 4096 321 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 2 0 0 0 0 0\n";
+        let f = parse_proc_stat(line).expect("stat line should parse");
+        assert_eq!(f.comm, b"a) b (c)");
+        assert_eq!((f.ppid, f.utime, f.stime, f.threads, f.rss), (1, 17, 5, 3, 321));
+
+        // A signed column printed negative still parses.
+        let line = b"7 (kworker) I 2 0 0 0 -1 0 0 0 0 0 0 0 0 0 20 0 1 0 9 0 -1 0 0 0 0 0 0 0 0 0 0 0 0 0 17 -1 0 0\n";
+        assert_eq!(parse_proc_stat(line).map(|f| (f.ppid, f.threads, f.rss)), Some((2, 1, 0)));
+        assert_eq!(parse_signed(b"-1"), Some(-1));
+        assert_eq!(parse_signed(b"-"), None);
+
+        assert!(parse_proc_stat(b"1 (short) S 1 2 3").is_none());
+        assert!(parse_proc_stat(b"garbage").is_none());
+    }
+
+    // Microbenchmark: the steady-state per-process path (pread of the cached
+    // fd, parse, interned name lookup) must not allocate.
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_stat_sampling_is_allocation_free() {
+        let mut pd = ProcDir::open().expect("/proc should be readable");
+        assert!(pd.scan());
+        let me = std::process::id() as i32;
+        let mut buf = [0u8; 1024];
+
+        let dir_fd = pd.dir.as_raw_fd();
+        let entry = pd.entries.iter_mut().find(|e| e.pid == me).expect("entry for our pid");
+
+        // Warm-up opens the fd, claims a table slot and interns the name.
+        let mut table = ProcTable::default();
+        table.begin();
+        let slot = table.claim(me);
+        let n = read_stat(dir_fd, entry, &mut buf).unwrap();
+        let comm = parse_proc_stat(&buf[..n]).unwrap().comm.to_vec();
+        table.set_name(slot, Arc::from(String::from_utf8_lossy(&comm).as_ref()));
+
+        const ITERS: usize = 2000;
+        let before = alloc_counter::allocations();
+        let mut ticks = 0_u64;
+        for _ in 0..ITERS {
+            table.begin();
+            let slot = table.claim(me);
+            let n = read_stat(dir_fd, entry, &mut buf).unwrap();
+            let f = parse_proc_stat(&buf[..n]).unwrap();
+            assert!(table.name(slot).is_some_and(|name| name.as_bytes() == f.comm));
+            let reading = ProcReading { slot, ticks: f.utime + f.stime, rss: f.rss, threads: f.threads, ppid: f.ppid, reset: false };
+            table.apply(&reading, 100.0);
+            table.sweep();
+            ticks = ticks.wrapping_add(reading.ticks);
+        }
+        let allocs = alloc_counter::allocations() - before;
+        std::hint::black_box(ticks);
+        assert_eq!(allocs, 0, "per-process sampling path allocated");
+    }
+
+    #[test]
+    fn test_filter_view_narrows() {
+        let names = ["Firefox", "firewalld", "bash", "sshd", "fish"];
+        let mut procs: Vec<ProcessInfo> = (0..500)
+            .map(|i| {
+                let name: Arc<str> = Arc::from(names[i as usize % names.len()]);
+                ProcessInfo {
+                    pid: i,
+                    ppid: -1,
+                    name_lower: lowercase(&name),
+                    name,
+                    cpu_percent: ((i * 37) % 101) as f64,
+                    mem_bytes: 0,
+                    threads: 1,
+                    read_rate: f64::NAN,
+                    write_rate: f64::NAN,
+                    cgroup: None,
+                    sort_key: (0, 0, 0),
+                }
+            })
+            .collect();
+        for p in procs.iter_mut() {
+            p.sort_key = sort_key(p, SortMode::Cpu);
+        }
+        assert!(Arc::ptr_eq(&procs[2].name, &procs[2].name_lower));
+        let mut sorted = 0;
+        sort_prefix(&mut procs, &mut sorted, 40);
+
+        let rebuilt = |query: &str| {
+            let mut v = FilterView::default();
+            v.update(&procs, sorted, query);
+            v.sort_prefix(&procs, usize::MAX);
+            v.rows
+        };
+        let mut view = FilterView::default();
+        view.update(&procs, sorted, "");
+        assert_eq!(view.rows.len(), 500);
+        assert_eq!(view.sorted, 40);
+
+        // Each appended character narrows; the result matches a fresh scan.
+        for query in ["f", "fi", "fir", "fire"] {
+            view.update(&procs, sorted, query);
+            assert!(view.sorted <= view.rows.len());
+            let before = view.sorted;
+            view.sort_prefix(&procs, usize::MAX);
+            assert!(view.sorted >= before);
+            assert_eq!(view.rows, rebuilt(query), "query {}", query);
+        }
+        assert_eq!(view.rows.len(), 200);
+        assert!(view.rows.iter().all(|&r| procs[r as usize].name_lower.starts_with("fire")));
+
+        // Deleting a character, or a new snapshot, rescans.
+        view.update(&procs, sorted, "fir");
+        assert_eq!(view.rows.len(), 200);
+        view.update(&procs, sorted, "12");
+        view.sort_prefix(&procs, usize::MAX);
+        assert_eq!(view.rows, rebuilt("12"));
+        assert!(view.rows.iter().all(|&r| procs[r as usize].pid.to_string().contains("12")));
+        procs.truncate(100);
+        view.current = false;
+        view.update(&procs, sorted, "12");
+        assert!(view.rows.iter().all(|&r| (r as usize) < procs.len()));
+        assert_eq!(view.rows.len(), procs.iter().filter(|p| p.pid.to_string().contains("12")).count());
+    }
+
+    #[test]
+    fn test_sort_prefix_matches_full_sort() {
+        let mut procs: Vec<ProcessInfo> = (0..500)
+            .map(|i| ProcessInfo {
+                pid: i,
+                ppid: -1,
+                name: Arc::from("p"),
+                name_lower: Arc::from("p"),
+                cpu_percent: ((i * 37) % 101) as f64 / 4.0,
+                mem_bytes: ((i * 53) % 17) as u64 * 4096,
+                threads: 1,
+                read_rate: f64::NAN,
+                write_rate: f64::NAN,
+                cgroup: None,
+                sort_key: (0, 0, 0),
+            })
+            .collect();
+        for p in procs.iter_mut() {
+            p.sort_key = sort_key(p, SortMode::Cpu);
+        }
+        let mut full = procs.clone();
+        full.sort_by(|a, b| {
+            b.cpu_percent.partial_cmp(&a.cpu_percent).unwrap()
+                .then_with(|| b.mem_bytes.cmp(&a.mem_bytes))
+                .then_with(|| a.pid.cmp(&b.pid))
+        });
+        let pids = |v: &[ProcessInfo]| v.iter().map(|p| p.pid).collect::<Vec<_>>();
+
+        let mut sorted = 0;
+        sort_prefix(&mut procs, &mut sorted, 20);
+        assert_eq!(sorted, 20);
+        assert_eq!(pids(&procs[..20]), pids(&full[..20]));
+
+        // Extending the prefix keeps the rows already in place.
+        sort_prefix(&mut procs, &mut sorted, 300);
+        assert_eq!(pids(&procs[..300]), pids(&full[..300]));
+        sort_prefix(&mut procs, &mut sorted, usize::MAX);
+        assert_eq!(sorted, 500);
+        assert_eq!(pids(&procs), pids(&full));
+    }
+
+    #[test]
+    fn test_triple_buffer_hands_over_latest_frame() {
+        let (mut writer, mut reader) = triple_buffer::<Vec<u32>>();
+        assert!(!reader.update(), "nothing published yet");
+
+        writer.back_mut().push(1);
+        writer.publish();
+        writer.back_mut().push(2);
+        writer.publish();
+        assert!(reader.update());
+        assert_eq!(*reader.get_mut(), vec![2], "reader skips straight to the newest frame");
+        assert!(!reader.update());
+
+        // The writer keeps cycling through the two buffers the reader isn't holding.
+        for i in 3..10 {
+            let back = writer.back_mut();
+            back.clear();
+            back.push(i);
+            writer.publish();
+            assert_eq!(*reader.get_mut(), vec![2]);
+        }
+        assert!(reader.update());
+        assert_eq!(*reader.get_mut(), vec![9]);
+    }
+
+    #[cfg(any(target_os = "linux", target_os = "windows"))]
+    #[test]
+    fn test_parse_nvidia_smi_reports_every_gpu() {
+        let csv = "NVIDIA A100-SXM4-80GB, 97, 40000, 81920, 61\nNVIDIA GeForce RTX 4090, 3, 512, 24564, 40\n";
+        let mut gpus = Vec::new();
+        parse_nvidia_smi_csv(csv, &mut gpus);
+        assert_eq!(gpus.len(), 2);
+        assert_eq!(gpus[0].name, "A100-SXM4-80GB");
+        assert_eq!(gpus[0].usage, 97.0);
+        assert_eq!(gpus[0].mem_total, 81920 * 1024 * 1024);
+        assert_eq!(gpus[1].name, "RTX 4090");
+        assert_eq!(gpus[1].temp, 40.0);
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_sysfs_gpu_usage_formats() {
+        assert_eq!(parse_percent("42\n"), Some(42.0));
+        assert_eq!(parse_busy_total("250 1000\n"), Some(25.0));
+        assert_eq!(parse_busy_total("0 0\n"), Some(0.0));
+        assert_eq!(parse_devfreq_load("37@500000000Hz\n"), Some(37.0));
+
+        let mut stats = Vec::new();
+        let header = "queue   timestamp  jobs  runtime\n";
+        let first = format!("{header}bin 1000 1 100\nrender 1000 1 200\n");
+        assert_eq!(v3d_usage(&first, &mut stats), None);
+        let second = format!("{header}bin 2000 2 200\nrender 2000 3 700\n");
+        assert_eq!(v3d_usage(&second, &mut stats), Some(50.0));
+    }
+
+    #[test]
+    fn test_parse_args() {
+        let args = |v: &[&str]| parse_args(v.iter().map(|s| s.to_string()));
+        assert_eq!(args(&[]).unwrap().sampler_threads, None);
+        assert_eq!(args(&["--sampler-threads", "4"]).unwrap().sampler_threads, Some(4));
+        assert!(args(&["--sampler-threads", "0"]).is_err());
+        assert!(args(&["--sampler-threads"]).is_err());
+        assert!(args(&["--bogus"]).is_err());
+
+        let batch = args(&["--batch", "--format", "csv", "--interval", "250ms", "--count", "3"]).unwrap();
+        assert!(batch.batch);
+        assert_eq!(batch.format, ExportFormat::Csv);
+        assert_eq!(batch.interval, Some(Duration::from_millis(250)));
+        assert_eq!(batch.count, Some(3));
+        assert!(args(&["--format", "csv"]).is_err(), "export options need --batch");
+        assert!(args(&["--batch", "--interval", "0s"]).is_err());
+        assert_eq!(parse_duration("1.5"), Some(Duration::from_millis(1500)));
+        assert_eq!(parse_duration("2m"), Some(Duration::from_secs(120)));
+
+        let replay = args(&["--replay", "a.rec", "--speed", "4"]).unwrap();
+        assert_eq!(replay.replay.as_deref(), Some("a.rec"));
+        assert_eq!(replay.speed, Some(4.0));
+        assert!(args(&["--speed", "2"]).is_err(), "--speed needs --replay");
+        assert!(args(&["--replay", "a.rec", "--record", "b.rec"]).is_err());
+        assert!(args(&["--batch", "--record", "b.rec"]).is_ok());
+        assert_eq!(args(&["--history", "600"]).unwrap().history, Some(600));
+        assert!(args(&["--history", "0"]).is_err());
+        assert_eq!(args(&["--proc-source", "bpf"]).unwrap().proc_source, ProcSource::Bpf);
+        assert!(args(&["--proc-source", "ebpf"]).is_err());
+        assert_eq!(args(&["--net-source", "netlink"]).unwrap().net_source, NetSource::Netlink);
+        assert!(args(&["--net-source", "sysfs"]).is_err());
+        assert!(args(&["--profile"]).unwrap().profile);
+        assert_eq!(args(&["--root", "/host"]).unwrap().root.as_deref(), Some("/host"));
+        assert!(args(&["--root", "/host", "--replay", "x.rec"]).is_err());
+        assert!(args(&["--profile", "--batch", "--format", "csv"]).is_err());
+        let periods = args(&["--period", "storage=30s", "--period", "procs=250ms"]).unwrap().periods;
+        assert_eq!(periods, vec![(Collector::Storage, Duration::from_secs(30)), (Collector::Procs, Duration::from_millis(250))]);
+        assert!(args(&["--period", "disk=1s"]).is_err());
+        assert!(args(&["--period", "net"]).is_err());
+        assert!(args(&["--batch", "--period", "net=1s"]).is_err());
+
+        let serve = args(&["--serve", "7373", "--interval", "2s"]).unwrap();
+        assert_eq!(serve.serve.as_deref(), Some("127.0.0.1:7373"));
+        assert_eq!(serve.interval, Some(Duration::from_secs(2)));
+        assert!(args(&["--serve", "7373", "--batch"]).is_err());
+        assert_eq!(args(&["--connect", "web1, web2:9000,"]).unwrap().connect, vec!["web1", "web2:9000"]);
+        assert!(args(&["--connect", ","]).is_err());
+        assert!(args(&["--connect", "web1", "--record", "a.rec"]).is_err());
+        assert!(args(&["--connect", "web1", "--interval", "1s"]).is_err());
+        assert_eq!(serve_addr(":8000"), "127.0.0.1:8000");
+        assert_eq!(serve_addr("0.0.0.0:8000"), "0.0.0.0:8000");
+        assert_eq!(with_default_port("web1"), "web1:7373");
+        assert_eq!(with_default_port("10.0.0.5:80"), "10.0.0.5:80");
+        assert_eq!(with_default_port("fe80::1"), "[fe80::1]:7373");
+        assert_eq!(with_default_port("[::1]"), "[::1]:7373");
+        assert_eq!(with_default_port("[::1]:80"), "[::1]:80");
+
+        assert_eq!(args(&["--batch", "--alert", "mem > 95%"]).unwrap().alerts.len(), 1);
+        assert!(args(&["--alert", "mem > 95%"]).is_err(), "--alert needs --batch or --serve");
+        assert!(args(&["--batch", "--alert-exec", "true"]).is_err());
+        assert!(args(&["--batch", "--alert", "load > 3"]).is_err());
+    }
+
+    #[test]
+    fn test_export_records() {
+        let mut snap = Snapshot {
+            cpu: 12.5,
+            cpu_temp: 51.0,
+            procs: vec![ProcessInfo {
+                pid: 7,
+                ppid: 1,
+                name: Arc::from("we\"ird,\tname"),
+                name_lower: Arc::from("we\"ird,\tname"),
+                cpu_percent: 3.5,
+                mem_bytes: 4096,
+                threads: 2,
+                read_rate: f64::NAN,
+                write_rate: f64::NAN,
+                cgroup: None,
+                sort_key: (0, 0, 0),
+            }],
+            ..Snapshot::default()
+        };
+        snap.sorted = 1;
+        snap.net.iface = "eth0".to_string();
+        snap.gpus.push(GpuSnapshot { usage: 40.0, has_usage: true, ..GpuSnapshot::default() });
+
+        let mut out = Vec::new();
+        write_jsonl_record(&mut out, 1000, &snap, 5, None);
+        let line = String::from_utf8(out).unwrap();
+        assert!(line.starts_with("{\"ts\":1000,\"cpu\":{\"usage\":12.5,\"temp\":51.0,\"freq_mhz\":null}"));
+        assert!(line.contains("\"gpus\":[{\"name\":\"GPU\",\"usage\":40.0,\"mem_used\":null,"));
+        assert!(line.contains("\"name\":\"we\\\"ird,\\tname\""));
+        assert!(line.ends_with("}]}\n") && line.matches('\n').count() == 1);
+
+        // Every CSV row has as many columns as the header, padding missing procs.
+        let mut header = Vec::new();
+        write_csv_header(&mut header, 2);
+        let mut row = Vec::new();
+        write_csv_record(&mut row, 1000, &snap, 2);
+        let row = String::from_utf8(row).unwrap();
+        assert!(row.contains(",7,\"we\"\"ird,\tname\",3.5,4096,,,,\n"));
+        let columns = |s: &str| s.replace("\"we\"\"ird,\tname\"", "x").split(',').count();
+        assert_eq!(columns(&row), columns(std::str::from_utf8(&header).unwrap()));
+    }
+
+    #[test]
+    fn test_proc_table_reuses_slots() {
+        let mut table = ProcTable::default();
+        let read = |slot, ticks| ProcReading { slot, ticks, rss: 4096, threads: 1, ppid: -1, reset: false };
+
+        table.begin();
+        let a = table.claim(100);
+        let b = table.claim(200);
+        table.set_name(a, Arc::from("a"));
+        table.set_name(b, Arc::from("b"));
+        table.apply(&read(a, 1000), 100.0);
+        table.apply(&read(b, 50), 100.0);
+        table.sweep();
+
+        // Same PIDs keep their slots; CPU is the delta over the denominator.
+        table.begin();
+        assert_eq!(table.claim(100), a);
+        table.apply(&read(a, 1040), 100.0);
+        table.sweep();
+        assert_eq!(table.cpu[a as usize], 40.0);
+        let mut out = Vec::new();
+        table.emit(&mut out);
+        assert_eq!(out.iter().map(|p| p.pid).collect::<Vec<_>>(), vec![100]);
+
+        // PID 200 was not listed, so its slot went to the free list and the
+        // next new PID takes it over without inheriting name or ticks.
+        table.begin();
+        table.claim(100);
+        let c = table.claim(300);
+        assert_eq!(c, b);
+        assert!(table.name(c).is_none());
+        assert_eq!(table.ticks[c as usize], NO_TICKS);
+        assert_eq!(table.pid.len(), 2);
+
+        let mut reset = read(a, 10);
+        reset.reset = true;
+        table.apply(&reset, 100.0);
+        assert_eq!(table.cpu[a as usize], if FIRST_READING_FROM_ZERO { 10.0 } else { 0.0 });
+    }
+
+    #[test]
+    fn test_proc_tree_tracks_parents() {
+        let mut table = ProcTable::default();
+        // (pid, ppid) pairs; ticks give each process its own CPU%.
+        let tick = |table: &mut ProcTable, procs: &[(i32, i32, u64)]| {
+            table.begin();
+            for &(pid, ppid, ticks) in procs {
+                let slot = table.claim(pid);
+                if table.name(slot).is_none() {
+                    table.set_name(slot, Arc::from(pid.to_string()));
+                }
+                table.apply(&ProcReading { slot, ticks, rss: 4096, threads: 1, ppid, reset: false }, 100.0);
+            }
+            table.sweep();
+            let mut procs = Vec::new();
+            table.emit(&mut procs);
+            for p in procs.iter_mut() {
+                p.sort_key = sort_key(p, SortMode::Cpu);
+            }
+            let mut sorted = 0;
+            sort_prefix(&mut procs, &mut sorted, usize::MAX);
+            let mut tree = Vec::new();
+            table.build_tree(&procs, SortMode::Cpu, &mut tree);
+            tree.iter().map(|t| (procs[t.row as usize].pid, t.depth, t.descendants, t.cpu)).collect::<Vec<_>>()
+        };
+
+        // The child is listed before its parent on the first tick.
+        tick(&mut table, &[(11, 10, 0), (1, 0, 0), (10, 1, 0), (12, 10, 0), (20, 1, 0)]);
+        let rows = tick(&mut table, &[(11, 10, 30), (1, 0, 0), (10, 1, 10), (12, 10, 5), (20, 1, 20)]);
+        // Siblings go by subtree CPU: 10 has 45% under it, 20 has 20%.
+        assert_eq!(rows, vec![(1, 0, 4, 65.0), (10, 1, 2, 45.0), (11, 2, 0, 30.0), (12, 2, 0, 5.0), (20, 1, 0, 20.0)]);
+
+        // When 10 exits its children stand alone until a reading names the
+        // process that adopted them.
+        let rows = tick(&mut table, &[(11, 10, 30), (1, 0, 0), (12, 10, 5), (20, 1, 20)]);
+        assert_eq!(rows.iter().map(|r| (r.0, r.1)).collect::<Vec<_>>(), vec![(1, 0), (20, 1), (11, 0), (12, 0)]);
+        let rows = tick(&mut table, &[(11, 1, 60), (1, 0, 0), (12, 1, 10), (20, 1, 40)]);
+        assert_eq!(rows, vec![(1, 0, 3, 55.0), (11, 1, 0, 30.0), (20, 1, 0, 20.0), (12, 1, 0, 5.0)]);
+    }
+
+    #[cfg(target_os = "linux")]
+    #[test]
+    fn test_cgroup_table_reads_hierarchy() {
+        let root = std::env::temp_dir().join(format!("utop-cgroup-{}", std::process::id()));
+        let write = |rel: &str, name: &str, text: &str| {
+            fs::create_dir_all(root.join(rel)).unwrap();
+            fs::write(root.join(rel).join(name), text).unwrap();
+        };
+        write("", "cpu.stat", "usage_usec 1000\nuser_usec 800\n");
+        write("web", "cpu.stat", "usage_usec 200\n");
+        write("web", "memory.current", "4096\n");
+        write("web", "io.stat", "8:0 rbytes=100 wbytes=200 rios=1 wios=2\n8:16 rbytes=50 wbytes=0 rios=1 wios=0\n");
+        write("web/old", "cpu.stat", "usage_usec 0\n");
+
+        let mut table = CgroupTable::new(Some(root.to_string_lossy().into_owned()));
+        table.read(1.0, 2);
+        // Two CPUs for one second: 500 ms of usage is a quarter of the machine.
+        write("", "cpu.stat", "usage_usec 1001000\n");
+        write("web", "cpu.stat", "usage_usec 500200\n");
+        write("web", "io.stat", "8:0 rbytes=1100 wbytes=200\n8:16 rbytes=50 wbytes=300\n");
+        let old = table.slots["/web/old"];
+        fs::remove_dir_all(root.join("web/old")).unwrap();
+        table.read(1.0, 2);
+        let mut out = Vec::new();
+        table.emit(SortMode::Cpu, &mut out);
+        let rows: Vec<_> = out.iter().map(|c| (&*c.path, c.cpu_percent, c.mem_bytes, c.read_rate, c.write_rate)).collect();
+        assert_eq!(rows, vec![("/", 50.0, 0, 0.0, 0.0), ("/web", 25.0, 4096, 1000.0, 300.0)]);
+
+        // A removed cgroup's slot goes to the next new one, starting afresh.
+        write("db", "cpu.stat", "usage_usec 7\n");
+        table.read(1.0, 2);
+        assert_eq!(table.slots["/db"], old);
+        assert_eq!(table.cpu[old as usize], 0.0);
+        assert_eq!(table.open_files, 5);
+        let _ = fs::remove_dir_all(&root);
+
+        assert_eq!(parse_proc_cgroup(b"1:name=systemd:/\n0::/web/app.scope\n"), Some("/web/app.scope"));
+        assert_eq!(parse_proc_cgroup(b"4:memory:/x\n"), None);
+    }
+
+    #[test]
+    fn test_io_rates() {
+        // A process's rates need readings on two ticks in a row.
+        let mut table = ProcTable::default();
+        let me = std::process::id() as i32;
+        table.begin();
+        let slot = table.claim(me) as usize;
+        table.read_io(slot, 0.5);
+        assert!(table.io_rate[slot][0].is_nan());
+        table.begin();
+        table.read_io(slot, 0.5);
+        if read_proc_io(me).is_some() {
+            assert!(table.io_rate[slot].iter().all(|&r| r >= 0.0));
+        }
+        table.begin();
+        table.begin();
+        table.read_io(slot, 0.5);
+        assert!(table.io_rate[slot][0].is_nan());
+
+        // Under a filter the rows named on screen read their I/O, wherever
+        // they rank, and nothing else does.
+        let mut sampler = Sampler::new();
+        let mut snap = Snapshot::default();
+        let needs = ViewNeeds { io_rows: 1, io_pids: &[me], ..Default::default() };
+        sample_due(&mut sampler, true, SortMode::Mem, 1, needs, &mut snap);
+        std::thread::sleep(Duration::from_millis(10));
+        sample_due(&mut sampler, true, SortMode::Mem, 1, needs, &mut snap);
+        let mine = snap.procs.iter().find(|p| p.pid == me).expect("own process listed");
+        if read_proc_io(me).is_some() {
+            assert!(mine.read_rate >= 0.0 && mine.write_rate >= 0.0);
+        }
+        assert!(snap.procs.iter().filter(|p| p.pid != me).all(|p| p.read_rate.is_nan()));
+
+        #[cfg(target_os = "linux")]
+        {
+            let mut disks = DiskStats::default();
+            let stats = |rd: u64, wr: u64| format!(" 252 0 vda 10 0 {} 5 20 0 {} 9 0 0 0\n   7 0 loop0 0 0 0 0 0 0 0 0 0 0 0\n", rd, wr);
+            disks.update(stats(1000, 2000).as_bytes(), 2.0);
+            let text = stats(1004, 2400);
+            let before = alloc_counter::allocations();
+            disks.update(text.as_bytes(), 2.0);
+            assert_eq!(alloc_counter::allocations() - before, 0, "known disks are updated in place");
+            let mut storage = vec![StorageSnapshot { mount_point: "/".into(), device: "/dev/vda".into(), used_bytes: 0, total_bytes: 0,
+                stale: false, read_rate: f64::NAN, write_rate: f64::NAN }];
+            disks.apply(&mut storage);
+            assert_eq!((storage[0].read_rate, storage[0].write_rate), (1024.0, 102400.0));
+
+            // An unplugged disk is forgotten along with its rates, and comes
+            // back counting from scratch.
+            disks.update(b"   7 0 loop0 0 0 0 0 0 0 0 0 0 0 0\n", 2.0);
+            disks.apply(&mut storage);
+            assert!(storage[0].read_rate.is_nan() && !disks.disks.contains_key("vda"));
+            disks.update(stats(8, 16).as_bytes(), 2.0);
+            disks.apply(&mut storage);
+            assert!(storage[0].read_rate.is_nan());
+            disks.apply(&mut []);
+            assert!(disks.names.is_empty());
+        }
+    }
+
+    #[test]
+    fn test_recording_round_trip() {
+        let path = std::env::temp_dir().join(format!("utop-test-{}.rec", std::process::id()));
+        let path = path.to_str().unwrap();
+        const BASE: u64 = 1_700_000_000_000;
+        const STEP: u64 = 60_000;
+
+        // Twelve frames a minute apart: three keyframe segments. PID 300 comes
+        // and goes, PID 200 burns 100 ticks per frame of a 1000-tick window.
+        let record = |frames: u64, finish: bool| {
+            let mut rec = Recorder::create(path, "4 cores", "Test CPU", "").unwrap();
+            let mut table = ProcTable::default();
+            let mut snap = Snapshot::default();
+            for i in 0..frames {
+                table.begin();
+                for (pid, name, ticks) in [(100, "init", 5), (200, "worker", 100 * i), (300, "short", i)] {
+                    if pid == 300 && i % 2 == 1 { continue; }
+                    let slot = table.claim(pid);
+                    if table.name(slot).is_none() {
+                        table.set_name(slot, Arc::from(name));
+                    }
+                    table.apply(&ProcReading { slot, ticks, rss: 8192 * (i + 1), threads: 1, ppid: -1, reset: false }, 1000.0);
+                }
+                table.sweep();
+                table.denominator = 1000.0;
+                snap.cpu = i as f64;
+                snap.net.iface = "eth0".to_string();
+                rec.write_frame(BASE + i * STEP, &table, &snap).unwrap();
+            }
+            if finish { rec.finish().unwrap(); }
+        };
+
+        for finish in [true, false] {
+            record(12, finish);
+            let mut replay = Replay::open(path).unwrap();
+            assert_eq!(replay.cpu_name, "Test CPU");
+            assert_eq!((replay.start_ms, replay.end_ms), (BASE, BASE + 11 * STEP));
+            assert_eq!(replay.keyframes.len(), 3, "finish={}", finish);
+
+            assert_eq!(replay.ts_ms, BASE);
+            assert!(replay.step());
+            let mut snap = Snapshot::default();
+            replay.fill(SortMode::Cpu, 10, &mut snap);
+            assert_eq!(snap.cpu, 1.0);
+            assert_eq!(snap.seq, 2, "one sample per decoded frame");
+            assert_eq!(snap.net.iface, "eth0");
+            assert_eq!(snap.procs.iter().map(|p| p.pid).collect::<Vec<_>>(), vec![200, 100]);
+            assert_eq!(snap.procs[0].cpu_percent, 10.0);
+            assert_eq!(snap.procs[0].mem_bytes, 16384);
+
+            // Landing mid-segment decodes forward from that segment's keyframe.
+            replay.seek(BASE + 7 * STEP + STEP / 2);
+            assert_eq!(replay.ts_ms, BASE + 7 * STEP);
+            replay.fill(SortMode::Mem, 10, &mut snap);
+            assert_eq!(snap.cpu, 7.0);
+            assert_eq!(snap.procs.len(), 2);
+            assert_eq!(snap.procs[0].mem_bytes, 8192 * 8);
+            replay.seek(BASE + 2 * STEP);
+            replay.fill(SortMode::Cpu, 10, &mut snap);
+            let mut view = FilterView::default();
+            view.update(&snap.procs, snap.sorted, "sho");
+            assert_eq!(view.rows.iter().map(|&r| &*snap.procs[r as usize].name).collect::<Vec<_>>(), vec!["short"]);
+
+            while replay.step() {}
+            assert_eq!(replay.ts_ms, BASE + 11 * STEP);
+        }
+        let _ = fs::remove_file(path);
+    }
+
+    #[test]
+    fn test_serve_stream_decodes_in_pieces() {
+        let mut stream = Recorder::new(Vec::new(), &["2 cores", "Test CPU", "", "web1"]).unwrap();
+        let preamble = std::mem::take(&mut stream.out);
+        let mut table = ProcTable::default();
+        let mut snap = Snapshot::default();
+        let mut frame = |stream: &mut Recorder<Vec<u8>>, i: u64| {
+            table.begin();
+            for (pid, name, ticks) in [(10, "sshd", 3), (20, "postgres", 50 * i)] {
+                let slot = table.claim(pid);
+                if table.name(slot).is_none() {
+                    table.set_name(slot, Arc::from(name));
+                }
+                table.apply(&ProcReading { slot, ticks, rss: 4096, threads: 2, ppid: -1, reset: false }, 200.0);
+            }
+            table.sweep();
+            table.denominator = 200.0;
+            snap.cpu = 10.0 * i as f64;
+            stream.write_frame(1_000 * (i + 1), &table, &snap).unwrap();
+        };
+        frame(&mut stream, 0);
+        frame(&mut stream, 1);
+
+        // A viewer joining now gets the header and strings, then a keyframe.
+        let mut wire = preamble.clone();
+        stream.write_strings(&mut wire);
+        stream.out.clear();
+        stream.force_keyframe();
+        frame(&mut stream, 2);
+        frame(&mut stream, 3);
+        wire.extend_from_slice(&stream.out);
+
+        let mut agent = RemoteAgent::new("10.0.0.5");
+        assert_eq!(agent.addr, "10.0.0.5:7373");
+        let mut frames = 0;
+        for piece in wire.chunks(7) {
+            agent.buf.extend_from_slice(piece);
+            frames += agent.decode().unwrap() as usize;
+        }
+        assert_eq!(frames, 2);
+        assert!(agent.buf.is_empty());
+        agent.summarize(Instant::now());
+        assert_eq!((&*agent.summary.name, &*agent.summary.cpu_name), ("web1", "Test CPU"));
+        assert_eq!(agent.summary.cpu, 30.0);
+        assert_eq!(agent.summary.procs, 2);
+        assert_eq!(agent.summary.top.as_ref().map(|(n, c)| (&**n, *c)), Some(("postgres", 25.0)));
+        let mut out = Snapshot::default();
+        agent.frames.fill(SortMode::Cpu, 10, &mut out);
+        assert_eq!(out.procs.iter().map(|p| p.pid).collect::<Vec<_>>(), vec![20, 10]);
+
+        // Joining without the keyframe is refused rather than misdecoded.
+        let mut late = RemoteAgent::new("web2");
+        late.buf = preamble;
+        stream.out.clear();
+        frame(&mut stream, 4);
+        late.buf.extend_from_slice(&stream.out);
+        assert!(late.decode().is_err());
+    }
+
+    #[test]
+    fn test_alert_rules() {
+        let rule = parse_alert("proc.cpu > 90% for 10s").unwrap();
+        assert_eq!((rule.metric, rule.above, rule.threshold, rule.hold_ms), (AlertMetric::ProcCpu, true, 90.0, 10_000));
+        let disk = parse_alert("dsk:/srv/data>98").unwrap();
+        assert_eq!((disk.metric, disk.mount.as_str()), (AlertMetric::Disk, "/srv/data"));
+        assert_eq!(parse_alert("net.rx > 100M").unwrap().threshold, 100.0 * 1024.0 * 1024.0);
+        assert_eq!(parse_alert("temp<20").map(|r| r.above), Some(false));
+        for bad in ["cpu", "cpu > lots", "mem > 5M", "net.tx > 50%", "proc.cpu < 1", "dsk: > 9", "cpu > 9 for ever"] {
+            assert!(parse_alert(bad).is_none(), "{}", bad);
+        }
+
+        let procs = |hot: &[(i32, f64)]| -> Vec<ProcessInfo> {
+            hot.iter().map(|&(pid, cpu)| ProcessInfo {
+                pid, ppid: 1, name: Arc::from("stress"), name_lower: Arc::from("stress"), cpu_percent: cpu,
+                mem_bytes: 0, threads: 1, read_rate: f64::NAN, write_rate: f64::NAN, cgroup: None, sort_key: (0, 0, 0),
+            }).collect()
+        };
+        let mut rule = parse_alert("proc.cpu > 90 for 2s").unwrap();
+        let mut snap = Snapshot { procs: procs(&[(7, 95.0), (8, 10.0)]), ..Default::default() };
+        let before = alloc_counter::allocations();
+        let mut fired = [None; 4];
+        for (i, f) in fired.iter_mut().enumerate() {
+            *f = rule.step(i as u64 * 1000, &snap);
+        }
+        assert_eq!(alloc_counter::allocations(), before, "checking a rule must not allocate");
+        assert_eq!(fired, [None, None, Some((95.0, 7)), None], "fires once after holding for 2s");
+
+        // A second hot process does not restart the clock on the first; once
+        // that one cools down the other is timed from scratch.
+        snap.procs = procs(&[(7, 95.0), (8, 99.0)]);
+        assert_eq!(rule.step(4000, &snap), None);
+        snap.procs = procs(&[(7, 5.0), (8, 99.0)]);
+        assert_eq!(rule.step(5000, &snap), None);
+        assert_eq!(rule.step(7000, &snap), Some((99.0, 8)));
+        snap.procs = procs(&[(8, 50.0)]);
+        assert_eq!(rule.step(8000, &snap), None);
+        assert!(!rule.fired, "re-armed once clear");
+
+        let mut mem = parse_alert("mem > 95%").unwrap();
+        snap.mem = MemorySnapshot { used_bytes: 96, total_bytes: 100, ..Default::default() };
+        assert_eq!(mem.step(0, &snap), Some((96.0, 0)));
+    }
+
+    #[test]
+    fn test_alert_capture_replays() {
+        let dir = std::env::temp_dir().join(format!("utop-capture-{}", std::process::id()));
+        let dir = dir.to_str().unwrap();
+        let mut sampler = Sampler::new();
+        sampler.cpu_name = "Test CPU".to_string();
+        let mut cap = AlertCapture::new(dir, &sampler).unwrap();
+        let mut table = ProcTable::default();
+        let mut snap = Snapshot::default();
+        let mut path = String::new();
+        // One frame every 10s for 100s, an alert at 70s: the capture reaches
+        // back to the keyframe before the last roll (30s) and runs to 100s.
+        for i in 0..11_u64 {
+            table.begin();
+            // A name first seen after the buffer was cut still resolves.
+            let slot = table.claim(if i < 5 { 42 } else { 43 });
+            if table.name(slot).is_none() {
+                table.set_name(slot, Arc::from(if i < 5 { "early" } else { "late" }));
+            }
+            table.apply(&ProcReading { slot, ticks: 10 * i, rss: 4096, threads: 1, ppid: -1, reset: false }, 100.0);
+            table.sweep();
+            snap.cpu = i as f64;
+            cap.frame(i * 10_000, &table, &snap).unwrap();
+            if i == 7 {
+                path = cap.trigger(i * 10_000).unwrap().to_string();
+            }
+        }
+        assert!(cap.file.is_none(), "post-roll finished");
+        let mut replay = Replay::open(&path).unwrap();
+        assert_eq!(replay.cpu_name, "Test CPU");
+        assert_eq!((replay.start_ms, replay.end_ms), (30_000, 100_000));
+        let mut out = Snapshot::default();
+        replay.fill(SortMode::Cpu, 10, &mut out);
+        assert_eq!((out.cpu, &*out.procs[0].name), (3.0, "early"));
+        replay.seek(100_000);
+        replay.fill(SortMode::Cpu, 10, &mut out);
+        assert_eq!((out.cpu, &*out.procs[0].name), (10.0, "late"));
+        let _ = fs::remove_dir_all(dir);
+    }
+
+    #[test]
+    fn test_run_chunked_covers_every_item_once() {
+        let mut items: Vec<i32> = (0..5000).collect();
+        let mut slabs: Vec<SampleSlab> = (0..4).map(|_| SampleSlab::default()).collect();
+        run_chunked(&mut items, &mut slabs, |chunk, slab| {
+            for pid in chunk.iter() {
+                slab.readings.push(ProcReading { slot: *pid as u32, ticks: 0, rss: 0, threads: 0, ppid: -1, reset: false });
+            }
+        });
+        assert!(slabs.iter().filter(|s| !s.readings.is_empty()).count() > 1, "work should be split");
+        let mut seen: Vec<i32> = slabs.iter().flat_map(|s| s.readings.iter().map(|r| r.slot as i32)).collect();
+        seen.sort_unstable();
+        assert_eq!(seen, items);
     }
 
     #[cfg(target_os = "windows")]
@@ -2357,6 +10694,97 @@ mod tests {
         assert!(mem.swap_used_bytes <= mem.swap_total_bytes, "swap used ({}) <= total ({})", mem.swap_used_bytes, mem.swap_total_bytes);
     }
 
+    #[test]
+    fn test_discovery_cache_round_trip() {
+        let found = Discovery {
+            cpu_count: "CPUs: 2, 128 cores".to_string(),
+            cpu_name: "EPYC 7763 64-Core".to_string(),
+            gpu_cores: String::new(),
+            cpu_temp_path: Some("/sys/class/hwmon/hwmon2/temp1_input".to_string()),
+            cpu_freq_paths: vec!["/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq".to_string(); 2],
+            nvidia_smi_missing: true,
+        };
+        let dir = std::env::temp_dir().join(format!("utop-discovery-{}", std::process::id()));
+        let path = format!("{}/utop/discovery", dir.display());
+        store_discovery(&path, "boot-a /host", &found).unwrap();
+        assert_eq!(load_discovery(&path, "boot-a /host"), Some(found.clone()));
+        // Another boot, or another --root, probes afresh.
+        assert_eq!(load_discovery(&path, "boot-b /host"), None);
+        assert_eq!(load_discovery(&path, "boot-a "), None);
+
+        let broken = Discovery { cpu_name: "two\nlines".to_string(), ..found };
+        assert!(store_discovery(&path, "boot-a /host", &broken).is_err());
+        assert!(Discovery::decode("utop-discovery 0\nkey boot-a /host\ncpu_count x\n", "boot-a /host").is_none());
+        let _ = fs::remove_dir_all(&dir);
+    }
+
+    #[test]
+    fn test_histogram_percentiles() {
+        // Buckets are contiguous and each value lands in the one that bounds it.
+        for v in (0..5000).chain([u64::MAX / 3, u64::MAX]) {
+            let b = Histogram::bucket(v);
+            assert!(v <= Histogram::bucket_max(b));
+            assert!(b == 0 || v > Histogram::bucket_max(b - 1));
+        }
+        let h = Histogram::new();
+        assert_eq!(h.percentile(0.5), None);
+        for v in 1..=100 {
+            h.record(v * 1000);
+        }
+        let p50 = h.percentile(0.5).unwrap();
+        let p99 = h.percentile(0.99).unwrap();
+        assert!((50_000..=50_000 * 9 / 8).contains(&p50), "{}", p50);
+        assert!((99_000..=99_000 * 9 / 8).contains(&p99), "{}", p99);
+    }
+
+    #[test]
+    #[cfg(target_os = "linux")]
+    fn test_profile_counts_stage_syscalls() {
+        let profile = Profile::new();
+        profile.count_syscalls.store(true, AtomicOrdering::Relaxed);
+        let f = File::open("/proc/self/stat").unwrap();
+        let probe = profile.start();
+        let mut buf = [0u8; 64];
+        let _ = f.read_at(&mut buf, 0);
+        let _ = f.read_at(&mut buf, 0);
+        profile.finish(STAGE_SORT, probe, 10);
+        let st = &profile.stages[STAGE_SORT];
+        assert_eq!(st.time_ns.count(), 1);
+        assert_eq!(st.syscalls.percentile(0.5), Some(2));
+        assert_eq!(st.bytes_written.percentile(0.5), Some(10));
+        // Without counting, only time and bytes are kept.
+        profile.count_syscalls.store(false, AtomicOrdering::Relaxed);
+        let probe = profile.start();
+        profile.finish(STAGE_SORT, probe, 0);
+        assert_eq!((st.time_ns.count(), st.syscalls.count()), (2, 1));
+    }
+
+    #[test]
+    #[cfg(target_os = "linux")]
+    fn test_net_table_rates() {
+        const HEAD: &str = "Inter-|   Receive                            |  Transmit\n face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n";
+        let mut table = NetTable::default();
+        let mut out = NetworkSnapshot::default();
+        let first = format!("{HEAD}    lo: 1000 10 0 0 0 0 0 0 1000 10 0 0 0 0 0 0\n  eth0: 5000 50 0 0 0 0 0 0 2000 20 0 0 0 0 0 0\n wlan0: 100 1 0 0 0 0 0 0 100 1 0 0 0 0 0 0\n");
+        table.begin();
+        parse_net_dev(first.as_bytes(), &mut table);
+        table.finish(1.0, &mut out);
+        assert_eq!(out.ifaces.len(), 3);
+        assert!(out.ifaces.iter().all(|i| i.rx_rate == 0.0));
+
+        let second = format!("{HEAD}    lo: 901000 910 0 0 0 0 0 0 901000 910 0 0 0 0 0 0\n  eth0: 7000 70 1 2 0 0 0 0 6000 60 0 1 0 0 0 0\n");
+        table.begin();
+        parse_net_dev(second.as_bytes(), &mut table);
+        table.finish(2.0, &mut out);
+        // Loopback is listed, busiest first, but never the summary; wlan0 is gone.
+        let names: Vec<&str> = out.ifaces.iter().map(|i| &*i.name).collect();
+        assert_eq!(names, ["lo", "eth0"]);
+        assert_eq!(&*out.iface, "eth0");
+        assert_eq!((out.rx_rate, out.tx_rate), (1000.0, 2000.0));
+        let eth = &out.ifaces[1];
+        assert_eq!((eth.rx_packets, eth.tx_packets, eth.drops, eth.errors), (10.0, 20.0, 1.5, 0.5));
+    }
+
     #[cfg(target_os = "windows")]
     #[test]
     fn test_read_cpu_count_windows() {
@@ -2372,9 +10800,9 @@ mod tests {
     #[cfg(target_os = "windows")]
     #[test]
     fn test_read_network_windows() {
-        let mut prev = HashMap::new();
-        let elapsed = 1.0;
-        let net = read_network(&mut prev, elapsed);
+        let mut reader = NetReader::default();
+        let mut net = NetworkSnapshot::default();
+        read_network(&mut reader, 1.0, &mut net);
         assert!(!net.iface.is_empty(), "network interface should not be empty");
         assert!(net.rx_rate >= 0.0, "rx rate >= 0");
         assert!(net.tx_rate >= 0.0, "tx rate >= 0");
@@ -2401,37 +10829,42 @@ mod tests {
         assert!(freq < 100_000.0, "CPU frequency unrealistic, got {freq}");
     }
 
+    #[cfg(target_os = "windows")]
+    #[test]
+    fn test_nt_process_snapshot_windows() {
+        let mut sampler = Sampler::new();
+        sampler.procs.begin();
+        assert!(read_nt_processes(&mut sampler), "SystemProcessInformation should be readable");
+        let me = std::process::id() as i32;
+        let slot = *sampler.procs.slots.get(&me).expect("own process listed");
+        let r = sampler.slabs[0].readings.iter().find(|r| r.slot == slot).expect("own reading");
+        assert!(r.threads >= 1 && r.rss > 0);
+        assert!(sampler.procs.name(slot).is_some_and(|n| n.to_lowercase().contains("utop")));
+        // The System process cannot be opened, but is in the snapshot.
+        assert!(sampler.procs.slots.contains_key(&4));
+
+        let capacity = sampler.nt_procs.len();
+        assert!(read_nt_processes(&mut sampler));
+        assert!(sampler.nt_procs.len() >= capacity, "the buffer only grows");
+
+        let mut cores = Vec::new();
+        read_cpu_times(&mut CpuStatFile::default(), &mut cores);
+        assert_eq!(cores.len() % CPU_FIELDS, 0);
+        assert!(!cores.is_empty() && cores.len() / CPU_FIELDS <= active_cpu_count() as usize);
+    }
+
     #[cfg(target_os = "windows")]
     #[test]
     fn test_sample_windows() {
         let mut sampler = Sampler::new();
-        let mut cpu = 0.0;
-        let mut mem = MemorySnapshot::default();
-        let mut net = NetworkSnapshot::default();
-        let mut gpu = GpuSnapshot::default();
-        let mut storage = Vec::new();
-        let mut cpus = String::new();
-        let mut cached_gpu = GpuSnapshot::default();
-        let mut last_gpu_read = Instant::now().checked_sub(Duration::from_secs(10)).unwrap();
-
-        sample(
-            &mut sampler,
-            SortMode::Cpu,
-            "",
-            &mut cpu,
-            &mut mem,
-            &mut net,
-            &mut gpu,
-            &mut storage,
-            &mut cpus,
-            &mut cached_gpu,
-            &mut last_gpu_read,
-        );
+        let mut snap = Snapshot::default();
 
-        assert!(cpu >= 0.0);
-        assert!(mem.total_bytes > 0);
-        assert!(!sampler.procs.is_empty(), "should have at least one process");
-        assert!(!cpus.is_empty(), "CPU count should be populated");
-        assert!(!storage.is_empty(), "should have at least one storage device");
+        sample(&mut sampler, SortMode::Cpu, usize::MAX, &mut snap);
+
+        assert!(snap.cpu >= 0.0);
+        assert!(snap.mem.total_bytes > 0);
+        assert!(!snap.procs.is_empty(), "should have at least one process");
+        assert!(!sampler.cpu_count.is_empty(), "CPU count should be populated");
+        assert!(!snap.storage.is_empty(), "should have at least one storage device");
     }
 }